@@ -0,0 +1,419 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 9th March 2024
+//
+// Standalone usbPkt codec benchmark, timing packet generation
+// and decode, NRZI encode and decode, and the CRC routines in
+// isolation, with no simulator or VProc. The results are
+// reported in ns per packet (or call) and MB/s of packet bytes
+// (SYNC, PID, payload and CRC, without bit stuffing).
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "usbCommon.h"
+#include "usbPkt.h"
+
+// Default minimum run time for each test, in milliseconds
+static const int    MINTIME_MS      = 100;
+
+// Payload sizes, and the bytes a packet adds (SYNC, PID and CRC16)
+static const int    payloadSizes[]  = {0, 8, 64, 512, 1024};
+
+// Data packets are generated for a high speed policy with the high speed
+// isochronous payload limit, so that all the payload sizes are timed
+typedef usbModel::usb_speed_policy_t<usbModel::usb_speed_e::HS, 1024> benchSpeed_t;
+static const int    NUMSIZES        = sizeof(payloadSizes)/sizeof(int);
+static const int    DATAOVERHEAD    = 4;
+static const int    HSHKBYTES       = 2;
+static const int    TOKENBYTES      = 4;
+
+// Payload patterns: random bytes, and all 0xff for the most bit stuffing
+static const int    PATTERN_RANDOM  = 0;
+static const int    PATTERN_ONES    = 1;
+static const char*  patternName[]   = {"random", "0xff"};
+
+// -------------------------------------------------------------------------
+// usbPktBench
+//
+// A usbPkt, so that the protected and (as a friend, with USBPKTBENCH
+// defined) private methods can be timed directly.
+//
+// -------------------------------------------------------------------------
+
+class usbPktBench : public usbPkt
+{
+public:
+
+    usbPktBench (const bool rawIn, const double mintimeIn) : usbPkt("BENCH"), raw(rawIn), mintime(mintimeIn), errors(0), sink(0)
+    {
+        usbPktSetRaw(raw);
+    }
+
+    int  run (void);
+
+private:
+
+    template<class F> double timeNs (F op);
+
+    void report       (const char* test, const int bytes, const double ns);
+    void fill         (const int len, const int pattern);
+    int  frame        (const int len);
+
+    void benchCrc     (void);
+    void benchPktGen  (void);
+    void benchPktDec  (void);
+    void benchNrzi    (void);
+
+    bool                     raw;
+    double                   mintime;
+    int                      errors;
+    volatile unsigned        sink;
+
+    uint8_t                  data   [usbModel::MAXBUFSIZE];
+    uint8_t                  rxdata [usbModel::MAXBUFSIZE];
+    uint8_t                  pkt    [usbModel::MAXBUFSIZE];
+    usbModel::usb_line_buf_t nrzi;
+};
+
+// -------------------------------------------------------------------------
+// timeNs()
+//
+// Runs op repeatedly, doubling the iterations until the run takes at
+// least the minimum time, and returns the time per call in ns.
+//
+// -------------------------------------------------------------------------
+
+template<class F> double usbPktBench::timeNs (F op)
+{
+    for (long iters = 16; ; iters *= 2)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (long idx = 0; idx < iters; idx++)
+        {
+            op();
+        }
+
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (secs >= mintime)
+        {
+            return secs * 1e9 / iters;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// report()
+//
+// Prints a result line, with the MB/s from the number of bytes processed
+// per call.
+//
+// -------------------------------------------------------------------------
+
+void usbPktBench::report (const char* test, const int bytes, const double ns)
+{
+    printf("  %-32s %6d %12.1f %10.1f\n", test, bytes, ns, bytes * 1e3 / ns);
+}
+
+// -------------------------------------------------------------------------
+// fill()
+//
+// Fills the first len bytes of data[] with the given pattern.
+//
+// -------------------------------------------------------------------------
+
+void usbPktBench::fill (const int len, const int pattern)
+{
+    for (int idx = 0; idx < len; idx++)
+    {
+        data[idx] = (pattern == PATTERN_ONES) ? 0xff : (rand() & 0xff);
+    }
+}
+
+// -------------------------------------------------------------------------
+// frame()
+//
+// Builds a DATA0 packet's bytes in pkt[] from the first len bytes of
+// data[], returning the number of bytes.
+//
+// -------------------------------------------------------------------------
+
+int usbPktBench::frame (const int len)
+{
+    int crc = usbcrc16(data, len);
+
+    pkt[usbModel::SYNCBYTEOFFSET] = usbModel::SYNC;
+    pkt[usbModel::PIDBYTEOFFSET]  = usbModel::PID_DATA_0 | ((~usbModel::PID_DATA_0 & 0xf) << 4);
+
+    memcpy(&pkt[usbModel::DATABYTEOFFSET], data, len);
+
+    pkt[usbModel::DATABYTEOFFSET + len]     = crc & 0xff;
+    pkt[usbModel::DATABYTEOFFSET + len + 1] = (crc >> 8) & 0xff;
+
+    return len + DATAOVERHEAD;
+}
+
+// -------------------------------------------------------------------------
+// benchCrc()
+//
+// CRC16 throughput over each payload size, and the CRC5 of a token's
+// 11 bit field.
+//
+// -------------------------------------------------------------------------
+
+void usbPktBench::benchCrc (void)
+{
+    printf("\nCRC\n");
+
+    fill(usbModel::MAXBUFSIZE, PATTERN_RANDOM);
+
+    for (int sdx = 0; sdx < NUMSIZES; sdx++)
+    {
+        int len = payloadSizes[sdx];
+
+        report("usbcrc16", len, timeNs([&]{sink += usbcrc16(data, len);}));
+    }
+
+    report("usbcrc5 (token field)", 2, timeNs([&]{data[0]++; sink += usbcrc5(data, 2, 3);}));
+}
+
+// -------------------------------------------------------------------------
+// benchPktGen()
+//
+// usbPktGen for each packet type. Handshakes, tokens and SOFs are
+// normally from the encoded packet cache.
+//
+// -------------------------------------------------------------------------
+
+void usbPktBench::benchPktGen (void)
+{
+    char     test[64];
+    uint16_t frame = 0;
+
+    printf("\nusbPktGen\n");
+
+    report("handshake (ACK)",  HSHKBYTES,  timeNs([&]{sink += usbPktGen(nrzi, usbModel::PID_HSHK_ACK);}));
+    report("token (IN)",       TOKENBYTES, timeNs([&]{sink += usbPktGen(nrzi, usbModel::PID_TOKEN_IN, 1, 0x81);}));
+    report("SOF",              TOKENBYTES, timeNs([&]{sink += usbPktGen(nrzi, usbModel::PID_TOKEN_SOF, frame++ & usbModel::FRAMEFIELDMASK);}));
+
+    for (int pattern = PATTERN_RANDOM; pattern <= PATTERN_ONES; pattern++)
+    {
+        for (int sdx = 0; sdx < NUMSIZES; sdx++)
+        {
+            int len = payloadSizes[sdx];
+
+            fill(len, pattern);
+
+            snprintf(test, sizeof(test), "DATA0 (%s)", patternName[pattern]);
+
+            if (usbPktGen<benchSpeed_t>(nrzi, usbModel::PID_DATA_0, data, len) < 0)
+            {
+                printf("  %-32s ***ERROR: generate failed: %s", test, usbPktErrStr().c_str());
+                errors++;
+                continue;
+            }
+
+            report(test, len + DATAOVERHEAD, timeNs([&]{sink += usbPktGen<benchSpeed_t>(nrzi, usbModel::PID_DATA_0, data, len);}));
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// benchPktDec()
+//
+// usbPktDecode for each packet type, each packet being checked as
+// decoding without error before it is timed.
+//
+// -------------------------------------------------------------------------
+
+void usbPktBench::benchPktDec (void)
+{
+    char           test[64];
+    usbPktResult_t result;
+
+    printf("\nusbPktDecode\n");
+
+    struct {const char* name; int bytes; int pid;} ctrlpkts[] =
+    {
+        {"handshake (ACK)", HSHKBYTES,  usbModel::PID_HSHK_ACK},
+        {"token (IN)",      TOKENBYTES, usbModel::PID_TOKEN_IN},
+        {"SOF",             TOKENBYTES, usbModel::PID_TOKEN_SOF}
+    };
+
+    for (int pdx = 0; pdx < 3; pdx++)
+    {
+        int pid = ctrlpkts[pdx].pid;
+
+        if      (pid == usbModel::PID_TOKEN_IN)  usbPktGen(nrzi, pid, 1, 0x81);
+        else if (pid == usbModel::PID_TOKEN_SOF) usbPktGen(nrzi, pid, 0x123);
+        else                                     usbPktGen(nrzi, pid);
+
+        if ((result = usbPktDecode(nrzi, rxdata)).status != usbModel::USBOK || result.pid != pid)
+        {
+            printf("  %-32s ***ERROR: decode failed: %s", ctrlpkts[pdx].name, usbPktErrStr().c_str());
+            errors++;
+            continue;
+        }
+
+        report(ctrlpkts[pdx].name, ctrlpkts[pdx].bytes, timeNs([&]{sink += usbPktDecode(nrzi, rxdata).status;}));
+    }
+
+    for (int pattern = PATTERN_RANDOM; pattern <= PATTERN_ONES; pattern++)
+    {
+        for (int sdx = 0; sdx < NUMSIZES; sdx++)
+        {
+            int len = payloadSizes[sdx];
+
+            fill(len, pattern);
+
+            snprintf(test, sizeof(test), "DATA0 (%s)", patternName[pattern]);
+
+            if (usbPktGen<benchSpeed_t>(nrzi, usbModel::PID_DATA_0, data, len) < 0)
+            {
+                printf("  %-32s ***ERROR: generate failed: %s", test, usbPktErrStr().c_str());
+                errors++;
+                continue;
+            }
+
+            result = usbPktDecode(nrzi, rxdata);
+
+            if (result.status != usbModel::USBOK || result.databytes != len || memcmp(data, rxdata, len))
+            {
+                printf("  %-32s ***ERROR: decode failed: %s", test, usbPktErrStr().c_str());
+                errors++;
+                continue;
+            }
+
+            report(test, len + DATAOVERHEAD, timeNs([&]{sink += usbPktDecode(nrzi, rxdata).databytes;}));
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// benchNrzi()
+//
+// nrziEnc and nrziDec of a DATA0 packet's bytes for each payload size.
+//
+// -------------------------------------------------------------------------
+
+void usbPktBench::benchNrzi (void)
+{
+    char test[64];
+
+    printf("\nnrziEnc/nrziDec\n");
+
+    for (int pattern = PATTERN_RANDOM; pattern <= PATTERN_ONES; pattern++)
+    {
+        for (int sdx = 0; sdx < NUMSIZES; sdx++)
+        {
+            fill(payloadSizes[sdx], pattern);
+
+            int len = frame(payloadSizes[sdx]);
+
+            snprintf(test, sizeof(test), "nrziEnc (%s)", patternName[pattern]);
+            report(test, len, timeNs([&]{sink += nrziEnc(pkt, nrzi, len);}));
+
+            pktDecSink_t dec = {rxdata, {0}, 0, false, 0, 0, NULL};
+
+            if (nrziDec(nrzi, dec) < 0 || dec.count != len || memcmp(&pkt[usbModel::DATABYTEOFFSET], rxdata, len - usbModel::DATABYTEOFFSET))
+            {
+                printf("  %-32s ***ERROR: decode failed: %s", test, usbPktErrStr().c_str());
+                errors++;
+                continue;
+            }
+
+            snprintf(test, sizeof(test), "nrziDec (%s)", patternName[pattern]);
+            report(test, len, timeNs([&]{pktDecSink_t out = {rxdata, {0}, 0, false, 0, 0, NULL}; sink += nrziDec(nrzi, out);}));
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// run()
+//
+// Runs all the benchmarks, returning the number of packets that failed
+// to generate or decode.
+//
+// -------------------------------------------------------------------------
+
+int usbPktBench::run (void)
+{
+    printf("usbPkt codec benchmark (%s packets", raw ? "raw" : "NRZI");
+#ifdef __PCLMUL__
+    printf(", PCLMUL");
+#endif
+#ifdef __BMI2__
+    printf(", BMI2");
+#endif
+    printf(")\n\n  %-32s %6s %12s %10s\n", "", "bytes", "ns/packet", "MB/s");
+
+    benchCrc();
+    benchPktGen();
+    benchPktDec();
+    benchNrzi();
+
+    return errors;
+}
+
+int main (int argc, char** argv)
+{
+    int      mintime = MINTIME_MS;
+    bool     raw     = false;
+    int      option;
+
+    // Process the command line options
+    while ((option = getopt(argc, argv, "t:rh")) != EOF)
+    {
+        switch (option)
+        {
+        case 't':
+            mintime = strtol(optarg, NULL, 0);
+            break;
+        case 'r':
+            raw = true;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-t <ms>] [-r]\n", argv[0]);
+            fprintf(stderr, "    -t minimum run time for each test in milliseconds (default %d)\n", MINTIME_MS);
+            fprintf(stderr, "    -r raw (byte parallel) packets\n");
+            return (option == 'h') ? 0 : 1;
+        }
+    }
+
+    usbPktBench bench(raw, mintime / 1000.0);
+
+    int errors = bench.run();
+
+    if (errors)
+    {
+        fprintf(stderr, "\n***ERROR: %d packets failed to generate or decode\n", errors);
+    }
+
+    return errors ? 1 : 0;
+}
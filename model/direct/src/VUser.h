@@ -0,0 +1,60 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 2nd March 2024
+//
+// Stand-in for the VProc API header when building the usbModel
+// C++ with a direct line backend and no VProc library. All
+// register accesses are expected to be serviced by backends
+// registered with usbLineBackend::setBackend(), so an access
+// reaching VWrite() or VRead() here is an error.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _VUSER_H_
+#define _VUSER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define DELTA_CYCLE    -1
+
+#define VPrint(...)    printf(__VA_ARGS__)
+
+typedef int (*pVUserInt_t)(void);
+
+static inline int VWrite (unsigned int addr, unsigned int data, int delta, uint32_t node)
+{
+    fprintf(stderr, "***ERROR: VWrite: no line backend for node %d (addr %d)\n", (int)node, addr);
+    exit(1);
+}
+
+static inline int VRead (unsigned int addr, unsigned int *data, int delta, uint32_t node)
+{
+    fprintf(stderr, "***ERROR: VRead: no line backend for node %d (addr %d)\n", (int)node, addr);
+    exit(1);
+}
+
+// There are no VProc interrupts without VProc, so registered handlers are never called
+static inline void VRegInterrupt (int level, pVUserInt_t func, uint32_t node)
+{
+}
+
+#endif
@@ -0,0 +1,1482 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 2nd March 2024
+//
+// Implementation of the usbDirectNode class, a C++ equivalent
+// of the usbModel HDL (usbModel.v) register map and engines.
+// Each engine method corresponds to an always block of the
+// HDL, and must be kept in step with it.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "usbCommon.h"
+#include "usbMap.h"
+#include "usbCrc.h"
+#include "usbDirectNode.h"
+
+// Node whose coroutine is being entered for the first time
+usbDirectNode* usbDirectNode::starting = NULL;
+
+// -------------------------------------------------------------------------
+// Constructor
+//
+// Initialises the state as for the HDL's initial block, and registers
+// the node as the line backend for its node number.
+//
+// -------------------------------------------------------------------------
+
+usbDirectNode::usbDirectNode (const int nodeIn, const bool isDevice, void (*usermainIn)(void), const unsigned stacksize) :
+    node     (nodeIn),
+    device   (isDevice),
+    usermain (usermainIn),
+    stacksz  (stacksize)
+{
+    stack          = new char[stacksz];
+    state          = IDLE;
+    ack            = false;
+    halt           = false;
+    tlm            = false;
+
+    nreset         = false;
+    lineval        = usbModel::USB_J;
+    oen            = false;
+    dp             = 1;
+    dm             = 0;
+    nopullup       = device;   // Default disabled for device, enabled for host
+    clkcount       = 0;
+
+    txwidx         = 0;
+    txlen          = 0;
+    txidx          = 0;
+    txreq          = false;
+    txack          = false;
+    txbusy         = false;
+    txsofok        = false;
+    txsamples      = 0;
+
+    rxridx         = 0;
+    rstthresh      = 120000;   // 10ms at 12MHz
+    suspthresh     = 36000;    // 3ms at 12MHz
+    rxtimeout      = 0;
+    rxdevice       = device;
+    rxnosuspend    = false;
+    rxreq          = false;
+    rxack          = false;
+    rxbusy         = false;
+    rxstatus       = RXSTAT_PKT;
+    rxbitcount     = 0;
+    rxactivity     = false;
+    rxidle         = true;
+    rxlookforreset = false;
+    rxrstcount     = 0;
+    rxidlecount    = 0;
+    rxeopcount     = 0;
+    rxbits         = 0;
+
+    cntlen         = 0;
+    cntval         = 0;
+    cntreq         = false;
+    cntack         = false;
+    cntbusy        = false;
+    cntsofok       = false;
+
+    serraw         = 0;
+    serlen         = 0;
+    seridx         = 0;
+    serphase       = SER_DATA;
+    serones        = 0;
+    sercount       = 0;
+    serlevel       = 1;
+    serstuff       = false;
+    serbusy        = false;
+    sersel         = false;
+    serdp          = 1;
+    serdm          = 0;
+    seroen         = false;
+    serbits        = 0;
+    sertlmlen      = 0;
+
+    rxtlmlen       = 0;
+    rxtlmvalid     = false;
+    rxtlmpend      = false;
+
+    sofen          = false;
+    sofdue         = false;
+    sofframe       = 0;
+    sofctlen       = false;
+    sofctlload     = false;
+    sofctlframe    = 0;
+    sofctlreq      = false;
+    sofctlack      = false;
+    softimer       = 0;
+
+    devaddr        = 0;
+    epstatout      = 0;
+    epstatin       = 0;
+    hsbusy         = false;
+    hspid          = 0;
+    hsreq          = false;
+    hsack          = false;
+    hsstate        = HS_IDLE;
+    hsprev         = usbModel::USB_J;
+    hsshift        = 0;
+    hsones         = 0;
+    hsinpkt        = false;
+    hsseen         = false;
+    hsbits         = 0;
+    hscount        = 0;
+
+    evirqmask      = 0;
+    evpend         = 0;
+    evclr          = 0;
+    evclrreq       = false;
+    evclrack       = false;
+    evwaitmask     = 0;
+    evtimeout      = 0;
+    evwaitreq      = false;
+    evwaitack      = false;
+    evwaitbusy     = false;
+    evprev         = usbModel::USB_J;
+    evse0count     = 0;
+    evjcount       = 0;
+    evwaitcount    = 0;
+
+    for (int idx = 0; idx < TXBUFWORDS; idx++)
+    {
+        txbuf[idx] = 0;
+    }
+
+    for (int idx = 0; idx < RXBUFWORDS; idx++)
+    {
+        rxbuf[idx] = 0;
+    }
+
+    usbLineBackend::setBackend(node, this);
+}
+
+usbDirectNode::~usbDirectNode()
+{
+    if (usbLineBackend::getBackend(node) == this)
+    {
+        usbLineBackend::setBackend(node, NULL);
+    }
+
+    delete [] stack;
+}
+
+// -------------------------------------------------------------------------
+// start()
+//
+// Creates the user code coroutine and runs it until its first wait.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::start (void)
+{
+    if (state != IDLE)
+    {
+        return;
+    }
+
+    getcontext(&usrctx);
+
+    usrctx.uc_stack.ss_sp   = stack;
+    usrctx.uc_stack.ss_size = stacksz;
+    usrctx.uc_link          = &simctx;
+
+    makecontext(&usrctx, entry, 0);
+
+    starting = this;
+
+    resume();
+}
+
+// -------------------------------------------------------------------------
+// entry()
+//
+// Coroutine entry point, calling the user code of the node being
+// started. Returning switches back to the last caller of resume(), as
+// set in the context's link.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::entry (void)
+{
+    usbDirectNode* p = starting;
+
+    p->usermain();
+
+    p->state = EXITED;
+}
+
+// -------------------------------------------------------------------------
+// resume()
+//
+// Switches to the user code, returning when it next waits or exits.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::resume (void)
+{
+    state = RUNNING;
+
+    swapcontext(&simctx, &usrctx);
+}
+
+// -------------------------------------------------------------------------
+// waitFor()
+//
+// Called from the user code to switch back to the caller of clock() (or
+// start()) until resumed.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::waitFor (const costate_e waitstate)
+{
+    state = waitstate;
+
+    swapcontext(&usrctx, &simctx);
+}
+
+// -------------------------------------------------------------------------
+// write() and read()
+//
+// usbLineBackend accesses from the user code
+//
+// -------------------------------------------------------------------------
+
+int usbDirectNode::write (const unsigned addr, const unsigned data, const int delta)
+{
+    access(addr, data, true, delta);
+
+    return usbModel::USBOK;
+}
+
+int usbDirectNode::read (const unsigned addr, unsigned *data, const int delta)
+{
+    *data = access(addr, 0, false, delta);
+
+    return usbModel::USBOK;
+}
+
+// -------------------------------------------------------------------------
+// access()
+//
+// Register map, as for the HDL's update process. A blocking command
+// waits until its engine acknowledges it, and an access with a delta
+// of 0 or more waits for the next clock.
+//
+// -------------------------------------------------------------------------
+
+int usbDirectNode::access (const unsigned addr, const unsigned wdata, const bool wr, const int delta)
+{
+    uint32_t rdata   = 0;
+    bool     holdack = false;
+
+    switch (addr)
+    {
+    case NODE_NUM:    rdata = node;     break;
+    case CLKCOUNT:    rdata = clkcount; break;
+    case RESET_STATE: rdata = !nreset;  break;
+
+    case PULLUP:
+        if (wr)
+            nopullup = !(wdata & 1);
+        rdata = nopullup;
+        break;
+
+    case OUTEN:
+        if (wr)
+            oen = wdata & 1;
+        rdata = oen;
+        break;
+
+    case LINE:
+        if (wr)
+        {
+            dp = wdata & 1;
+            dm = (wdata >> 1) & 1;
+        }
+        rdata = lineval;
+        break;
+
+    case TXBUFIDX:
+        if (wr)
+            txwidx = wdata;
+        rdata = txwidx;
+        break;
+
+    case TXBUFDATA:
+        if (wr)
+        {
+            txbuf[txwidx & (TXBUFWORDS-1)] = wdata;
+            txwidx++;
+        }
+        break;
+
+    case RSTCOUNT:
+        if (wr)
+            rstthresh = wdata;
+        rdata = rstthresh;
+        break;
+
+    case SUSPCOUNT:
+        if (wr)
+            suspthresh = wdata;
+        rdata = suspthresh;
+        break;
+
+    case RXCAPTURE:
+        if (wr)
+        {
+            oen         = false;
+            rxdevice    = (wdata >> 31) & 1;
+            rxnosuspend = (wdata >> 30) & 1;
+            rxtimeout   = wdata & 0x3fffffff;
+            rxridx      = 0;
+            rxreq       = !rxreq;
+            holdack     = true;
+        }
+        break;
+
+    case RXSTATUS:
+        rdata = (rxactivity ? 0x00100000 : 0) | (rxstatus << 16) | (rxbitcount & 0xffff);
+        break;
+
+    case RXBUFDATA:
+        rdata = rxbuf[rxridx & (RXBUFWORDS-1)];
+        rxridx++;
+        break;
+
+    case EVIRQMASK:
+        if (wr)
+            evirqmask = wdata & 0x7;
+        rdata = evirqmask;
+        break;
+
+    case EVSTATUS:
+        if (wr)
+        {
+            evclr    = wdata & 0x7;
+            evclrreq = !evclrreq;
+        }
+        rdata = evpend;
+        break;
+
+    case EVWAIT:
+        if (wr)
+        {
+            evwaitmask = wdata & 0x7;
+            evtimeout  = wdata >> 3;
+            evwaitreq  = !evwaitreq;
+            holdack    = true;
+        }
+        break;
+
+    case COUNTDOWN:
+        if (wr)
+        {
+            cntlen   = wdata & 0x7fffffff;
+            cntsofok = (wdata >> 31) & 1;
+            cntreq   = !cntreq;
+            holdack  = true;
+        }
+        break;
+
+    case TXSEND:
+        if (wr && (wdata & 0x7fffffff) != 0)
+        {
+            txlen    = wdata & 0x7fffffff;
+            txsofok  = (wdata >> 31) & 1;
+            txreq    = !txreq;
+            holdack  = true;
+
+            // In TLM mode, txlen is a byte count, sent as the packet's
+            // bit time at K followed by an EOP
+            if (tlm)
+            {
+                int len = (txlen < (uint32_t)MAXTLMBYTES) ? txlen : MAXTLMBYTES;
+
+                for (int idx = 0; idx < len; idx++)
+                {
+                    txtlm[idx] = (txbuf[(idx/4) & (TXBUFWORDS-1)] >> ((idx%4)*8)) & 0xff;
+                }
+
+                txsamples = tlmBitTime(txtlm, len) + 3;
+            }
+            else
+            {
+                txsamples = txlen;
+            }
+        }
+        break;
+
+    case DEVADDR:
+        if (wr)
+            devaddr = wdata & 0x7f;
+        rdata = devaddr;
+        break;
+
+    case EPSTATOUT:
+        if (wr)
+            epstatout = wdata;
+        rdata = epstatout;
+        break;
+
+    case EPSTATIN:
+        if (wr)
+            epstatin = wdata;
+        rdata = epstatin;
+        break;
+
+    case PHYIF:       rdata = tlm ? PHYIF_TLM : PHYIF_SERIAL; break;
+
+    case SOFCTRL:
+        if (wr)
+        {
+            sofctlen    = wdata & 1;
+            sofctlload  = (wdata >> 1) & 1;
+            sofctlframe = (wdata >> 16) & 0x7ff;
+            sofctlreq   = !sofctlreq;
+        }
+        rdata = sofen;
+        break;
+
+    case SOFFRAME:    rdata = sofframe; break;
+
+    case UVH_STOP:
+    case UVH_FINISH:
+        if (wr)
+            halt = true;
+        break;
+
+    default:
+        fprintf(stderr, "usbDirectNode %d: ***Error. access to invalid address (%d)\n", node, addr);
+        halt = true;
+        break;
+    }
+
+    // Wait for the engine to acknowledge a blocking command
+    if (holdack)
+    {
+        ack = false;
+
+        while (!ack)
+        {
+            waitFor(WAITCMD);
+        }
+    }
+
+    if (delta >= 0)
+    {
+        waitFor(WAITCLK);
+    }
+
+    return rdata;
+}
+
+// -------------------------------------------------------------------------
+// Line outputs, as for the HDL's line select logic
+//
+// -------------------------------------------------------------------------
+
+bool usbDirectNode::txGo (void) const
+{
+    return (txreq != txack) && !(sersel || (sofdue && txsofok));
+}
+
+// Transmit buffer sample idx of D+ (dm = 0) or D- (dm = 1). In TLM mode
+// this is K for the packet's bit time, then SE0, SE0 and J.
+int usbDirectNode::txSample (const uint32_t idx, const int dm) const
+{
+    if (tlm)
+    {
+        int line = (idx < txsamples - 3) ? usbModel::USB_K   :
+                   (idx < txsamples - 1) ? usbModel::USB_SE0 :
+                                           usbModel::USB_J;
+        return (line >> dm) & 1;
+    }
+
+    return (txbuf[(idx >> 4) & (TXBUFWORDS-1)] >> ((dm ? 16 : 0) + (idx & 0xf))) & 1;
+}
+
+int usbDirectNode::lineOe (void) const
+{
+    uint32_t txcurr = txbusy ? txidx : 0;
+
+    return sersel ? seroen : (txGo() || txbusy) ? (txcurr != (txsamples - 1)) : oen;
+}
+
+int usbDirectNode::lineDp (void) const
+{
+    return sersel ? serdp : (txGo() || txbusy) ? txSample(txbusy ? txidx : 0, 0) : dp;
+}
+
+int usbDirectNode::lineDm (void) const
+{
+    return sersel ? serdm : (txGo() || txbusy) ? txSample(txbusy ? txidx : 0, 1) : dm;
+}
+
+// -------------------------------------------------------------------------
+// TLM mode packet transfer
+//
+// -------------------------------------------------------------------------
+
+const uint8_t* usbDirectNode::tlmPacket (int &len) const
+{
+    if (!tlm)
+    {
+        return NULL;
+    }
+
+    // The serialiser drives its EOP's first SE0 with a count of 1
+    if (sersel)
+    {
+        if (serphase == SER_EOP && sercount == 1)
+        {
+            len = sertlmlen;
+            return sertlm;
+        }
+    }
+    // The transmit engine drives its EOP's first SE0 three samples from the end
+    else if ((txGo() || txbusy) && (txbusy ? txidx : 0) == (txsamples - 3))
+    {
+        len = (txlen < (uint32_t)MAXTLMBYTES) ? txlen : MAXTLMBYTES;
+        return txtlm;
+    }
+
+    return NULL;
+}
+
+void usbDirectNode::tlmDeliver (const uint8_t* pkt, const int len)
+{
+    rxtlmlen   = (len < MAXTLMBYTES) ? len : MAXTLMBYTES;
+    rxtlmvalid = true;
+
+    for (int idx = 0; idx < rxtlmlen; idx++)
+    {
+        rxtlm[idx] = pkt[idx];
+    }
+}
+
+// -------------------------------------------------------------------------
+// tlmBitTime()
+//
+// Number of bits a raw packet occupies on the line, with the SYNC
+// byte, and a stuffed bit after every six consecutive ones. SYNC ends
+// in a single one, which starts the first run.
+//
+// -------------------------------------------------------------------------
+
+unsigned usbDirectNode::tlmBitTime (const uint8_t* pkt, const int len)
+{
+    unsigned bits = usbModel::NRZI_BITSPERBYTE;
+    int      ones = 1;
+
+    for (int idx = 0; idx < len; idx++)
+    {
+        for (int bit = 0; bit < usbModel::NRZI_BITSPERBYTE; bit++)
+        {
+            bits++;
+
+            if ((pkt[idx] >> bit) & 1)
+            {
+                if (++ones == 6)
+                {
+                    bits++;
+                    ones = 0;
+                }
+            }
+            else
+            {
+                ones = 0;
+            }
+        }
+    }
+
+    return bits;
+}
+
+// -------------------------------------------------------------------------
+// tlmSkip()
+//
+// Number of clocks for which, with the line held at K, the engines
+// would do no more than count, so the user code is not resumed, and
+// no command, packet or line event is handled. The last sampled line
+// must also be K, so no line change is seen. A transmitting node is
+// limited to the rest of its packet's K samples, and the countdown,
+// frame and event wait timers to the clock before they expire.
+//
+// -------------------------------------------------------------------------
+
+uint32_t usbDirectNode::tlmSkip (void) const
+{
+    uint32_t clks = UINT32_MAX;
+
+    if (!tlm || lineval != usbModel::USB_K || rxtlmvalid ||
+        state == WAITCLK || (state == WAITCMD && ack))
+    {
+        return 0;
+    }
+
+    // Any command issued by the user code is taken on a normal clock
+    if (txreq != txack || cntreq != cntack || rxreq != rxack || sofctlreq != sofctlack ||
+        evwaitreq != evwaitack || evclrreq != evclrack || hsreq != hsack)
+    {
+        return 0;
+    }
+
+    // The serialiser drives K until its bit count is reached, and the
+    // transmit engine until the EOP's first SE0 sample
+    if (sersel)
+    {
+        if (serphase != SER_DATA || seridx == 0)
+        {
+            return 0;
+        }
+
+        clks = serbits - 1 - seridx;
+    }
+
+    if (txbusy)
+    {
+        if ((txidx + 3) >= txsamples)
+        {
+            return 0;
+        }
+
+        clks = std::min(clks, txsamples - 3 - txidx);
+    }
+
+    // An SOF waiting on the countdown would be launched
+    if (!device && sofdue && cntbusy && cntsofok && !oen)
+    {
+        return 0;
+    }
+
+    if (cntbusy && cntlen != 0 && !sersel)
+    {
+        if ((cntval + 1) >= cntlen)
+        {
+            return 0;
+        }
+
+        clks = std::min(clks, cntlen - 1 - cntval);
+    }
+
+    if (sofen)
+    {
+        clks = std::min(clks, (uint32_t)(SOFPERIOD - 1 - softimer));
+    }
+
+    if (evwaitbusy && evtimeout != 0)
+    {
+        if ((evwaitcount + 1) >= evtimeout)
+        {
+            return 0;
+        }
+
+        clks = std::min(clks, evtimeout - 1 - evwaitcount);
+    }
+
+    // A receive capture completes on a delivered packet's EOP, or ends on
+    // a K if looking for a reset
+    if (rxbusy && !hsbusy && (rxlookforreset || rxtlmpend))
+    {
+        return 0;
+    }
+
+    // The handshake responder releases its transaction once its handshake is sent
+    if (device && hsstate == HS_SEND && hsseen && !sersel)
+    {
+        return 0;
+    }
+
+    return clks;
+}
+
+// -------------------------------------------------------------------------
+// tlmAdvance()
+//
+// Advances the engines by clks clocks with the line held at K, as
+// clock() would for the number of clocks returned by tlmSkip().
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::tlmAdvance (const uint32_t clks)
+{
+    clkcount += clks;
+
+    if (sersel)
+    {
+        seridx += clks;
+    }
+
+    if (txbusy)
+    {
+        txidx  += clks;
+    }
+
+    if (cntbusy)
+    {
+        cntval += clks;
+    }
+
+    if (sofen)
+    {
+        softimer += clks;
+    }
+
+    if (evwaitbusy)
+    {
+        evwaitcount += clks;
+    }
+
+    if (device && (hsstate == HS_IDLE || hsstate == HS_ABSORB))
+    {
+        hsinpkt = true;
+    }
+    else if (device && hsstate == HS_SEND && sersel)
+    {
+        hsseen  = true;
+    }
+
+    if (rxbusy && hsbusy)
+    {
+        rxidle         = true;
+        rxlookforreset = false;
+        rxrstcount     = 0;
+        rxidlecount    = 0;
+        rxeopcount     = 0;
+        rxbits         = 0;
+        rxtlmpend      = false;
+    }
+    else if (rxbusy)
+    {
+        rxactivity     = true;
+        rxidle         = false;
+        rxidlecount    = 0;
+    }
+}
+
+// -------------------------------------------------------------------------
+// clock()
+//
+// Advances all the engines on a clock edge. The signals that pass
+// between engines are taken from the state before the edge, as for
+// the HDL's non-blocking assignments. The user code is then resumed if
+// its command was acknowledged or it was waiting for the clock.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clock (const int linep, const int linem)
+{
+    edge_t e;
+
+    e.line      = ((linem & 1) << 1) | (linep & 1);
+    e.txgo      = txGo();
+    e.soflaunch = !device && sofdue && !sersel &&
+                  (((txreq != txack) && txsofok) || (cntbusy && cntsofok && !oen));
+    e.hsstart   = hsreq != hsack;
+    e.sersel    = sersel;
+    e.hsbusy    = hsbusy;
+    e.tlmrx     = rxtlmvalid;
+
+    lineval     = e.line;
+    clkcount++;
+
+    clkTx(e);
+    clkCountdown(e);
+    clkSerialiser(e);
+    clkResponder(e);
+    clkEvents(e);
+    clkRxCapture(e);
+
+    rxtlmvalid  = false;
+
+    if ((state == WAITCMD && ack) || state == WAITCLK)
+    {
+        resume();
+    }
+}
+
+// -------------------------------------------------------------------------
+// clkTx()
+//
+// Transmit engine. Shifts out txlen line samples from the transmit
+// buffer, one per clock, and then acknowledges the TXSEND access.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clkTx (const edge_t &e)
+{
+    if (e.txgo)
+    {
+        txack = txreq;
+
+        if (txsamples <= 1)
+        {
+            ack = true;
+        }
+        else
+        {
+            txbusy = true;
+            txidx  = 1;
+        }
+    }
+    else if (txbusy)
+    {
+        if (txidx == (txsamples - 1))
+        {
+            txbusy = false;
+            ack    = true;
+        }
+        else
+        {
+            txidx++;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// clkCountdown()
+//
+// Acknowledges the COUNTDOWN access after cntlen clocks, or never if
+// cntlen is 0. Expiry is extended whilst the serialiser is sending.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clkCountdown (const edge_t &e)
+{
+    if (cntreq != cntack)
+    {
+        cntack = cntreq;
+
+        if (cntlen == 1 && !e.sersel)
+        {
+            ack = true;
+        }
+        else
+        {
+            cntbusy = true;
+            cntval  = 1;
+        }
+    }
+    else if (cntbusy)
+    {
+        if (cntlen != 0 && (cntval + 1) >= cntlen && !e.sersel)
+        {
+            cntbusy = false;
+            ack     = true;
+        }
+        else
+        {
+            cntval++;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// clkSerialiser()
+//
+// Start of frame generator and raw packet serialiser. When enabled in
+// a host, an SOF becomes due every 1ms and is sent at the next
+// transaction boundary. The serialiser NRZI encodes and bit stuffs
+// serlen raw bits, then sends EOP and holds the line idle for
+// SERGAPCLKS clocks. It also sends the handshake responder's packets.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clkSerialiser (const edge_t &e)
+{
+    bool prevsofen = sofen;
+
+    if (e.soflaunch)
+    {
+        sofdue = false;
+        serraw = (crc5(sofframe) << 27) | (sofframe << 16) | 0xa580;
+        serlen = 32;
+    }
+    else if (e.hsstart)
+    {
+        hsack  = hsreq;
+        serraw = (hspid << 8) | 0x80;
+        serlen = 16;
+    }
+
+    if (e.soflaunch || e.hsstart)
+    {
+        // In TLM mode, the raw bits after SYNC are the packet bytes
+        if (tlm)
+        {
+            sertlmlen = serlen/8 - 1;
+
+            for (int idx = 0; idx < sertlmlen; idx++)
+            {
+                sertlm[idx] = (serraw >> ((idx+1)*8)) & 0xff;
+            }
+
+            serbits = tlmBitTime(sertlm, sertlmlen);
+        }
+
+        serbusy  = true;
+        serphase = SER_DATA;
+        seridx   = 0;
+        serones  = 0;
+        serlevel = 1;
+        serstuff = false;
+    }
+
+    // Apply any SOFCTRL update, with an SOF due straight away when enabled,
+    // else count out the frame period
+    if (sofctlreq != sofctlack)
+    {
+        sofctlack = sofctlreq;
+        sofen     = sofctlen;
+
+        if (sofctlload)
+        {
+            sofframe = sofctlframe;
+        }
+
+        if (sofctlen && !prevsofen)
+        {
+            softimer = 0;
+            sofdue   = true;
+        }
+        else if (!sofctlen)
+        {
+            sofdue   = false;
+        }
+    }
+    else if (sofen)
+    {
+        if (softimer == (SOFPERIOD - 1))
+        {
+            softimer = 0;
+            sofframe = (sofframe + 1) & 0x7ff;
+            sofdue   = true;
+        }
+        else
+        {
+            softimer++;
+        }
+    }
+
+    if (serbusy)
+    {
+        switch (serphase)
+        {
+        case SER_DATA:
+            // In TLM mode, hold the line at K for the packet's bit time
+            if (tlm)
+            {
+                serdp  = 0;
+                serdm  = 1;
+                seroen = true;
+
+                if (++seridx == serbits)
+                {
+                    serphase = SER_EOP;
+                    sercount = 0;
+                }
+                break;
+            }
+
+            // A zero, or a stuffed bit after six ones, toggles the line state
+            if (serstuff)
+            {
+                serlevel = !serlevel;
+                serones  = 0;
+                serstuff = false;
+            }
+            else
+            {
+                if (!((serraw >> seridx) & 1))
+                {
+                    serlevel = !serlevel;
+                    serones  = 0;
+                }
+                else
+                {
+                    serones++;
+                }
+
+                seridx++;
+                serstuff = (serones == 6);
+            }
+
+            serdp  = serlevel;
+            serdm  = !serlevel;
+            seroen = true;
+
+            if (seridx == serlen && !serstuff)
+            {
+                serphase = SER_EOP;
+                sercount = 0;
+            }
+            break;
+
+        // Two SE0s then a J, with the outputs disabled on the J
+        case SER_EOP:
+            sercount++;
+
+            if (sercount <= 2)
+            {
+                serdp    = 0;
+                serdm    = 0;
+            }
+            else
+            {
+                serdp    = 1;
+                serdm    = 0;
+                seroen   = false;
+                serphase = SER_GAP;
+                sercount = 0;
+            }
+            break;
+
+        default:
+            sercount++;
+
+            if (sercount == SERGAPCLKS)
+            {
+                serbusy = false;
+            }
+            break;
+        }
+    }
+
+    sersel = serbusy;
+}
+
+// -------------------------------------------------------------------------
+// clkResponder()
+//
+// Handshake responder (device only). Decodes tokens on the line and,
+// for an IN or OUT token to this device's address on an endpoint with
+// a NAK or STALL status, claims the transaction from the receive
+// capture engine and sends the handshake after turnaround. An OUT
+// token's data packet is first absorbed.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clkResponder (const edge_t &e)
+{
+    bool hseop = false;
+
+    // In TLM mode, a delivered packet is seen as its bits (after a SYNC)
+    // at its EOP, and is in progress whilst the line is at K
+    if (tlm)
+    {
+        if (device && (hsstate == HS_IDLE || hsstate == HS_ABSORB))
+        {
+            hsinpkt = (e.line == usbModel::USB_K);
+
+            if (e.tlmrx)
+            {
+                hsinpkt = false;
+                hseop   = true;
+                hsbits  = (rxtlmlen + 1) * usbModel::NRZI_BITSPERBYTE;
+                hsshift = 0x80;
+
+                for (int idx = 0; idx < rxtlmlen && idx < 3; idx++)
+                {
+                    hsshift |= (uint32_t)rxtlm[idx] << ((idx+1)*8);
+                }
+            }
+        }
+    }
+    // Decode the NRZI, unstuffed bits of packets when looking at the line
+    else if (device && (hsstate == HS_IDLE || hsstate == HS_ABSORB))
+    {
+        // A packet starts with a K after idle
+        if (!hsinpkt && e.line == usbModel::USB_K && hsprev == usbModel::USB_J)
+        {
+            hsinpkt = true;
+            hsbits  = 0;
+            hsones  = 0;
+            hsshift = 0;
+        }
+
+        if (hsinpkt)
+        {
+            if (e.line == usbModel::USB_SE0)
+            {
+                hsinpkt = false;
+                hseop   = true;
+            }
+            // Drop stuffed bits after six ones, else no change in line state is a one
+            else if (hsones == 6)
+            {
+                hsones = 0;
+            }
+            else
+            {
+                hsones = (e.line == hsprev) ? hsones + 1 : 0;
+
+                if (hsbits < 32 && e.line == hsprev)
+                {
+                    hsshift |= 1U << hsbits;
+                }
+
+                hsbits++;
+            }
+        }
+    }
+
+    hsprev = e.line;
+
+    switch (hsstate)
+    {
+    case HS_IDLE:
+        // On a valid token for this device, check the endpoint's status
+        if (hseop && hsbits == 32 && (hsshift & 0xff) == 0x80 &&
+            ((hsshift >> 12) & 0xf) == (~(hsshift >> 8) & 0xf) &&
+            ((hsshift >> 16) & 0x7f) == devaddr &&
+            (hsshift >> 27) == crc5((hsshift >> 16) & 0x7ff))
+        {
+            unsigned pid   = (hsshift >> 8)  & 0xf;
+            unsigned ep    = (hsshift >> 23) & 0xf;
+            unsigned epstat;
+
+            hscount = 0;
+
+            if (pid == usbModel::PID_TOKEN_IN)
+                epstat = (epstatin  >> (ep*2)) & 0x3;
+            else if (pid == usbModel::PID_TOKEN_OUT)
+                epstat = (epstatout >> (ep*2)) & 0x3;
+            else
+                epstat = EPSTAT_READY;
+
+            if (epstat == EPSTAT_NAK || epstat == EPSTAT_STALL)
+            {
+                hsbusy  = true;
+                hspid   = (epstat == EPSTAT_NAK) ? 0x5a : 0x1e;
+                hsstate = (pid == usbModel::PID_TOKEN_OUT) ? HS_ABSORB : HS_TURN;
+            }
+        }
+        break;
+
+    // Wait for the OUT token's data packet, giving up if none arrives
+    case HS_ABSORB:
+        if (hseop)
+        {
+            hsstate = HS_TURN;
+            hscount = 0;
+        }
+        else if (!hsinpkt)
+        {
+            hscount++;
+
+            if (hscount >= HSABSORBCLKS)
+            {
+                hsbusy  = false;
+                hsstate = HS_IDLE;
+            }
+        }
+        break;
+
+    // Count the turnaround once the line is back at idle, then send the handshake
+    case HS_TURN:
+        if (e.line == usbModel::USB_J)
+        {
+            hscount++;
+        }
+
+        if (hscount == HSTURNCLKS)
+        {
+            hsreq   = !hsreq;
+            hsseen  = false;
+            hsstate = HS_SEND;
+        }
+        break;
+
+    // Release the transaction once the serialiser has sent the handshake
+    default:
+        if (e.sersel)
+        {
+            hsseen = true;
+        }
+        else if (hsseen)
+        {
+            hsbusy  = false;
+            hsstate = HS_IDLE;
+        }
+        break;
+    }
+}
+
+// -------------------------------------------------------------------------
+// clkEvents()
+//
+// Line event detectors. Flags line state changes, SE0 held for the
+// reset period and J held for the suspend period as pending events,
+// and acknowledges an EVWAIT access when a waited for event occurs or
+// the wait times out.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clkEvents (const edge_t &e)
+{
+    unsigned evnew = 0;
+    unsigned evstate;
+
+    // Detect a change in line state
+    if (e.line != evprev)
+    {
+        evnew |= 1 << EV_LINECHG;
+    }
+
+    evprev = e.line;
+
+    // Count consecutive SE0 and J states, flagging when they reach the
+    // reset and suspend periods respectively
+    evse0count = (e.line == usbModel::USB_SE0) ? evse0count + 1 : 0;
+    evjcount   = (e.line == usbModel::USB_J)   ? evjcount   + 1 : 0;
+
+    if (evse0count == rstthresh)
+    {
+        evnew |= 1 << EV_RESET;
+    }
+
+    if (evjcount == suspthresh)
+    {
+        evnew |= 1 << EV_SUSPEND;
+    }
+
+    evstate = evpend;
+
+    // Clear any events requested from an EVSTATUS write
+    if (evclrreq != evclrack)
+    {
+        evclrack = evclrreq;
+        evstate &= ~evclr;
+    }
+
+    // Starting a wait clears the events being waited on, so only new events complete it
+    if (evwaitreq != evwaitack)
+    {
+        evwaitack   = evwaitreq;
+        evstate    &= ~evwaitmask;
+        evwaitbusy  = true;
+        evwaitcount = 0;
+    }
+
+    evstate |= evnew;
+    evpend   = evstate;
+
+    // Acknowledge the EVWAIT access when a waited for event is pending or on timeout
+    if (evwaitbusy)
+    {
+        evwaitcount++;
+
+        if ((evstate & evwaitmask) != 0 || (evtimeout != 0 && evwaitcount >= evtimeout))
+        {
+            evwaitbusy = false;
+            ack        = true;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// clkRxCapture()
+//
+// Receive capture engine. Samples the line once per clock, waiting for
+// a packet and capturing its samples up to the EOP. Reset, suspend,
+// disconnection and timeout are also detected. The RXCAPTURE access is
+// acknowledged when any of these occur.
+//
+// -------------------------------------------------------------------------
+
+void usbDirectNode::clkRxCapture (const edge_t &e)
+{
+    bool rxdone = false;
+
+    if (rxreq != rxack)
+    {
+        rxack          = rxreq;
+        rxbusy         = true;
+        rxidle         = true;
+        rxlookforreset = false;
+        rxrstcount     = 0;
+        rxidlecount    = 0;
+        rxeopcount     = 0;
+        rxbits         = 0;
+        rxactivity     = false;
+        rxtlmpend      = false;
+    }
+
+    // Anything seen whilst the handshake responder is handling a transaction
+    // is discarded, with the capture starting afresh afterwards
+    if (rxbusy && e.hsbusy)
+    {
+        rxidle         = true;
+        rxlookforreset = false;
+        rxrstcount     = 0;
+        rxidlecount    = 0;
+        rxeopcount     = 0;
+        rxbits         = 0;
+        rxtlmpend      = false;
+    }
+    else if (rxbusy)
+    {
+        // If a host and SE0 seen when idle, there is no device connected
+        if (!rxdevice && rxidle && e.line == usbModel::USB_SE0)
+        {
+            rxstatus = RXSTAT_DISCONNECTED;
+            rxdone   = true;
+        }
+        else
+        {
+            // Flag any activity that would bring a device out of suspension
+            if (e.line == usbModel::USB_K || (rxdevice && e.line == usbModel::USB_SE0))
+            {
+                rxactivity = true;
+            }
+
+            // If not in the middle of a reset detection and K seen, then line is not idle
+            if (!rxlookforreset && e.line == usbModel::USB_K)
+            {
+                rxidle = false;
+            }
+            // If idle and an SE0 seen then this may be a reset
+            else if (rxdevice && rxidle && e.line == usbModel::USB_SE0)
+            {
+                rxidle         = false;
+                rxlookforreset = true;
+                rxrstcount++;
+            }
+
+            // If in the middle of a potential reset, count consecutive SE0s. When a
+            // non-SE0 state occurs, the status is reset if seen sufficient
+            // consecutive SE0s, else an error for unexplained SE0s.
+            if (rxlookforreset)
+            {
+                if (e.line == usbModel::USB_SE0)
+                {
+                    rxrstcount++;
+                }
+                else
+                {
+                    rxstatus = (rxrstcount >= rstthresh) ? RXSTAT_RESET : RXSTAT_ERROR;
+                    rxdone   = true;
+                }
+            }
+
+            if (!rxdone)
+            {
+                // In TLM mode, wait for the packet to be delivered at the start
+                // of its EOP, completing at the end of the EOP
+                if (tlm && !rxidle && !rxlookforreset)
+                {
+                    rxidlecount = 0;
+                    rxtlmpend   = rxtlmpend || e.tlmrx;
+
+                    if (rxtlmpend && ++rxeopcount == 3)
+                    {
+                        for (int idx = 0; idx < rxtlmlen; idx += 4)
+                        {
+                            uint32_t word = 0;
+
+                            for (int bidx = 0; bidx < 4 && (idx+bidx) < rxtlmlen; bidx++)
+                            {
+                                word |= (uint32_t)rxtlm[idx+bidx] << (bidx*8);
+                            }
+
+                            rxbuf[(idx/4) & (RXBUFWORDS-1)] = word;
+                        }
+
+                        rxbits   = rxtlmlen * usbModel::NRZI_BITSPERBYTE;
+                        rxstatus = RXSTAT_PKT;
+                        rxdone   = true;
+                    }
+                }
+                // If not idle, then capture the packet samples until the 3 bits of EOP
+                else if (!rxidle && !rxlookforreset)
+                {
+                    uint32_t &word = rxbuf[(rxbits >> 4) & (RXBUFWORDS-1)];
+                    unsigned  bit  = rxbits & 0xf;
+
+                    rxidlecount = 0;
+
+                    word = (word & ~((1U << bit) | (1U << (16 + bit)))) |
+                           ((e.line & 1) << bit) | (((e.line >> 1) & 1) << (16 + bit));
+                    rxbits++;
+
+                    if (!rxeopcount && e.line == usbModel::USB_SE0)
+                    {
+                        rxeopcount = 1;
+                    }
+                    else if (rxeopcount)
+                    {
+                        rxeopcount++;
+
+                        if (rxeopcount == 3)
+                        {
+                            rxstatus = RXSTAT_PKT;
+                            rxdone   = true;
+                        }
+                    }
+                }
+                else
+                {
+                    rxidlecount++;
+
+                    if (rxdevice && !rxnosuspend && rxidlecount >= suspthresh)
+                    {
+                        rxstatus = RXSTAT_SUSPEND;
+                        rxdone   = true;
+                    }
+                    else if (rxtimeout != 0 && rxidlecount >= rxtimeout)
+                    {
+                        rxstatus = RXSTAT_NORESPONSE;
+                        rxdone   = true;
+                    }
+                }
+            }
+        }
+
+        // On completion, save the bit count and acknowledge the RXCAPTURE access
+        if (rxdone)
+        {
+            rxbusy     = false;
+            rxbitcount = rxbits;
+            ack        = true;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// crc5()
+//
+// CRC5 of an 11 bit token field, in the bit order it is sent on the
+// line, as for the HDL's crc5 function
+//
+// -------------------------------------------------------------------------
+
+unsigned usbDirectNode::crc5 (const unsigned data)
+{
+    return usbCrc::crc5Field(data);
+}
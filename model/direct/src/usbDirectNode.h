@@ -0,0 +1,321 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 2nd March 2024
+//
+// Contains the usbDirectNode class, a C++ implementation of the
+// usbModel HDL register map and line engines that services a
+// node's usbPliApi accesses directly, without VProc.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_DIRECT_NODE_H_
+#define _USB_DIRECT_NODE_H_
+
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "usbLineBackend.h"
+
+// -------------------------------------------------------------------------
+// usbDirectNode
+//
+// Behaves as a usbModel module (serial D+/D- interface) instantiated
+// with the given node number. The node's user code (e.g. VUserMain0)
+// runs as a coroutine on its own stack, switched to with swapcontext
+// rather than as a VProc thread. Register accesses complete at once,
+// except for blocking ones (TXSEND, COUNTDOWN, RXCAPTURE, EVWAIT) and
+// those that advance time, which switch back to the caller of clock()
+// until the engines complete them. The whole simulation therefore runs
+// in a single OS thread, with the caller stepping the clock, e.g. from
+// a Verilator eval() loop or a C++ bus model.
+//
+// Each clock, the caller drives the line with the lineXxx() outputs
+// (resolving the pullup externally, as for usbModel in Verilator),
+// then calls clock() with the resolved line state.
+//
+// In transaction level (TLM) mode, selected with setTlm() before
+// start(), PHYIF reads as PHYIF_TLM and the user code passes raw
+// packet bytes, as for the UTMI model. A transmitted packet is not
+// NRZI encoded on the line. Instead, the line is held at K for the
+// packet's bit time (SYNC, data and stuffed bits), followed by a
+// normal EOP. The packet bytes are then available from tlmPacket() for
+// the cycle the EOP's first SE0 is driven, for the caller to pass to
+// the other nodes with tlmDeliver(). The receive capture engine and handshake
+// responder take packets from tlmDeliver() in place of decoding the
+// line. Whilst the line is held at K, the caller may advance the nodes
+// through the packet's bit time in one step, with tlmSkip() and
+// tlmAdvance(), rather than clocking them cycle by cycle. Line states outside of packets (idle, reset, suspend and
+// disconnection) are as for bit accurate mode, so frame timing and
+// line event detection are unchanged.
+//
+// -------------------------------------------------------------------------
+
+class usbDirectNode : public usbLineBackend
+{
+public:
+
+    // Coroutine stack size. User code keeps its usbHost/usbDevice object
+    // on the stack, so this is generous.
+    static const unsigned DEFAULTSTACKSIZE = 4*1024*1024;
+
+    // Transmit and receive buffer sizes in 32 bit words, as for the HDL
+    static const int      TXBUFWORDS       = 1024;
+    static const int      RXBUFWORDS       = 1024;
+
+    // Start of frame period, serialiser gap and handshake responder
+    // timings, as for the HDL
+    static const int      SOFPERIOD        = 12000;
+    static const int      SERGAPCLKS       = 4;
+    static const int      HSTURNCLKS       = 4;
+    static const int      HSABSORBCLKS     = 64;
+
+    // Maximum packet size in TLM mode
+    static const int      MAXTLMBYTES      = TXBUFWORDS*4;
+
+    usbDirectNode (const int nodeIn, const bool isDevice, void (*usermainIn)(void),
+                   const unsigned stacksize = DEFAULTSTACKSIZE);
+
+    ~usbDirectNode();
+
+    // Enter the user code, which runs until its first access that
+    // must wait for the clock
+    void     start      (void);
+
+    // Advance the engines by one clock, sampling the given line state,
+    // and resume the user code if its wait is over
+    void     clock      (const int linep, const int linem);
+
+    // Set the state of the reset input (active high)
+    void     setReset   (const bool reset) {nreset = !reset;};
+
+    // Line outputs for the current clock cycle
+    int      lineOe     (void) const;
+    int      lineDp     (void) const;
+    int      lineDm     (void) const;
+    int      linePullup (void) const {return !nopullup;};
+
+    bool     isDevice   (void) const {return device;};
+
+    // Select transaction level mode, before start()
+    void     setTlm     (const bool enable) {tlm = enable;};
+    bool     isTlm      (void) const {return tlm;};
+
+    // TLM mode packet transfer. tlmPacket() returns the bytes of a packet
+    // completing in the current cycle (else NULL), and tlmDeliver() passes
+    // such a packet to this node for its next clock.
+    const uint8_t* tlmPacket  (int &len) const;
+    void           tlmDeliver (const uint8_t* pkt, const int len);
+
+    // Bit time of a raw packet on the line, including SYNC and bit stuffing
+    // but not EOP
+    static unsigned tlmBitTime (const uint8_t* pkt, const int len);
+
+    // TLM mode skipping of a packet's bit time. tlmSkip() returns the
+    // number of clocks, from the current one, for which the engines would
+    // only count with the line held at K (else 0), and tlmAdvance() then
+    // advances them by that many clocks in one step. The caller must
+    // check the line resolves to K for the current cycle.
+    uint32_t       tlmSkip    (void) const;
+    void           tlmAdvance (const uint32_t clks);
+
+    // Flags whether the user code has requested a halt (UVH_FINISH or
+    // UVH_STOP), or has returned
+    bool     halted     (void) const {return halt || state == EXITED;};
+
+    uint32_t clkCount   (void) const {return clkcount;};
+
+    // usbLineBackend accesses, called from the user code
+    int      write      (const unsigned addr, const unsigned data, const int delta);
+    int      read       (const unsigned addr, unsigned *data, const int delta);
+
+private:
+
+    // Coroutine states
+    enum costate_e {IDLE, RUNNING, WAITCMD, WAITCLK, EXITED};
+
+    // Serialiser phases and handshake responder states
+    enum serphase_e {SER_DATA, SER_EOP, SER_GAP};
+    enum hsstate_e  {HS_IDLE, HS_ABSORB, HS_TURN, HS_SEND};
+
+    // Combinatorial signals, from the state before a clock edge, that
+    // are seen by more than one engine
+    struct edge_t
+    {
+        int  line;
+        bool txgo;
+        bool soflaunch;
+        bool hsstart;
+        bool sersel;
+        bool hsbusy;
+        bool tlmrx;
+    };
+
+    int      access       (const unsigned addr, const unsigned wdata, const bool wr, const int delta);
+    void     waitFor      (const costate_e waitstate);
+    void     resume       (void);
+    static void entry     (void);
+
+    bool     txGo         (void) const;
+    int      txSample     (const uint32_t idx, const int dm) const;
+
+    void     clkTx        (const edge_t &e);
+    void     clkCountdown (const edge_t &e);
+    void     clkSerialiser(const edge_t &e);
+    void     clkResponder (const edge_t &e);
+    void     clkEvents    (const edge_t &e);
+    void     clkRxCapture (const edge_t &e);
+
+    static unsigned crc5  (const unsigned data);
+
+    // Node configuration and coroutine
+    int            node;
+    bool           device;
+    void         (*usermain)(void);
+    char*          stack;
+    unsigned       stacksz;
+    ucontext_t     usrctx;
+    ucontext_t     simctx;
+    costate_e      state;
+    bool           ack;
+    bool           halt;
+    bool           tlm;
+
+    static usbDirectNode* starting;
+
+    // Inputs and register state
+    bool           nreset;
+    int            lineval;
+    bool           oen;
+    bool           nopullup;
+    int            dp;
+    int            dm;
+    uint32_t       clkcount;
+
+    // Transmit engine state
+    uint32_t       txbuf[TXBUFWORDS];
+    uint32_t       txwidx;
+    uint32_t       txlen;
+    uint32_t       txidx;
+    bool           txreq;
+    bool           txack;
+    bool           txbusy;
+    bool           txsofok;
+    uint32_t       txsamples;
+    uint8_t        txtlm[MAXTLMBYTES];
+
+    // Receive capture engine state
+    uint32_t       rxbuf[RXBUFWORDS];
+    uint32_t       rxridx;
+    uint32_t       rstthresh;
+    uint32_t       suspthresh;
+    uint32_t       rxtimeout;
+    bool           rxdevice;
+    bool           rxnosuspend;
+    bool           rxreq;
+    bool           rxack;
+    bool           rxbusy;
+    unsigned       rxstatus;
+    unsigned       rxbitcount;
+    bool           rxactivity;
+    bool           rxidle;
+    bool           rxlookforreset;
+    uint32_t       rxrstcount;
+    uint32_t       rxidlecount;
+    int            rxeopcount;
+    uint32_t       rxbits;
+
+    // Countdown state
+    uint32_t       cntlen;
+    uint32_t       cntval;
+    bool           cntreq;
+    bool           cntack;
+    bool           cntbusy;
+    bool           cntsofok;
+
+    // Raw packet serialiser state
+    uint32_t       serraw;
+    int            serlen;
+    int            seridx;
+    serphase_e     serphase;
+    int            serones;
+    int            sercount;
+    int            serlevel;
+    bool           serstuff;
+    bool           serbusy;
+    bool           sersel;
+    int            serdp;
+    int            serdm;
+    bool           seroen;
+    int            serbits;
+    uint8_t        sertlm[4];
+    int            sertlmlen;
+
+    // TLM mode delivered packet
+    uint8_t        rxtlm[MAXTLMBYTES];
+    int            rxtlmlen;
+    bool           rxtlmvalid;
+    bool           rxtlmpend;
+
+    // Start of frame generator state
+    bool           sofen;
+    bool           sofdue;
+    unsigned       sofframe;
+    bool           sofctlen;
+    bool           sofctlload;
+    unsigned       sofctlframe;
+    bool           sofctlreq;
+    bool           sofctlack;
+    int            softimer;
+
+    // Handshake responder state
+    unsigned       devaddr;
+    uint32_t       epstatout;
+    uint32_t       epstatin;
+    bool           hsbusy;
+    unsigned       hspid;
+    bool           hsreq;
+    bool           hsack;
+    hsstate_e      hsstate;
+    int            hsprev;
+    uint32_t       hsshift;
+    int            hsones;
+    bool           hsinpkt;
+    bool           hsseen;
+    int            hsbits;
+    int            hscount;
+
+    // Line event detector state
+    unsigned       evirqmask;
+    unsigned       evpend;
+    unsigned       evclr;
+    bool           evclrreq;
+    bool           evclrack;
+    unsigned       evwaitmask;
+    uint32_t       evtimeout;
+    bool           evwaitreq;
+    bool           evwaitack;
+    bool           evwaitbusy;
+    int            evprev;
+    uint32_t       evse0count;
+    uint32_t       evjcount;
+    uint32_t       evwaitcount;
+};
+
+#endif
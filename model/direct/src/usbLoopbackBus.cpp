@@ -0,0 +1,268 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 4th March 2024
+//
+// Implementation of the usbLoopbackBus class
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#include <stdlib.h>
+#include <algorithm>
+
+#include "usbCommon.h"
+#include "usbLoopbackBus.h"
+
+// -------------------------------------------------------------------------
+// Constructor
+//
+// TLM mode defaults to the setting of the USBMODEL_TLM environment
+// variable.
+//
+// -------------------------------------------------------------------------
+
+usbLoopbackBus::usbLoopbackBus () : clkcount(0), steps(0), contentions(0), linep(0), linem(0)
+{
+    const char* env = getenv("USBMODEL_TLM");
+
+    tlm = (env != NULL) && (strtol(env, NULL, 0) != 0);
+}
+
+// -------------------------------------------------------------------------
+// Destructor
+//
+// -------------------------------------------------------------------------
+
+usbLoopbackBus::~usbLoopbackBus ()
+{
+    for (unsigned idx = 0; idx < nodes.size(); idx++)
+    {
+        delete nodes[idx];
+    }
+}
+
+// -------------------------------------------------------------------------
+// addNode()
+//
+// Creates a node on the bus. The node registers itself as the line
+// backend for its node number, so must be added before the user code
+// creates its usbHost or usbDevice object (i.e. before run()).
+//
+// -------------------------------------------------------------------------
+
+usbDirectNode* usbLoopbackBus::addNode (const int node, const bool isDevice, void (*usermain)(void))
+{
+    usbDirectNode* n = new usbDirectNode(node, isDevice, usermain);
+
+    nodes.push_back(n);
+
+    return n;
+}
+
+// -------------------------------------------------------------------------
+// run()
+//
+// Starts the nodes' user code and clocks the bus until a node halts the
+// simulation, or until maxclks clocks have elapsed if non-zero. A step
+// is not allowed past the end of reset or the timeout.
+//
+// -------------------------------------------------------------------------
+
+int usbLoopbackBus::run (const uint64_t maxclks)
+{
+    for (unsigned idx = 0; idx < nodes.size(); idx++)
+    {
+        nodes[idx]->setTlm(tlm);
+        nodes[idx]->setReset(clkcount < RESETCLKS);
+        nodes[idx]->start();
+    }
+
+    while (!halted())
+    {
+        if (maxclks != 0 && clkcount >= maxclks)
+        {
+            return usbModel::USBERROR;
+        }
+
+        if (clkcount == RESETCLKS)
+        {
+            for (unsigned idx = 0; idx < nodes.size(); idx++)
+            {
+                nodes[idx]->setReset(false);
+            }
+        }
+
+        uint64_t limit = (maxclks != 0) ? maxclks - clkcount : UINT64_MAX;
+
+        if (clkcount < RESETCLKS)
+        {
+            limit = std::min(limit, (uint64_t)(RESETCLKS - clkcount));
+        }
+
+        step(limit);
+    }
+
+    return usbModel::USBOK;
+}
+
+// -------------------------------------------------------------------------
+// step()
+//
+// Resolves the line from the nodes' outputs for this cycle. In TLM mode,
+// if every node can be advanced by more than one clock, they are all
+// advanced together by up to maxclks clocks. Otherwise every node is
+// clocked once with the resolved line.
+//
+// -------------------------------------------------------------------------
+
+uint64_t usbLoopbackBus::step (const uint64_t maxclks)
+{
+    uint64_t clks;
+
+    resolve();
+
+    clks = std::min(tlmSkip(), maxclks);
+
+    if (clks > 1)
+    {
+        for (unsigned idx = 0; idx < nodes.size(); idx++)
+        {
+            nodes[idx]->tlmAdvance((uint32_t)clks);
+        }
+    }
+    else
+    {
+        clks = 1;
+
+        for (unsigned idx = 0; idx < nodes.size(); idx++)
+        {
+            nodes[idx]->clock(linep, linem);
+        }
+    }
+
+    clkcount += clks;
+    steps++;
+
+    return clks;
+}
+
+// -------------------------------------------------------------------------
+// resolve()
+//
+// Resolves the line state, and in TLM mode delivers any packet that
+// completes this cycle to the other nodes.
+//
+// -------------------------------------------------------------------------
+
+void usbLoopbackBus::resolve (void)
+{
+    int drivers = 0;
+    int pullup  = 0;
+
+    linep = 0;
+    linem = 0;
+
+    for (unsigned idx = 0; idx < nodes.size(); idx++)
+    {
+        usbDirectNode* n = nodes[idx];
+
+        if (tlm)
+        {
+            int            len;
+            const uint8_t* pkt = n->tlmPacket(len);
+
+            if (pkt != NULL)
+            {
+                for (unsigned ridx = 0; ridx < nodes.size(); ridx++)
+                {
+                    if (ridx != idx)
+                    {
+                        nodes[ridx]->tlmDeliver(pkt, len);
+                    }
+                }
+            }
+        }
+
+        if (n->lineOe())
+        {
+            drivers++;
+            linep = n->lineDp();
+            linem = n->lineDm();
+        }
+        else if (n->isDevice() && n->linePullup())
+        {
+            pullup = 1;
+        }
+    }
+
+    if (drivers > 1)
+    {
+        contentions++;
+        linep = 0;
+        linem = 0;
+    }
+    else if (drivers == 0)
+    {
+        linep = pullup;
+        linem = 0;
+    }
+}
+
+// -------------------------------------------------------------------------
+// tlmSkip()
+//
+// In TLM mode, with a packet holding the line at K, the number of clocks
+// all the nodes can be advanced by in one step, else 0
+//
+// -------------------------------------------------------------------------
+
+uint64_t usbLoopbackBus::tlmSkip (void) const
+{
+    uint64_t clks = UINT64_MAX;
+
+    if (!tlm || lineState() != usbModel::USB_K)
+    {
+        return 0;
+    }
+
+    for (unsigned idx = 0; idx < nodes.size() && clks != 0; idx++)
+    {
+        clks = std::min(clks, (uint64_t)nodes[idx]->tlmSkip());
+    }
+
+    return clks;
+}
+
+// -------------------------------------------------------------------------
+// halted()
+//
+// -------------------------------------------------------------------------
+
+bool usbLoopbackBus::halted (void) const
+{
+    for (unsigned idx = 0; idx < nodes.size(); idx++)
+    {
+        if (nodes[idx]->halted())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
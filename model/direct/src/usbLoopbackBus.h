@@ -0,0 +1,114 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 4th March 2024
+//
+// Contains the usbLoopbackBus class, a pure C++ USB bus
+// connecting usbDirectNode host and device nodes, so the
+// usbModel C++ can be run without any HDL simulator.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_LOOPBACK_BUS_H_
+#define _USB_LOOPBACK_BUS_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "usbDirectNode.h"
+
+// -------------------------------------------------------------------------
+// usbLoopbackBus
+//
+// Holds a set of nodes (normally a host and a device) on a shared clock
+// and USB line. Each clock, the line is resolved from the nodes' outputs:
+// a driving node sets D+ and D- directly, else an enabled (full speed)
+// device pullup holds D+ high against the host pulldowns, giving J when
+// a device is connected and SE0 otherwise. Two nodes driving at once
+// is contention, which is counted and resolves to SE0.
+//
+// run() holds the nodes in reset for RESETCLKS clocks, and then clocks
+// them until one halts the simulation or the timeout expires.
+//
+// In transaction level (TLM) mode, the nodes exchange packets as raw
+// bytes rather than NRZI line samples, with the line held busy for each
+// packet's computed bit time (see usbDirectNode). A packet completing
+// on a node is delivered to all the other nodes. TLM mode is selected
+// with setTlm(), or by setting the environment variable USBMODEL_TLM to
+// a non-zero value, so the same test can run bit accurate or at the
+// transaction level. Whilst a packet holds the line at K, the bus
+// advances through its bit time in a single step, rather than clocking
+// the nodes cycle by cycle, for as long as no node has anything but its
+// counters to update (see usbDirectNode::tlmSkip()).
+//
+// -------------------------------------------------------------------------
+
+class usbLoopbackBus
+{
+public:
+
+    // Clocks of reset at the start of a run, as for the test benches
+    static const int RESETCLKS = 10;
+
+    usbLoopbackBus ();
+
+    ~usbLoopbackBus ();
+
+    // Create a node on the bus, running usermain as its user code
+    usbDirectNode* addNode      (const int node, const bool isDevice, void (*usermain)(void));
+
+    // Run until a node halts or maxclks clocks have elapsed (0 for no
+    // limit), returning usbModel::USBOK, or usbModel::USBERROR on timeout
+    int            run          (const uint64_t maxclks = 0);
+
+    // Select TLM mode, before run()
+    void           setTlm       (const bool enable) {tlm = enable;};
+    bool           isTlm        (void) const {return tlm;};
+
+    // Advance the bus by a single clock
+    void           clock        (void) {step(1);};
+
+    // Advance the bus by a single clock, or in TLM mode by up to maxclks
+    // clocks in one step whilst a packet holds the line at K, returning
+    // the number of clocks advanced
+    uint64_t       step         (const uint64_t maxclks);
+
+    // Bus state
+    uint64_t       clkCount     (void) const {return clkcount;};
+    uint64_t       stepCount    (void) const {return steps;};
+    uint64_t       contention   (void) const {return contentions;};
+    int            lineState    (void) const {return (linem << 1) | linep;};
+
+private:
+
+    void           resolve      (void);
+    uint64_t       tlmSkip      (void) const;
+    bool           halted       (void) const;
+
+    std::vector<usbDirectNode*> nodes;
+
+    uint64_t       clkcount;
+    uint64_t       steps;
+    uint64_t       contentions;
+    bool           tlm;
+    int            linep;
+    int            linem;
+};
+
+#endif
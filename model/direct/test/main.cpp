@@ -0,0 +1,112 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 4th March 2024
+//
+// Standalone usbModel test, running the host and device user
+// code (VUserMain0 and VUserMain1) on a usbLoopbackBus with no
+// HDL simulator. The run time and clock rate are reported, as
+// a measure of the C++ model's own cost.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "usbCommon.h"
+#include "usbLog.h"
+#include "usbLoopbackBus.h"
+
+// User code entry points for the host (node 0) and device (node 1)
+extern "C" void VUserMain0(void);
+extern "C" void VUserMain1(void);
+
+// Clock frequency and default timeout, as for the test benches
+static const int CLK_PERIOD_MHZ = 12;
+static const int TIMEOUT_US     = 5000;
+
+int main (int argc, char** argv)
+{
+    uint64_t timeout = (uint64_t)CLK_PERIOD_MHZ * TIMEOUT_US;
+    bool     tlm     = false;
+    int      option;
+
+    // Process the command line options
+    while ((option = getopt(argc, argv, "t:Th")) != EOF)
+    {
+        switch (option)
+        {
+        case 't':
+            timeout = (uint64_t)strtoull(optarg, NULL, 0) * CLK_PERIOD_MHZ;
+            break;
+        case 'T':
+            tlm = true;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-t <timeout us>] [-T]\n", argv[0]);
+            fprintf(stderr, "    -t timeout in simulated microseconds (default %d, 0 for none)\n", TIMEOUT_US);
+            fprintf(stderr, "    -T transaction level mode (default from USBMODEL_TLM)\n");
+            return (option == 'h') ? 0 : 1;
+        }
+    }
+
+    usbLoopbackBus bus;
+
+    if (tlm)
+    {
+        bus.setTlm(true);
+    }
+
+    bus.addNode(0, false, VUserMain0);
+    bus.addNode(1, true,  VUserMain1);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int status = bus.run(timeout);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Output any messages still queued for the logging thread
+    usbModel::usbLog::flush();
+
+    if (status != usbModel::USBOK)
+    {
+        fprintf(stderr, "***ERROR: simulation timed out\n");
+    }
+
+    if (bus.contention())
+    {
+        fprintf(stderr, "***ERROR: line contention on %llu clocks\n", (unsigned long long)bus.contention());
+        status = usbModel::USBERROR;
+    }
+
+    fprintf(stderr, "\nusbloopback (%s): %llu clocks in %llu steps (%.3f ms simulated) in %.3f s (%.2f Mclks/s)\n",
+                    bus.isTlm() ? "TLM" : "bit accurate",
+                    (unsigned long long)bus.clkCount(),
+                    (unsigned long long)bus.stepCount(),
+                    (double)bus.clkCount() / (CLK_PERIOD_MHZ * 1000),
+                    secs,
+                    secs > 0 ? bus.clkCount() / secs / 1e6 : 0.0);
+
+    return (status == usbModel::USBOK) ? 0 : 1;
+}
@@ -0,0 +1,334 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 13th March 2024
+//
+// Standalone test of the usbModel per-endpoint traffic
+// statistics. A host and device on a usbLoopbackBus run a known
+// sequence of bulk transfers, including a NAKed IN that is sent
+// again, and the host checks both nodes' counters from their
+// snapshots, dumps them as CSV and JSON, and checks that a reset
+// clears them.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "usbCommon.h"
+#include "usbLog.h"
+#include "usbHost.h"
+#include "usbDevice.h"
+#include "usbLoopbackBus.h"
+
+// Clock frequency and timeout, as for the test benches
+static const int CLK_PERIOD_MHZ = 12;
+static const int TIMEOUT_US     = 5000;
+
+// Transfer sizes, with the OUT data split over two packets
+static const int TESTADDR       = 1;
+static const int BULKEP         = 1;
+static const int MAXPKTSIZE     = 64;
+static const int OUTBYTES       = 100;
+static const int INBYTES        = 32;
+
+// Host name, with quotes for the dumps to escape, and the start of the
+// JSON dump and of the CSV dump's first endpoint line, with the name
+// escaped
+static const char* HOSTNAME     = "HOST\"0\"";
+static const char* HOSTJSON     = "{\"node\": \"HOST\\\"0\\\"\", \"endpoints\": [";
+static const char* HOSTCSV      = "\"HOST\"\"0\"\"\",1,1,";
+
+// The device, for the host to check its counters (the nodes run as
+// coroutines on the one thread), and the number of failed checks
+static usbDevice* device        = NULL;
+static int        failures      = 0;
+
+// -------------------------------------------------------------------------
+// dataCallback()
+//
+// Device data callback, NAKing the first IN, and then returning INBYTES
+// bytes for each IN. OUT data is accepted.
+//
+// -------------------------------------------------------------------------
+
+static usbDevice::dataResponseType_e dataCallback (const uint8_t endp, uint8_t* data, int &numbytes)
+{
+    static bool naked = false;
+
+    if (endp & usbModel::DIRTOHOST)
+    {
+        if (!naked)
+        {
+            naked = true;
+            return usbDevice::NAK;
+        }
+
+        numbytes = INBYTES;
+
+        for (int idx = 0; idx < numbytes; idx++)
+        {
+            data[idx] = idx;
+        }
+    }
+
+    return usbDevice::ACK;
+}
+
+// -------------------------------------------------------------------------
+// checkStats()
+//
+// Checks a node's snapshot holds just the bulk endpoint's OUT and IN
+// counters, with the expected values.
+//
+// -------------------------------------------------------------------------
+
+static void checkStats (const char* node, const std::vector<usbModel::usb_ep_stats_entry_t> &entries,
+                        const usbModel::usb_ep_stats_t &expout, const usbModel::usb_ep_stats_t &expin)
+{
+    if (entries.size() != 2)
+    {
+        fprintf(stderr, "***ERROR: %s: %d endpoints with traffic, expected 2\n", node, (int)entries.size());
+        failures++;
+        return;
+    }
+
+    for (unsigned edx = 0; edx < entries.size(); edx++)
+    {
+        const usbModel::usb_ep_stats_entry_t &e   = entries[edx];
+        const usbModel::usb_ep_stats_t       &exp = e.in ? expin : expout;
+
+        if (e.addr != TESTADDR || e.endp != BULKEP || memcmp(&e.stats, &exp, sizeof(usbModel::usb_ep_stats_t)))
+        {
+            fprintf(stderr, "***ERROR: %s: unexpected counters for addr %d endp %d %s\n", node, e.addr, e.endp, e.in ? "in" : "out");
+            failures++;
+        }
+    }
+}
+
+// -------------------------------------------------------------------------
+// checkDumpName()
+//
+// Checks line lineidx of the host's dump in the given format starts with
+// exp, the host name as escaped for the format.
+//
+// -------------------------------------------------------------------------
+
+static void checkDumpName (usbHost &host, const int format, const int lineidx, const char* exp)
+{
+    const char* fmtname   = (format == usbModel::usbStats::STATS_JSON) ? "JSON" : "CSV";
+    char        line[256] = "";
+    FILE*       fp        = tmpfile();
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "***ERROR: host: could not open a temporary file for the %s dump\n", fmtname);
+        failures++;
+        return;
+    }
+
+    host.usbHostDumpStats(fp, format);
+
+    rewind(fp);
+
+    for (int idx = 0; idx <= lineidx; idx++)
+    {
+        if (fgets(line, sizeof(line), fp) == NULL)
+        {
+            line[0] = 0;
+            break;
+        }
+    }
+
+    if (strncmp(line, exp, strlen(exp)))
+    {
+        fprintf(stderr, "***ERROR: host: %s dump line %d is %s\n", fmtname, lineidx, line);
+        failures++;
+    }
+
+    fclose(fp);
+}
+
+// -------------------------------------------------------------------------
+// hostMain()
+//
+// Host user code. Configures the device, resets the counters to drop the
+// enumeration traffic, and runs the bulk transfers before checking the
+// counters.
+//
+// -------------------------------------------------------------------------
+
+static void hostMain (void)
+{
+    uint8_t                                     buf[usbModel::MAXBUFSIZE];
+    std::vector<usbModel::usb_ep_stats_entry_t> entries;
+
+    usbHost host(0, HOSTNAME);
+
+    host.usbHostSleepUs(10);
+
+    if (host.usbHostWaitForConnection() != usbModel::USB_J)
+    {
+        fprintf(stderr, "***ERROR: host: no device connected\n");
+        failures++;
+        host.usbHostEndExecution();
+        return;
+    }
+
+    host.usbHostSetDeviceAddress(usbModel::CONTROL_ADDR, usbModel::CONTROL_EP, TESTADDR);
+    host.usbHostSetDeviceConfig(TESTADDR, usbModel::CONTROL_EP, 1);
+
+    // Drop the enumeration traffic, once the device has received the
+    // last ACK
+    host.usbHostSleepUs(10);
+
+    host.usbHostResetStats();
+    device->usbDeviceResetStats();
+
+    host.usbHostGetStats(entries);
+
+    if (!entries.empty())
+    {
+        fprintf(stderr, "***ERROR: host: %d endpoints with traffic after a reset\n", (int)entries.size());
+        failures++;
+    }
+
+    for (int idx = 0; idx < OUTBYTES; idx++)
+    {
+        buf[idx] = idx;
+    }
+
+    // Two DATA packets out, and an IN that is NAKed, then sent again
+    if (host.usbHostBulkDataOut(TESTADDR, BULKEP, buf, OUTBYTES, MAXPKTSIZE) != usbModel::USBOK)
+    {
+        fprintf(stderr, "***ERROR: host: bulk OUT failed\n");
+        failures++;
+    }
+
+    if (host.usbHostBulkDataIn(TESTADDR, BULKEP | usbModel::DIRTOHOST, buf, INBYTES, MAXPKTSIZE) == usbModel::USBOK)
+    {
+        fprintf(stderr, "***ERROR: host: first bulk IN not NAKed\n");
+        failures++;
+    }
+
+    if (host.usbHostBulkDataIn(TESTADDR, BULKEP | usbModel::DIRTOHOST, buf, INBYTES, MAXPKTSIZE) != usbModel::USBOK)
+    {
+        fprintf(stderr, "***ERROR: host: bulk IN failed\n");
+        failures++;
+    }
+
+    // Let the device receive the last ACK
+    host.usbHostSleepUs(10);
+
+    // Expected counters. Handshakes are counted whether sent or received,
+    // and the host counts the IN sent again as a retry.
+    usbModel::usb_ep_stats_t expout = usbModel::usb_ep_stats_t();
+    usbModel::usb_ep_stats_t expin  = usbModel::usb_ep_stats_t();
+
+    expout.packets = 2;
+    expout.bytes   = OUTBYTES;
+    expout.acks    = 2;
+
+    expin.packets  = 1;
+    expin.bytes    = INBYTES;
+    expin.acks     = 1;
+    expin.naks     = 1;
+
+    usbModel::usb_ep_stats_t hostin = expin;
+
+    hostin.retries = 1;
+
+    host.usbHostGetStats(entries);
+    checkStats("host", entries, expout, hostin);
+
+    device->usbDeviceGetStats(entries);
+    checkStats("device", entries, expout, expin);
+
+    host.usbHostDumpStats(stdout);
+    host.usbHostDumpStats(stdout, usbModel::usbStats::STATS_JSON);
+
+    // The CSV has a header line before the endpoints
+    checkDumpName(host, usbModel::usbStats::STATS_CSV,  1, HOSTCSV);
+    checkDumpName(host, usbModel::usbStats::STATS_JSON, 0, HOSTJSON);
+    device->usbDeviceDumpStats(stdout);
+    device->usbDeviceDumpStats(stdout, usbModel::usbStats::STATS_JSON);
+
+    host.usbHostResetStats();
+    host.usbHostGetStats(entries);
+
+    if (!entries.empty())
+    {
+        fprintf(stderr, "***ERROR: host: %d endpoints with traffic after a reset\n", (int)entries.size());
+        failures++;
+    }
+
+    host.usbHostEndExecution();
+}
+
+// -------------------------------------------------------------------------
+// deviceMain()
+//
+// Device user code, running the device until the host ends the test.
+//
+// -------------------------------------------------------------------------
+
+static void deviceMain (void)
+{
+    usbDevice dev(1, dataCallback);
+
+    device = &dev;
+
+    dev.usbDeviceSleepUs(50);
+
+    if (dev.usbDeviceRun() != usbModel::USBOK)
+    {
+        fprintf(stderr, "***ERROR: device: usbDeviceRun returned bad status\n");
+        failures++;
+        dev.usbDeviceEndExecution();
+    }
+
+    dev.usbDeviceSleepUs(usbDevice::SLEEP_FOREVER);
+}
+
+int main (void)
+{
+    usbLoopbackBus bus;
+
+    // Just the counters and any errors are output
+    for (int comp = 0; comp < usbModel::usbLog::LOG_NUMCOMPS; comp++)
+    {
+        usbModel::usbLog::setLevel(comp, usbModel::usbLog::LOG_OFF);
+    }
+
+    bus.addNode(0, false, hostMain);
+    bus.addNode(1, true,  deviceMain);
+
+    if (bus.run((uint64_t)CLK_PERIOD_MHZ * TIMEOUT_US) != usbModel::USBOK)
+    {
+        fprintf(stderr, "***ERROR: simulation timed out\n");
+        failures++;
+    }
+
+    fprintf(stderr, "\nusbstatstest: %s\n", failures ? "FAIL" : "PASS");
+
+    return failures ? 1 : 0;
+}
@@ -66,6 +66,7 @@ namespace usbModel
     static const int      PID_DATA_M               = 0xf;
 
     static const int      PID_INVALID              = NOT_VALID;
+    static const int      NUMPIDS                  = 16;
 
     static const int      SYNC                     = 0x80;
 
@@ -77,6 +78,7 @@ namespace usbModel
     static const int      NUMEPDIRS                = 2;
     static const int      MAXENDP                  = MAXENDPOINTS-1;
     static const int      MAXFRAMENUM              = 4095;
+    static const int      FRAMEFIELDMASK           = 0x7ff;
     static const int      MAXONESLENGTH            = 6;
 
     static const int      POLY16                   = 0x8005;
@@ -92,8 +94,26 @@ namespace usbModel
     static const int      USBSUSPEND               = -4;
     static const int      USBDISCONNECTED          = -5;
     static const int      USBNORESPONSE            = -6;
+
+    // Error record codes (see usb_err_record_t)
+    static const int      USBERR_NONE              = 0;
+    static const int      USBERR_NRZI              = 1;    // Line decode: SE1, bad or no EOP
+    static const int      USBERR_BADPKT            = 2;    // Packet decode failed, with the cause recorded before it
+    static const int      USBERR_PID               = 3;    // Invalid PID
+    static const int      USBERR_ADDR              = 4;    // Invalid address or endpoint
+    static const int      USBERR_LENGTH            = 5;    // Invalid packet, data or frame number length
+    static const int      USBERR_CRC5              = 6;
+    static const int      USBERR_CRC16             = 7;
+    static const int      USBERR_UNSUPPORTED       = 8;    // Unsupported or unrecognised packet type
+    static const int      USBERR_UNEXPECTED        = 9;    // Valid packet, but not the one expected
+    static const int      USBERR_REQUEST           = 10;   // Unexpected control request field
+    static const int      USBERR_STATUS            = 11;   // Bad status waiting for a packet
+    static const int      USBERR_NOCONNECT         = 12;   // No device connected
+    static const int      USBERR_NAKLIMIT          = 13;   // Too many NAKs
     static const int      ERRBUFSIZE               = 8192;
     static const int      MAXBUFSIZE               = 2048;
+    static const int      LINEBUFWORDSAMPLES       = 64;
+    static const int      MAXBUFWORDS              = MAXBUFSIZE*NRZI_BITSPERBYTE/LINEBUFWORDSAMPLES;
 
     static const int      MINPKTSIZEBITS           = 16;
 
@@ -399,12 +419,45 @@ namespace usbModel
         uint16_t       wLength;
     };
 
-    // Basic Differential line signal, as bytes
-    typedef struct
+    // Packet line sample buffer, with D+ and D- in separate bit planes,
+    // first sample in bit 0 of word 0. Raw (byte parallel) packets hold
+    // a byte in every 8 samples of D+, with the complement in D-, and
+    // are terminated with an SE0 byte.
+    struct usb_line_buf_t
     {
-        uint8_t        dp;
-        uint8_t        dm;
-    } usb_signal_t;
+        uint64_t       dp[MAXBUFWORDS];
+        uint64_t       dm[MAXBUFWORDS];
+
+        // Access to a byte's worth of samples
+        uint8_t        dpByte  (const int idx) const {return dp[idx / 8] >> ((idx % 8) * 8);}
+        uint8_t        dmByte  (const int idx) const {return dm[idx / 8] >> ((idx % 8) * 8);}
+
+        void           setByte (const int idx, const uint8_t dpbyte, const uint8_t dmbyte)
+        {
+            int      shift = (idx % 8) * 8;
+            uint64_t mask  = 0xffULL << shift;
+
+            dp[idx / 8] = (dp[idx / 8] & ~mask) | ((uint64_t)dpbyte << shift);
+            dm[idx / 8] = (dm[idx / 8] & ~mask) | ((uint64_t)dmbyte << shift);
+        }
+    };
+
+    // An error, as recorded by usbPkt (see usbPkt::usbPktGetErr()). The
+    // message is only rendered from the format and arguments when asked
+    // for. The site is the name of the function recording the error, and
+    // the tick the most recent simulation clock count known to the node
+    // when recorded (or 0 when not available).
+    static const int      MAXERRARGS               = 4;
+
+    struct usb_err_record_t
+    {
+        int            code;
+        const char*    site;
+        const char*    fmt;
+        int            nargs;
+        int64_t        args[MAXERRARGS];
+        uint64_t       tick;
+    };
 
     // Line speed types
     enum class usb_speed_e
@@ -413,6 +466,37 @@ namespace usbModel
         FS,
         HS
     };
+
+    // Compile time line speed policies, as the SPEED parameter of usbHostT,
+    // usbDeviceT and usbPkt::usbPktGen. The model is clocked at 12MHz, and
+    // the reset and suspend times are the same, whatever the line speed, so
+    // the policies differ only in their data payload limit
+    template<usb_speed_e SPEEDIN, int MAXPAYLOADIN> struct usb_speed_policy_t
+    {
+        static constexpr usb_speed_e SPEED           = SPEEDIN;
+        static constexpr int         MAXPAYLOAD      = MAXPAYLOADIN;
+
+        static constexpr int         ONE_US          = 12;
+        static constexpr int         ONE_MS          = ONE_US * 1000;
+#ifndef USBTESTMODE
+        static constexpr int         MINRSTCOUNT     = ONE_MS * 10;
+        static constexpr int         MINSUSPENDCOUNT = ONE_MS * 3;
+#else
+        static constexpr int         MINRSTCOUNT     = ONE_US * 25;
+        static constexpr int         MINSUSPENDCOUNT = ONE_US * 100;
+#endif
+
+        static const char* name (void)
+        {
+            return SPEED == usb_speed_e::LS ? "low speed"  :
+                   SPEED == usb_speed_e::FS ? "full speed" :
+                                              "high speed";
+        }
+    };
+
+    typedef usb_speed_policy_t<usb_speed_e::LS, 8>   usb_speed_ls_t;
+    typedef usb_speed_policy_t<usb_speed_e::FS, 64>  usb_speed_fs_t;
+    typedef usb_speed_policy_t<usb_speed_e::HS, 512> usb_speed_hs_t;
 }
 
 #endif
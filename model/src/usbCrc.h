@@ -0,0 +1,156 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 6th March 2024
+//
+// Contains the table driven USB CRC16 and CRC5 engines, with
+// the tables generated at compile time
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_CRC_H_
+#define _USB_CRC_H_
+
+#include <stdint.h>
+
+#include "usbTableGen.h"
+
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+
+// -------------------------------------------------------------------------
+// CRC table entry generators
+// -------------------------------------------------------------------------
+
+namespace usbCrcGen
+{
+    // Reflected CRC16 (x^16 + x^15 + x^2 + 1, reflected 0xa001) over n bits
+    constexpr unsigned crc16Bits (const unsigned crc, const int n)
+    {
+        return n ? crc16Bits((crc & 1) ? ((crc >> 1) ^ 0xa001) : (crc >> 1), n - 1) : crc;
+    }
+
+    // Reflected CRC5 (x^5 + x^2 + 1, reflected 0x14) over n data bits
+    constexpr unsigned crc5Bits (const unsigned crc, const unsigned data, const int n)
+    {
+        return n ? crc5Bits(((crc ^ data) & 1) ? ((crc >> 1) ^ 0x14) : (crc >> 1), data >> 1, n - 1) : crc;
+    }
+
+    constexpr unsigned rev8Bits (const unsigned data, const int n)
+    {
+        return n ? (((data & 1) << (n - 1)) | rev8Bits(data >> 1, n - 1)) : 0;
+    }
+
+    // Table entry generators
+    struct crc16Entry {typedef uint16_t type; static constexpr type get (const unsigned i) {return crc16Bits(i, 8);}};
+    struct crc5Entry  {typedef uint8_t  type; static constexpr type get (const unsigned i) {return ~crc5Bits(0x1f, i, 11) & 0x1f;}};
+    struct rev8Entry  {typedef uint8_t  type; static constexpr type get (const unsigned i) {return rev8Bits(i, 8);}};
+}
+
+// -------------------------------------------------------------------------
+// usbCrc
+//
+// USB CRCs are sent LSB first, so the CRC16 is run reflected, a byte at
+// a time, with the state register holding the CRC bit reversed. The
+// final inversion then gives the CRC field value directly, with no
+// separate bit reversal. The CRC5 only ever covers the 11 bit token and
+// SOF fields, so its table is indexed with the whole field and holds
+// the final (inverted and reflected) CRC field value.
+//
+// When built with carry-less multiply support (e.g. -mpclmul), long
+// payloads are processed eight bytes at a time with PCLMULQDQ, using
+// Barrett reduction. The CLMUL state is not reflected, so is converted
+// on entry and exit with the byte reversal table.
+//
+// -------------------------------------------------------------------------
+
+class usbCrc
+{
+public:
+
+    static const unsigned CRC16INIT     = 0xffff;
+    static const unsigned CRC5INIT      = 0x1f;
+
+    // Minimum payload length for the carry-less multiply path
+    static const unsigned CLMULMINBYTES = 32;
+
+    // Update the reflected CRC16 state with a byte
+    static unsigned crc16Byte  (const unsigned crc, const uint8_t byte)
+    {
+        return (crc >> 8) ^ crc16Tab::data[(crc ^ byte) & 0xff];
+    }
+
+    // CRC5 field value for an 11 bit token or SOF field (LSB sent first)
+    static unsigned crc5Field  (const unsigned field)
+    {
+        return crc5Tab::data[field & 0x7ff];
+    }
+
+    static unsigned rev16      (const unsigned data)
+    {
+        return (rev8Tab::data[data & 0xff] << 8) | rev8Tab::data[(data >> 8) & 0xff];
+    }
+
+#ifdef __PCLMUL__
+    // Update the reflected CRC16 state with eight bytes, packed LSB (first
+    // byte) to MSB, as a single polynomial remainder
+    static unsigned crc16Clmul (const unsigned crc, const uint64_t bytes)
+    {
+        // Message polynomial, first bit sent in the top bit, with the
+        // (unreflected) state added at the top
+        uint64_t v = rev64(bytes) ^ ((uint64_t)rev16(crc) << 48);
+
+        // Barrett quotient of v.x^16 / P, with mu = x^80 / P = x^64 + MU16
+        __m128i  a = _mm_cvtsi64_si128((long long)v);
+        uint64_t q = v ^ (uint64_t)_mm_cvtsi128_si64(_mm_srli_si128(_mm_clmulepi64_si128(a, _mm_cvtsi64_si128((long long)MU16), 0x00), 8));
+
+        // The remainder is the low 16 bits of q.P, and only q's low 16 bits
+        // reach them
+        a          = _mm_cvtsi64_si128((long long)(q & 0xffff));
+        unsigned r = (unsigned)_mm_cvtsi128_si64(_mm_clmulepi64_si128(a, _mm_cvtsi64_si128(POLY16), 0x00)) & 0xffff;
+
+        return rev16(r);
+    }
+#endif
+
+private:
+
+    typedef usbTableGen::table<usbCrcGen::crc16Entry, usbTableGen::make<256>::type>  crc16Tab;
+    typedef usbTableGen::table<usbCrcGen::crc5Entry,  usbTableGen::make<2048>::type> crc5Tab;
+    typedef usbTableGen::table<usbCrcGen::rev8Entry,  usbTableGen::make<256>::type>  rev8Tab;
+
+#ifdef __PCLMUL__
+    static const int      POLY16 = 0x8005;
+    static const uint64_t MU16   = 0xfffbffe7ffaffe1fULL;
+
+    static uint64_t rev64 (const uint64_t data)
+    {
+        uint64_t r = data;
+
+        r = ((r >> 1) & 0x5555555555555555ULL) | ((r & 0x5555555555555555ULL) << 1);
+        r = ((r >> 2) & 0x3333333333333333ULL) | ((r & 0x3333333333333333ULL) << 2);
+        r = ((r >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((r & 0x0f0f0f0f0f0f0f0fULL) << 4);
+
+        return __builtin_bswap64(r);
+    }
+#endif
+};
+
+#endif
@@ -37,7 +37,8 @@
 //
 //-------------------------------------------------------------
 
-int usbDevice::usbDeviceRun(const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::usbDeviceRun(const int idle)
 {
     int                  error = usbModel::USBOK;
     int                  pid;
@@ -122,7 +123,7 @@ int usbDevice::usbDeviceRun(const int idle)
                 break;
 
             default:
-                USBERRMSG("runUsbDevice: Received unexpected packet ID (0x%x)\n", pid);
+                USBERRMSG(usbModel::USBERR_UNEXPECTED, "runUsbDevice: Received unexpected packet ID (0x%x)\n", pid);
                 error = usbModel::USBERROR;
                 break;
             }
@@ -148,7 +149,8 @@ int usbDevice::usbDeviceRun(const int idle)
 //
 //-------------------------------------------------------------
 
-int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args, uint8_t* data, int &databytes, const bool ignorebadpkts, const int timeout)
+template<class SPEED>
+int usbDeviceT<SPEED>::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args, uint8_t* data, int &databytes, const bool ignorebadpkts, const int timeout)
 {
     int error = usbModel::USBOK;
     int status;
@@ -159,7 +161,7 @@ int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args
     while (true)
     {
         // Wait for a packet
-        if ((status = apiWaitForPkt(nrzi, usbPliApi::IS_DEVICE)) == usbModel::USBRESET)
+        if ((status = apiRxCapture(usbPliApi::IS_DEVICE)) == usbModel::USBRESET)
         {
             USBDISPPKT ( "  %s SEEN RESET\n", name.c_str());
 
@@ -178,13 +180,37 @@ int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args
             continue;
         }
 
-        if (usbPktDecode(nrzi, pid, args, data, databytes) != usbModel::USBOK)
+        usbPktResult_t pkt = {usbModel::USBERROR, usbModel::PID_INVALID, 0, {0}};
+
+        if (status < 0)
+        {
+            USBERRMSG(usbModel::USBERR_STATUS, "waitForExpectedPacket: bad status waiting for packet (%d)\n", status);
+
+            stats.txn().timeouts += status == usbModel::USBNORESPONSE;
+        }
+        else if (!receivePacket(data, pkt))
+        {
+            continue;
+        }
+
+        pid       = pkt.pid;
+        databytes = pkt.databytes;
+
+        if (pkt.status != usbModel::USBOK)
         {
             suspended = false;
 
-            for(int i = 0; i < databytes; i++)
-                USBDEVDEBUG("%02x ", data[i]);
-            USBDEVDEBUG("\n");
+            if (status >= 0)
+            {
+                stats.txn().badPkt(usbPktGetErr());
+            }
+
+            if (usbModel::usbLog::enabled(USBLOGCOMP, usbModel::usbLog::LOG_DEBUG))
+            {
+                for(int i = 0; i < databytes; i++)
+                    USBDEVDEBUG("%02x ", data[i]);
+                USBDEVDEBUG("\n");
+            }
 
             // Ignore any packets that have errors
             if (ignorebadpkts)
@@ -200,6 +226,21 @@ int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args
         }
         else
         {
+            memcpy(args, pkt.args, sizeof(pkt.args));
+
+            // Count the packet, with a token selecting the endpoint for the transaction
+            if (pid == usbModel::PID_TOKEN_OUT || pid == usbModel::PID_TOKEN_IN || pid == usbModel::PID_TOKEN_SETUP)
+            {
+                stats.select(args[usbModel::ARGADDRIDX], args[usbModel::ARGENDPIDX], pid == usbModel::PID_TOKEN_IN);
+            }
+            else if (pid == usbModel::PID_DATA_0 || pid == usbModel::PID_DATA_1)
+            {
+                stats.txn().data(databytes);
+            }
+            else
+            {
+                stats.txn().handshake(pid);
+            }
 
             USBDEVDEBUG ("<== waitForExpectedPacket: received a good packet (pid=0x%02x args={%d %d %d} dataytes=%d)\n", pid, args[0], args[1], args[2], databytes);
             break;
@@ -214,7 +255,7 @@ int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args
         // Generate a STALL handshake for the error
         sendPktToHost(usbModel::PID_HSHK_STALL, DEFAULT_IDLE);
 
-        USBERRMSG("waitForExpectedPacket: Received unexpected pid (got 0x%02x, expected 0x%02x)\n", pid, pktType);
+        USBERRMSG(usbModel::USBERR_UNEXPECTED, "waitForExpectedPacket: Received unexpected pid (got 0x%02x, expected 0x%02x)\n", pid, pktType);
 
         error = usbModel::USBERROR;
     }
@@ -222,6 +263,74 @@ int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args
     return error;
 }
 
+//-------------------------------------------------------------
+// receivePacket()
+//
+// Reads back and decodes a packet captured by apiRxCapture(),
+// a receive buffer word at a time, with any data placed in
+// data[]. As soon as a token's address is decoded, a token for
+// another device is abandoned without reading back the rest of
+// it, as are the data and handshake packets that follow it, up
+// to the next token or SOF.
+//
+// The method returns false for an abandoned packet, otherwise
+// it returns true, with the decode result in pkt.
+//
+//-------------------------------------------------------------
+
+template<class SPEED>
+bool usbDeviceT<SPEED>::receivePacket(uint8_t* data, usbPktResult_t &pkt)
+{
+    uint64_t dp;
+    uint64_t dm;
+    int      nsamples;
+    int      pid;
+    uint8_t  addr;
+    uint8_t  endp;
+    bool     checked = false;
+
+    usbPktRxStart(data);
+
+    while ((nsamples = apiRxRead(dp, dm)) != 0)
+    {
+        int state = usbPktRxPut(dp, dm, nsamples);
+
+        // Check the packet belongs to this device once the PID, and any token
+        // fields, are decoded
+        if (!checked && (pid = usbPktRxPid()) != usbModel::PID_INVALID)
+        {
+            if (pid == usbModel::PID_TOKEN_OUT || pid == usbModel::PID_TOKEN_IN || pid == usbModel::PID_TOKEN_SETUP)
+            {
+                if (usbPktRxToken(addr, endp))
+                {
+                    checked   = true;
+                    rxforeign = !(addr == 0 || addr == devaddr);
+                }
+            }
+            else
+            {
+                checked   = true;
+                rxforeign = rxforeign && pid != usbModel::PID_TOKEN_SOF;
+            }
+
+            if (checked && rxforeign)
+            {
+                USBDEVDEBUG("<== receivePacket: discarding a packet for another device (pid=0x%02x)\n", pid);
+                return false;
+            }
+        }
+
+        if (state != usbNrzi::DECACTIVE)
+        {
+            break;
+        }
+    }
+
+    pkt = usbPktRxEnd();
+
+    return true;
+}
+
 //-------------------------------------------------------------
 // sendPktToHost
 //
@@ -250,7 +359,8 @@ int usbDevice::waitForExpectedPacket(const int pktType, int &pid, uint32_t* args
 //-------------------------------------------------------------
 
 // Data
-int usbDevice::sendPktToHost(const int pid, const uint8_t data[], unsigned datalen, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::sendPktToHost(const int pid, const uint8_t data[], unsigned datalen, const int idle)
 {
     int error = usbModel::USBOK;
 
@@ -262,24 +372,27 @@ int usbDevice::sendPktToHost(const int pid, const uint8_t data[], unsigned datal
         USBDEVDEBUG ("<== sendPktToHost: DATAx seen invalid PID\n");
 
         error = usbModel::USBERROR;
-        USBERRMSG("sendPktToHost(DATA): Invalid pid for packet type (0x%02x)", pid);
+        USBERRMSG(usbModel::USBERR_PID, "sendPktToHost(DATA): Invalid pid for packet type (0x%02x)", pid);
     }
     else
     {
         USBDEVDEBUG("<== sendPktToHost: sending packet to host\n");
 
         // Generate packet
-        int numbits = usbPktGen(nrzi, pid, data, datalen);
+        int numbits = usbPktGen<SPEED>(nrzi, pid, data, datalen);
 
         // Send over the USB line
         apiSendPacket(nrzi, numbits, idle);
+
+        stats.txn().data(datalen);
     }
 
     return error;
 }
 
 // Token
-int usbDevice::sendPktToHost(const int pid, const uint8_t addr, const uint8_t endp, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::sendPktToHost(const int pid, const uint8_t addr, const uint8_t endp, const int idle)
 {
     int error = usbModel::USBOK;
 
@@ -291,7 +404,7 @@ int usbDevice::sendPktToHost(const int pid, const uint8_t addr, const uint8_t en
         USBDEVDEBUG ("<== sendPktToHost: TOKEN seen invalid PID\n");
 
         error = usbModel::USBERROR;
-        USBERRMSG("sendPktToHost(TOKEN): Invalid pid for packet type (0x%02x)", pid);
+        USBERRMSG(usbModel::USBERR_PID, "sendPktToHost(TOKEN): Invalid pid for packet type (0x%02x)", pid);
     }
     else
     {
@@ -308,7 +421,8 @@ int usbDevice::sendPktToHost(const int pid, const uint8_t addr, const uint8_t en
 }
 
 // SOF
-int usbDevice::sendPktToHost(const int pid, const uint16_t framenum, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::sendPktToHost(const int pid, const uint16_t framenum, const int idle)
 {
     int error = usbModel::USBOK;
 
@@ -320,7 +434,7 @@ int usbDevice::sendPktToHost(const int pid, const uint16_t framenum, const int i
         USBDEVDEBUG ("<== sendPktToHost: SOF seen invalid PID\n");
 
         error = usbModel::USBERROR;
-        USBERRMSG("sendPktToHost(SOF): Invalid pid for packet type (0x%02x)", pid);
+        USBERRMSG(usbModel::USBERR_PID, "sendPktToHost(SOF): Invalid pid for packet type (0x%02x)", pid);
     }
     else
     {
@@ -337,7 +451,8 @@ int usbDevice::sendPktToHost(const int pid, const uint16_t framenum, const int i
 }
 
 // Handshake
-int usbDevice::sendPktToHost(const int pid, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::sendPktToHost(const int pid, const int idle)
 {
     int error = usbModel::USBOK;
 
@@ -349,7 +464,7 @@ int usbDevice::sendPktToHost(const int pid, const int idle)
         USBDEVDEBUG ("<== sendPktToHost: HSHK seen invalid PID\n");
 
         error = usbModel::USBERROR;
-        USBERRMSG("sendPktToHost(HANDSHAKE): Invalid pid for packet type (0x%02x)", pid);
+        USBERRMSG(usbModel::USBERR_PID, "sendPktToHost(HANDSHAKE): Invalid pid for packet type (0x%02x)", pid);
     }
     else
     {
@@ -360,6 +475,8 @@ int usbDevice::sendPktToHost(const int pid, const int idle)
 
         // Send over the USB line
         apiSendPacket(nrzi, numbits, idle);
+
+        stats.txn().handshake(pid);
     }
 
     return error;
@@ -380,7 +497,8 @@ int usbDevice::sendPktToHost(const int pid, const int idle)
 //
 //-------------------------------------------------------------
 
-int usbDevice::processControl(const uint32_t addr, const uint32_t endp, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::processControl(const uint32_t addr, const uint32_t endp, const int idle)
 {
     int                  error = usbModel::USBOK;
     int                  pid;
@@ -395,14 +513,14 @@ int usbDevice::processControl(const uint32_t addr, const uint32_t endp, const in
         USBDEVDEBUG ("<== processControl: bad address or endpoint (addr=0x%02x, endp=0x%02x)\n", addr, endp);
 
         error = usbModel::USBERROR;
-        USBERRMSG("processControl: Received bad addr/endp (0x%02x 0x%02x)\n", addr, endp);
+        USBERRMSG(usbModel::USBERR_ADDR, "processControl: Received bad addr/endp (0x%02x 0x%02x)\n", addr, endp);
     }
 
     // Wait for DATA0 packet
     USBDEVDEBUG ( "Waiting for DATA0\n");
     if (waitForExpectedPacket(dataPid(endp), pid, args, rxdata, databytes) != usbModel::USBOK)
     {
-        USBDEVDEBUG("%s", errbuf);
+        USBDEVDEBUG("%s", usbPktErrStr().c_str());
         error = usbModel::USBERROR;
     }
 
@@ -473,7 +591,8 @@ int usbDevice::processControl(const uint32_t addr, const uint32_t endp, const in
 //
 //-------------------------------------------------------------
 
-int usbDevice::processIn (const uint32_t args[], int &databytes, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::processIn (const uint32_t args[], int &databytes, const int idle)
 {
     int                error  = usbModel::USBOK;
 
@@ -481,7 +600,7 @@ int usbDevice::processIn (const uint32_t args[], int &databytes, const int idle)
     uint8_t            endp   = args[usbModel::ARGENDPIDX] | usbModel::DIRTOHOST;
     int                numbytes;
 
-    dataResponseType_e cbresp = usbDevice::ACK;
+    dataResponseType_e cbresp = usbDeviceT::ACK;
 
     USBDEVDEBUG ("<== processIn (addr = 0x%02x, endp = 0x%02x)\n", addr, endp);
 
@@ -492,7 +611,7 @@ int usbDevice::processIn (const uint32_t args[], int &databytes, const int idle)
         sendPktToHost(usbModel::PID_HSHK_STALL);
 
         error = usbModel::USBERROR;
-        USBERRMSG("processIn: Received bad addr/endp (0x%02x 0x%02x)\n", addr, endp);
+        USBERRMSG(usbModel::USBERR_ADDR, "processIn: Received bad addr/endp (0x%02x 0x%02x)\n", addr, endp);
     }
     else
     {
@@ -502,13 +621,13 @@ int usbDevice::processIn (const uint32_t args[], int &databytes, const int idle)
             cbresp = datacb(endp, rxdata, numbytes);
         }
 
-        if (cbresp == usbDevice::STALL)
+        if (cbresp == usbDeviceT::STALL)
         {
             ephalted[epIdx(endp)][epDirIn(endp)] = true;
             sendPktToHost(usbModel::PID_HSHK_STALL);
             error = usbModel::USBERROR;
         }
-        else if (cbresp == usbDevice::NAK)
+        else if (cbresp == usbDeviceT::NAK)
         {
             sendPktToHost(usbModel::PID_HSHK_NAK, idle);
         }
@@ -545,7 +664,8 @@ int usbDevice::processIn (const uint32_t args[], int &databytes, const int idle)
 //
 //-------------------------------------------------------------
 
-int usbDevice::processOut (const uint32_t args[], uint8_t data[], int databytes, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::processOut (const uint32_t args[], uint8_t data[], int databytes, const int idle)
 {
     int                  error    = usbModel::USBOK;
 
@@ -559,7 +679,7 @@ int usbDevice::processOut (const uint32_t args[], uint8_t data[], int databytes,
     int                  epdir    = epDirIn(endp);
 
 
-    dataResponseType_e   cbresp = usbDevice::ACK;
+    dataResponseType_e   cbresp = usbDeviceT::ACK;
 
     USBDEVDEBUG ("<== processOut (addr = 0x%02x, endp = 0x%02x)\n", addr, endp);
 
@@ -570,7 +690,7 @@ int usbDevice::processOut (const uint32_t args[], uint8_t data[], int databytes,
         sendPktToHost(usbModel::PID_HSHK_STALL);
 
         error = usbModel::USBERROR;
-        USBERRMSG("processOut: Received bad addr/endp (0x%02x 0x%02x)\n", addr, endp);
+        USBERRMSG(usbModel::USBERR_ADDR, "processOut: Received bad addr/endp (0x%02x 0x%02x)\n", addr, endp);
     }
     else
     {
@@ -578,7 +698,7 @@ int usbDevice::processOut (const uint32_t args[], uint8_t data[], int databytes,
         USBDEVDEBUG ( "processOut: Waiting for DATAx\n");
         if (waitForExpectedPacket(dataPid(endp), pid, dargs, data, numbytes) != usbModel::USBOK)
         {
-            USBDEVDEBUG("%s", errbuf);
+            USBDEVDEBUG("%s", usbPktErrStr().c_str());
             error = usbModel::USBERROR;
         }
 
@@ -588,13 +708,13 @@ int usbDevice::processOut (const uint32_t args[], uint8_t data[], int databytes,
              cbresp = datacb(args[usbModel::ARGENDPIDX], data, numbytes);
         }
 
-        if (cbresp == usbDevice::STALL)
+        if (cbresp == usbDeviceT::STALL)
         {
             ephalted[endp & 0xf][(endp >> 7) & 1] = true;
             sendPktToHost(usbModel::PID_HSHK_STALL);
             error = usbModel::USBERROR;
         }
-        else if (cbresp == usbDevice::NAK)
+        else if (cbresp == usbDeviceT::NAK)
         {
             sendPktToHost(usbModel::PID_HSHK_NAK, idle);
         }
@@ -619,7 +739,8 @@ int usbDevice::processOut (const uint32_t args[], uint8_t data[], int databytes,
 //
 //-------------------------------------------------------------
 
-int  usbDevice::processSOF(const uint32_t args[], const int idle)
+template<class SPEED>
+int  usbDeviceT<SPEED>::processSOF(const uint32_t args[], const int idle)
 {
     USBDISPPKT("  %s RX SOF: FRAME NUMBER 0x%04x\n", name.c_str(), args[usbModel::ARGFRAMEIDX]);
 
@@ -654,7 +775,8 @@ int  usbDevice::processSOF(const uint32_t args[], const int idle)
 //
 //-------------------------------------------------------------
 
-int usbDevice::handleDevReq(const usbModel::setupRequest* sreq, const uint8_t endp, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::handleDevReq(const usbModel::setupRequest* sreq, const uint8_t endp, const int idle)
 {
     int                  error = usbModel::USBOK;
 
@@ -733,8 +855,9 @@ int usbDevice::handleDevReq(const usbModel::setupRequest* sreq, const uint8_t en
         sendPktToHost(usbModel::PID_HSHK_ACK, idle);
         dataPidUpdate(endp);
 
-        // Extract address
+        // Extract address, and pass on to the usbModel handshake responder
         devaddr = sreq->wValue;
+        apiSetDevAddr(devaddr);
 
         USBDISPPKT("  %s RX DEV REQ: SET ADDRESS 0x%02x\n", name.c_str(), devaddr);
         break;
@@ -817,7 +940,7 @@ int usbDevice::handleDevReq(const usbModel::setupRequest* sreq, const uint8_t en
             break;
 
         default:
-            USBERRMSG("handleDevReq: Received unexpected wValue descriptor type (0x%02x)\n", sreq->wValue);
+            USBERRMSG(usbModel::USBERR_REQUEST, "handleDevReq: Received unexpected wValue descriptor type (0x%02x)\n", sreq->wValue);
 
             // Generate an STALL handshake for the SETUP data
             ephalted[usbModel::CONTROL_EP & 0xf][(usbModel::CONTROL_EP >> 7) & 1] = true;
@@ -914,7 +1037,8 @@ int usbDevice::handleDevReq(const usbModel::setupRequest* sreq, const uint8_t en
 //
 //-------------------------------------------------------------
 
-int usbDevice::controlStatusStage(const bool instatus, const uint8_t endp)
+template<class SPEED>
+int usbDeviceT<SPEED>::controlStatusStage(const bool instatus, const uint8_t endp)
 {
     int      error = usbModel::USBOK;
 
@@ -971,7 +1095,8 @@ int usbDevice::controlStatusStage(const bool instatus, const uint8_t endp)
 //
 //-------------------------------------------------------------
 
-int usbDevice::handleIfReq(const usbModel::setupRequest* sreq, const uint8_t endp, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::handleIfReq(const usbModel::setupRequest* sreq, const uint8_t endp, const int idle)
 {
     int     error = usbModel::USBOK;
     int     datasize;
@@ -1101,7 +1226,8 @@ int usbDevice::handleIfReq(const usbModel::setupRequest* sreq, const uint8_t end
 //
 //-------------------------------------------------------------
 
-int usbDevice::handleEpReq(const usbModel::setupRequest* sreq, const uint8_t endp, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::handleEpReq(const usbModel::setupRequest* sreq, const uint8_t endp, const int idle)
 {
     int     error = usbModel::USBOK;
     int     datasize;
@@ -1224,7 +1350,8 @@ int usbDevice::handleEpReq(const usbModel::setupRequest* sreq, const uint8_t end
 //
 //-------------------------------------------------------------
 
-int usbDevice::sendGetResp (const usbModel::setupRequest* sreq, const uint8_t data[], const int databytes, const uint8_t endp, const char* fmtstr, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::sendGetResp (const usbModel::setupRequest* sreq, const uint8_t data[], const int databytes, const uint8_t endp, const char* fmtstr, const int idle)
 {
     int                  pid;
     uint32_t             args[usbModel::MAXNUMARGS];
@@ -1240,7 +1367,7 @@ int usbDevice::sendGetResp (const usbModel::setupRequest* sreq, const uint8_t da
         sreq->bmRequestType != usbModel::USB_IF_REQTYPE_GET  &&
         sreq->bmRequestType != usbModel::USB_EP_REQTYPE_GET)
     {
-        USBERRMSG("getResp: Received unexpected bmRequestType with a GET command (0x%02x)\n", sreq->bmRequestType);
+        USBERRMSG(usbModel::USBERR_REQUEST, "getResp: Received unexpected bmRequestType with a GET command (0x%02x)\n", sreq->bmRequestType);
         return usbModel::USBERROR;
     }
 
@@ -1272,7 +1399,8 @@ int usbDevice::sendGetResp (const usbModel::setupRequest* sreq, const uint8_t da
 //
 //-------------------------------------------------------------
 
-int usbDevice::sendInData(const uint8_t data[], const int databytes, const uint8_t endp, bool skipfirstIN, const int idle)
+template<class SPEED>
+int usbDeviceT<SPEED>::sendInData(const uint8_t data[], const int databytes, const uint8_t endp, bool skipfirstIN, const int idle)
 {
     int                  pid;
     uint32_t             args[usbModel::MAXNUMARGS];
@@ -1326,7 +1454,7 @@ int usbDevice::sendInData(const uint8_t data[], const int databytes, const uint8
         // Wait for acknowledge (either ACK or NAK)
         if (waitForExpectedPacket(PID_NO_CHECK, pid, args, rxdata, numbytes) != usbModel::USBOK)
         {
-            USBERRMSG ("sendInData: unexpected error wait for ACK/NAK\n");
+            USBERRMSG (usbModel::USBERR_STATUS, "sendInData: unexpected error wait for ACK/NAK\n");
             return usbModel::USBERROR;
         }
 
@@ -1352,9 +1480,11 @@ int usbDevice::sendInData(const uint8_t data[], const int databytes, const uint8
 
             if (numnaks > MAXNAKS)
             {
-                USBERRMSG ("sendInData: seen too many NAKs\n");
+                USBERRMSG (usbModel::USBERR_NAKLIMIT, "sendInData: seen too many NAKs\n");
                 return usbModel::USBERROR;
             }
+
+            stats.txn().retries++;
         }
         else
         {
@@ -1366,3 +1496,10 @@ int usbDevice::sendInData(const uint8_t data[], const int databytes, const uint8
     return usbModel::USBOK;
 }
 
+// -------------------------------------------------------------------------
+// Speed policy instantiations
+// -------------------------------------------------------------------------
+
+template class usbDeviceT<usbModel::usb_speed_ls_t>;
+template class usbDeviceT<usbModel::usb_speed_fs_t>;
+template class usbDeviceT<usbModel::usb_speed_hs_t>;
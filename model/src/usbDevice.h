@@ -28,8 +28,16 @@
 #include "usbCommon.h"
 #include "usbPkt.h"
 #include "usbPliApi.h"
+#include "usbStats.h"
 
-class usbDevice : public usbPliApi, public usbPkt
+// -------------------------------------------------------------------------
+// The device is a template on a line speed policy (see usbCommon.h), fixing
+// its data packet size limit and timing at compile time. The policies
+// are instantiated in usbDevice.cpp.
+// -------------------------------------------------------------------------
+
+template<class SPEED>
+class usbDeviceT : public usbPliApi, public usbPkt
 {
 public:
 
@@ -76,14 +84,17 @@ private:
     // Maximum number of received NAKs before generating an error
     static const int      MAXNAKS                  = 3;
 
+    // usbLog component for messages from this class
+    static const int      USBLOGCOMP               = usbModel::usbLog::LOG_DEVICE;
+
 public:
 
     //-------------------------------------------------------------
     // Constructor
     //-------------------------------------------------------------
 
-    usbDevice (int nodeIn, usbDeviceDataCallback_t datacbIn = NULL, std::string name = std::string(FMT_DEVICE "DEV " FMT_NORMAL)) :
-        usbPliApi(nodeIn, name),
+    usbDeviceT (int nodeIn, usbDeviceDataCallback_t datacbIn = NULL, std::string name = std::string(FMT_DEVICE "DEV " FMT_NORMAL)) :
+        usbPliApi(nodeIn, name, SPEED::MINRSTCOUNT, SPEED::MINSUSPENDCOUNT),
         usbPkt(name),
         deviceConfigured(false),
         ephalted{{false}},
@@ -91,9 +102,10 @@ public:
                 {false, false}, {false, false}, {false, false}, {false, false},
                 {false, true},  {false, false}, {false, false}, {false, false},
                 {false, false}, {false, false}, {false, false}, {false, false}},
+        datacb(datacbIn),
         framenum(0),
         suspended(false),
-        datacb(datacbIn)
+        rxforeign(false)
     {
         strdesc[0].bLength    = 6; // bLength + bDescriptorType bytes plus two wLANGID entries (2 bytes each)
         strdesc[0].bString[0] = usbModel::LANGID_ENG_UK; // English UK
@@ -105,6 +117,9 @@ public:
         strdesc[2].bLength = 2;  // bLength + bDescriptorType bytes
         strdesc[2].bLength += usbModel::fmtStrToUnicode(strdesc[2].bString, "usbModel");
 
+        // Use raw packets if connected to a byte parallel usbModel
+        usbPktSetRaw(apiIsRawPkt());
+
         reset();
     };
 
@@ -116,7 +131,7 @@ public:
     {
         unsigned ticks = apiGetClkCount();
 
-        return (float)ticks * 1.0/(float)usbPliApi::ONE_US;
+        return (float)ticks * 1.0/(float)SPEED::ONE_US;
     }
 
     //-------------------------------------------------------------
@@ -125,7 +140,7 @@ public:
 
     void usbDeviceSleepUs(const unsigned time_us)
     {
-        unsigned ticks = time_us * usbPliApi::ONE_US;
+        unsigned ticks = time_us * SPEED::ONE_US;
 
         apiSendIdle(ticks);
     }
@@ -148,6 +163,21 @@ public:
         apiEnablePullup();
     }
 
+    //-------------------------------------------------------------
+    // Method to set how the usbModel HDL answers an endpoint's
+    // IN or OUT transactions (endp bit 7 set for IN). With NAK or
+    // STALL, the HDL sends the handshake without the transaction
+    // reaching the C++ (or the data callback). With ACK (the
+    // default), transactions are handled in the C++ as normal.
+    //-------------------------------------------------------------
+
+    void usbDeviceSetEpStatus(const uint8_t endp, const dataResponseType_e status)
+    {
+        apiSetEpStatus(endp, status == NAK   ? usbPliApi::EPSTATUS_NAK   :
+                             status == STALL ? usbPliApi::EPSTATUS_STALL :
+                                               usbPliApi::EPSTATUS_READY);
+    }
+
     //-------------------------------------------------------------
     // User entry method to start the USB device model
     //-------------------------------------------------------------
@@ -163,8 +193,36 @@ public:
         apiHaltSimulation();
     }
 
+    //-------------------------------------------------------------
+    // Per-endpoint traffic statistics (see usbStats.h). A
+    // snapshot holds the endpoints with traffic, and the dump is
+    // CSV, or JSON with usbModel::usbStats::STATS_JSON
+    //-------------------------------------------------------------
+
+    void usbDeviceGetStats(std::vector<usbModel::usb_ep_stats_entry_t> &entries)
+    {
+        stats.snapshot(entries);
+    }
+
+    void usbDeviceResetStats()
+    {
+        stats.reset();
+    }
+
+    void usbDeviceDumpStats(FILE* fp = stdout, const int format = usbModel::usbStats::STATS_CSV)
+    {
+        stats.dump(fp, name.c_str(), format);
+    }
+
 private:
 
+    // Error records are stamped with the clock count last read,
+    // rather than accessing the simulation for each error
+    uint64_t usbPktTick (void)
+    {
+        return apiLastClkCount();
+    }
+
     //-------------------------------------------------------------
     // Configuration structure
     //-------------------------------------------------------------
@@ -226,6 +284,9 @@ private:
         // Clear suspension state
         suspended = false;
 
+        // No transaction for another device in progress
+        rxforeign = false;
+
 
         for (int edx = 0; edx < usbModel::MAXENDPOINTS; edx++)
         {
@@ -263,6 +324,7 @@ private:
 
     int          waitForExpectedPacket (const int  pktType, int &pid, uint32_t* args, uint8_t* data, int &databytes,
                                         const bool ignorebadpkts = true, const int timeout = usbModel::NOTIMEOUT);
+    bool         receivePacket         (uint8_t* data, usbPktResult_t &pkt);
 
     //-------------------------------------------------------------
     // Methods for processing different packet types
@@ -315,9 +377,13 @@ private:
     bool                    epdata0  [usbModel::MAXENDPOINTS][usbModel::NUMEPDIRS];
 
     // Internal buffers for use by class methods
-    uint8_t                 rxdata   [usbModel::MAXBUFSIZE];
-    usbModel::usb_signal_t  nrzi     [usbModel::MAXBUFSIZE];
-    char                    sbuf     [usbModel::ERRBUFSIZE];
+    uint8_t                  rxdata   [usbModel::MAXBUFSIZE];
+    usbModel::usb_line_buf_t nrzi;
+    char                     sbuf     [usbModel::ERRBUFSIZE];
+
+    // Traffic counters, with the current transaction's endpoint
+    // selected by the last token received
+    usbModel::usbStats       stats;
 
     // Device's descriptors
     usbModel::deviceDesc    devdesc;
@@ -332,5 +398,13 @@ private:
     
     bool                    suspended;
 
+    // In a transaction addressed to another device
+    bool                    rxforeign;
+
+
+};
 
-};
\ No newline at end of file
+// Default full speed device, and the instantiations for the other speeds
+typedef usbDeviceT<usbModel::usb_speed_fs_t> usbDevice;
+typedef usbDeviceT<usbModel::usb_speed_ls_t> usbDeviceLS;
+typedef usbDeviceT<usbModel::usb_speed_hs_t> usbDeviceHS;
@@ -28,6 +28,7 @@
 #define _USB_FORMAT_H_
 
 #include "usbCommon.h"
+#include "usbLog.h"
 
 // Definitions for use in formatted packet information display
 
@@ -92,28 +93,27 @@
 #define FMT_DEVICE              FMT_BRIGHT_BLUE FMT_BOLD
 #define FMT_HOST                FMT_RED FMT_BOLD
 
-// Macro for constructing error messages into an error buffer. Default enabled.
+// Macro for recording an error, with a code (see usbCommon.h), and a
+// message format and up to four integer arguments, rendered only when
+// asked for (see usbPkt::usbPktGetErr()). Default enabled.
 #ifndef DISABLEUSBDEBUG
-#define USBERRMSG(...) {snprintf(errbuf, usbModel::ERRBUFSIZE, __VA_ARGS__);}
+#define USBERRMSG(_code, ...) {usbPktErr((_code), __func__, __VA_ARGS__);}
 #else
 #define USBERRMSG(...) {}
 #endif
 
-// Macro for displaying received packet information. Default enabled.
+// Macro for displaying received packet information, at the usbLog info
+// level for the component of the calling code. Default enabled, but can
+// still be removed completely at compile time.
 #ifndef DISABLEUSBDISPPKT
-#define USBDISPPKT(...) {fprintf(stderr, __VA_ARGS__);}
+#define USBDISPPKT(...) USBLOG(USBLOGCOMP, usbModel::usbLog::LOG_INFO, __VA_ARGS__)
 #else
 #define USBDISPPKT(...) {}
 #endif
 
-//#define ENABLEDEVDEBUG
-
-// Macro for displaying development debug messages. Default disabled
-#ifdef ENABLEDEVDEBUG
-#define USBDEVDEBUG(...) {fprintf(stderr, __VA_ARGS__);}
-#else
-#define USBDEVDEBUG(...) {}
-#endif
+// Macro for displaying development debug messages, at the usbLog debug
+// level. Default disabled, unless ENABLEDEVDEBUG is defined.
+#define USBDEVDEBUG(...) USBLOG(USBLOGCOMP, usbModel::usbLog::LOG_DEBUG, __VA_ARGS__)
 
 namespace usbModel
 {
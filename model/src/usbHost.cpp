@@ -38,30 +38,37 @@
 //
 // Two optional arguments can be specified for the period to poll the line
 // for a connection (polldelay, defaults to 10us) and a time out period
-// to give up waiting (timeout, defaults to 3ms).
+// to give up waiting (timeout, defaults to 3ms). The line is no longer
+// polled, with the method sleeping until a line state change event, so
+// polldelay is unused and kept only for compatibility.
 //
 // The method returns the linestate if a connection detected, else returns
 // usbModel::USBERROR if it timed out.
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostWaitForConnection (const unsigned polldelay, const unsigned timeout)
+template<class SPEED>
+int usbHostT<SPEED>::usbHostWaitForConnection (const unsigned polldelay, const unsigned timeout)
 {
     int      linestate;
     unsigned clkcycles  = 0;
+    unsigned starttime;
 
     // Make sure reset is deasserted before checking for a connection
     apiWaitOnNotReset();
 
+    starttime = apiGetClkCount();
+
     while ((linestate = apiReadLineState()) == usbModel::USB_SE0 && clkcycles < timeout)
     {
-        apiSendIdle(polldelay);
-        clkcycles += polldelay;
+        // Sleep until the line changes state, or the remaining time expires
+        apiWaitForEvent(usbPliApi::EVENT_LINECHG, timeout - clkcycles);
+        clkcycles = apiGetClkCount() - starttime;
     }
 
     if (clkcycles >= timeout)
     {
-        USBERRMSG("waitForConnection: timed out waiting for a device to be connected");
+        USBERRMSG(usbModel::USBERR_NOCONNECT, "waitForConnection: timed out waiting for a device to be connected");
         linestate = usbModel::USBERROR;
     }
     else
@@ -93,7 +100,8 @@ int usbHost::usbHostWaitForConnection (const unsigned polldelay, const unsigned
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetDeviceStatus (const uint8_t addr, const uint8_t endp, uint16_t &status, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetDeviceStatus (const uint8_t addr, const uint8_t endp, uint16_t &status, const unsigned idle)
 {
     int error = usbModel::USBOK;
 
@@ -126,7 +134,8 @@ int usbHost::usbHostGetDeviceStatus (const uint8_t addr, const uint8_t endp, uin
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetDeviceConfig (const uint8_t addr, const uint8_t endp, uint8_t &cfgstate, const uint8_t index, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetDeviceConfig (const uint8_t addr, const uint8_t endp, uint8_t &cfgstate, const uint8_t index, const unsigned idle)
 {
     int error = usbModel::USBOK;
     int databytes;
@@ -195,7 +204,8 @@ int usbHost::usbHostGetDeviceConfig (const uint8_t addr, const uint8_t endp, uin
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetStrDescriptor (const uint8_t  addr,     const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetStrDescriptor (const uint8_t  addr,     const uint8_t  endp,
                                       const uint8_t  stridx,         uint8_t  data[],
                                       const uint16_t reqlen,         uint16_t &rxlen,
                                       const bool     chklen,
@@ -241,7 +251,7 @@ int usbHost::usbHostGetStrDescriptor (const uint8_t  addr,     const uint8_t  en
 
         if (chklen && receivedbytes != reqlen)
         {
-            USBERRMSG("getDeviceDescriptor: unexpected length of data received (got %d, expected %d)\n", receivedbytes, reqlen);
+            USBERRMSG(usbModel::USBERR_LENGTH, "getDeviceDescriptor: unexpected length of data received (got %d, expected %d)\n", receivedbytes, reqlen);
             error = usbModel::USBERROR;
         }
         else
@@ -290,7 +300,8 @@ int usbHost::usbHostGetStrDescriptor (const uint8_t  addr,     const uint8_t  en
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetDeviceDescriptor (const uint8_t  addr,   const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetDeviceDescriptor (const uint8_t  addr,   const uint8_t  endp,
                                                uint8_t  data[], const uint16_t reqlen, uint16_t &rxlen,
                                         const  bool     chklen, const unsigned idle)
 {
@@ -332,7 +343,7 @@ int usbHost::usbHostGetDeviceDescriptor (const uint8_t  addr,   const uint8_t  e
 
         if (chklen && receivedbytes != reqlen)
         {
-            USBERRMSG("getDeviceDescriptor: unexpected length of data received (got %d, expected %d)\n", receivedbytes, reqlen);
+            USBERRMSG(usbModel::USBERR_LENGTH, "getDeviceDescriptor: unexpected length of data received (got %d, expected %d)\n", receivedbytes, reqlen);
             error = usbModel::USBERROR;
         }
         else
@@ -376,7 +387,8 @@ int usbHost::usbHostGetDeviceDescriptor (const uint8_t  addr,   const uint8_t  e
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetConfigDescriptor  (const uint8_t  addr,   const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetConfigDescriptor  (const uint8_t  addr,   const uint8_t  endp,
                                                 uint8_t  data[], const uint16_t reqlen, uint16_t &rxlen,
                                           const bool     chklen, const unsigned idle)
 {
@@ -418,7 +430,7 @@ int usbHost::usbHostGetConfigDescriptor  (const uint8_t  addr,   const uint8_t
 
         if (chklen && receivedbytes != reqlen)
         {
-            USBERRMSG("getDeviceDescriptor: unexpected length of data received (got %d, expected %d)\n", receivedbytes, reqlen);
+            USBERRMSG(usbModel::USBERR_LENGTH, "getDeviceDescriptor: unexpected length of data received (got %d, expected %d)\n", receivedbytes, reqlen);
             error = usbModel::USBERROR;
         }
         else
@@ -454,7 +466,8 @@ int usbHost::usbHostGetConfigDescriptor  (const uint8_t  addr,   const uint8_t
 //
 // -------------------------------------------------------------------------
 
-int  usbHost::usbHostSetDeviceAddress (const uint8_t addr, const uint8_t endp, const uint16_t devaddr, const unsigned idle)
+template<class SPEED>
+int  usbHostT<SPEED>::usbHostSetDeviceAddress (const uint8_t addr, const uint8_t endp, const uint16_t devaddr, const unsigned idle)
 {
     int error = usbModel::USBOK;
 
@@ -494,7 +507,8 @@ int  usbHost::usbHostSetDeviceAddress (const uint8_t addr, const uint8_t endp, c
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostSetDeviceConfig (const uint8_t  addr, const uint8_t  endp, const uint8_t index, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::usbHostSetDeviceConfig (const uint8_t  addr, const uint8_t  endp, const uint8_t index, const unsigned idle)
 {
     int error = usbModel::USBOK;
 
@@ -533,7 +547,8 @@ int usbHost::usbHostSetDeviceConfig (const uint8_t  addr, const uint8_t  endp, c
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostClearDeviceFeature (const uint8_t  addr, const uint8_t endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostClearDeviceFeature (const uint8_t  addr, const uint8_t endp,
                                         const uint16_t feature,
                                         const unsigned idle)
 {
@@ -574,7 +589,8 @@ int usbHost::usbHostClearDeviceFeature (const uint8_t  addr, const uint8_t endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostSetDeviceFeature (const uint8_t  addr, const uint8_t endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostSetDeviceFeature (const uint8_t  addr, const uint8_t endp,
                                       const uint16_t feature,
                                       const unsigned idle)
 {
@@ -616,7 +632,8 @@ int usbHost::usbHostSetDeviceFeature (const uint8_t  addr, const uint8_t endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetInterfaceStatus (const uint8_t addr, const uint8_t endp, const uint16_t ifidx, uint16_t &status, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetInterfaceStatus (const uint8_t addr, const uint8_t endp, const uint16_t ifidx, uint16_t &status, const unsigned idle)
 {
     int error = usbModel::USBOK;
 
@@ -649,7 +666,8 @@ int usbHost::usbHostGetInterfaceStatus (const uint8_t addr, const uint8_t endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostClearInterfaceFeature (const uint8_t  addr,    const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostClearInterfaceFeature (const uint8_t  addr,    const uint8_t  endp,
                                            const uint16_t ifidx,   const uint16_t feature,
                                            const unsigned idle)
 {
@@ -690,7 +708,8 @@ int usbHost::usbHostClearInterfaceFeature (const uint8_t  addr,    const uint8_t
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostSetInterfaceFeature (const uint8_t  addr,      const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostSetInterfaceFeature (const uint8_t  addr,      const uint8_t  endp,
                                          const uint16_t ifidx,     const uint16_t feature,
                                          const unsigned idle)
 {
@@ -731,7 +750,8 @@ int usbHost::usbHostSetInterfaceFeature (const uint8_t  addr,      const uint8_t
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetInterface (const uint8_t  addr,      const uint8_t endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetInterface (const uint8_t  addr,      const uint8_t endp,
                                   const uint16_t ifidx,           uint8_t &altif,
                                   const unsigned idle)
 {
@@ -793,7 +813,8 @@ int usbHost::usbHostGetInterface (const uint8_t  addr,      const uint8_t endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostSetInterface (const uint8_t  addr,      const uint8_t endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostSetInterface (const uint8_t  addr,      const uint8_t endp,
                                   const uint16_t ifidx,     const uint8_t altif,
                                   const unsigned idle)
 {
@@ -833,7 +854,8 @@ int usbHost::usbHostSetInterface (const uint8_t  addr,      const uint8_t endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetEndpointStatus (const uint8_t  addr,    const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetEndpointStatus (const uint8_t  addr,    const uint8_t  endp,
                                              uint16_t &status, const unsigned idle)
 {
     int error = usbModel::USBOK;
@@ -867,7 +889,8 @@ int usbHost::usbHostGetEndpointStatus (const uint8_t  addr,    const uint8_t  en
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostClearEndpointFeature (const uint8_t  addr,    const uint8_t endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostClearEndpointFeature (const uint8_t  addr,    const uint8_t endp,
                                           const uint16_t feature,
                                           const unsigned idle)
 {
@@ -908,7 +931,8 @@ int usbHost::usbHostClearEndpointFeature (const uint8_t  addr,    const uint8_t
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostSetEndpointFeature (const uint8_t  addr,    const uint8_t endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostSetEndpointFeature (const uint8_t  addr,    const uint8_t endp,
                                         const uint16_t feature,
                                         const unsigned idle)
 {
@@ -949,7 +973,8 @@ int usbHost::usbHostSetEndpointFeature (const uint8_t  addr,    const uint8_t en
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostGetEndpointSynchFrame (const uint8_t  addr,      const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostGetEndpointSynchFrame (const uint8_t  addr,      const uint8_t  endp,
                                                  uint16_t &framenum,
                                            const unsigned idle)
 {
@@ -1016,7 +1041,8 @@ int usbHost::usbHostGetEndpointSynchFrame (const uint8_t  addr,      const uint8
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostBulkDataOut (const uint8_t  addr,       const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostBulkDataOut (const uint8_t  addr,       const uint8_t  endp,
                                        uint8_t  data[],     const int      databytes,
                                  const int      maxpktsize,
                                  const unsigned idle)
@@ -1049,7 +1075,8 @@ int usbHost::usbHostBulkDataOut (const uint8_t  addr,       const uint8_t  endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostIsoDataOut (const uint8_t  addr,       const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostIsoDataOut (const uint8_t  addr,       const uint8_t  endp,
                                       uint8_t  data[],     const int      databytes,
                                 const int      maxpktsize,
                                 const unsigned idle)
@@ -1082,7 +1109,8 @@ int usbHost::usbHostIsoDataOut (const uint8_t  addr,       const uint8_t  endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostBulkDataIn (const uint8_t  addr,      const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostBulkDataIn (const uint8_t  addr,      const uint8_t  endp,
                                       uint8_t* data,      const int      reqlen, const int maxpktsize,
                                 const unsigned idle)
 {
@@ -1114,7 +1142,8 @@ int usbHost::usbHostBulkDataIn (const uint8_t  addr,      const uint8_t  endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostIsoDataIn (const uint8_t  addr,      const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::usbHostIsoDataIn (const uint8_t  addr,      const uint8_t  endp,
                                      uint8_t* data,      const int      reqlen, const int maxpktsize,
                                const unsigned idle)
 {
@@ -1152,7 +1181,8 @@ int usbHost::usbHostIsoDataIn (const uint8_t  addr,      const uint8_t  endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::sendDataOut (const uint8_t  addr,       const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::sendDataOut (const uint8_t  addr,       const uint8_t  endp,
                                 uint8_t  data[],     const int      databytes,
                           const int      maxpktsize, const bool     isochronous,
                           const unsigned idle)
@@ -1206,18 +1236,22 @@ int usbHost::sendDataOut (const uint8_t  addr,       const uint8_t  endp,
             // Wait for acknowledge (either ACK or NAK)
             if ((error = apiWaitForPkt(nrzi, usbPliApi::IS_HOST)) < 0)
             {
-                USBERRMSG ("***ERROR: usbHostBulkDataOut: error waiting for ACK\n");
+                USBERRMSG (usbModel::USBERR_STATUS, "***ERROR: usbHostBulkDataOut: error waiting for ACK\n");
+
+                stats.txn().timeouts += error == usbModel::USBNORESPONSE;
             }
-            else if ((error = usbPktDecode(nrzi, pid, args, data, numbytes)) != usbModel::USBOK)
+            else if ((error = usbPktDecode(nrzi, pid, args, rxdata, numbytes)) != usbModel::USBOK)
             {
-                usbPktGetErrMsg(sbuf);
-                USBERRMSG ("***ERROR: usbHostBulkDataOut: received bad packet waiting for data\n%s", sbuf);
+                stats.txn().badPkt(usbPktGetErr());
+                USBERRMSG (usbModel::USBERR_BADPKT, "***ERROR: usbHostBulkDataOut: received bad packet waiting for data\n");
             }
             // If ACK then end of transaction if no more bytes
             else if (pid == usbModel::PID_HSHK_ACK)
             {
                 USBDEVDEBUG("==> usbHostBulkDataOut: seen ACK for DATAx\n");
 
+                stats.txn().handshake(pid);
+
                 datasent += datasize;
 
                 if ((databytes - datasent) == 0)
@@ -1230,14 +1264,22 @@ int usbHost::sendDataOut (const uint8_t  addr,       const uint8_t  endp,
             {
                 numnaks++;
 
+                stats.txn().handshake(pid);
+
                 if (numnaks > MAXNAKS)
                 {
-                    USBERRMSG ("usbHostBulkDataOut: seen too many NAKs\n");
+                    USBERRMSG (usbModel::USBERR_NAKLIMIT, "usbHostBulkDataOut: seen too many NAKs\n");
                     error =  usbModel::USBERROR;
                 }
+                else
+                {
+                    stats.txn().retries++;
+                }
             }
             else
             {
+                stats.txn().handshake(pid);
+
                 error = usbModel::USBERROR;
             }
         }
@@ -1272,7 +1314,8 @@ int usbHost::sendDataOut (const uint8_t  addr,       const uint8_t  endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::getDataIn (const uint8_t  addr,       const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::getDataIn (const uint8_t  addr,       const uint8_t  endp,
                               uint8_t* data,       const int      reqlen,
                         const int      maxpktsize, const bool     isochronous,
                         const unsigned idle)
@@ -1339,19 +1382,24 @@ int usbHost::getDataIn (const uint8_t  addr,       const uint8_t  endp,
 // The token PID is specified in pid with a device address (addr) and an
 // endpoint index (endp), including direction bit in bit 7). An optional
 // idle argument specifies a period to wait before instigating the
-// transaction (default 4 clock periods).
+// transaction (default 4 clock periods). A token starts a transaction, so
+// the usbModel may send a due SOF before it when hardware SOFs enabled.
 //
 // No return value
 //
 // -------------------------------------------------------------------------
 
-void usbHost::sendTokenToDevice (const int pid, const uint8_t addr, const uint8_t endp, const unsigned idle)
+template<class SPEED>
+void usbHostT<SPEED>::sendTokenToDevice (const int pid, const uint8_t addr, const uint8_t endp, const unsigned idle)
 {
     int numbits = usbPktGen(nrzi, pid, addr, endp);
 
     USBDEVDEBUG("==> sendTokenToDevice: pid=0x%02x addr=%d endp=0x%02x numbits=%d\n", pid, addr, endp, numbits);
 
-    apiSendPacket(nrzi, numbits, idle);
+    apiSendPacket(nrzi, numbits, idle, hwsof && keepalive);
+
+    // Count the transaction's traffic against the token's endpoint
+    stats.select(addr, epIdx(endp), pid == usbModel::PID_TOKEN_IN);
 }
 
 // -------------------------------------------------------------------------
@@ -1367,7 +1415,8 @@ void usbHost::sendTokenToDevice (const int pid, const uint8_t addr, const uint8_
 //
 // -------------------------------------------------------------------------
 
-void usbHost::sendSofToDevice (const int pid, const uint16_t framenum, const unsigned idle)
+template<class SPEED>
+void usbHostT<SPEED>::sendSofToDevice (const int pid, const uint16_t framenum, const unsigned idle)
 {
     int numbits = usbPktGen(nrzi, pid, framenum);
 
@@ -1390,7 +1439,8 @@ void usbHost::sendSofToDevice (const int pid, const uint16_t framenum, const uns
 //
 // -------------------------------------------------------------------------
 
-int usbHost::sendDataToDevice (const int datatype, const uint8_t data[], const int len, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::sendDataToDevice (const int datatype, const uint8_t data[], const int len, const unsigned idle)
 {
     int error = usbModel::USBOK;
 
@@ -1398,14 +1448,16 @@ int usbHost::sendDataToDevice (const int datatype, const uint8_t data[], const i
 
     if (datatype != usbModel::PID_DATA_0 && datatype != usbModel::PID_DATA_1)
     {
-        USBERRMSG ("***ERROR: sendDataToDevice: bad pid (0x%02x) when sending data\n", datatype);
+        USBERRMSG (usbModel::USBERR_PID, "***ERROR: sendDataToDevice: bad pid (0x%02x) when sending data\n", datatype);
         error = usbModel::USBERROR;
     }
     else
     {
-        int numbits = usbPktGen(nrzi, datatype, data, len);
+        int numbits = usbPktGen<SPEED>(nrzi, datatype, data, len);
 
         apiSendPacket(nrzi, numbits, idle);
+
+        stats.txn().data(len);
     }
 
     return error;
@@ -1433,36 +1485,50 @@ int usbHost::sendDataToDevice (const int datatype, const uint8_t data[], const i
 //
 // -------------------------------------------------------------------------
 
-int usbHost::getDataFromDevice(const int expPID, uint8_t data[], int &databytes, bool noack, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::getDataFromDevice(const int expPID, uint8_t data[], int &databytes, bool noack, const unsigned idle)
 {
     int                  error = usbModel::USBOK;
     int                  status;
-    int                  pid;
-    uint32_t             args[4];
+    usbPktResult_t       pkt;
+
+    // An IN sent again after a NAK is a retry
+    if (innak == &stats.txn())
+    {
+        stats.txn().retries++;
+    }
+
+    innak = NULL;
 
     // Wait for data
     status = apiWaitForPkt(nrzi, usbPliApi::IS_HOST);
 
     if (status == usbModel::USBDISCONNECTED)
     {
-        USBERRMSG ("***ERROR: getDataFromDevice: no device connected\n");
+        USBERRMSG (usbModel::USBERR_NOCONNECT, "***ERROR: getDataFromDevice: no device connected\n");
         error = status;
     }
     else if (status == usbModel::USBERROR || status == usbModel::USBNORESPONSE)
     {
-        USBERRMSG ("***ERROR: getDataFromDevice: bad status waiting for packet (%d)\n", status);
+        USBERRMSG (usbModel::USBERR_STATUS, "***ERROR: getDataFromDevice: bad status waiting for packet (%d)\n", status);
         error = status;
-    }
-    else if ((error = usbPktDecode(nrzi, pid, args, data, databytes)) != usbModel::USBOK)
-    {
-        USBERRMSG ("***ERROR: getDataFromDevice: received bad packet waiting for data\n");
-        usbPktGetErrMsg(sbuf);
-        USBERRMSG ("%s\n", sbuf);
+
+        stats.txn().timeouts += status == usbModel::USBNORESPONSE;
     }
     else
     {
-        if (pid == expPID)
+        pkt       = usbPktDecode(nrzi, data);
+        databytes = pkt.databytes;
+
+        if ((error = pkt.status) != usbModel::USBOK)
+        {
+            stats.txn().badPkt(usbPktGetErr());
+            USBERRMSG (usbModel::USBERR_BADPKT, "***ERROR: getDataFromDevice: received bad packet waiting for data\n");
+        }
+        else if (pkt.pid == expPID)
         {
+            stats.txn().data(databytes);
+
             if (!noack)
             {
                 USBDEVDEBUG("==> getDataFromDevice: Sending an ACK\n");
@@ -1470,13 +1536,23 @@ int usbHost::getDataFromDevice(const int expPID, uint8_t data[], int &databytes,
                 // Send ACK
                 int numbits = usbPktGen(nrzi, usbModel::PID_HSHK_ACK);
                 apiSendPacket(nrzi, numbits, idle);
+
+                stats.txn().handshake(usbModel::PID_HSHK_ACK);
             }
         }
         else
         {
-            USBDEVDEBUG("==> getDataFromDevice: unexpected pid. Got 0x%02x, exp 0x%02x\n", pid, expPID);
+            USBDEVDEBUG("==> getDataFromDevice: unexpected pid. Got 0x%02x, exp 0x%02x\n", pkt.pid, expPID);
+
+            // A NAK or STALL in place of data
+            stats.txn().handshake(pkt.pid);
+
+            if (pkt.pid == usbModel::PID_HSHK_NAK)
+            {
+                innak = &stats.txn();
+            }
 
-            USBERRMSG ("***ERROR: getDataFromDevice: received unexpected packet ID waiting for data (0x%02x)\n", pid);
+            USBERRMSG (usbModel::USBERR_UNEXPECTED, "***ERROR: getDataFromDevice: received unexpected packet ID waiting for data (0x%02x)\n", pkt.pid);
             error = usbModel::USBERROR;
         }
     }
@@ -1515,7 +1591,8 @@ int usbHost::getDataFromDevice(const int expPID, uint8_t data[], int &databytes,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::sendStandardRequest(const uint8_t  addr,    const uint8_t  endp,
+template<class SPEED>
+int usbHostT<SPEED>::sendStandardRequest(const uint8_t  addr,    const uint8_t  endp,
                                  const uint8_t  reqtype, const uint8_t  request,
                                  const uint16_t value,   const uint16_t index, const uint16_t length,
                                  const unsigned idle)
@@ -1573,7 +1650,8 @@ int usbHost::sendStandardRequest(const uint8_t  addr,    const uint8_t  endp,
 //
 // -------------------------------------------------------------------------
 
-int usbHost::waitForAck ()
+template<class SPEED>
+int usbHostT<SPEED>::waitForAck ()
 {
     int                  error = usbModel::USBOK;
     int                  status;
@@ -1588,28 +1666,31 @@ int usbHost::waitForAck ()
 
         if (status == usbModel::USBDISCONNECTED)
         {
-            USBERRMSG ("***ERROR: waitForAck: no device connected\n");
+            USBERRMSG (usbModel::USBERR_NOCONNECT, "***ERROR: waitForAck: no device connected\n");
             error = status;
         }
         else if (status == usbModel::USBNORESPONSE || status == usbModel::USBERROR)
         {
-            USBERRMSG ("***ERROR: waitForAck: bad status waiting for packet (%d)\n", status);
+            USBERRMSG (usbModel::USBERR_STATUS, "***ERROR: waitForAck: bad status waiting for packet (%d)\n", status);
             error = status;
+
+            stats.txn().timeouts += status == usbModel::USBNORESPONSE;
         }
         else
         {
             if ((status = usbPktDecode(nrzi, pid, args, rxdata, databytes)) != usbModel::USBOK)
             {
-                USBERRMSG("***ERROR: waitForAck: received bad packet waiting for ACK\n");
-                usbPktGetErrMsg(sbuf);
-                USBERRMSG("%s\n", sbuf);
+                stats.txn().badPkt(usbPktGetErr());
+                USBERRMSG(usbModel::USBERR_BADPKT, "***ERROR: waitForAck: received bad packet waiting for ACK\n");
                 error = status;
                 break;
             }
 
+            stats.txn().handshake(pid);
+
             if (pid != usbModel::PID_HSHK_ACK && pid != usbModel::PID_HSHK_NAK)
             {
-                USBERRMSG("***ERROR: waitForAck: received unexpected packet ID (0x%02x)\n", pid);
+                USBERRMSG(usbModel::USBERR_UNEXPECTED, "***ERROR: waitForAck: received unexpected packet ID (0x%02x)\n", pid);
                 error = usbModel::USBERROR;
                 break;
             }
@@ -1639,7 +1720,8 @@ int usbHost::waitForAck ()
 //
 // -------------------------------------------------------------------------
 
-int  usbHost::sendControlStatus (const uint8_t  addr, const uint8_t  endp, const bool out,
+template<class SPEED>
+int  usbHostT<SPEED>::sendControlStatus (const uint8_t  addr, const uint8_t  endp, const bool out,
                                  const unsigned idle)
 {
     int error = usbModel::USBOK;
@@ -1707,7 +1789,8 @@ int  usbHost::sendControlStatus (const uint8_t  addr, const uint8_t  endp, const
 //
 // -------------------------------------------------------------------------
 
-int usbHost::getStatus (const uint8_t addr, const uint8_t endp, const uint8_t type, uint16_t &status, const uint16_t wValue, const uint16_t wIndex, const unsigned idle)
+template<class SPEED>
+int usbHostT<SPEED>::getStatus (const uint8_t addr, const uint8_t endp, const uint8_t type, uint16_t &status, const uint16_t wValue, const uint16_t wIndex, const unsigned idle)
 {
     int error = usbModel::USBOK;
     int databytes;
@@ -1744,7 +1827,8 @@ int usbHost::getStatus (const uint8_t addr, const uint8_t endp, const uint8_t ty
 //
 // -------------------------------------------------------------------------
 
-bool usbHost::checkConnected()
+template<class SPEED>
+bool usbHostT<SPEED>::checkConnected()
 {
     unsigned line = apiReadLineState();
 
@@ -1769,13 +1853,14 @@ bool usbHost::checkConnected()
 // of when the last SOF sent and sending one if the frame period has expired
 // (basically at each frame boundary since time 0). An optional idle argument
 // specifies a period to wait before instigating the transaction (default 4
-// clock periods).
+// clock periods). Nothing is sent when the usbModel is generating SOFs.
 //
 // -------------------------------------------------------------------------
 
-void usbHost::checkSof (const unsigned idle)
+template<class SPEED>
+void usbHostT<SPEED>::checkSof (const unsigned idle)
 {
-    if (checkConnected() && keepalive)
+    if (checkConnected() && keepalive && !hwsof)
     {
         // Get the current time in milliseconds
         float currtimeMs = usbHostGetTimeUs() / (float)1000.0;
@@ -1812,7 +1897,8 @@ void usbHost::checkSof (const unsigned idle)
 //
 // -------------------------------------------------------------------------
 
-int usbHost::usbHostFindDescriptor (const int desctype, const int descidx, const uint8_t* rawdata, const int len, uint8_t* descdata)
+template<class SPEED>
+int usbHostT<SPEED>::usbHostFindDescriptor (const int desctype, const int descidx, const uint8_t* rawdata, const int len, uint8_t* descdata)
 {
     int error = usbModel::USBOK;
     int idx = 0;
@@ -1853,5 +1939,36 @@ int usbHost::usbHostFindDescriptor (const int desctype, const int descidx, const
     return error;
 }
 
+// -------------------------------------------------------------------------
+// usbHostEnableHwSof
+//
+// Method to select whether SOFs are generated by the usbModel HDL (enable
+// true) or by the C++ model (enable false). When generated in the HDL, an
+// SOF is sent every 1ms at the first transaction boundary thereafter (a
+// token or a usbHostSleepUs idle), without the C++ having to check for
+// them, and the frame numbering carries on from that of the C++ model.
+// When disabled, the C++ model carries on from the usbModel's frame number.
+//
+// -------------------------------------------------------------------------
+
+template<class SPEED>
+void usbHostT<SPEED>::usbHostEnableHwSof (const bool enable)
+{
+    // Pick up the frame number from the usbModel before its generator stops
+    if (!enable && hwsof)
+    {
+        framenum = apiGetHwSofFrame();
+    }
 
+    apiEnableHwSof(enable, enable ? (int)(framenum & 0x7ff) : -1);
+
+    hwsof = enable;
+}
+
+// -------------------------------------------------------------------------
+// Speed policy instantiations
+// -------------------------------------------------------------------------
 
+template class usbHostT<usbModel::usb_speed_ls_t>;
+template class usbHostT<usbModel::usb_speed_fs_t>;
+template class usbHostT<usbModel::usb_speed_hs_t>;
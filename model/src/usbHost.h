@@ -32,8 +32,16 @@
 #include "usbCommon.h"
 #include "usbPkt.h"
 #include "usbPliApi.h"
+#include "usbStats.h"
 
-class usbHost : public usbPliApi, public usbPkt
+// -------------------------------------------------------------------------
+// The host is a template on a line speed policy (see usbCommon.h), fixing
+// its data packet size limit and timing at compile time. The policies
+// are instantiated in usbHost.cpp.
+// -------------------------------------------------------------------------
+
+template<class SPEED>
+class usbHostT : public usbPliApi, public usbPkt
 {
 public:
 
@@ -41,21 +49,28 @@ public:
     static const int      DEFAULTIDLEDELAY         = 4; // 0.33us at 12MHz
     static const int      MAXNAKS                  = 3;
 
+    // usbLog component for messages from this class
+    static const int      USBLOGCOMP               = usbModel::usbLog::LOG_HOST;
+
     // ----------------------------------------------------------
     // Constructor
     // ----------------------------------------------------------
 
-    usbHost (int nodeIn, std::string name = std::string(FMT_HOST "HOST" FMT_NORMAL)) :
-        usbPliApi(nodeIn, name),
+    usbHostT (int nodeIn, std::string name = std::string(FMT_HOST "HOST" FMT_NORMAL)) :
+        usbPliApi(nodeIn, name, SPEED::MINRSTCOUNT, SPEED::MINSUSPENDCOUNT),
         usbPkt(name),
         connected(false),
         keepalive(true),
+        hwsof(false),
         framenum(0),
         epdata0{{true, true}, {true, true}, {true, true}, {true, true},
                 {true, true}, {true, true}, {true, true}, {true, true},
                 {true, true}, {true, true}, {true, true}, {true, true},
-                {true, true}, {true, true}, {true, true}, {true, true}}
+                {true, true}, {true, true}, {true, true}, {true, true}},
+        innak(NULL)
     {
+        // Use raw packets if connected to a byte parallel usbModel
+        usbPktSetRaw(apiIsRawPkt());
     }
 
     // -------------------------------------------------------------------------
@@ -69,8 +84,22 @@ public:
 
     void usbHostSleepUs(const unsigned time_us)
     {
-        unsigned ticks         = time_us * usbPliApi::ONE_US;
-        unsigned maxidlechunks = usbPliApi::ONE_US;
+        unsigned ticks         = time_us * SPEED::ONE_US;
+        unsigned maxidlechunks = SPEED::ONE_US;
+
+        // With hardware SOFs, the usbModel sends any that become due
+        // during the idle, so no need to break it up
+        if (hwsof)
+        {
+            checkConnected();
+
+            if (ticks)
+            {
+                apiSendIdle(ticks, keepalive);
+            }
+
+            return;
+        }
 
         // Break up idle into chunks to ensure an SOF is sent
         // within spec if delay argument is large
@@ -100,7 +129,7 @@ public:
     float usbHostGetTimeUs()
     {
         unsigned ticks = apiGetClkCount();
-        float timeus = (float)ticks / (float)usbPliApi::ONE_US;
+        float timeus = (float)ticks / (float)SPEED::ONE_US;
 
         return timeus;
     }
@@ -118,8 +147,8 @@ public:
     // Wait for a connection on the line
     // ----------------------------------------------------------
 
-    int  usbHostWaitForConnection     (const unsigned polldelay = 10*usbPliApi::ONE_US,
-                                       const unsigned timeout   =  3*usbPliApi::ONE_MS);
+    int  usbHostWaitForConnection     (const unsigned polldelay = 10*SPEED::ONE_US,
+                                       const unsigned timeout   =  3*SPEED::ONE_MS);
 
     // ----------------------------------------------------------
     // Extract descriptors from raw configuration description
@@ -245,15 +274,41 @@ public:
     // Line control
     // ----------------------------------------------------------
 
-    void usbHostSuspendDevice         (void) { keepalive = false; apiSendIdle(MINSUSPENDCOUNT); keepalive = true;}
+    void usbHostSuspendDevice         (void) { keepalive = false; apiSendIdle(SPEED::MINSUSPENDCOUNT); keepalive = true;}
+
+    void usbHostResetDevice           (void) { apiSendReset(SPEED::MINRSTCOUNT); }
+
+    // ----------------------------------------------------------
+    // SOF generation in the usbModel HDL (default off, with SOFs
+    // sent from the C++ model)
+    // ----------------------------------------------------------
 
-    void usbHostResetDevice           (void) { apiSendReset(MINRSTCOUNT); }
+    void usbHostEnableHwSof           (const bool enable = true);
+
+    // ----------------------------------------------------------
+    // Per-endpoint traffic statistics (see usbStats.h). A
+    // snapshot holds the endpoints with traffic, and the dump is
+    // CSV, or JSON with usbModel::usbStats::STATS_JSON
+    // ----------------------------------------------------------
+
+    void usbHostGetStats              (std::vector<usbModel::usb_ep_stats_entry_t> &entries) { stats.snapshot(entries); }
+
+    void usbHostResetStats            (void) { stats.reset(); }
+
+    void usbHostDumpStats             (FILE* fp = stdout, const int format = usbModel::usbStats::STATS_CSV) { stats.dump(fp, name.c_str(), format); }
 
     // -------------------------------------------------------------------------
     // Private methods
     // -------------------------------------------------------------------------
 
 private:
+    // Error records are stamped with the clock count last read,
+    // rather than accessing the simulation for each error
+    uint64_t usbPktTick (void)
+    {
+        return apiLastClkCount();
+    }
+
     void sendTokenToDevice            (const int      pid,        const uint8_t  addr,    const uint8_t  endp,
                                        const unsigned idle = DEFAULTIDLEDELAY);
 
@@ -315,18 +370,31 @@ private:
     // -------------------------------------------------------------------------
 private:
     // Internal buffers for use by class methods
-    usbModel::usb_signal_t nrzi   [usbModel::MAXBUFSIZE];
-    uint8_t                rxdata [usbModel::MAXBUFSIZE];
-    char                   sbuf   [usbModel::ERRBUFSIZE];
+    usbModel::usb_line_buf_t nrzi;
+    uint8_t                  rxdata [usbModel::MAXBUFSIZE];
 
     bool                   connected;
     bool                   keepalive;
+    bool                   hwsof;
     uint64_t               framenum;
 
     bool                   epdata0[usbModel::MAXENDPOINTS][usbModel::NUMEPDIRS];
 
+    // Traffic counters, with the current transaction's endpoint
+    // selected by the last token sent
+    usbModel::usbStats     stats;
+
+    // Counters of the endpoint whose last IN was NAKed, so an IN
+    // sent to it again is counted as a retry
+    usbModel::usb_ep_stats_t* innak;
 
 };
 
+// Default full speed host, and the instantiations for the other speeds
+typedef usbHostT<usbModel::usb_speed_fs_t> usbHost;
+typedef usbHostT<usbModel::usb_speed_ls_t> usbHostLS;
+typedef usbHostT<usbModel::usb_speed_hs_t> usbHostHS;
+
+
 
 #endif
\ No newline at end of file
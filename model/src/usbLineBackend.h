@@ -0,0 +1,83 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 2nd March 2024
+//
+// Contains the usbModel line backend interface, allowing
+// usbPliApi register accesses to be serviced by something
+// other than a VProc virtual processor
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_LINE_BACKEND_H_
+#define _USB_LINE_BACKEND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// -------------------------------------------------------------------------
+// usbLineBackend
+//
+// Abstract base class for a backend servicing the usbModel register
+// accesses of a node, with the same arguments and semantics as the
+// VProc VWrite() and VRead() calls. A backend registered for a node
+// with setBackend() is used by usbPliApi in place of VProc for all
+// accesses on that node.
+//
+// -------------------------------------------------------------------------
+
+class usbLineBackend
+{
+public:
+
+    // Maximum number of nodes that may have a backend registered
+    static const int MAXNODES = 64;
+
+    virtual ~usbLineBackend() {};
+
+    virtual int write (const unsigned addr, const unsigned data, const int delta) = 0;
+    virtual int read  (const unsigned addr, unsigned *data, const int delta) = 0;
+
+    // Register (or, with NULL, unregister) the backend for a node
+    static void setBackend(const int node, usbLineBackend* backend)
+    {
+        if (node >= 0 && node < MAXNODES)
+        {
+            table()[node] = backend;
+        }
+    }
+
+    // Returns the backend registered for a node, or NULL for VProc
+    static usbLineBackend* getBackend(const int node)
+    {
+        return (node >= 0 && node < MAXNODES) ? table()[node] : NULL;
+    }
+
+private:
+
+    // Backend table, shared by all users of this header
+    static usbLineBackend** table()
+    {
+        static usbLineBackend* backends[MAXNODES] = {};
+
+        return backends;
+    }
+};
+
+#endif
@@ -0,0 +1,946 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 10th March 2024
+//
+// Contains the run time logger for the usbModel packet display
+// and debug messages, with a level for each component (packet
+// layer, host, device, API and user code). A message's arguments
+// are captured in a record, and only formatted if its level is
+// enabled. Records may be formatted and written by a separate
+// logging thread (see usbLogAsync).
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_LOG_H_
+#define _USB_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "usbCommon.h"
+
+namespace usbModel
+{
+
+// -------------------------------------------------------------------------
+// A captured message argument. Integers are held at their widest, so
+// any length modifier in the format is ignored, but signed integers no
+// wider than an int (INT) are shown in hex (etc.) at int width, as for
+// printf.
+// -------------------------------------------------------------------------
+
+struct usb_log_arg_t
+{
+    enum arg_type_e
+    {
+        INT,
+        INT64,
+        UINT,
+        DBL,
+        STR,
+        PTR
+    } type;
+
+    union
+    {
+        int64_t      i;
+        uint64_t     u;
+        double       d;
+        const char*  s;
+        const void*  p;
+    };
+};
+
+// -------------------------------------------------------------------------
+// A captured message, with its component and level, the printf style
+// format string and the arguments
+// -------------------------------------------------------------------------
+
+static const int MAXLOGARGS = 8;
+
+struct usb_log_record_t
+{
+    int              comp;
+    int              level;
+    const char*      fmt;
+    int              nargs;
+    usb_log_arg_t    args[MAXLOGARGS];
+};
+
+// Receiver for records, in place of the default output to stderr
+typedef void (*usb_log_sink_t) (const usb_log_record_t &rec);
+
+// -------------------------------------------------------------------------
+// usbLog
+//
+// All static. The levels are set from the USBMODEL_LOG environment
+// variable when the first usbModel object is constructed (see init()),
+// and with setLevel() at any time. USBMODEL_LOG is a level for all
+// components, and/or a comma separated list of component=level, e.g.
+// USBMODEL_LOG=pkt=off,device=debug. Levels are off, info or debug (or
+// 0 to 2), and components are pkt, host, device, api and user. An
+// entry of async selects asynchronous output (see setAsync()).
+//
+// -------------------------------------------------------------------------
+
+class usbLog
+{
+public:
+
+    // Components
+    static const int LOG_PKT      = 0;
+    static const int LOG_HOST     = 1;
+    static const int LOG_DEVICE   = 2;
+    static const int LOG_API      = 3;
+    static const int LOG_USER     = 4;
+    static const int LOG_NUMCOMPS = 5;
+
+    // Levels. Packet display is at LOG_INFO, and development debug
+    // messages at LOG_DEBUG
+    static const int LOG_OFF      = 0;
+    static const int LOG_INFO     = 1;
+    static const int LOG_DEBUG    = 2;
+
+#ifndef ENABLEDEVDEBUG
+    static const int LOG_DEFAULT  = LOG_INFO;
+#else
+    static const int LOG_DEFAULT  = LOG_DEBUG;
+#endif
+
+    //-------------------------------------------------------------
+    // Level check, made before any argument is evaluated
+    //-------------------------------------------------------------
+
+    static bool enabled (const int comp, const int level)
+    {
+        return state<>::levels[comp] >= level;
+    }
+
+    //-------------------------------------------------------------
+    // Level control
+    //-------------------------------------------------------------
+
+    static void setLevel (const int comp, const int level)
+    {
+        init();
+
+        state<>::levels[comp] = level;
+    }
+
+    static void setLevel (const int level)
+    {
+        init();
+
+        for (int comp = 0; comp < LOG_NUMCOMPS; comp++)
+        {
+            state<>::levels[comp] = level;
+        }
+    }
+
+    static int  getLevel (const int comp)
+    {
+        return state<>::levels[comp];
+    }
+
+    //-------------------------------------------------------------
+    // Set a receiver for records, or NULL for output to stderr
+    //-------------------------------------------------------------
+
+    static void setSink (const usb_log_sink_t sink)
+    {
+        state<>::sink = sink;
+    }
+
+    //-------------------------------------------------------------
+    // Select asynchronous output, where records are queued by the
+    // logging threads and passed to the sink (or written to
+    // stderr) by a separate thread, in the order logged. When
+    // deselected, all queued records are output first. flush()
+    // waits for all records logged so far to be output.
+    //-------------------------------------------------------------
+
+    static void setAsync (const bool async);
+    static void flush    (void);
+
+    //-------------------------------------------------------------
+    // Apply the USBMODEL_LOG environment variable, the first time
+    // called. Returns usbModel::USBERROR if the variable has a bad
+    // entry, which is then ignored.
+    //-------------------------------------------------------------
+
+    static int init (void)
+    {
+        if (state<>::initialised)
+        {
+            return USBOK;
+        }
+
+        state<>::initialised = true;
+
+        return parseEnv(getenv("USBMODEL_LOG"));
+    }
+
+    //-------------------------------------------------------------
+    // Capture a message into a record, and pass it to the sink
+    // (or write it to stderr)
+    //-------------------------------------------------------------
+
+    template<class... ARGS> static void log (const int comp, const int level, const char* fmt, ARGS... args)
+    {
+        static_assert(sizeof...(ARGS) <= MAXLOGARGS, "usbLog::log: too many arguments");
+
+        usb_log_record_t rec = {comp, level, fmt, (int)sizeof...(ARGS), {toArg(args)...}};
+
+        if (state<>::async.load(std::memory_order_relaxed))
+        {
+            pushAsync(rec);
+        }
+        else if (state<>::sink != NULL)
+        {
+            state<>::sink(rec);
+        }
+        else
+        {
+            write(rec, stderr);
+        }
+    }
+
+    //-------------------------------------------------------------
+    // Record formatting, for sinks
+    //-------------------------------------------------------------
+
+    static void write  (const usb_log_record_t &rec, FILE* fp)
+    {
+        fileOut_t out(fp);
+
+        render(rec, out);
+        out.flush();
+    }
+
+    static int  format (const usb_log_record_t &rec, char* buf, const int size)
+    {
+        bufOut_t out(buf, size);
+
+        render(rec, out);
+
+        return out.len;
+    }
+
+private:
+
+    friend class usbLogAsync;
+
+    static void pushAsync (const usb_log_record_t &rec);
+
+    //-------------------------------------------------------------
+    // Logger state, as static members of a class template so that
+    // they can be defined in this header
+    //-------------------------------------------------------------
+
+    template<class T = void> struct state
+    {
+        static int            levels[LOG_NUMCOMPS];
+        static usb_log_sink_t    sink;
+        static std::atomic<bool> async;
+        static bool              initialised;
+    };
+
+    //-------------------------------------------------------------
+    // Argument capture
+    //-------------------------------------------------------------
+
+    template<class T> static typename std::enable_if<std::is_floating_point<T>::value, usb_log_arg_t>::type toArg (const T v)
+    {
+        usb_log_arg_t arg;
+
+        arg.type = usb_log_arg_t::DBL;
+        arg.d    = v;
+
+        return arg;
+    }
+
+    template<class T> static typename std::enable_if<(std::is_integral<T>::value && std::is_signed<T>::value) || std::is_enum<T>::value, usb_log_arg_t>::type toArg (const T v)
+    {
+        usb_log_arg_t arg;
+
+        arg.type = (sizeof(T) <= sizeof(int)) ? usb_log_arg_t::INT : usb_log_arg_t::INT64;
+        arg.i    = (int64_t)v;
+
+        return arg;
+    }
+
+    template<class T> static typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, usb_log_arg_t>::type toArg (const T v)
+    {
+        usb_log_arg_t arg;
+
+        arg.type = usb_log_arg_t::UINT;
+        arg.u    = v;
+
+        return arg;
+    }
+
+    template<class T> static typename std::enable_if<std::is_pointer<T>::value, usb_log_arg_t>::type toArg (const T v)
+    {
+        usb_log_arg_t arg;
+
+        if (std::is_same<typename std::remove_cv<typename std::remove_pointer<T>::type>::type, char>::value)
+        {
+            arg.type = usb_log_arg_t::STR;
+            arg.s    = (const char*)v;
+        }
+        else
+        {
+            arg.type = usb_log_arg_t::PTR;
+            arg.p    = (const void*)v;
+        }
+
+        return arg;
+    }
+
+    //-------------------------------------------------------------
+    // Formatted output to a file, a buffer full at a time, and to
+    // a fixed size buffer, truncating
+    //-------------------------------------------------------------
+
+    struct fileOut_t
+    {
+        static const int OUTBUFSIZE = 512;
+
+        FILE*        fp;
+        char         buf[OUTBUFSIZE];
+        int          len;
+
+        fileOut_t (FILE* fpIn) : fp(fpIn), len(0) {}
+
+        void put (const char* str, const int n)
+        {
+            if (len + n > OUTBUFSIZE)
+            {
+                flush();
+            }
+
+            if (n > OUTBUFSIZE)
+            {
+                fwrite(str, 1, n, fp);
+            }
+            else
+            {
+                memcpy(&buf[len], str, n);
+                len += n;
+            }
+        }
+
+        void flush (void)
+        {
+            fwrite(buf, 1, len, fp);
+            len = 0;
+        }
+    };
+
+    struct bufOut_t
+    {
+        char*        buf;
+        int          size;
+        int          len;
+
+        bufOut_t (char* bufIn, const int sizeIn) : buf(bufIn), size(sizeIn), len(0)
+        {
+            if (size > 0)
+            {
+                buf[0] = 0;
+            }
+        }
+
+        void put (const char* str, const int n)
+        {
+            int copy = (len + n < size) ? n : size - len - 1;
+
+            if (copy > 0)
+            {
+                memcpy(&buf[len], str, copy);
+                len += copy;
+                buf[len] = 0;
+            }
+        }
+    };
+
+    //-------------------------------------------------------------
+    // render()
+    //
+    // A minimal printf, formatting a record's arguments with its
+    // format string, a conversion at a time. Field widths and
+    // precisions must be in the format string (not *).
+    //
+    //-------------------------------------------------------------
+
+    template<class OUT> static void render (const usb_log_record_t &rec, OUT &out)
+    {
+        const char* fmt    = rec.fmt;
+        int         argidx = 0;
+
+        while (*fmt)
+        {
+            const char* pct = strchr(fmt, '%');
+
+            if (pct == NULL)
+            {
+                out.put(fmt, strlen(fmt));
+                break;
+            }
+
+            out.put(fmt, pct - fmt);
+
+            // Copy the flags, width and precision, skipping any length modifier
+            const char* cp   = pct + 1;
+            char        spec[32];
+            int         slen = 0;
+
+            spec[slen++] = '%';
+
+            while (*cp && strchr("-+ #0123456789.", *cp) && slen < 24)
+            {
+                spec[slen++] = *cp++;
+            }
+
+            while (*cp && strchr("hlLqjzt", *cp))
+            {
+                cp++;
+            }
+
+            char conv = *cp;
+            fmt       = conv ? cp + 1 : cp;
+
+            if (conv == '%')
+            {
+                out.put("%", 1);
+                continue;
+            }
+
+            if (conv == 0 || argidx >= rec.nargs)
+            {
+                continue;
+            }
+
+            const usb_log_arg_t &arg = rec.args[argidx++];
+            char                 str[256];
+            int                  n;
+
+            switch (conv)
+            {
+            case 'd': case 'i':
+                spec[slen++] = 'l'; spec[slen++] = 'l'; spec[slen++] = conv; spec[slen] = 0;
+                n = snprintf(str, sizeof(str), spec, (long long)(arg.type == usb_log_arg_t::DBL ? (int64_t)arg.d : arg.i));
+                break;
+
+            case 'u': case 'x': case 'X': case 'o':
+                spec[slen++] = 'l'; spec[slen++] = 'l'; spec[slen++] = conv; spec[slen] = 0;
+                n = snprintf(str, sizeof(str), spec, (unsigned long long)(arg.type == usb_log_arg_t::DBL ? (uint64_t)arg.d           :
+                                                                          arg.type == usb_log_arg_t::INT ? (uint64_t)(unsigned)arg.i :
+                                                                                                           arg.u));
+                break;
+
+            case 'c':
+                spec[slen++] = conv; spec[slen] = 0;
+                n = snprintf(str, sizeof(str), spec, (int)arg.i);
+                break;
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+                spec[slen++] = conv; spec[slen] = 0;
+                n = snprintf(str, sizeof(str), spec, arg.type == usb_log_arg_t::DBL  ? arg.d         :
+                                                     arg.type == usb_log_arg_t::UINT ? (double)arg.u :
+                                                                                       (double)arg.i);
+                break;
+
+            case 's':
+            {
+                const char* s = (arg.type == usb_log_arg_t::STR && arg.s != NULL) ? arg.s : "(null)";
+
+                // Strings with no width or precision go straight out, whatever their length
+                if (slen == 1)
+                {
+                    out.put(s, strlen(s));
+                    continue;
+                }
+
+                spec[slen++] = conv; spec[slen] = 0;
+                n = snprintf(str, sizeof(str), spec, s);
+                break;
+            }
+
+            case 'p':
+                spec[slen++] = conv; spec[slen] = 0;
+                n = snprintf(str, sizeof(str), spec, arg.p);
+                break;
+
+            default:
+                continue;
+            }
+
+            if (n > 0)
+            {
+                out.put(str, (n < (int)sizeof(str)) ? n : (int)sizeof(str) - 1);
+            }
+        }
+    }
+
+    //-------------------------------------------------------------
+    // parseEnv()
+    //
+    // Sets levels from a USBMODEL_LOG string. Returns
+    // usbModel::USBERROR if any entry is not recognised.
+    //
+    //-------------------------------------------------------------
+
+    static int parseLevel (const char* str, const int len)
+    {
+        static const char* names[] = {"off", "info", "debug"};
+
+        for (int level = LOG_OFF; level <= LOG_DEBUG; level++)
+        {
+            if ((int)strlen(names[level]) == len && strncmp(str, names[level], len) == 0)
+            {
+                return level;
+            }
+        }
+
+        return (len == 1 && str[0] >= '0' && str[0] <= '0' + LOG_DEBUG) ? str[0] - '0' : -1;
+    }
+
+    static int parseEnv (const char* env)
+    {
+        static const char* compnames[LOG_NUMCOMPS] = {"pkt", "host", "device", "api", "user"};
+
+        int status = USBOK;
+
+        while (env != NULL && *env)
+        {
+            const char* end   = strchr(env, ',');
+            const char* eq    = strchr(env, '=');
+            int         len   = end ? (int)(end - env) : (int)strlen(env);
+            int         comp  = -1;
+            int         level = -1;
+            bool        async = len == 5 && strncmp(env, "async", len) == 0;
+
+            // Either component=level, or a level for all components
+            if (eq != NULL && eq < env + len)
+            {
+                for (int cdx = 0; cdx < LOG_NUMCOMPS; cdx++)
+                {
+                    if ((int)strlen(compnames[cdx]) == eq - env && strncmp(env, compnames[cdx], eq - env) == 0)
+                    {
+                        comp = cdx;
+                    }
+                }
+
+                if (comp >= 0 && (level = parseLevel(eq + 1, env + len - eq - 1)) >= 0)
+                {
+                    state<>::levels[comp] = level;
+                }
+            }
+            else if (async)
+            {
+                setAsync(true);
+            }
+            else if ((level = parseLevel(env, len)) >= 0)
+            {
+                for (int cdx = 0; cdx < LOG_NUMCOMPS; cdx++)
+                {
+                    state<>::levels[cdx] = level;
+                }
+            }
+
+            if (level < 0 && !async)
+            {
+                fprintf(stderr, "usbLog: ***WARNING: bad USBMODEL_LOG entry (%.*s) ignored\n", len, env);
+                status = USBERROR;
+            }
+
+            env = end ? end + 1 : NULL;
+        }
+
+        return status;
+    }
+};
+
+template<class T> int               usbLog::state<T>::levels[usbLog::LOG_NUMCOMPS] = {LOG_DEFAULT, LOG_DEFAULT, LOG_DEFAULT, LOG_DEFAULT, LOG_DEFAULT};
+template<class T> usb_log_sink_t    usbLog::state<T>::sink                         = NULL;
+template<class T> std::atomic<bool> usbLog::state<T>::async(false);
+template<class T> bool              usbLog::state<T>::initialised                  = false;
+
+// -------------------------------------------------------------------------
+// usbLogAsync
+//
+// Asynchronous record output, for usbLog::setAsync(). Each logging
+// thread has its own single producer, single consumer ring of fixed
+// size slots, so logging takes no lock. The output thread takes the
+// records from all the rings, puts them back in order and formats
+// them into a batch, written with one call. Records are ordered by a
+// sequence number taken as they are logged. The usbModel nodes' user
+// threads run one at a time, in step with the simulation, so this is
+// also simulation time order across the nodes.
+//
+// String arguments are copied into the slot, or to the heap if too
+// large for it. Format strings must be literals.
+//
+// -------------------------------------------------------------------------
+
+class usbLogAsync
+{
+public:
+
+    static const int      LOGSTRBYTES = 96;
+    static const unsigned RINGSLOTS   = 1024;
+    static const int      IDLEUS      = 1000;
+
+    //-------------------------------------------------------------
+    // Queue a record on the calling thread's ring, waiting if
+    // the ring is full
+    //-------------------------------------------------------------
+
+    static void push (const usb_log_record_t &rec)
+    {
+        ring_t*  ring = state<>::ring;
+
+        if (ring == NULL)
+        {
+            ring = newRing();
+        }
+
+        unsigned head = ring->head.load(std::memory_order_relaxed);
+
+        while (head - ring->tail.load(std::memory_order_acquire) >= RINGSLOTS)
+        {
+            std::this_thread::yield();
+        }
+
+        slot_t &slot = ring->slots[head % RINGSLOTS];
+
+        slot.rec  = rec;
+        slot.heap = NULL;
+
+        // Copy the strings, replacing the pointers with offsets
+        size_t strbytes = 0;
+
+        for (int adx = 0; adx < rec.nargs; adx++)
+        {
+            if (rec.args[adx].type == usb_log_arg_t::STR && rec.args[adx].s != NULL)
+            {
+                strbytes += strlen(rec.args[adx].s) + 1;
+            }
+        }
+
+        char*  strings = (strbytes <= (size_t)LOGSTRBYTES) ? slot.strings : (slot.heap = (char*)malloc(strbytes));
+        size_t offset  = 0;
+
+        for (int adx = 0; adx < rec.nargs; adx++)
+        {
+            if (rec.args[adx].type == usb_log_arg_t::STR)
+            {
+                if (rec.args[adx].s == NULL)
+                {
+                    slot.rec.args[adx].u = NULLSTR;
+                }
+                else
+                {
+                    size_t len = strlen(rec.args[adx].s) + 1;
+
+                    memcpy(strings + offset, rec.args[adx].s, len);
+
+                    slot.rec.args[adx].u = offset;
+                    offset              += len;
+                }
+            }
+        }
+
+        slot.seq = state<>::ctrl.seq.fetch_add(1, std::memory_order_relaxed);
+
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    //-------------------------------------------------------------
+    // Start the output thread, if not running
+    //-------------------------------------------------------------
+
+    static void start (void)
+    {
+        ctrl_t &ctrl = state<>::ctrl;
+
+        std::lock_guard<std::mutex> lock(ctrl.mtx);
+
+        if (!ctrl.thread.joinable())
+        {
+            ctrl.running = true;
+            ctrl.thread  = std::thread(outputThread);
+        }
+    }
+
+    //-------------------------------------------------------------
+    // Stop the output thread, once all queued records are output
+    //-------------------------------------------------------------
+
+    static void stop (void)
+    {
+        ctrl_t &ctrl = state<>::ctrl;
+
+        if (ctrl.thread.joinable())
+        {
+            ctrl.running = false;
+            ctrl.thread.join();
+        }
+    }
+
+    //-------------------------------------------------------------
+    // Wait until all records logged so far are output
+    //-------------------------------------------------------------
+
+    static void flush (void)
+    {
+        ctrl_t  &ctrl   = state<>::ctrl;
+        uint64_t logged = ctrl.seq.load();
+
+        while (ctrl.thread.joinable() && ctrl.done.load() < logged)
+        {
+            idle(IDLEUS/10);
+        }
+    }
+
+private:
+
+    static const uint64_t NULLSTR = ~0ULL;
+
+    struct slot_t
+    {
+        uint64_t         seq;
+        usb_log_record_t rec;
+        char*            heap;
+        char             strings[LOGSTRBYTES];
+    };
+
+    struct ring_t
+    {
+        slot_t                slots[RINGSLOTS];
+        std::atomic<unsigned> head;
+        std::atomic<unsigned> tail;
+
+        ring_t () : head(0), tail(0) {}
+    };
+
+    // Process wide state. On exit, the output thread is stopped,
+    // so all queued records are output.
+    struct ctrl_t
+    {
+        std::mutex            mtx;
+        std::vector<ring_t*>  rings;
+        std::thread           thread;
+        std::atomic<bool>     running;
+        std::atomic<uint64_t> seq;
+        std::atomic<uint64_t> done;
+
+        ctrl_t () : running(false), seq(0), done(0) {}
+
+        ~ctrl_t ()
+        {
+            usbLog::state<>::async = false;
+
+            stop();
+
+            for (unsigned rdx = 0; rdx < rings.size(); rdx++)
+            {
+                delete rings[rdx];
+            }
+        }
+    };
+
+    template<class T = void> struct state
+    {
+        static ctrl_t                ctrl;
+        static thread_local ring_t*  ring;
+    };
+
+    // Strings of records output as text are held until the batch is
+    // written
+    struct strOut_t
+    {
+        std::string &str;
+
+        strOut_t (std::string &s) : str(s) {}
+
+        void put (const char* s, const int n)
+        {
+            str.append(s, n);
+        }
+    };
+
+    static void idle (const int us)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+
+    static ring_t* newRing (void)
+    {
+        ctrl_t &ctrl = state<>::ctrl;
+        ring_t* ring = new ring_t;
+
+        std::lock_guard<std::mutex> lock(ctrl.mtx);
+
+        ctrl.rings.push_back(ring);
+        state<>::ring = ring;
+
+        return ring;
+    }
+
+    //-------------------------------------------------------------
+    // outputThread()
+    //
+    // Takes all queued records from the rings, sorts them into
+    // logged order and outputs them, until stopped with the rings
+    // empty. Sleeps when there is nothing to output.
+    //
+    //-------------------------------------------------------------
+
+    static void outputThread (void)
+    {
+        ctrl_t             &ctrl = state<>::ctrl;
+        std::vector<slot_t> batch;
+        std::string         text;
+        strOut_t            out(text);
+
+        while (true)
+        {
+            bool running = ctrl.running;
+
+            {
+                std::lock_guard<std::mutex> lock(ctrl.mtx);
+
+                for (unsigned rdx = 0; rdx < ctrl.rings.size(); rdx++)
+                {
+                    ring_t*  ring = ctrl.rings[rdx];
+                    unsigned tail = ring->tail.load(std::memory_order_relaxed);
+                    unsigned head = ring->head.load(std::memory_order_acquire);
+
+                    for (; tail != head; tail++)
+                    {
+                        batch.push_back(ring->slots[tail % RINGSLOTS]);
+                    }
+
+                    ring->tail.store(tail, std::memory_order_release);
+                }
+            }
+
+            if (batch.empty())
+            {
+                if (!running)
+                {
+                    break;
+                }
+
+                idle(IDLEUS);
+                continue;
+            }
+
+            std::sort(batch.begin(), batch.end(), [](const slot_t &a, const slot_t &b) {return a.seq < b.seq;});
+
+            for (unsigned bdx = 0; bdx < batch.size(); bdx++)
+            {
+                slot_t &slot    = batch[bdx];
+                char*   strings = slot.heap ? slot.heap : slot.strings;
+
+                for (int adx = 0; adx < slot.rec.nargs; adx++)
+                {
+                    usb_log_arg_t &arg = slot.rec.args[adx];
+
+                    if (arg.type == usb_log_arg_t::STR)
+                    {
+                        arg.s = (arg.u == NULLSTR) ? NULL : strings + arg.u;
+                    }
+                }
+
+                if (usbLog::state<>::sink != NULL)
+                {
+                    usbLog::state<>::sink(slot.rec);
+                }
+                else
+                {
+                    usbLog::render(slot.rec, out);
+                }
+
+                free(slot.heap);
+            }
+
+            if (!text.empty())
+            {
+                fwrite(text.data(), 1, text.size(), stderr);
+                fflush(stderr);
+                text.clear();
+            }
+
+            ctrl.done += batch.size();
+            batch.clear();
+        }
+    }
+};
+
+template<class T> usbLogAsync::ctrl_t               usbLogAsync::state<T>::ctrl;
+template<class T> thread_local usbLogAsync::ring_t* usbLogAsync::state<T>::ring = NULL;
+
+inline void usbLog::setAsync (const bool async)
+{
+    if (async)
+    {
+        usbLogAsync::start();
+        state<>::async = true;
+    }
+    else
+    {
+        state<>::async = false;
+        usbLogAsync::stop();
+    }
+}
+
+inline void usbLog::flush (void)
+{
+    usbLogAsync::flush();
+}
+
+inline void usbLog::pushAsync (const usb_log_record_t &rec)
+{
+    usbLogAsync::push(rec);
+}
+
+}
+
+// Component of messages from code outside of the usbModel classes. The
+// classes each define their own USBLOGCOMP.
+static const int USBLOGCOMP = usbModel::usbLog::LOG_USER;
+
+// Log a message at the given level for a component, if enabled
+#define USBLOG(_comp, _level, ...) {if (usbModel::usbLog::enabled((_comp), (_level))) usbModel::usbLog::log((_comp), (_level), __VA_ARGS__);}
+
+#endif
@@ -0,0 +1,420 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 7th March 2024
+//
+// Contains the lookup tables for byte at a time NRZI encoding
+// with bit stuffing, a streaming NRZI encoder, and the word
+// parallel NRZI decode operations and streaming decoder
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_NRZI_H_
+#define _USB_NRZI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbTableGen.h"
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// -------------------------------------------------------------------------
+// NRZI encode table entry generator
+//
+// Encodes a byte, LSB first, from a given line level (1 for J) and run
+// of ones, stuffing a zero (a level change) after six ones. A stuff can
+// fall after the last bit of the byte, so a byte encodes to between 8
+// and 10 line bits. The entry is packed as:
+//
+//   [9:0]   line levels for D+, first bit in bit 0
+//   [15:12] number of line bits
+//   [16]    line level after the byte
+//   [22:20] run of ones after the byte (0 to 5)
+//
+// -------------------------------------------------------------------------
+
+namespace usbNrziGen
+{
+    constexpr uint32_t encBits  (const unsigned byte, const int bit, const unsigned level, const unsigned ones,
+                                 const uint32_t out, const unsigned n);
+
+    constexpr uint32_t encStuff (const unsigned byte, const int bit, const unsigned level, const unsigned ones,
+                                 const uint32_t out, const unsigned n)
+    {
+        return (ones == 6) ? encBits(byte, bit, level ^ 1, 0, out | ((level ^ 1) << n), n + 1)
+                           : encBits(byte, bit, level,     ones, out, n);
+    }
+
+    constexpr uint32_t encBits  (const unsigned byte, const int bit, const unsigned level, const unsigned ones,
+                                 const uint32_t out, const unsigned n)
+    {
+        return (bit == 8)               ? (out | (n << 12) | (level << 16) | (ones << 20)) :
+               ((byte >> bit) & 1)      ? encStuff(byte, bit + 1, level,     ones + 1, out | (level << n),       n + 1)
+                                        : encStuff(byte, bit + 1, level ^ 1, 0,        out | ((level ^ 1) << n), n + 1);
+    }
+
+    // Index is (ones * 2 + level) * 256 + byte
+    struct encEntry {typedef uint32_t type; static constexpr type get (const unsigned i) {return encBits(i & 0xff, 0, (i >> 8) & 1, i >> 9, 0, 0);}};
+}
+
+// -------------------------------------------------------------------------
+// usbNrzi
+//
+// The decode operations work on 64 line samples at a time, with D+ and
+// D- each packed into a 64 bit word, first sample in bit 0. A decoded
+// bit is 1 where the line level does not change from the previous
+// sample. Following the decoder's run of ones count, a bit is stuffed
+// (and discarded) when it follows six decoded ones, whether or not
+// those include earlier stuffed bits, so the stuffed bit positions
+// depend only on the decoded bits and the six decoded before the word.
+//
+// -------------------------------------------------------------------------
+
+class usbNrzi
+{
+public:
+
+    static const unsigned MAXONESRUN = 6;
+
+    // Streaming decoder (usbNrziDec) states
+    static const int      DECACTIVE  = 0;
+    static const int      DECDONE    = 1;
+    static const int      DECSE1     = 2;
+    static const int      DECBADSE0  = 3;
+    static const int      DECBADEOP  = 4;
+
+    // Encode table entry for a byte from the given line level and run of ones
+    static uint32_t encLookup  (const uint8_t byte, const unsigned level, const unsigned ones)
+    {
+        return encTab::data[(((ones << 1) | level) << 8) | byte];
+    }
+
+    // Encode table entry fields
+    static uint32_t encLevels  (const uint32_t entry) {return entry & 0x3ff;};
+    static unsigned encNumBits (const uint32_t entry) {return (entry >> 12) & 0xf;};
+    static unsigned encLevel   (const uint32_t entry) {return (entry >> 16) & 0x1;};
+    static unsigned encOnes    (const uint32_t entry) {return (entry >> 20) & 0x7;};
+
+    // Decoded bits for the D+ samples in dp, where level is the line level
+    // before the first sample
+    static uint64_t decBits    (const uint64_t dp, const unsigned level)
+    {
+        return ~(dp ^ ((dp << 1) | level));
+    }
+
+    // Positions of stuffed bits in the decoded bits, where hist holds the
+    // six decoded bits before the word, most recent in bit 5
+    static uint64_t stuffBits  (const uint64_t bits, const uint64_t hist)
+    {
+        uint64_t run = ~0ULL;
+
+        for (unsigned k = 1; k <= MAXONESRUN; k++)
+        {
+            run &= (bits << k) | (hist >> (MAXONESRUN - k));
+        }
+
+        return run;
+    }
+
+    // The six decoded bits up to (but not including) position n, from the
+    // word's bits and the history before the word
+    static uint64_t decHist    (const uint64_t bits, const uint64_t hist, const unsigned n)
+    {
+        return ((n >= MAXONESRUN) ? (bits >> (n - MAXONESRUN)) : ((hist >> n) | (bits << (MAXONESRUN - n)))) & 0x3f;
+    }
+
+    // Extract the bits of data selected by keep, packed down from bit 0
+    static uint64_t extract    (const uint64_t data, const uint64_t keep)
+    {
+#ifdef __BMI2__
+        return _pext_u64(data, keep);
+#else
+        uint64_t result = data & keep;
+        uint64_t remove = ~keep;
+
+        // Remove the unselected bits from the top down, which is cheap as
+        // all but the top of the word is normally kept
+        remove &= (keep == 0) ? 0 : ~0ULL >> __builtin_clzll(keep);
+
+        while (remove)
+        {
+            unsigned bit  = 63 - __builtin_clzll(remove);
+            uint64_t low  = (1ULL << bit) - 1;
+
+            result  = (result & low) | ((result >> 1) & ~low);
+            remove &= low;
+        }
+
+        return result;
+#endif
+    }
+
+private:
+
+    typedef usbTableGen::table<usbNrziGen::encEntry, usbTableGen::make<MAXONESRUN*2*256>::type> encTab;
+};
+
+// -------------------------------------------------------------------------
+// usbNrziEnc
+//
+// Streaming NRZI encoder, writing to D+ and D- sample planes of 64 bit
+// words, first sample in bit 0 of the first word. Bytes are encoded
+// with put() as they are produced, and the packet is completed with
+// an EOP by finish(), so a packet can be encoded in the same pass as
+// it is built, without a raw byte buffer.
+//
+// -------------------------------------------------------------------------
+
+class usbNrziEnc
+{
+public:
+
+    static const int WORDSAMPLES = 64;
+
+    usbNrziEnc (uint64_t* dpIn, uint64_t* dmIn, const unsigned startlevel = 1) :
+        dp(dpIn), dm(dmIn), level(startlevel & 1), ones(0), outp(0), outm(0), obit(0), oword(0), bitcnt(0)
+    {
+    }
+
+    // Encode a byte, returning the number of line bits (more than 8 if
+    // bits were stuffed)
+    int put (const uint8_t byte)
+    {
+        uint32_t entry = usbNrzi::encLookup(byte, level, ones);
+        int      nbits = usbNrzi::encNumBits(entry);
+        uint64_t mask  = (1ULL << nbits) - 1;
+        uint64_t bitsp =  usbNrzi::encLevels(entry) & mask;
+        uint64_t bitsm = ~usbNrzi::encLevels(entry) & mask;
+
+        outp   |= bitsp << obit;
+        outm   |= bitsm << obit;
+        bitcnt += nbits;
+
+        level   = usbNrzi::encLevel(entry);
+        ones    = usbNrzi::encOnes(entry);
+
+        // If output has a whole word, write it and keep any residue bits
+        if ((obit + nbits) >= WORDSAMPLES)
+        {
+            dp[oword] = outp;
+            dm[oword] = outm;
+            oword++;
+
+            outp = bitsp >> (WORDSAMPLES - obit);
+            outm = bitsm >> (WORDSAMPLES - obit);
+        }
+
+        obit = (obit + nbits) % WORDSAMPLES;
+
+        return nbits;
+    }
+
+    // Add the EOP (two SE0s and a J), with the rest of the final word(s)
+    // at J, returning the total bit count
+    int finish (void)
+    {
+        uint64_t eop = ~0ULL << 2;
+
+        dp[oword] = outp | (eop << obit);
+        dm[oword] = outm;
+
+        if ((obit + 3) > WORDSAMPLES)
+        {
+            dp[oword+1] = ~(~eop >> (WORDSAMPLES - obit));
+            dm[oword+1] = 0;
+        }
+
+        bitcnt += 3;
+
+        return bitcnt;
+    }
+
+    // Number of line bits encoded so far
+    int bits (void) const {return bitcnt;};
+
+private:
+
+    uint64_t* dp;
+    uint64_t* dm;
+    unsigned  level;
+    unsigned  ones;
+    uint64_t  outp;
+    uint64_t  outm;
+    int       obit;
+    int       oword;
+    int       bitcnt;
+};
+
+// -------------------------------------------------------------------------
+// usbNrziDec
+//
+// Streaming NRZI decoder, taking D+ and D- samples up to a 64 bit word
+// at a time, as they become available, and passing each decoded byte to
+// OUT's put(uint8_t) method as soon as it is complete. The decoded bits
+// are processed a word at a time (see usbNrzi) up to the first SE0 or
+// SE1, after which the EOP is checked sample by sample, across words if
+// need be. Any partial byte is flushed when the EOP's J is seen.
+//
+// -------------------------------------------------------------------------
+
+template<class OUT> class usbNrziDec
+{
+public:
+
+    static const unsigned WORDSAMPLES = 64;
+
+    usbNrziDec (OUT* outIn = NULL, const unsigned startlevel = 1) :
+        out(outIn), lastbit(startlevel & 1), onehist(0), output(0), obit(0), bitcnt(0),
+        eopcnt(-1), state(usbNrzi::DECACTIVE), linedp(0), linedm(0)
+    {
+    }
+
+    // Decode the first nsamples (1 to 64) samples of dp and dm, returning
+    // the decoder state, which stays at the first non-active state reached
+    int put (const uint64_t dp, const uint64_t dm, const unsigned nsamples = WORDSAMPLES)
+    {
+        unsigned first = 0;
+
+        if (state != usbNrzi::DECACTIVE)
+        {
+            return state;
+        }
+
+        if (eopcnt < 0)
+        {
+            // Number of data samples before any SE0 or SE1
+            uint64_t inword   = (nsamples >= WORDSAMPLES) ? ~0ULL : ((1ULL << nsamples) - 1);
+            uint64_t se       = ~(dp ^ dm) & inword;
+            unsigned ndata    = se ? __builtin_ctzll(se) : nsamples;
+            uint64_t valid    = (ndata >= WORDSAMPLES) ? ~0ULL : ((1ULL << ndata) - 1);
+
+            // Decode the data samples, and discard the stuffed bits
+            uint64_t bits     = usbNrzi::decBits(dp, lastbit) & valid;
+            uint64_t keep     = valid & ~usbNrzi::stuffBits(bits, onehist);
+            uint64_t outbits  = usbNrzi::extract(bits, keep);
+            int      nout     = __builtin_popcountll(keep);
+
+            if (ndata)
+            {
+                onehist = usbNrzi::decHist(bits, onehist, ndata);
+                lastbit = (dp >> (ndata - 1)) & 1;
+            }
+
+            // Add decoded bits to output, passing on whole bytes
+            if (nout)
+            {
+                uint64_t lo    = output | (outbits << obit);
+                int      total = obit + nout;
+                int      whole = (total >= 64) ? 8 : (total / 8);
+
+                for (int idx = 0; idx < whole; idx++)
+                {
+                    out->put((lo >> (idx * 8)) & 0xff);
+                }
+
+                if (total >= 64)
+                {
+                    output = obit ? (outbits >> (64 - obit)) : 0;
+                    obit   = total - 64;
+                }
+                else
+                {
+                    output = lo >> (whole * 8);
+                    obit   = total - whole * 8;
+                }
+
+                bitcnt += nout;
+            }
+
+            if (!se)
+            {
+                return state;
+            }
+
+            eopcnt = 0;
+            first  = ndata;
+        }
+
+        // Check the EOP, sample by sample, from the first SE0 or SE1
+        for (unsigned sample = first; sample < nsamples; sample++, eopcnt++)
+        {
+            linedp = (dp >> sample) & 1;
+            linedm = (dm >> sample) & 1;
+
+            bool se0orse1 = (linedp == linedm);
+
+            // Always an error for SE1
+            if (se0orse1 && linedp)
+            {
+                return state = usbNrzi::DECSE1;
+            }
+
+            // If seen one SE0, check this bit is also SE0
+            if (eopcnt == 1 && !se0orse1)
+            {
+                return state = usbNrzi::DECBADSE0;
+            }
+
+            // If seen two SE0s, this bit must be a J, when any residue bits are flushed
+            if (eopcnt == 2)
+            {
+                if (linedp & !linedm)
+                {
+                    if (obit)
+                    {
+                        out->put(output & 0xff);
+                        bitcnt += obit;
+                    }
+
+                    return state = usbNrzi::DECDONE;
+                }
+
+                return state = usbNrzi::DECBADEOP;
+            }
+        }
+
+        return state;
+    }
+
+    // Decoder state, and number of decoded bits
+    int      status (void) const {return state;};
+    int      bits   (void) const {return bitcnt;};
+
+    // Line state of the last sample checked for the EOP
+    int      eopDp  (void) const {return linedp;};
+    int      eopDm  (void) const {return linedm;};
+
+private:
+
+    OUT*      out;
+    unsigned  lastbit;
+    uint64_t  onehist;
+    uint64_t  output;
+    int       obit;
+    int       bitcnt;
+    int       eopcnt;
+    int       state;
+    int       linedp;
+    int       linedm;
+};
+
+#endif
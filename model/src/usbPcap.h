@@ -0,0 +1,370 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 11th March 2024
+//
+// Contains the pcap capture file writer for the usbModel bus
+// traffic, with link type USB 2.0 (LINKTYPE_USB_2_0), as
+// dissected by Wireshark's usbll. Packets are buffered in large
+// blocks, which are written to the file by a separate thread.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_PCAP_H_
+#define _USB_PCAP_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "usbCommon.h"
+
+namespace usbModel
+{
+
+// -------------------------------------------------------------------------
+// usbPcapWriter
+//
+// Writes packets to a pcap file, with nanosecond timestamps. Records
+// are added to the active one of two blocks. When it is full, it is
+// handed to the flush thread to write, and the other block is used,
+// waiting only if the flush thread has not finished with it.
+//
+// -------------------------------------------------------------------------
+
+class usbPcapWriter
+{
+public:
+
+    static const uint32_t PCAP_MAGIC_NS    = 0xa1b23c4d;
+    static const uint16_t PCAP_VER_MAJOR   = 2;
+    static const uint16_t PCAP_VER_MINOR   = 4;
+    static const uint32_t PCAP_SNAPLEN     = MAXBUFSIZE;
+    static const uint32_t LINKTYPE_USB_2_0 = 288;
+
+    static const int      BLOCKSIZE        = 1 << 20;
+    static const int      RECHDRSIZE       = 16;
+
+    usbPcapWriter () : fp(NULL), active(0), fill(0), flushlen(0), stop(false)
+    {
+    }
+
+    ~usbPcapWriter ()
+    {
+        close();
+    }
+
+    //-------------------------------------------------------------
+    // Open a capture file, writing its header, and start the
+    // flush thread. Any open file is closed first.
+    //-------------------------------------------------------------
+
+    int open (const char* filename)
+    {
+        close();
+
+        if ((fp = fopen(filename, "wb")) == NULL)
+        {
+            return USBERROR;
+        }
+
+        for (int bdx = 0; bdx < 2; bdx++)
+        {
+            block[bdx].resize(BLOCKSIZE);
+        }
+
+        active   = 0;
+        fill     = 0;
+        flushlen = 0;
+        stop     = false;
+
+        put32(PCAP_MAGIC_NS);
+        put16(PCAP_VER_MAJOR);
+        put16(PCAP_VER_MINOR);
+        put32(0);                  // thiszone
+        put32(0);                  // sigfigs
+        put32(PCAP_SNAPLEN);
+        put32(LINKTYPE_USB_2_0);
+
+        flusher = std::thread(&usbPcapWriter::flushThread, this);
+
+        return USBOK;
+    }
+
+    //-------------------------------------------------------------
+    // Flush any buffered packets and close the file
+    //-------------------------------------------------------------
+
+    void close (void)
+    {
+        if (fp == NULL)
+        {
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+
+            handOff(lock);
+
+            stop = true;
+            cv.notify_all();
+        }
+
+        flusher.join();
+
+        fclose(fp);
+        fp = NULL;
+    }
+
+    bool isOpen (void) const
+    {
+        return fp != NULL;
+    }
+
+    //-------------------------------------------------------------
+    // Add a packet's bytes (PID to CRC) to the capture, with a
+    // timestamp in nanoseconds
+    //-------------------------------------------------------------
+
+    void record (const uint64_t ns, const uint8_t bytes[], const int len)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        if (fp == NULL)
+        {
+            return;
+        }
+
+        if (fill + RECHDRSIZE + len > BLOCKSIZE)
+        {
+            handOff(lock);
+        }
+
+        put32((uint32_t)(ns / 1000000000ULL));
+        put32((uint32_t)(ns % 1000000000ULL));
+        put32(len);
+        put32(len);
+
+        memcpy(&block[active][fill], bytes, len);
+        fill += len;
+    }
+
+private:
+
+    // Append header fields, in host byte order (as for the magic number)
+    void put16 (const uint16_t half)
+    {
+        memcpy(&block[active][fill], &half, 2);
+        fill += 2;
+    }
+
+    void put32 (const uint32_t word)
+    {
+        memcpy(&block[active][fill], &word, 4);
+        fill += 4;
+    }
+
+    // Pass the active block to the flush thread, once it has finished
+    // with the other, and switch to the other
+    void handOff (std::unique_lock<std::mutex> &lock)
+    {
+        cv.wait(lock, [this]{return flushlen == 0;});
+
+        if (fill)
+        {
+            flushlen = fill;
+            active  ^= 1;
+            fill     = 0;
+
+            cv.notify_all();
+        }
+    }
+
+    void flushThread (void)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        while (true)
+        {
+            cv.wait(lock, [this]{return flushlen != 0 || stop;});
+
+            if (flushlen)
+            {
+                const char* buf = &block[active ^ 1][0];
+                int         len = flushlen;
+
+                lock.unlock();
+                fwrite(buf, 1, len, fp);
+                lock.lock();
+
+                flushlen = 0;
+                cv.notify_all();
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    FILE*                   fp;
+    std::vector<char>       block[2];
+    int                     active;
+    int                     fill;
+    int                     flushlen;
+    bool                    stop;
+
+    std::thread             flusher;
+    std::mutex              mtx;
+    std::condition_variable cv;
+};
+
+// -------------------------------------------------------------------------
+// usbPcap
+//
+// All static, for the one capture of a simulation, shared by all the
+// host and device nodes. A capture is started with open(), or by the
+// USBMODEL_PCAP environment variable when the first node is constructed
+// (see init()), as <filename>[,tx|rx|txrx]. Each node captures the
+// packets it transmits (tx, the default), receives (rx), or both. With
+// every node a usbModel, tx captures each packet once. With a single
+// usbModel node against other HDL, txrx captures both directions.
+// The capture is closed with close(), or at exit.
+//
+// -------------------------------------------------------------------------
+
+class usbPcap
+{
+public:
+
+    static const int PCAP_TX   = 1;
+    static const int PCAP_RX   = 2;
+    static const int PCAP_TXRX = PCAP_TX | PCAP_RX;
+
+    static bool enabled (const int dir)
+    {
+        return state<>::dirs & dir;
+    }
+
+    static int open (const char* filename, const int dirs = PCAP_TX)
+    {
+        state<>::initialised = true;
+
+        if (state<>::writer.open(filename) != USBOK)
+        {
+            state<>::dirs = 0;
+            return USBERROR;
+        }
+
+        state<>::dirs = dirs;
+
+        return USBOK;
+    }
+
+    static void close (void)
+    {
+        state<>::dirs = 0;
+        state<>::writer.close();
+    }
+
+    // Add a packet, timestamped in simulation clock ticks
+    static void record (const unsigned ticks, const uint8_t bytes[], const int len)
+    {
+        state<>::writer.record((uint64_t)ticks * 1000 / state<>::ticksperus, bytes, len);
+    }
+
+    // Set the number of clock ticks per microsecond, for the timestamps
+    static void setTicksPerUs (const unsigned ticks)
+    {
+        state<>::ticksperus = ticks;
+    }
+
+    //-------------------------------------------------------------
+    // Open a capture from the USBMODEL_PCAP environment variable,
+    // the first time called (unless already opened)
+    //-------------------------------------------------------------
+
+    static int init (const unsigned ticksperus)
+    {
+        if (state<>::initialised)
+        {
+            return USBOK;
+        }
+
+        state<>::initialised = true;
+        state<>::ticksperus  = ticksperus;
+
+        const char* env = getenv("USBMODEL_PCAP");
+
+        if (env == NULL || *env == 0)
+        {
+            return USBOK;
+        }
+
+        std::string filename(env);
+        int         dirs  = PCAP_TX;
+        size_t      comma = filename.rfind(',');
+
+        // A trailing ,tx ,rx or ,txrx selects the directions
+        if (comma != std::string::npos)
+        {
+            std::string opt = filename.substr(comma + 1);
+
+            if (opt == "tx" || opt == "rx" || opt == "txrx")
+            {
+                dirs     = (opt == "tx") ? PCAP_TX : (opt == "rx") ? PCAP_RX : PCAP_TXRX;
+                filename = filename.substr(0, comma);
+            }
+        }
+
+        if (open(filename.c_str(), dirs) != USBOK)
+        {
+            fprintf(stderr, "usbPcap: ***WARNING: could not open capture file %s\n", filename.c_str());
+            return USBERROR;
+        }
+
+        return USBOK;
+    }
+
+private:
+
+    template<class T = void> struct state
+    {
+        static usbPcapWriter writer;
+        static int           dirs;
+        static unsigned      ticksperus;
+        static bool          initialised;
+    };
+};
+
+template<class T> usbPcapWriter usbPcap::state<T>::writer;
+template<class T> int           usbPcap::state<T>::dirs        = 0;
+template<class T> unsigned      usbPcap::state<T>::ticksperus  = 12;
+template<class T> bool          usbPcap::state<T>::initialised = false;
+
+}
+
+#endif
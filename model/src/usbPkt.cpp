@@ -23,7 +23,42 @@
 //
 //=============================================================
 
+#include <string.h>
+
 #include "usbPkt.h"
+#include "usbCrc.h"
+#include "usbNrzi.h"
+
+// -------------------------------------------------------------------------
+// PID byte decode table entry generator
+//
+// Classifies a received PID byte by its packet type, or as PIDBAD when
+// the top nibble is not the inverse of the bottom nibble.
+//
+// -------------------------------------------------------------------------
+
+namespace usbPidGen
+{
+    enum pidClass_e {PIDBAD, PIDHSHK, PIDTOKEN, PIDSOF, PIDDATA, PIDUNSUPPORTED, PIDUNKNOWN};
+
+    constexpr uint8_t pidClass (const int pid)
+    {
+        return (pid == usbModel::PID_HSHK_ACK   || pid == usbModel::PID_HSHK_NAK    ||
+                pid == usbModel::PID_HSHK_STALL || pid == usbModel::PID_HSHK_NYET)   ? PIDHSHK        :
+               (pid == usbModel::PID_TOKEN_OUT  || pid == usbModel::PID_TOKEN_IN    ||
+                pid == usbModel::PID_TOKEN_SETUP)                                    ? PIDTOKEN       :
+               (pid == usbModel::PID_TOKEN_SOF)                                      ? PIDSOF         :
+               (pid == usbModel::PID_DATA_0     || pid == usbModel::PID_DATA_1)      ? PIDDATA        :
+               (pid == usbModel::PID_TOKEN_ERR  || pid == usbModel::PID_TOKEN_SPLIT ||
+                pid == usbModel::PID_TOKEN_PING || pid == usbModel::PID_DATA_2      ||
+                pid == usbModel::PID_DATA_M)                                         ? PIDUNSUPPORTED :
+                                                                                       PIDUNKNOWN;
+    }
+
+    struct pidEntry {typedef uint8_t type; static constexpr type get (const unsigned i) {return ((~i >> 4) & 0xf) != (i & 0xf) ? (type)PIDBAD : (type)pidClass(i & 0xf);}};
+
+    typedef usbTableGen::table<pidEntry, usbTableGen::make<256>::type> pidTab;
+}
 
 // -------------------------------------------------------------------------
 // bitrev()
@@ -56,27 +91,44 @@ uint32_t usbPkt::bitrev(const uint32_t Data, const int bits)
 // Sixteen bit CRC generation for polynomial:
 //   crc16 = x^16 + x^15 + x^2 + 1
 //
-// Data for CRC is pass in as a usb_signal_t, but only dp used, with
-// the length of the data (in bytes) specified with len. The
-// length is expected to be byte aligned. The CRC is initialised with
-// crcinit before calculation. The result is bit reversed
-// before returning value.
+// Data for CRC is passed in as bytes, with the length of the data
+// (in bytes) specified with len. The length is expected to be byte
+// aligned. The CRC is initialised with crcinit before calculation.
+// The result is bit reversed before returning value.
+//
+// The CRC is table driven a byte at a time, with the state held
+// reflected so that no bit reversal of the result is needed (see
+// usbCrc.h). When built with carry-less multiply support, long
+// (high speed) payloads are processed eight bytes at a time.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbcrc16 (const usbModel::usb_signal_t data[], const unsigned len, const unsigned crcinit)
+int usbPkt::usbcrc16 (const uint8_t data[], const unsigned len, const unsigned crcinit)
 {
-    unsigned crc = crcinit;
+    unsigned crc  = (crcinit == usbCrc::CRC16INIT) ? crcinit : usbCrc::rev16(crcinit);
+    unsigned byte = 0;
 
-    for (unsigned byte = 0; byte < len; byte++)
+#ifdef __PCLMUL__
+    if (len >= usbCrc::CLMULMINBYTES)
     {
-        for (int i = 0; i < 8; i++)
+        for (; (byte + 8) <= len; byte += 8)
         {
-            crc = (crc << 1UL) ^ ((((crc & usbModel::BIT16) ? 1 : 0) ^ ((data[byte].dp >> i) & 1)) ? usbModel::POLY16 : 0);
+            uint64_t bytes;
+
+            // PCLMUL targets are little endian, so the first byte is the LSB
+            memcpy(&bytes, &data[byte], sizeof(bytes));
+
+            crc = usbCrc::crc16Clmul(crc, bytes);
         }
     }
+#endif
+
+    for (; byte < len; byte++)
+    {
+        crc = usbCrc::crc16Byte(crc, data[byte]);
+    }
 
-    return bitrev(~crc & 0xffff, 16);
+    return ~crc & 0xffff;
 }
 
 // -------------------------------------------------------------------------
@@ -85,16 +137,24 @@ int usbPkt::usbcrc16 (const usbModel::usb_signal_t data[], const unsigned len, c
 // Five bit CRC generation for polynomial:
 //   crc5  =  x^5 +  x^2 + 1
 //
-// Data for CRC is pass in as a usb_signal_t, but only dp used, with
-// the length of the data (in bytes) specified with len. The
-// data may not be byte aligned, so the number of trailing bits is
-// specified in endbits. The CRC is initialised with crcinit before
-// calculation. The result is bit reversed before returning value.
+// Data for CRC is passed in as bytes, with the length of the data
+// (in bytes) specified with len. The data may not be byte aligned,
+// so the number of trailing bits is specified in endbits. The CRC is
+// initialised with crcinit before calculation. The result is bit
+// reversed before returning value.
+//
+// The 11 bit token and SOF fields are looked up directly from a table
+// of the final CRC values. Other lengths are calculated a bit at a time.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbcrc5(const usbModel::usb_signal_t data[], const unsigned len, const int endbits, const unsigned crcinit )
+int usbPkt::usbcrc5(const uint8_t data[], const unsigned len, const int endbits, const unsigned crcinit )
 {
+    if (len == 2 && endbits == 3 && crcinit == usbCrc::CRC5INIT)
+    {
+        return usbCrc::crc5Field(data[0] | ((data[1] & 0x7) << 8));
+    }
+
     unsigned crc = crcinit;
 
     for (unsigned bytes = 0; bytes < len; bytes++)
@@ -102,7 +162,7 @@ int usbPkt::usbcrc5(const usbModel::usb_signal_t data[], const unsigned len, con
         int bits = (bytes == (len - 1)) ? endbits : 8;
         for (int i = 0; i < bits; i++)
         {
-            crc = (crc << 1UL) ^ ((((crc & usbModel::BIT5) ? 1 : 0) ^ ((data[bytes].dp >> i) & 1)) ? usbModel::POLY16 : 0);
+            crc = (crc << 1UL) ^ ((((crc & usbModel::BIT5) ? 1 : 0) ^ ((data[bytes] >> i) & 1)) ? usbModel::POLY16 : 0);
         }
     }
 
@@ -112,104 +172,110 @@ int usbPkt::usbcrc5(const usbModel::usb_signal_t data[], const unsigned len, con
 // -------------------------------------------------------------------------
 // nrziEnc
 //
-// NRZI encoding of raw byte data (raw[]), with result placed in nrzi[].
+// NRZI encoding of raw byte data (raw[]), with result placed in nrzi.
 // The length (in bytes) of data to encode is specified in len, and the
 // state of the line (J or K) prior to the start of this encoding is
 // given in start. Bit stuffing is performed by inserting a virtual 0 in the
 // input data when 6 consecutive 1s are seen.
 //
+// Each byte is encoded with a single table lookup (see usbNrziEnc),
+// indexed by the byte, the current line level and the current run of
+// ones, returning the line bits (including any stuffed bits), their
+// number, and the level and run of ones to carry into the next byte.
+//
 // The method returns the number of bits generated in the encoding.
 //
+// In raw mode, the bytes after the SYNC byte are copied to nrzi[]
+// without encoding, terminated with an SE0 entry.
+//
 // -------------------------------------------------------------------------
 
-int usbPkt::nrziEnc(const usbModel::usb_signal_t raw[], usbModel::usb_signal_t nrzi[], const unsigned len, const int start)
+int usbPkt::nrziEnc(const uint8_t raw[], usbModel::usb_line_buf_t &nrzi, const unsigned len, const int start)
 {
-    int      state = start;
-    uint32_t outputp = 0;
-    uint32_t outputm = 0;
-    int      onescnt = 0;
-    int      obit    = 0;
-    int      bitcnt  = 0;
-    int      obyte   = 0;
-
-    // Run through each byte in the buffer
+    if (rawmode)
+    {
+        for (unsigned byte = 1; byte < len; byte++)
+        {
+            nrzi.setByte(byte-1, raw[byte], ~raw[byte]);
+        }
+
+        nrzi.setByte(len-1, 0, 0);
+
+        return (len - 1) * usbModel::NRZI_BITSPERBYTE;
+    }
+
+    usbNrziEnc enc(nrzi.dp, nrzi.dm, start);
+
+    // Check the log level once, rather than for every stuffed byte
+    const bool debug = usbModel::usbLog::enabled(USBLOGCOMP, usbModel::usbLog::LOG_DEBUG);
+
+    // Run through each byte in the buffer, encoding a whole byte (with any
+    // stuffed bits) from the current line state and run of ones in a
+    // single lookup
     for (unsigned byte = 0; byte < len; byte++)
     {
+        int bitcnt = enc.bits();
+        int nbits  = enc.put(raw[byte]);
 
-        // Run through each bit in the byte
-        for (int bit = 0; bit < usbModel::NRZI_BITSPERBYTE; bit++)
+        if (debug && nbits > usbModel::NRZI_BITSPERBYTE)
         {
-            // A zero is a state change
-            if (!(raw[byte].dp & (usbModel::NRZI_BYTELSBMASK << bit)))
-            {
-                state = ~state & usbModel::NRZI_BYTELSBMASK;
-                onescnt = 0;
-            }
-            // A one is no state change
-            else
-            {
-                // Keep count of the number of consecutive 1s
-                onescnt++;
-            }
+            USBDEVDEBUG("==> nrziEnc: stuffing %d bit(s) (%d)\n", nbits - usbModel::NRZI_BITSPERBYTE, bitcnt);
+        }
+    }
 
-            // Output NRZI bit
-            outputp |= ( state & usbModel::NRZI_BYTELSBMASK) << obit;
-            outputm |= (~state & usbModel::NRZI_BYTELSBMASK) << obit;
-            obit++;
-            bitcnt++;
+    // Add EOP
+    return enc.finish();
+}
 
-            // If seen 6 ones, stuff an extra 0 in the output (state change)
-            if (onescnt == usbModel::MAXONESLENGTH)
-            {
-                USBDEVDEBUG("==> nrziEnc: stuffing bit (%d)\n", obit);
-                state = ~state;
-                onescnt = 0;
-
-                outputp |= ( state & usbModel::NRZI_BYTELSBMASK) << obit;
-                outputm |= (~state & usbModel::NRZI_BYTELSBMASK) << obit;
-                obit++;
-                bitcnt++;
-            }
+// -------------------------------------------------------------------------
+// pktDecSink_t::put()
+//
+// Takes the next decoded byte of a packet. For a data packet, the bytes
+// after the PID are stored in data[] as they arrive, and are added to
+// the CRC16 two bytes behind, so that at the end of the packet the CRC
+// covers just the payload, and not the received CRC16 field.
+//
+// -------------------------------------------------------------------------
 
-            // If output shift has a whole byte or more, send to output
-            while (obit >= 8)
-            {
-                nrzi[obyte].dp = (uint8_t)outputp;
-                nrzi[obyte].dm = (uint8_t)outputm;
-                obyte++;
-
-                // Remember any residue bits
-                outputp >>= 8;
-                outputm >>= 8;
-                obit -= 8;
-            }
+void usbPkt::pktDecSink_t::put(const uint8_t byte)
+{
+    if (count < usbModel::DATABYTEOFFSET)
+    {
+        hdr[count] = byte;
+
+        if (count == usbModel::PIDBYTEOFFSET)
+        {
+            isdata = usbPidGen::pidTab::data[byte] == usbPidGen::PIDDATA;
         }
     }
+    else if (isdata)
+    {
+        int idx = count - usbModel::DATABYTEOFFSET;
 
-    // Add EOP
-    outputp |= usbModel::SE0P << obit;
-    outputm |= usbModel::SE0M << obit;
-    obit += 3;
-    bitcnt += 3;
+        if (idx < usbModel::MAXBUFSIZE)
+        {
+            data[idx] = byte;
+
+            if (idx >= 2)
+            {
+                crc = usbCrc::crc16Byte(crc, (lag >> 8) & 0xff);
+            }
 
-    // Flush any residue bits out
-    while (obit > 0)
+            lag = (lag << 8) | byte;
+        }
+    }
+    else if (count < DECHDRBYTES)
     {
-        nrzi[obyte].dp = (uint8_t)outputp;
-        nrzi[obyte].dm = (uint8_t)outputm;
-        obyte++;
-        outputp >>= 8;
-        outputm >>= 8;
-        obit -= 8;
+        hdr[count] = byte;
     }
 
-    return bitcnt;
+    count++;
 }
 
 // -------------------------------------------------------------------------
 // nrziDec
 //
-// Decodes NRZI data from nrzi[] and places decoded bytes in raw[]. The
+// Decodes NRZI data from nrzi[] and passes decoded bytes to out. The
 // state of the line before the decode is specified in start. The method
 // will remove stuffed bits (the bit following 6 consectived decoded
 // 1s).
@@ -223,133 +289,97 @@ int usbPkt::nrziEnc(const usbModel::usb_signal_t raw[], usbModel::usb_signal_t n
 // The bit count of the decoded data is returned if there are no errors,
 // else usbModel::USBERROR is returned.
 //
+// The line is decoded a buffer word (64 samples) at a time by a
+// usbNrziDec streaming decoder (see usbNrzi.h).
+//
+// In raw mode, the bytes in nrzi[] up to the SE0 entry are passed to
+// out after a SYNC byte, and the bit count returned includes the SYNC.
+//
 // -------------------------------------------------------------------------
 
-int usbPkt::nrziDec(const usbModel::usb_signal_t nrzi[], usbModel::usb_signal_t raw[], const int start)
+int usbPkt::nrziDec(const usbModel::usb_line_buf_t &nrzi, pktDecSink_t &out, const int start)
 {
-    int      ibyte     = 0;
-    int      eofactive = 0;
-    int      bitcount  = 0;
-    uint8_t  lastbit   = start;
-
     int      obyte     = 0;
-    int      obit      = 0;
-    uint32_t output    = 0;
-    int      onecnt    = 0;
-
-    usbModel::usb_signal_t currbit;
 
-    while (true)
+    if (rawmode)
     {
-        for (int bit = 0; bit < 8; bit++)
-        {
-            currbit.dp      = (nrzi[ibyte].dp >> bit) & 1;
-            currbit.dm      = (nrzi[ibyte].dm >> bit) & 1;
-
-            uint8_t se      = (currbit.dp == currbit.dm);
+        out.put(usbModel::SYNC);
+        obyte++;
 
-            // Always an error for SE1
-            if (se && currbit.dp)
+        for (int ibyte = 0; nrzi.dpByte(ibyte) != nrzi.dmByte(ibyte); ibyte++)
+        {
+            if (obyte >= usbModel::MAXBUFSIZE)
             {
-                USBERRMSG("nrziDec: seen SE1\n");
+                USBERRMSG(usbModel::USBERR_NRZI, "nrziDec: raw packet has no terminating SE0\n");
                 return usbModel::USBERROR;
             }
 
-            // If receiving a potential EOP...
-            if (eofactive)
-            {
-                // If seen one SE0, check this bit is also SE0
-                if (eofactive == 1 && !se)
-                {
-                    USBERRMSG("nrziDec: Bad EOP. SE0 not followed by another SE0\n");
-                    return usbModel::USBERROR;
-                }
+            out.put(nrzi.dpByte(ibyte));
+            obyte++;
+        }
 
-                // If seen two SE0s, check this bit is a J
-                if (eofactive == 2)
-                {
-                    // If current bit is a J, then flush any remaining output bits and return bit count
-                    if (currbit.dp & !currbit.dm)
-                    {
-                        // Residue bits to flush
-                        // TODO: check if flushing needed. Maybe an error not to be byte aligned
-                        if (obit)
-                        {
-                            raw[obyte].dp = output & 0xff;
-                            bitcount += obit;
-                        }
-
-                        return bitcount;
-                    }
-                    // Anything other than a J at this point is an error
-                    else
-                    {
-                        USBERRMSG("nrziDec: Bad EOP. two SE0s not followed by a J (D+ = %d D- = %d)\n", currbit.dp, currbit.dm);
-                        return usbModel::USBERROR;
-                    }
-                }
-            }
+        return obyte * usbModel::NRZI_BITSPERBYTE;
+    }
 
-            // If SE0 increment EOF active state
-            if (se && !currbit.dp)
-            {
-                eofactive++;
-            }
+    usbNrziDec<pktDecSink_t> dec(&out, start & usbModel::NRZI_BYTELSBMASK);
 
-            // If not processing an EOF...
-            if (!eofactive)
-            {
-                if (onecnt < usbModel::MAXONESLENGTH)
-                {
-                    // Add decoded current bit to output: change = 0, same = 1
-                    output |= ((lastbit ^ currbit.dp) ? 0 : 1) << obit;
+    for (int iword = 0; iword < usbModel::MAXBUFWORDS; iword++)
+    {
+        if (dec.put(nrzi.dp[iword], nrzi.dm[iword]) != usbNrzi::DECACTIVE)
+        {
+            break;
+        }
+    }
 
-                    // Increment count of bits on output
-                    obit++;
-                    bitcount++;
-                }
+    return nrziDecStatus(dec);
+}
 
-                // If a 0, reset the onecnt
-                if (lastbit ^ currbit.dp)
-                {
-                    onecnt = 0;
-                }
-                else
-                {
-                    onecnt++;
-                }
+// -------------------------------------------------------------------------
+// nrziDecStatus
+//
+// Returns the bit count of a completed NRZI decode, or else sets the
+// error message for the decoder's state and returns usbModel::USBERROR.
+//
+// -------------------------------------------------------------------------
 
-                // If enough bits for a byte on the output, place in the output buffer
-                while (obit >= 8)
-                {
-                    raw[obyte].dp = output & 0xff;
-                    output >>= 8;
-                    obit -= 8;
-                    obyte++;
-                }
+int usbPkt::nrziDecStatus(const usbNrziDec<pktDecSink_t> &dec)
+{
+    switch (dec.status())
+    {
+    case usbNrzi::DECDONE:
+        return dec.bits();
 
-                lastbit = currbit.dp;
-            }
-        }
+    case usbNrzi::DECSE1:
+        USBERRMSG(usbModel::USBERR_NRZI, "nrziDec: seen SE1\n");
+        break;
 
-        ibyte++;
+    case usbNrzi::DECBADSE0:
+        USBERRMSG(usbModel::USBERR_NRZI, "nrziDec: Bad EOP. SE0 not followed by another SE0\n");
+        break;
+
+    case usbNrzi::DECBADEOP:
+        USBERRMSG(usbModel::USBERR_NRZI, "nrziDec: Bad EOP. two SE0s not followed by a J (D+ = %d D- = %d)\n", dec.eopDp(), dec.eopDm());
+        break;
+
+    default:
+        USBERRMSG(usbModel::USBERR_NRZI, "nrziDec: no EOP found in buffer\n");
+        break;
     }
 
-    // Should never reach here.
     return usbModel::USBERROR;
 }
 
 // -------------------------------------------------------------------------
-// usbPktGen (for handshake/preamble)
+// pktGenHshk
 //
 // Generates a handshake or preamble token packet, as specified by pid,
-// and places it in buf[]. It will return usbModel::USBERROR if the
+// and places it in buf. It will return usbModel::USBERROR if the
 // pid is not a valid type for this packet, or if NRZI encoding
 // failed.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid)
+int usbPkt::pktGenHshk(usbModel::usb_line_buf_t &buf, const int pid)
 {
     int idx = 0;
 
@@ -363,18 +393,16 @@ int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid)
     case usbModel::PID_SPCL_PREAMB:
         break;
     default:
-        USBERRMSG("genUsbPkt: Bad PID (0x%x) seen for handshake generation.\n", pid);
+        USBERRMSG(usbModel::USBERR_PID, "genUsbPkt: Bad PID (0x%x) seen for handshake generation.\n", pid);
         return usbModel::USBERROR;
     }
 
     // SOP/Sync
-    rawbuf[idx].dp = usbModel::SYNC;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = usbModel::SYNC;
     idx++;
 
     // PID
-    rawbuf[idx].dp = pid | ((~pid & 0xf) << 4);
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = pid | ((~pid & 0xf) << 4);
     idx++;
 
     // NRZI encode with bit stuffing and EOP
@@ -382,16 +410,16 @@ int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid)
 }
 
 // -------------------------------------------------------------------------
-// usbPktGen (for SOF)
+// pktGenToken
 //
 // Generates a token packet (not SOF), as specified by pid,
-// and places it in buf[]. It will return usbModel::USBERROR if the
+// and places it in buf. It will return usbModel::USBERROR if the
 // pid is not a valid type for this packet, or if NRZI encoding
 // failed.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint8_t addr, const uint8_t endp)
+int usbPkt::pktGenToken(usbModel::usb_line_buf_t &buf, const int pid, const uint8_t addr, const uint8_t endp)
 {
     int idx = 0;
     unsigned crc;
@@ -404,46 +432,42 @@ int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint8_t
     case usbModel::PID_TOKEN_SETUP:
         break;
     default:
-        USBERRMSG("genUsbPkt: Bad PID (0x%x) seen for token generation.\n", pid);
+        USBERRMSG(usbModel::USBERR_PID, "genUsbPkt: Bad PID (0x%x) seen for token generation.\n", pid);
         return usbModel::USBERROR;
     }
 
     // Validate the address (0 to 127)
     if (addr > usbModel::MAXDEVADDR)
     {
-        USBERRMSG("genUsbPkt: Invalid token address (0x%x\n", addr);
+        USBERRMSG(usbModel::USBERR_ADDR, "genUsbPkt: Invalid token address (0x%x\n", addr);
         return usbModel::USBERROR;
     }
 
     // Validate the endpoint
     if ((endp & 0x7f) > usbModel::MAXENDP)
     {
-        USBERRMSG("genUsbPkt: Invalid token end point (0x%x\n", endp);
+        USBERRMSG(usbModel::USBERR_ADDR, "genUsbPkt: Invalid token end point (0x%x\n", endp);
         return usbModel::USBERROR;
     }
 
     // SOP/Sync
-    rawbuf[idx].dp = usbModel::SYNC;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = usbModel::SYNC;
     idx++;
 
     // PID
-    rawbuf[idx].dp = pid | ((~pid & 0xf) << 4);
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = pid | ((~pid & 0xf) << 4);
     idx++;
 
     // Payload
-    rawbuf[idx].dp = (addr & 0x7f) | ((endp & 0x1) << 7);
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = (addr & 0x7f) | ((endp & 0x1) << 7);
     idx++;
 
-    rawbuf[idx].dp   = endp >> 1;
+    rawbuf[idx]   = endp >> 1;
 
     // CRC5 over ADDR and ENDP
     crc = usbcrc5(&rawbuf[idx - 1], 2, 3);
 
-    rawbuf[idx].dp |= crc << 3;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] |= crc << 3;
     idx++;
 
     // NRZI encode with bit stuffing and EOP
@@ -451,16 +475,16 @@ int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint8_t
 }
 
 // -------------------------------------------------------------------------
-// usbPktGen (for SOF token)
+// pktGenSof
 //
-// Generates an AOF token packet, as specified by pid,
-// and places it in buf[]. It will return usbModel::USBERROR if the
+// Generates an SOF token packet, as specified by pid,
+// and places it in buf. It will return usbModel::USBERROR if the
 // pid is not a valid type for this packet, or if NRZI encoding
 // failed.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint16_t framenum)
+int usbPkt::pktGenSof(usbModel::usb_line_buf_t &buf, const int pid, const uint16_t framenum)
 {
     int idx = 0;
     unsigned crc;
@@ -471,59 +495,251 @@ int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint16_
     case usbModel::PID_TOKEN_SOF:
         break;
     default:
-        USBERRMSG("genUsbPkt: Bad PID (0x%x) seen for SOF generation.\n", pid);
+        USBERRMSG(usbModel::USBERR_PID, "genUsbPkt: Bad PID (0x%x) seen for SOF generation.\n", pid);
         return usbModel::USBERROR;
     }
 
     // Validate frame number
     if (framenum > usbModel::MAXFRAMENUM)
     {
-        USBERRMSG("genUsbPkt: Ivalid frame number (%d)\n", framenum);
+        USBERRMSG(usbModel::USBERR_LENGTH, "genUsbPkt: Ivalid frame number (%d)\n", framenum);
         return usbModel::USBERROR;
     }
 
     // SOP/Sync
-    rawbuf[idx].dp = usbModel::SYNC;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = usbModel::SYNC;
     idx++;
 
     // PID
-    rawbuf[idx].dp = pid | ((~pid & 0xf) << 4);
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = pid | ((~pid & 0xf) << 4);
     idx++;
 
     // Payload
-    rawbuf[idx].dp = framenum & 0xff;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] = framenum & 0xff;
     idx++;
 
-    rawbuf[idx].dp = (framenum >> 8) & 0x7;
+    rawbuf[idx] = (framenum >> 8) & 0x7;
 
     // CRC5 over frame number
     crc = usbcrc5(&rawbuf[idx - 1], 2, 3);
 
-    rawbuf[idx].dp |= crc << 3;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
+    rawbuf[idx] |= crc << 3;
     idx++;
 
     // NRZI encode with bit stuffing and EOP
     return nrziEnc(rawbuf, buf, idx);
 }
 
+// -------------------------------------------------------------------------
+// pktCacheBuild
+//
+// (Re)builds the encoded packet cache for the current packet mode
+// (NRZI or raw). All the handshakes and SOFs are generated, and any
+// cached tokens are discarded to be rebuilt on first use.
+//
+// -------------------------------------------------------------------------
+
+void usbPkt::pktCacheBuild(void)
+{
+    static const int hshkpids[] = {usbModel::PID_HSHK_ACK,  usbModel::PID_HSHK_NAK,
+                                   usbModel::PID_HSHK_NYET, usbModel::PID_HSHK_STALL,
+                                   usbModel::PID_SPCL_PREAMB};
+
+    usbModel::usb_line_buf_t buf;
+
+    for (int pid = 0; pid < usbModel::NUMPIDS; pid++)
+    {
+        hshkcache[pid].bits = 0;
+    }
+
+    for (unsigned idx = 0; idx < sizeof(hshkpids)/sizeof(hshkpids[0]); idx++)
+    {
+        pktCacheSave(hshkcache[hshkpids[idx]], buf, pktGenHshk(buf, hshkpids[idx]));
+    }
+
+    sofcache.resize(usbModel::FRAMEFIELDMASK+1);
+
+    for (int frame = 0; frame <= usbModel::FRAMEFIELDMASK; frame++)
+    {
+        pktCacheSave(sofcache[frame], buf, pktGenSof(buf, usbModel::PID_TOKEN_SOF, frame));
+    }
+
+    for (int addr = 0; addr <= usbModel::MAXDEVADDR; addr++)
+    {
+        tokcache[addr].clear();
+    }
+}
+
+// -------------------------------------------------------------------------
+// pktCacheSave
+//
+// Saves a generated packet, of the given bit count, from nrzibuf to a
+// cache image. Packets that fail to generate, or that are too long for
+// an image, are left uncached.
+//
+// -------------------------------------------------------------------------
+
+void usbPkt::pktCacheSave(pktImage_t &image, const usbModel::usb_line_buf_t &nrzibuf, const int bits)
+{
+    if (bits > 0 && bits < usbModel::LINEBUFWORDSAMPLES)
+    {
+        // A raw packet is only valid up to its SE0 terminating byte, with
+        // whatever was in the buffer after it, so the rest is cleared
+        uint64_t valid = (rawmode && (bits + usbModel::NRZI_BITSPERBYTE) < usbModel::LINEBUFWORDSAMPLES) ?
+                             ((1ULL << (bits + usbModel::NRZI_BITSPERBYTE)) - 1) : ~0ULL;
+
+        image.dp   = nrzibuf.dp[0] & valid;
+        image.dm   = nrzibuf.dm[0] & valid;
+        image.bits = bits;
+    }
+    else
+    {
+        image.bits = 0;
+    }
+}
+
+// -------------------------------------------------------------------------
+// pktCacheLoad
+//
+// Copies a cached packet image to nrzibuf, returning its bit count.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::pktCacheLoad(const pktImage_t &image, usbModel::usb_line_buf_t &nrzibuf)
+{
+    nrzibuf.dp[0] = image.dp;
+    nrzibuf.dm[0] = image.dm;
+
+    return image.bits;
+}
+
+// -------------------------------------------------------------------------
+// usbPktGen (for handshake/preamble)
+//
+// Generates a handshake or preamble token packet, as specified by pid,
+// and places it in buf. All valid handshakes are cached, so any other
+// pid is passed to pktGenHshk() for its error.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktGen(usbModel::usb_line_buf_t &buf, const int pid)
+{
+    if (pid >= 0 && pid < usbModel::NUMPIDS && hshkcache[pid].bits)
+    {
+        return pktCacheLoad(hshkcache[pid], buf);
+    }
+
+    return pktGenHshk(buf, pid);
+}
+
+// -------------------------------------------------------------------------
+// usbPktGen (for token)
+//
+// Generates a token packet (not SOF), as specified by pid, addr and endp,
+// and places it in buf. A valid token is generated on its first use
+// and cached, with the cache for an address allocated on the first
+// token for that address.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktGen(usbModel::usb_line_buf_t &buf, const int pid, const uint8_t addr, const uint8_t endp)
+{
+    int pididx;
+
+    switch (pid)
+    {
+    case usbModel::PID_TOKEN_IN:    pididx = 0; break;
+    case usbModel::PID_TOKEN_OUT:   pididx = 1; break;
+    case usbModel::PID_TOKEN_SETUP: pididx = 2; break;
+    default:                        pididx = usbModel::NOT_VALID; break;
+    }
+
+    // Invalid tokens are generated uncached, for the error
+    if (pididx == usbModel::NOT_VALID || addr > usbModel::MAXDEVADDR || (endp & 0x7f) > usbModel::MAXENDP)
+    {
+        return pktGenToken(buf, pid, addr, endp);
+    }
+
+    // The endpoint direction bit is part of the key, as it is encoded
+    std::vector<pktImage_t> &cache = tokcache[addr];
+    int                      idx   = (pididx * usbModel::NUMEPDIRS + (endp >> 7)) * usbModel::MAXENDPOINTS + (endp & usbModel::MAXENDP);
+
+    if (cache.empty())
+    {
+        pktImage_t unbuilt = {0, 0, 0};
+
+        cache.resize(3 * usbModel::NUMEPDIRS * usbModel::MAXENDPOINTS, unbuilt);
+    }
+
+    if (cache[idx].bits)
+    {
+        return pktCacheLoad(cache[idx], buf);
+    }
+
+    int bits = pktGenToken(buf, pid, addr, endp);
+
+    pktCacheSave(cache[idx], buf, bits);
+
+    return bits;
+}
+
+// -------------------------------------------------------------------------
+// usbPktGen (for SOF token)
+//
+// Generates an SOF token packet, as specified by pid and framenum,
+// and places it in buf. SOFs for all frame numbers are cached, with
+// only the 11 bit frame number field encoded.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktGen(usbModel::usb_line_buf_t &buf, const int pid, const uint16_t framenum)
+{
+    if (pid == usbModel::PID_TOKEN_SOF && framenum <= usbModel::MAXFRAMENUM && sofcache[framenum & usbModel::FRAMEFIELDMASK].bits)
+    {
+        return pktCacheLoad(sofcache[framenum & usbModel::FRAMEFIELDMASK], buf);
+    }
+
+    return pktGenSof(buf, pid, framenum);
+}
+
 // -------------------------------------------------------------------------
 // usbPktGen (for DATAx)
 //
+// Generates a DATAx packet, with the payload length checked against the
+// current (run time selected) line speed. Code with a fixed line speed
+// uses usbPktGen<SPEED>(), where the check is against a constant.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktGen(usbModel::usb_line_buf_t &buf, const int pid, const uint8_t data[], const unsigned len)
+{
+    switch (currspeed)
+    {
+    case usbModel::usb_speed_e::LS:
+        return usbPktGen<usbModel::usb_speed_ls_t>(buf, pid, data, len);
+    case usbModel::usb_speed_e::HS:
+        return usbPktGen<usbModel::usb_speed_hs_t>(buf, pid, data, len);
+    default:
+        return usbPktGen<usbModel::usb_speed_fs_t>(buf, pid, data, len);
+    }
+}
+
+// -------------------------------------------------------------------------
+// pktGenData
+//
 // Generates a DATAx packet, as specified by pid,
-// and places it in buf[]. It will return usbModel::USBERROR if the
+// and places it in buf. It will return usbModel::USBERROR if the
 // pid is not a valid type for this packet, or if NRZI encoding
-// failed.
+// failed. The payload length has already been checked.
+//
+// The packet is encoded in a single pass directly from data[], with
+// the CRC16 calculated as the payload is NRZI encoded, and only the
+// line image written.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint8_t data[], const unsigned len)
+int usbPkt::pktGenData(usbModel::usb_line_buf_t &buf, const int pid, const uint8_t data[], const unsigned len)
 {
-    int idx = 0;
-
     USBDEVDEBUG("<=> genUsbPkt: pid=0x%x len=%d\n", pid, len);
 
     // Validate PID for this type of packet
@@ -535,183 +751,195 @@ int usbPkt::usbPktGen(usbModel::usb_signal_t buf[], const int pid, const uint8_t
     case usbModel::PID_DATA_M:
         break;
     default:
-        USBERRMSG("genUsbPkt: Bad PID (0x%x) seen for data packet generation.\n", pid);
+        USBERRMSG(usbModel::USBERR_PID, "genUsbPkt: Bad PID (0x%x) seen for data packet generation.\n", pid);
         return usbModel::USBERROR;
     }
 
-    // Validate length
-    switch (currspeed)
+    uint8_t  pidbyte = pid | ((~pid & 0xf) << 4);
+    unsigned crc     = usbCrc::CRC16INIT;
+
+    // A byte parallel packet is the PID, payload and CRC bytes, with their
+    // complement in dm, terminated with an SE0 byte
+    if (rawmode)
     {
-    case usbModel::usb_speed_e::LS:
-        if (len > 8)
-        {
-            USBERRMSG("genUsbPkt: Invalid data length for low speed (%d).\n", len);
-            return usbModel::USBERROR;
-        }
-        break;
-    case usbModel::usb_speed_e::FS:
-        if (len > 64)
-        {
-            USBERRMSG("genUsbPkt: Invalid data length for fast speed (%d).\n", len);
-            return usbModel::USBERROR;
-        }
-        break;
-    case usbModel::usb_speed_e::HS:
-        if (len > 512)
+        int bidx = 0;
+
+        buf.setByte(bidx++, pidbyte, ~pidbyte);
+
+        for (unsigned byte = 0; byte < len; byte++)
         {
-            USBERRMSG("genUsbPkt: Invalid data length for high speed (%d).\n", len);
-            return usbModel::USBERROR;
+            crc = usbCrc::crc16Byte(crc, data[byte]);
+            buf.setByte(bidx++, data[byte], ~data[byte]);
         }
-        break;
+
+        crc = ~crc & 0xffff;
+
+        buf.setByte(bidx++, crc & 0xff,        ~crc & 0xff);
+        buf.setByte(bidx++, (crc >> 8) & 0xff, (~crc >> 8) & 0xff);
+        buf.setByte(bidx,   0, 0);
+
+        return bidx * usbModel::NRZI_BITSPERBYTE;
     }
 
-    // SOP/Sync
-    rawbuf[idx].dp = usbModel::SYNC;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
-    idx++;
+    usbNrziEnc enc(buf.dp, buf.dm);
 
-    // PID
-    rawbuf[idx].dp = pid | ((~pid & 0xf) << 4);
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
-    idx++;
+    // SOP/Sync and PID
+    enc.put(usbModel::SYNC);
+    enc.put(pidbyte);
 
-    // Payload
-    for (unsigned byte = 0; byte < len; byte++)
+    // Payload, NRZI encoded directly from data[], with the CRC16 calculated
+    // in the same pass
+    unsigned byte = 0;
+
+#ifdef __PCLMUL__
+    if (len >= usbCrc::CLMULMINBYTES)
     {
-        rawbuf[idx].dp = data[byte];
-        rawbuf[idx].dm = ~rawbuf[idx].dp;
-        idx++;
+        for (; (byte + 8) <= len; byte += 8)
+        {
+            uint64_t bytes;
+
+            memcpy(&bytes, &data[byte], sizeof(bytes));
+
+            crc = usbCrc::crc16Clmul(crc, bytes);
+
+            for (int idx = 0; idx < 8; idx++)
+            {
+                enc.put(data[byte + idx]);
+            }
+        }
     }
+#endif
 
-    // CRC16 over data
-    unsigned crc = usbcrc16(&rawbuf[2], len);
+    for (; byte < len; byte++)
+    {
+        crc = usbCrc::crc16Byte(crc, data[byte]);
+        enc.put(data[byte]);
+    }
 
-    USBDEVDEBUG("    ");
-    for (int i = 0; i < len; i++)
-        USBDEVDEBUG("%02x ", rawbuf[i+2].dp);
-    USBDEVDEBUG("\n    crc=0x%04x\n", crc);
+    crc = ~crc & 0xffff;
 
-    rawbuf[idx].dp = crc & 0xff;
-    rawbuf[idx].dm = ~rawbuf[idx].dp;
-    idx++;
+    if (usbModel::usbLog::enabled(USBLOGCOMP, usbModel::usbLog::LOG_DEBUG))
+    {
+        USBDEVDEBUG("    ");
+        for (unsigned i = 0; i < len; i++)
+            USBDEVDEBUG("%02x ", data[i]);
+        USBDEVDEBUG("\n    crc=0x%04x\n", crc);
+    }
 
-    rawbuf[idx].dp = (crc >> 8) & 0xff;
-    rawbuf[idx].dm = ~buf[idx].dp;
-    idx++;
+    // CRC16 and EOP
+    enc.put(crc & 0xff);
+    enc.put((crc >> 8) & 0xff);
 
-    // NRZI encode with bit stuffing and EOP
-    return nrziEnc(rawbuf, buf, idx);
+    return enc.finish();
 }
 
 
 // -------------------------------------------------------------------------
 // usbPktDecode
 //
-// Decodes a received NRZI packet (in nrzibuf[]), returing the PID in pid,
-// and other extracted values in args[] (the number of arguments dependant
-// on the packet type. The data (if any) is placed in data[] and the length
-// (in bytes) of this data returned in databytes.
+// Decodes a received NRZI packet (in nrzibuf[]), returning the PID,
+// the other extracted values in args[] (the number of arguments dependant
+// on the packet type), and the status, in a usbPktResult_t. The data (if
+// any) is placed in data[], which must have room for usbModel::MAXBUFSIZE
+// bytes, and the length (in bytes) of this data returned in databytes.
+//
+// The packet is decoded in a single pass of nrziDec, with the PID
+// checked against a lookup table, and data packet bytes stored in a
+// scratch buffer and added to the CRC16 as they are decoded. The payload
+// is copied to data[] only when the packet is good.
 //
-// The method returns usbModel::USBERROR if NRZI decoding fails, if
-// the PID field upper bits not inverse of lower bits, CRC checks fail,
-// or the PID is invalid. If the PID is valid but not yet supported, then
+// The status is usbModel::USBERROR if NRZI decoding fails, if the PID
+// field upper bits not inverse of lower bits, CRC checks fail, or the PID
+// is invalid. If the PID is valid but not yet supported, then
 // usbModel::USBUNSUPPORTED is returned. If decoding was error free then
 // usbModel::USBOK is returned.
 //
 // -------------------------------------------------------------------------
 
-int usbPkt::usbPktDecode(const usbModel::usb_signal_t nrzibuf[], int& pid, uint32_t args[], uint8_t data[], int &databytes)
+usbPkt::usbPktResult_t usbPkt::usbPktDecode(const usbModel::usb_line_buf_t &nrzibuf, uint8_t data[])
 {
-    int     crc;
-    int     idx;
-    uint8_t addr;
-    uint8_t endp;
+    pktDecSink_t   pkt    = {decbuf, {0}, 0, false, usbCrc::CRC16INIT, 0, data};
 
+    // NRZI decode
+    int bitcnt = nrziDec(nrzibuf, pkt);
 
-    // Default data length is zero
-    databytes = 0;
+    return pktDecResult(pkt, bitcnt);
+}
 
-    // NRZI decode
-    int bitcnt = nrziDec(nrzibuf, rawbuf);
+// -------------------------------------------------------------------------
+// pktDecResult
+//
+// Checks and extracts the fields of a packet from its decoded bytes
+// (in pkt) and the bit count from the NRZI decode (bitcnt), returning
+// the usbPktDecode() result.
+//
+// -------------------------------------------------------------------------
+
+usbPkt::usbPktResult_t usbPkt::pktDecResult(const pktDecSink_t &pkt, const int bitcnt)
+{
+    usbPktResult_t result = {usbModel::USBERROR, usbModel::PID_INVALID, 0, {0}};
+    uint32_t*      args   = result.args;
+    uint8_t*       data   = pkt.data;
+    int            crc;
+    uint8_t        addr;
+    uint8_t        endp;
 
     if (bitcnt < usbModel::MINPKTSIZEBITS)
     {
-        USBERRMSG("%sdecodePkt: Invalid bit count returned from nrziDec (%d).\n", errbuf, bitcnt);
+        USBERRMSG(usbModel::USBERR_BADPKT, "decodePkt: Invalid bit count returned from nrziDec (%d).\n", bitcnt);
 
-        return usbModel::USBERROR;
+        return result;
     }
 
     // Extract PID
-    pid = rawbuf[usbModel::PIDBYTEOFFSET].dp & 0xf;
-    uint8_t pidchk = (~rawbuf[usbModel::PIDBYTEOFFSET].dp >> 4) & 0xf;
+    int pid    = pkt.hdr[usbModel::PIDBYTEOFFSET] & 0xf;
+    result.pid = pid;
 
-    // Check PID inverse is in top bits
-    if (pid != pidchk)
+    switch (usbPidGen::pidTab::data[pkt.hdr[usbModel::PIDBYTEOFFSET]])
     {
-        USBERRMSG("decodePkt: Invalid PID. Top nibble is not the inverse of bottom nibble (0x%02x).\n", rawbuf[usbModel::PIDBYTEOFFSET].dp);
-        return usbModel::USBERROR;
-    }
-
-    switch (pid)
-    {
-    case usbModel::PID_HSHK_ACK:
-        USBDISPPKT("  %s RX HNDSHK:  ACK\n", name.c_str());
-        break;
-    case usbModel::PID_HSHK_NAK:
-        USBDISPPKT("  %s RX HNDSHK:  NAK\n", name.c_str());
-        break;
-    case usbModel::PID_HSHK_STALL:
-        USBDISPPKT("  %s RX HNDSHK:  STALL\n", name.c_str());
-        break;
-    case usbModel::PID_HSHK_NYET:
-        USBDISPPKT("  %s RX HNDSHK:  NYET\n", name.c_str());
+    // PID inverse not in top bits
+    case usbPidGen::PIDBAD:
+        USBERRMSG(usbModel::USBERR_PID, "decodePkt: Invalid PID. Top nibble is not the inverse of bottom nibble (0x%02x).\n", pkt.hdr[usbModel::PIDBYTEOFFSET]);
+        return result;
+
+    case usbPidGen::PIDHSHK:
+        USBDISPPKT("  %s RX HNDSHK:  %s\n", name.c_str(), pid == usbModel::PID_HSHK_ACK   ? "ACK"   :
+                                                           pid == usbModel::PID_HSHK_NAK   ? "NAK"   :
+                                                           pid == usbModel::PID_HSHK_STALL ? "STALL" :
+                                                                                             "NYET");
         break;
 
-    case usbModel::PID_TOKEN_OUT:
-    case usbModel::PID_TOKEN_IN:
-    case usbModel::PID_TOKEN_SETUP:
-        args[usbModel::ARGADDRIDX]    = rawbuf[usbModel::ADDRBYTEOFFSET].dp & 0x7f;
-        args[usbModel::ARGENDPIDX]    = (rawbuf[usbModel::ENDPBYTEOFFSET].dp >> 7) | ((rawbuf[usbModel::ENDPBYTEOFFSET+1].dp & 0x7) << 1);
-        args[usbModel::ARGTKNCRC5IDX] = rawbuf[usbModel::CRC5BYTEOFFSET].dp >> 3;
+    case usbPidGen::PIDTOKEN:
+        args[usbModel::ARGADDRIDX]    = pkt.hdr[usbModel::ADDRBYTEOFFSET] & 0x7f;
+        args[usbModel::ARGENDPIDX]    = (pkt.hdr[usbModel::ENDPBYTEOFFSET] >> 7) | ((pkt.hdr[usbModel::ENDPBYTEOFFSET+1] & 0x7) << 1);
+        args[usbModel::ARGTKNCRC5IDX] = pkt.hdr[usbModel::CRC5BYTEOFFSET] >> 3;
 
         addr = args[usbModel::ARGADDRIDX];
         endp = args[usbModel::ARGENDPIDX] | ((args[usbModel::ARGENDPIDX] == 0 || pid == usbModel::PID_TOKEN_OUT) ? usbModel::DIRTODEV : usbModel::DIRTOHOST);
 
-        crc = usbcrc5(&rawbuf[usbModel::ADDRBYTEOFFSET], 2, 3);
+        crc = usbCrc::crc5Field(pkt.hdr[usbModel::ADDRBYTEOFFSET] | ((pkt.hdr[usbModel::ADDRBYTEOFFSET+1] & 0x7) << 8));
 
-        if (args[usbModel::ARGTKNCRC5IDX] != crc)
+        if (args[usbModel::ARGTKNCRC5IDX] != (uint32_t)crc)
         {
-            USBERRMSG("decodePkt: Bad CRC5 for token. Got 0x%x, expected 0x%x.\n",
+            USBERRMSG(usbModel::USBERR_CRC5, "decodePkt: Bad CRC5 for token. Got 0x%x, expected 0x%x.\n",
                 args[usbModel::ARGTKNCRC5IDX], crc);
-            return usbModel::USBERROR;
-        }
-        else if (pid == usbModel::PID_TOKEN_OUT)
-        {
-            USBDISPPKT("  %s RX TOKEN:   OUT\n    " FMT_DATA_GREY "addr=%d endp=0x%02x" FMT_NORMAL "\n",
-                name.c_str(), addr, endp);
-        }
-        else if (pid == usbModel::PID_TOKEN_IN)
-        {
-            USBDISPPKT("  %s RX TOKEN:   IN\n    " FMT_DATA_GREY "addr=%d endp=0x%02x" FMT_NORMAL "\n",
-                name.c_str(), addr, endp);
-        }
-        else
-        {
-            USBDISPPKT("  %s RX TOKEN:   SETUP\n    " FMT_DATA_GREY "addr=%d endp=0x%02x" FMT_NORMAL "\n",
-                name.c_str(), addr, endp);
+            return result;
         }
+
+        USBDISPPKT("  %s RX TOKEN:   %s\n    " FMT_DATA_GREY "addr=%d endp=0x%02x" FMT_NORMAL "\n",
+            name.c_str(), pid == usbModel::PID_TOKEN_OUT ? "OUT" : pid == usbModel::PID_TOKEN_IN ? "IN" : "SETUP", addr, endp);
         break;
 
-    case usbModel::PID_TOKEN_SOF:
-        args[usbModel::ARGFRAMEIDX]   = rawbuf[usbModel::FRAMEBYTEOFFSET].dp | (rawbuf[usbModel::FRAMEBYTEOFFSET+1].dp & 0x7) << 8;           // Frame number
-        args[usbModel::ARGSOFCRC5IDX] = rawbuf[usbModel::CRC5BYTEOFFSET].dp >> 3;                                                   // CRC5
+    case usbPidGen::PIDSOF:
+        args[usbModel::ARGFRAMEIDX]   = pkt.hdr[usbModel::FRAMEBYTEOFFSET] | (pkt.hdr[usbModel::FRAMEBYTEOFFSET+1] & 0x7) << 8;   // Frame number
+        args[usbModel::ARGSOFCRC5IDX] = pkt.hdr[usbModel::CRC5BYTEOFFSET] >> 3;                                                   // CRC5
 
-        crc = usbcrc5(&rawbuf[usbModel::FRAMEBYTEOFFSET], 2, 3);
+        crc = usbCrc::crc5Field(args[usbModel::ARGFRAMEIDX]);
 
-        if (args[usbModel::ARGSOFCRC5IDX] != crc)
+        if (args[usbModel::ARGSOFCRC5IDX] != (uint32_t)crc)
         {
-            USBERRMSG("decodePkt: Bad CRC5 for SOF. Got 0x%x, expected 0x%x.\n", args[usbModel::ARGTKNCRC5IDX], crc);
-            return usbModel::USBERROR;
+            USBERRMSG(usbModel::USBERR_CRC5, "decodePkt: Bad CRC5 for SOF. Got 0x%x, expected 0x%x.\n", args[usbModel::ARGSOFCRC5IDX], crc);
+            return result;
         }
 
         USBDISPPKT("  %s RX TOKEN:   SOF\n    " FMT_DATA_GREY "frame=%d" FMT_NORMAL "\n",
@@ -719,70 +947,263 @@ int usbPkt::usbPktDecode(const usbModel::usb_signal_t nrzibuf[], int& pid, uint3
 
         break;
 
-    case usbModel::PID_DATA_0:
-    case usbModel::PID_DATA_1:
+    case usbPidGen::PIDDATA:
+    {
         // Calulate the size of the data packet payload (total size in bytes minus SYNC, PID and CRC16)
-        databytes = (bitcnt / 8) - usbModel::DATABYTEOFFSET - 2;
+        int databytes = (bitcnt / 8) - usbModel::DATABYTEOFFSET - 2;
+
+        if (databytes < 0)
+        {
+            USBERRMSG(usbModel::USBERR_LENGTH, "decodePkt: Data packet too short for a CRC16 (%d bits).\n", bitcnt);
+            return result;
+        }
+
+        result.databytes = databytes;
 
         // Extract CRC16
-        args[usbModel::ARGCRC16IDX] = rawbuf[databytes + usbModel::DATABYTEOFFSET].dp | (rawbuf[databytes + usbModel::DATABYTEOFFSET + 1].dp << 8); // CRC16
+        args[usbModel::ARGCRC16IDX] = data[databytes] | (data[databytes + 1] << 8);
 
-        // Calculate CRC16
-        crc = usbcrc16(&rawbuf[usbModel::DATABYTEOFFSET], databytes);
+        // The CRC16 accumulated during decode covers all but the last two bytes
+        // received, which is the payload unless a partial byte was flushed
+        if (databytes == pkt.count - usbModel::DATABYTEOFFSET - 2)
+        {
+            crc = ~pkt.crc & 0xffff;
+        }
+        else
+        {
+            crc = usbcrc16(data, databytes);
+        }
 
         // Check CRCs match
-        if (crc != args[usbModel::ARGCRC16IDX])
+        if ((uint32_t)crc != args[usbModel::ARGCRC16IDX])
         {
-            USBERRMSG("decodePkt: Bad CRC16 for data packet. Got 0x%04x, expected 0x%04x.\n", args[usbModel::ARGCRC16IDX], crc);
+            USBERRMSG(usbModel::USBERR_CRC16, "decodePkt: Bad CRC16 for data packet. Got 0x%04x, expected 0x%04x.\n", args[usbModel::ARGCRC16IDX], crc);
 
-            USBDEVDEBUG("    \n");
-            for (int i = 0; i < databytes+2; i++)
-                USBDEVDEBUG("%02x ", rawbuf[usbModel::DATABYTEOFFSET+i].dp);
-            USBDEVDEBUG("\n");
+            if (usbModel::usbLog::enabled(USBLOGCOMP, usbModel::usbLog::LOG_DEBUG))
+            {
+                USBDEVDEBUG("    \n");
+                for (int i = 0; i < databytes+2; i++)
+                    USBDEVDEBUG("%02x ", data[i]);
+                USBDEVDEBUG("\n");
+            }
 
-            return usbModel::USBERROR;
+            return result;
         }
 
         // Copy validated memory to output buffer
-        USBDISPPKT("  %s RX DATA:    %s%s", name.c_str(), pid == usbModel::PID_DATA_0 ? "DATA0" : "DATA1", databytes ? "" : " (zero length)");
+        if (pkt.out != NULL && pkt.out != data)
+        {
+            memcpy(pkt.out, data, databytes);
+        }
 
-        for (idx = 0; idx < databytes; idx++)
+#ifndef DISABLEUSBDISPPKT
+        // Display the payload a line of 16 bytes at a time, formatting
+        // the lines only if they will be displayed
+        if (usbModel::usbLog::enabled(USBLOGCOMP, usbModel::usbLog::LOG_INFO))
         {
-            data[idx] = rawbuf[usbModel::DATABYTEOFFSET+idx].dp;
+            USBDISPPKT("  %s RX DATA:    %s%s", name.c_str(), pid == usbModel::PID_DATA_0 ? "DATA0" : "DATA1", databytes ? "" : " (zero length)");
+
+            for (int idx = 0; idx < databytes; idx += 16)
+            {
+                char line[16*3 + 1];
+                int  len = 0;
+
+                for (int byte = idx; byte < databytes && byte < (idx + 16); byte++)
+                {
+                    len += sprintf(&line[len], " %02x", data[byte]);
+                }
+
+                USBDISPPKT(FMT_DATA_GREY "\n   %s", line);
+            }
 
-            if ((idx % 16) == 0)
+            if (databytes % 16 != 1)
             {
-                USBDISPPKT(FMT_DATA_GREY "\n   ");
+                USBDISPPKT(FMT_NORMAL "\n");
+            }
+            else
+            {
+                USBDISPPKT(FMT_NORMAL);
             }
-            USBDISPPKT(" %02x", data[idx]);
         }
+#endif
 
-        if (idx % 16 != 1)
-        {
-            USBDISPPKT(FMT_NORMAL "\n");
-        }
-        else
+        break;
+    }
+
+    case usbPidGen::PIDUNSUPPORTED:
+        USBERRMSG(usbModel::USBERR_UNSUPPORTED, "decodePkt: Unsupported packet type (0x%x)\n", pid);
+        result.status = usbModel::USBUNSUPPORTED;
+        return result;
+
+    default:
+        USBERRMSG(usbModel::USBERR_UNSUPPORTED, "decodePkt: Unrecognised packet type (0x%x)\n", pid);
+        return result;
+    }
+
+    result.status = usbModel::USBOK;
+
+    return result;
+}
+
+// -------------------------------------------------------------------------
+// usbPktRxStart
+//
+// Starts an incremental decode of a packet, with any data placed in
+// data[], which must have room for usbModel::MAXBUFSIZE bytes.
+//
+// -------------------------------------------------------------------------
+
+void usbPkt::usbPktRxStart(uint8_t data[])
+{
+    pktDecSink_t pkt = {decbuf, {0}, 0, false, usbCrc::CRC16INIT, 0, data};
+
+    rxpkt = pkt;
+    rxdec = usbNrziDec<pktDecSink_t>(&rxpkt);
+
+    // Raw packets have no SYNC, so add one as for nrziDec()
+    if (rawmode)
+    {
+        rxpkt.put(usbModel::SYNC);
+    }
+}
+
+// -------------------------------------------------------------------------
+// usbPktRxPut
+//
+// Adds the next nsamples (1 to 64) line samples of the packet being
+// decoded, from dp and dm, returning the NRZI decoder state (see
+// usbNrzi.h). Decoding stops at the end of the packet, or at an error,
+// and any further samples are ignored.
+//
+// In raw mode each byte takes 8 samples, with the byte in dp and its
+// complement in dm, and the end of the packet is an SE0 entry or the
+// last sample.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktRxPut(const uint64_t dp, const uint64_t dm, const unsigned nsamples)
+{
+    if (!rawmode)
+    {
+        return rxdec.put(dp, dm, nsamples);
+    }
+
+    for (unsigned sample = 0; sample < nsamples; sample += usbModel::NRZI_BITSPERBYTE)
+    {
+        uint8_t bytep = (dp >> sample) & 0xff;
+        uint8_t bytem = (dm >> sample) & 0xff;
+
+        if (bytep == bytem || rxpkt.count > usbModel::MAXBUFSIZE)
         {
-            USBDISPPKT(FMT_NORMAL);
+            return usbNrzi::DECDONE;
         }
 
-        break;
+        rxpkt.put(bytep);
+    }
 
-    // Unsupported
-    case usbModel::PID_TOKEN_ERR:
-    case usbModel::PID_TOKEN_SPLIT:
-    case usbModel::PID_TOKEN_PING:
-    case usbModel::PID_DATA_2:
-    case usbModel::PID_DATA_M:
-        USBERRMSG("decodePkt: Unsupported packet type (0x%x)\n", pid);
-        return usbModel::USBUNSUPPORTED;
-        break;
+    return usbNrzi::DECACTIVE;
+}
 
-    default:
-        USBERRMSG("decodePkt: Unrecognised packet type (0x%x)\n", pid);
-        return usbModel::USBERROR;
-        break;
+// -------------------------------------------------------------------------
+// usbPktRxPid
+//
+// Returns the PID of the packet being decoded, once its PID byte has
+// been decoded, else usbModel::PID_INVALID. A PID byte whose top nibble
+// is not the inverse of the bottom nibble also gives PID_INVALID.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktRxPid(void)
+{
+    uint8_t pidbyte = rxpkt.hdr[usbModel::PIDBYTEOFFSET];
+
+    if (rxpkt.count <= usbModel::PIDBYTEOFFSET || usbPidGen::pidTab::data[pidbyte] == usbPidGen::PIDBAD)
+    {
+        return usbModel::PID_INVALID;
+    }
+
+    return pidbyte & 0xf;
+}
+
+// -------------------------------------------------------------------------
+// usbPktRxToken
+//
+// Returns true, with the address and endpoint (without the direction),
+// once the fields of a token packet being decoded have been received
+// with a good CRC5, else returns false.
+//
+// -------------------------------------------------------------------------
+
+bool usbPkt::usbPktRxToken(uint8_t &addr, uint8_t &endp)
+{
+    const uint8_t* hdr   = rxpkt.hdr;
+    unsigned       field = hdr[usbModel::ADDRBYTEOFFSET] | ((hdr[usbModel::ADDRBYTEOFFSET+1] & 0x7) << 8);
+
+    if (rxpkt.count < DECHDRBYTES || usbPidGen::pidTab::data[hdr[usbModel::PIDBYTEOFFSET]] != usbPidGen::PIDTOKEN ||
+        usbCrc::crc5Field(field) != (unsigned)(hdr[usbModel::CRC5BYTEOFFSET] >> 3))
+    {
+        return false;
+    }
+
+    addr = field & 0x7f;
+    endp = field >> 7;
+
+    return true;
+}
+
+// -------------------------------------------------------------------------
+// usbPktRxEnd
+//
+// Completes an incremental decode, returning the result as for
+// usbPktDecode().
+//
+// -------------------------------------------------------------------------
+
+usbPkt::usbPktResult_t usbPkt::usbPktRxEnd(void)
+{
+    int bitcnt;
+
+    if (!rawmode)
+    {
+        bitcnt = nrziDecStatus(rxdec);
+    }
+    else if (rxpkt.count > usbModel::MAXBUFSIZE)
+    {
+        USBERRMSG(usbModel::USBERR_NRZI, "nrziDec: raw packet has no terminating SE0\n");
+        bitcnt = usbModel::USBERROR;
+    }
+    else
+    {
+        bitcnt = rxpkt.count * usbModel::NRZI_BITSPERBYTE;
+    }
+
+    return pktDecResult(rxpkt, bitcnt);
+}
+
+// -------------------------------------------------------------------------
+// usbPktDecode
+//
+// Decodes a received NRZI packet (in nrzibuf[]), returing the PID in pid,
+// and other extracted values in args[] (the number of arguments dependant
+// on the packet type. The data (if any) is placed in data[] and the length
+// (in bytes) of this data returned in databytes.
+//
+// Returns the status of the decode, as for the usbPktResult_t version
+// above.
+//
+// -------------------------------------------------------------------------
+
+int usbPkt::usbPktDecode(const usbModel::usb_line_buf_t &nrzibuf, int& pid, uint32_t args[], uint8_t data[], int &databytes)
+{
+    usbPktResult_t result = usbPktDecode(nrzibuf, data);
+
+    pid       = result.pid;
+    databytes = result.databytes;
+
+    for (int idx = 0; idx < usbModel::MAXNUMARGS; idx++)
+    {
+        args[idx] = result.args[idx];
     }
 
-    return usbModel::USBOK;
+    return result.status;
 }
@@ -24,34 +24,125 @@
 //=============================================================
 
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 #include "usbCommon.h"
 #include "usbFormat.h"
+#include "usbNrzi.h"
 
 #ifndef _USBPKT_H_
 #define _USBPKT_H_
 
 class usbPkt
 {
+#ifdef USBPKTBENCH
+    // The codec benchmark (model/bench) times the internal methods directly
+    friend class usbPktBench;
+#endif
+
 public:
 
     //-------------------------------------------------------------
     // Constructor
     //-------------------------------------------------------------
     
-    usbPkt(std::string _name = "ENDP") : rawbuf(), errbuf{ 0 }
+    usbPkt(std::string _name = "ENDP") : errhist(), errcount(0), rawbuf(), rawmode(false), rxpkt()
     {
         name = _name;
+        usbModel::usbLog::init();
         reset();
+        pktCacheBuild();
+    }
+
+    virtual ~usbPkt() {}
+
+    //-------------------------------------------------------------
+    // Error history. The last ERRHISTORY errors are held as
+    // records (see usbCommon.h), with idx 0 the most recent, and
+    // usbPktGetErr() returns NULL for one not held.
+    // usbPktErrCount() is the number recorded since constructed
+    // or cleared.
+    //-------------------------------------------------------------
+
+    static const int ERRHISTORY = 16;
+
+    unsigned     usbPktErrCount (void) const
+    {
+        return errcount;
+    }
+
+    const usbModel::usb_err_record_t* usbPktGetErr (const unsigned idx = 0) const
+    {
+        if (idx >= errcount || idx >= (unsigned)ERRHISTORY)
+        {
+            return NULL;
+        }
+
+        return &errhist[(errcount - 1 - idx) % ERRHISTORY];
+    }
+
+    void         usbPktClearErrs (void)
+    {
+        errcount = 0;
+    }
+
+    //-------------------------------------------------------------
+    // Render an error record's message into buf, returning its
+    // length
+    //-------------------------------------------------------------
+
+    int          usbPktFmtErr (const usbModel::usb_err_record_t &err, char* buf, const int size) const
+    {
+        usbModel::usb_log_record_t rec = {USBLOGCOMP, usbModel::usbLog::LOG_INFO, err.fmt, err.nargs, {}};
+
+        for (int adx = 0; adx < err.nargs; adx++)
+        {
+            rec.args[adx].type = usbModel::usb_log_arg_t::INT;
+            rec.args[adx].i    = err.args[adx];
+        }
+
+        return usbModel::usbLog::format(rec, buf, size);
+    }
+
+    //-------------------------------------------------------------
+    // Render the last error message, followed by its cause when a
+    // packet failed to decode (USBERR_BADPKT), or an empty string
+    // if there is no error
+    //-------------------------------------------------------------
+
+    std::string  usbPktErrStr (void) const
+    {
+        std::string                       str;
+        char                              buf[ERRSTRSIZE];
+        const usbModel::usb_err_record_t* err = usbPktGetErr(0);
+
+        for (unsigned idx = 1; err != NULL; idx++)
+        {
+            usbPktFmtErr(*err, buf, ERRSTRSIZE);
+            str += buf;
+
+            const usbModel::usb_err_record_t* cause = usbPktGetErr(idx);
+
+            // A cause is recorded at the same tick, just before
+            if (err->code != usbModel::USBERR_BADPKT || cause == NULL || cause->tick != err->tick)
+            {
+                break;
+            }
+
+            err = cause;
+        }
+
+        return str;
     }
 
     //-------------------------------------------------------------
-    // Return last error message
+    // Return last error message, as rendered by usbPktErrStr(),
+    // into a buffer of usbModel::ERRBUFSIZE bytes
     //-------------------------------------------------------------
     void usbPktGetErrMsg(char* msg)
     {
-        sprintf(msg, "%s", errbuf);
+        snprintf(msg, usbModel::ERRBUFSIZE, "%s", usbPktErrStr().c_str());
     }
 
 protected:
@@ -59,16 +150,63 @@ protected:
     // Packet generation methods
     //-------------------------------------------------------------
     
-    int          usbPktGen    (usbModel::usb_signal_t nrzibuf[], const int pid);                                              // Handshake
-    int          usbPktGen    (usbModel::usb_signal_t nrzibuf[], const int pid, const uint8_t  addr,   const uint8_t endp);   // Token
-    int          usbPktGen    (usbModel::usb_signal_t nrzibuf[], const int pid, const uint16_t framenum);                     // SOF
-    int          usbPktGen    (usbModel::usb_signal_t nrzibuf[], const int pid, const uint8_t  data[], const unsigned len);   // Data
+    int          usbPktGen    (usbModel::usb_line_buf_t &nrzibuf, const int pid);                                              // Handshake
+    int          usbPktGen    (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint8_t  addr,   const uint8_t endp);   // Token
+    int          usbPktGen    (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint16_t framenum);                     // SOF
+    int          usbPktGen    (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint8_t  data[], const unsigned len);   // Data
+
+    //-------------------------------------------------------------
+    // Data packet generation for a fixed line speed, with the
+    // payload limit of the SPEED policy (see usbCommon.h)
+    //-------------------------------------------------------------
+
+    template<class SPEED>
+    int          usbPktGen    (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint8_t  data[], const unsigned len)
+    {
+        if (len > SPEED::MAXPAYLOAD)
+        {
+            USBERRMSG(usbModel::USBERR_LENGTH, "genUsbPkt: Invalid data length (%d, maximum %d).\n", len, SPEED::MAXPAYLOAD);
+            return usbModel::USBERROR;
+        }
+
+        return pktGenData(nrzibuf, pid, data, len);
+    }
 
     //-------------------------------------------------------------
-    // Packet decode method
+    // Result of a packet decode. The args[] fields are as for the
+    // PID (see usbCommon.h), and databytes is the length of any
+    // data packet payload
+    //-------------------------------------------------------------
+
+    struct usbPktResult_t
+    {
+        int          status;
+        int          pid;
+        int          databytes;
+        uint32_t     args[usbModel::MAXNUMARGS];
+    };
+
+    //-------------------------------------------------------------
+    // Packet decode methods
     //-------------------------------------------------------------
     
-    int          usbPktDecode (const usbModel::usb_signal_t nrzibuf[], int& pid, uint32_t args[], uint8_t data[], int &databytes);
+    usbPktResult_t usbPktDecode (const usbModel::usb_line_buf_t &nrzibuf, uint8_t data[]);
+    int          usbPktDecode (const usbModel::usb_line_buf_t &nrzibuf, int& pid, uint32_t args[], uint8_t data[], int &databytes);
+
+    //-------------------------------------------------------------
+    // Incremental packet decode methods. A decode is started with
+    // usbPktRxStart(), and the packet's line samples passed in,
+    // in order, with usbPktRxPut() as they are received (in raw
+    // mode, samples are the bytes of usb_line_buf_t). The PID and
+    // token fields are available as soon as they are decoded, and
+    // usbPktRxEnd() completes the decode, as for usbPktDecode().
+    //-------------------------------------------------------------
+
+    void         usbPktRxStart (uint8_t data[]);
+    int          usbPktRxPut   (const uint64_t dp, const uint64_t dm, const unsigned nsamples);
+    int          usbPktRxPid   (void);
+    bool         usbPktRxToken (uint8_t &addr, uint8_t &endp);
+    usbPktResult_t usbPktRxEnd (void);
 
     //-------------------------------------------------------------
     // Force reset of internal state
@@ -79,23 +217,153 @@ protected:
         currspeed = usbModel::usb_speed_e::FS;
     }
 
+    //-------------------------------------------------------------
+    // Select the line speed for data packets generated with the
+    // run time speed usbPktGen()
+    //-------------------------------------------------------------
+
+    void         usbPktSetSpeed (const usbModel::usb_speed_e speed)
+    {
+        currspeed = speed;
+    }
+
+    //-------------------------------------------------------------
+    // Select raw packets for a byte parallel (UTMI) interface,
+    // with bytes (PID onwards) in dp and their complement in dm,
+    // terminated by an SE0 entry, and no SYNC, NRZI, bit stuffing
+    // or EOP
+    //-------------------------------------------------------------
+
+    void         usbPktSetRaw (const bool raw)
+    {
+        if (raw != rawmode)
+        {
+            rawmode = raw;
+            pktCacheBuild();
+        }
+    }
+
+    //-------------------------------------------------------------
+    // Record an error in the history (see USBERRMSG in
+    // usbFormat.h), with up to MAXERRARGS integer arguments
+    //-------------------------------------------------------------
+
+    template<class... ARGS> void usbPktErr (const int code, const char* site, const char* fmt, ARGS... args)
+    {
+        static_assert(sizeof...(ARGS) <= usbModel::MAXERRARGS, "USBERRMSG: too many arguments");
+        static_assert(errArgsOk<ARGS...>::value, "USBERRMSG: arguments must be integers");
+
+        usbModel::usb_err_record_t &err    = errhist[errcount++ % ERRHISTORY];
+        int64_t                     vals[] = {(int64_t)args..., 0};
+
+        err.code  = code;
+        err.site  = site;
+        err.fmt   = fmt;
+        err.nargs = sizeof...(ARGS);
+        err.tick  = usbPktTick();
+
+        for (int adx = 0; adx < err.nargs; adx++)
+        {
+            err.args[adx] = vals[adx];
+        }
+    }
+
+    //-------------------------------------------------------------
+    // Simulation clock count, for error records. Overridden by
+    // classes with access to the simulation, with a count already
+    // to hand (called for every error recorded).
+    //-------------------------------------------------------------
+
+    virtual uint64_t usbPktTick (void)
+    {
+        return 0;
+    }
+
      //-------------------------------------------------------------
      // Protected state
      //-------------------------------------------------------------
      
-    // Buffer for error messages
-    char         errbuf[usbModel::ERRBUFSIZE];
+    // Error history, with the total number recorded
+    usbModel::usb_err_record_t errhist[ERRHISTORY];
+    unsigned     errcount;
+
+    // usbLog component for messages from this class
+    static const int USBLOGCOMP = usbModel::usbLog::LOG_PKT;
 
     // Formatted output display name string
     std::string name;
 
 private:
+
+    // Rendered size limit of an error record's message
+    static const int ERRSTRSIZE = 512;
+
+    template<class... T> struct errArgsOk : std::true_type {};
+
+    template<class T, class... REST> struct errArgsOk<T, REST...> :
+        std::integral_constant<bool, (std::is_integral<T>::value || std::is_enum<T>::value) && errArgsOk<REST...>::value> {};
+
+    //-------------------------------------------------------------
+    // An encoded packet image, as generated into the first word
+    // of a line buffer. Cached packets are all short enough to
+    // fit in the one word. A bit count of zero marks an image
+    // not yet built.
+    //-------------------------------------------------------------
+
+    struct pktImage_t
+    {
+        uint64_t dp;
+        uint64_t dm;
+        int      bits;
+    };
+
+    //-------------------------------------------------------------
+    // Receiver for the bytes of a packet as nrziDec decodes them.
+    // The SYNC, PID and token/SOF field bytes are kept in hdr[],
+    // whilst data packet bytes after the PID go straight to data[]
+    // (a scratch buffer), with the CRC16 accumulated as they
+    // arrive. The payload is copied to out[], the caller's buffer,
+    // only once the CRC16 is checked.
+    //-------------------------------------------------------------
+
+    static const int DECHDRBYTES = 4;
+
+    struct pktDecSink_t
+    {
+        uint8_t*     data;
+        uint8_t      hdr[DECHDRBYTES];
+        int          count;
+        bool         isdata;
+        unsigned     crc;
+        unsigned     lag;
+        uint8_t*     out;
+
+        void         put (const uint8_t byte);
+    };
+
+    //-------------------------------------------------------------
+    // Uncached packet generation methods
+    //-------------------------------------------------------------
+
+    int          pktGenHshk   (usbModel::usb_line_buf_t &nrzibuf, const int pid);
+    int          pktGenToken  (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint8_t  addr,   const uint8_t endp);
+    int          pktGenSof    (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint16_t framenum);
+    int          pktGenData   (usbModel::usb_line_buf_t &nrzibuf, const int pid, const uint8_t  data[], const unsigned len);
+
+    //-------------------------------------------------------------
+    // Encoded packet cache methods
+    //-------------------------------------------------------------
+
+    void         pktCacheBuild (void);
+    void         pktCacheSave  (pktImage_t &image, const usbModel::usb_line_buf_t &nrzibuf, const int bits);
+    int          pktCacheLoad  (const pktImage_t &image, usbModel::usb_line_buf_t &nrzibuf);
+
     //-------------------------------------------------------------
     // CRC generation methods
     //-------------------------------------------------------------
     
-    int          usbcrc16(const usbModel::usb_signal_t data[], const unsigned len = 1, const unsigned crcinit = 0xffff);
-    int          usbcrc5 (const usbModel::usb_signal_t data[], const unsigned len = 1, const int      endbits = 8, const unsigned crcinit = 0x1f);
+    int          usbcrc16(const uint8_t data[], const unsigned len = 1, const unsigned crcinit = 0xffff);
+    int          usbcrc5 (const uint8_t data[], const unsigned len = 1, const int      endbits = 8, const unsigned crcinit = 0x1f);
 
     //-------------------------------------------------------------
     // Bit reversal utility method
@@ -107,34 +375,60 @@ private:
     // NRZI methods
     //-------------------------------------------------------------
     
-    int          nrziEnc (const usbModel::usb_signal_t raw[],  usbModel::usb_signal_t   nrzi[],  const unsigned len, const int start = 1);
-    int          nrziDec (const usbModel::usb_signal_t nrzi[], usbModel::usb_signal_t   raw[],   const int start = 1);
+    int          nrziEnc (const uint8_t raw[],                    usbModel::usb_line_buf_t &nrzi, const unsigned len, const int start = 1);
+    int          nrziDec (const usbModel::usb_line_buf_t &nrzi,   pktDecSink_t             &out,   const int start = 1);
+    int          nrziDecStatus (const usbNrziDec<pktDecSink_t> &dec);
+
+    //-------------------------------------------------------------
+    // Decode result from the bytes of a decoded packet
+    //-------------------------------------------------------------
+
+    usbPktResult_t pktDecResult (const pktDecSink_t &pkt, const int bitcnt);
 
     //-------------------------------------------------------------
     // Debug method to return differential signal state as
     // printable character: K, J, SE0 (0) or SE1 (1)
     //-------------------------------------------------------------
     
-    char bitenc(usbModel::usb_signal_t raw, const int bit)
+    char bitenc(const usbModel::usb_line_buf_t &nrzi, const int sample)
     {
-        uint8_t se = ~(raw.dp ^ raw.dm);
+        int dp = (nrzi.dp[sample / usbModel::LINEBUFWORDSAMPLES] >> (sample % usbModel::LINEBUFWORDSAMPLES)) & 1;
+        int dm = (nrzi.dm[sample / usbModel::LINEBUFWORDSAMPLES] >> (sample % usbModel::LINEBUFWORDSAMPLES)) & 1;
 
-        return ((se &  raw.dp) & (1 << bit)) ? '1' :
-               ((se & ~raw.dp) & (1 << bit)) ? '0' :
-               (raw.dp         & (1 << bit)) ? 'J' :
-                                               'K';
+        return (dp == dm) ? (dp ? '1' : '0') :
+               dp         ? 'J'              :
+                            'K';
     }
     
     //-------------------------------------------------------------
     // Internal private state
     //-------------------------------------------------------------
 
-    // Internal buffer for constructing raw, non-NRZI encoded packets
-    usbModel::usb_signal_t rawbuf [usbModel::MAXBUFSIZE];
+    // Internal buffer for constructing raw, non-NRZI encoded handshake,
+    // token and SOF packets (data packets are encoded straight from the
+    // caller's buffer), sized for SYNC, PID and the two field bytes
+    uint8_t                rawbuf [DECHDRBYTES];
 
     // State of current line seed
     usbModel::usb_speed_e  currspeed;
 
+    // Raw (non-NRZI) packet mode
+    bool                   rawmode;
+
+    // Decoded data packet bytes, before the CRC16 is checked
+    uint8_t                  decbuf [usbModel::MAXBUFSIZE];
+
+    // Incremental decode state
+    pktDecSink_t             rxpkt;
+    usbNrziDec<pktDecSink_t> rxdec;
+
+    // Encoded packet cache. Handshakes are indexed by PID, and SOFs by
+    // the 11 bit frame number field. Tokens are cached on first use,
+    // indexed by address, then PID and endpoint (see pktCacheBuild()).
+    pktImage_t              hshkcache [usbModel::NUMPIDS];
+    std::vector<pktImage_t> sofcache;
+    std::vector<pktImage_t> tokcache  [usbModel::MAXDEVADDR+1];
+
 };
 
 #endif
@@ -27,6 +27,9 @@
 #include "usbCommon.h"
 #include "usbFormat.h"
 #include "usbMap.h"
+#include "usbLineBackend.h"
+#include "usbNrzi.h"
+#include "usbPcap.h"
 
 extern "C"
 {
@@ -41,23 +44,28 @@ class usbPliApi
 {
 public:
     static const int major_ver       = 1;
-    static const int minor_ver       = 2;
-    static const int patch_ver       = 1;
+    static const int minor_ver       = 3;
+    static const int patch_ver       = 0;
     
-    static const int ONE_US          = 12;
-    static const int ONE_MS          = ONE_US * 1000;
+    // Model timing, as for the default (full speed) speed policy
+    static const int ONE_US          = usbModel::usb_speed_fs_t::ONE_US;
+    static const int ONE_MS          = usbModel::usb_speed_fs_t::ONE_MS;
 
     static const int IS_HOST         = false;
     static const int IS_DEVICE       = true;
 
+    // Line event bitmaps for apiWaitForEvent and apiSetEventIrqMask.
+    // When enabled as interrupts, an event's VProc interrupt level is
+    // its usbModel EV_xxx bit position plus 1.
+    static const unsigned EVENT_LINECHG = 1 << EV_LINECHG;
+    static const unsigned EVENT_SUSPEND = 1 << EV_SUSPEND;
+    static const unsigned EVENT_RESET   = 1 << EV_RESET;
 
-#ifndef USBTESTMODE
-    static const int MINRSTCOUNT     = ONE_MS * 10;  // 10ms for fullspeed device
-    static const int MINSUSPENDCOUNT = ONE_MS * 3;   // 3ms for fullspeed device
-#else
-    static const int MINRSTCOUNT     = ONE_US * 25;
-    static const int MINSUSPENDCOUNT = ONE_US * 100;
-#endif
+    // Endpoint statuses for the usbModel handshake responder (see
+    // apiSetEpStatus)
+    static const int EPSTATUS_READY     = EPSTAT_READY;
+    static const int EPSTATUS_NAK       = EPSTAT_NAK;
+    static const int EPSTATUS_STALL     = EPSTAT_STALL;
 
 private:
 
@@ -65,6 +73,46 @@ private:
     static const int ADVANCE_TIME = 0;
     static const int MINIMUMIDLE  = 1;
 
+    // Number of line samples held in each 32 bit word of the usbModel
+    // transmit and receive buffers (dp in the lower 16 bits, dm in the
+    // upper 16 bits)
+    static const int TXWORDSAMPLES = 16;
+    static const int RXWORDSAMPLES = 16;
+
+    // Number of bytes held in each 32 bit word of the buffers of a
+    // byte parallel (UTMI) usbModel, first byte in the lower bits
+    static const int TXWORDBYTES   = 4;
+    static const int RXWORDBYTES   = 4;
+
+    // usbLog component for messages from this class
+    static const int USBLOGCOMP    = usbModel::usbLog::LOG_API;
+
+    // Receive capture control and status fields
+    static const uint32_t RXCAPDEVICE     = 0x80000000;
+    static const uint32_t RXCAPNOSUSPEND  = 0x40000000;
+    static const uint32_t RXTIMEOUTMASK   = 0x3fffffff;
+    static const uint32_t RXBITCOUNTMASK  = 0x0000ffff;
+    static const int      RXSTATUSSHIFT   = 16;
+    static const uint32_t RXSTATUSMASK    = 0xf;
+    static const uint32_t RXACTIVITY      = 0x00100000;
+
+    // Event wait control fields
+    static const uint32_t EVMASKBITS      = 0x7;
+    static const int      EVTIMEOUTSHIFT  = 3;
+
+    // Transaction boundary flag for TXSEND and COUNTDOWN, allowing a
+    // due hardware SOF to be sent, and SOF generator control fields
+    static const uint32_t SOFOK           = 0x80000000;
+    static const uint32_t SOFCTLENABLE    = 0x1;
+    static const uint32_t SOFCTLLOAD      = 0x2;
+    static const int      SOFCTLFRAMESHIFT= 16;
+    static const uint32_t SOFFRAMEMASK    = 0x7ff;
+
+    // Handshake responder fields
+    static const int      EPSTATBITS      = 2;
+    static const uint32_t EPSTATMASK      = 0x3;
+    static const uint32_t DEVADDRMASK     = 0x7f;
+
 public:
 
     //-------------------------------------------------------------
@@ -79,8 +127,27 @@ public:
     //
     //-------------------------------------------------------------
 
-    usbPliApi(const int nodeIn, std::string name = std::string("DEV ")) : node(nodeIn)
+    // The reset and suspend detection periods (in clock ticks) are those
+    // of the host or device speed policy (see usbCommon.h)
+    usbPliApi(const int nodeIn, std::string name = std::string("DEV "),
+              const unsigned rstcountIn  = usbModel::usb_speed_fs_t::MINRSTCOUNT,
+              const unsigned suspcountIn = usbModel::usb_speed_fs_t::MINSUSPENDCOUNT) :
+        node(nodeIn),
+        rstcount(rstcountIn),
+        suspcount(suspcountIn)
     {
+        suspended    = false;
+        rxconfigured = false;
+        lastclkcount = 0;
+        hwdevaddr    = 0;
+        hwepstat[0]  = 0;
+        hwepstat[1]  = 0;
+        rawpkt       = false;
+        rxremaining  = 0;
+        pcaprxactive = false;
+
+        usbModel::usbLog::init();
+        usbModel::usbPcap::init(ONE_US);
     }
     
     void usbGetVersionStr(char *vstr, unsigned len = 12)
@@ -95,25 +162,21 @@ protected:
     //
     // Advance simulation time for specified number of clock ticks
     // (default 1) whilst drive the line at the idle state
-    // (OE inactive).
+    // (OE inactive). The usbModel COUNTDOWN register holds off
+    // its acknowledge for the given number of ticks, so the wait
+    // is a single access however long it is. If sofok is set, the
+    // idle is at a transaction boundary and the usbModel may send
+    // a due hardware SOF during it (see apiEnableHwSof()).
     //
     //-------------------------------------------------------------
 
-    void apiSendIdle(const unsigned ticks = 1)
+    void apiSendIdle(const unsigned ticks = 1, const bool sofok = false)
     {
-        unsigned time;
-        unsigned currtime;
-
-        // Sample Current clock count
-        time = apiGetClkCount();
-
         // Disable outputs
-        VWrite(OUTEN, 0, DELTA_CYCLE, node);
+        apiWrite(OUTEN, 0, DELTA_CYCLE);
 
-        // Keep reading clock count for 'ticks' number of cycles
-        do {
-            currtime = apiGetClkCount(ADVANCE_TIME);
-        } while ((ticks == IDLE_FOREVER) || ((currtime-time) < ticks));
+        // Wait for 'ticks' number of cycles (forever if IDLE_FOREVER)
+        apiWrite(COUNTDOWN, (ticks & ~SOFOK) | (sofok ? SOFOK : 0), DELTA_CYCLE);
     }
 
     //-------------------------------------------------------------
@@ -121,30 +184,48 @@ protected:
     //
     // Advance simulation time for specified number of clock ticks
     // (default 1) whilst drive the line at the SE0 state
-    // (OE active).
+    // (OE active). As for apiSendIdle, the wait is a single
+    // COUNTDOWN access.
     //
     //-------------------------------------------------------------
 
     void apiSendReset (const unsigned ticks = 1)
     {
-        unsigned time;
-        unsigned currtime;
-
-        // Sample Current clock count
-        time = apiGetClkCount();
         // Enable outputs
-        VWrite(OUTEN, 1, DELTA_CYCLE, node);
+        apiWrite(OUTEN, 1, DELTA_CYCLE);
 
         // Set the line to SE0
-        VWrite(LINE, 0, ADVANCE_TIME, node);
+        apiWrite(LINE, usbModel::USB_SE0, DELTA_CYCLE);
 
-        // Keep reading clock count for 'ticks' number of cycles
-        do {
-            currtime = apiGetClkCount(ADVANCE_TIME);
-        } while ((ticks == IDLE_FOREVER) || ((currtime-time) < ticks));
+        // Wait for 'ticks' number of cycles (forever if IDLE_FOREVER)
+        apiWrite(COUNTDOWN, ticks, DELTA_CYCLE);
 
         // Disable outputs
-        VWrite(OUTEN, 0, DELTA_CYCLE, node);
+        apiWrite(OUTEN, 0, DELTA_CYCLE);
+    }
+
+    //-------------------------------------------------------------
+    // apiIsRawPkt
+    //
+    // Queries the usbModel's physical interface, returning true
+    // if it is byte parallel (UTMI) or a transaction level C++
+    // backend (TLM), when packets are passed as raw bytes (PID
+    // onwards) without SYNC, NRZI, bit stuffing or EOP, else false
+    // for the serial D+/D- lines. The result
+    // selects the packet format used by apiSendPacket() and
+    // apiWaitForPkt().
+    //
+    //-------------------------------------------------------------
+
+    bool apiIsRawPkt(void)
+    {
+        unsigned phyif;
+
+        apiRead(PHYIF, &phyif, DELTA_CYCLE);
+
+        rawpkt = (phyif == PHYIF_UTMI || phyif == PHYIF_TLM);
+
+        return rawpkt;
     }
 
     //-------------------------------------------------------------
@@ -160,7 +241,7 @@ protected:
         unsigned reset;
 
         do {
-            VRead(RESET_STATE, &reset, ADVANCE_TIME, node);
+            apiRead(RESET_STATE, &reset, ADVANCE_TIME);
         } while (reset);
     }
 
@@ -177,7 +258,7 @@ protected:
 
     void apiEnablePullup(void)
     {
-        VWrite(PULLUP, 1, ADVANCE_TIME, node);
+        apiWrite(PULLUP, 1, ADVANCE_TIME);
     }
 
     //-------------------------------------------------------------
@@ -193,7 +274,7 @@ protected:
 
     void apiDisablePullup(void)
     {
-        VWrite(PULLUP, 0, ADVANCE_TIME, node);
+        apiWrite(PULLUP, 0, ADVANCE_TIME);
     }
 
     //-------------------------------------------------------------
@@ -208,7 +289,7 @@ protected:
 
     void apiHaltSimulation()
     {
-        VWrite(UVH_FINISH, 0, 0, node);
+        apiWrite(UVH_FINISH, 0, 0);
     }
 
     //-------------------------------------------------------------
@@ -225,11 +306,22 @@ protected:
 
     unsigned apiGetClkCount(int delta = DELTA_CYCLE)
     {
-        unsigned clkCount;
+        apiRead(CLKCOUNT, &lastclkcount, delta);
 
-        VRead(CLKCOUNT, &clkCount, delta, node);
+        return lastclkcount;
+    }
 
-        return clkCount;
+    //-------------------------------------------------------------
+    // apiLastClkCount
+    //
+    // Returns the clkcount value last read by apiGetClkCount (0 if
+    // never read), without a simulation access.
+    //
+    //-------------------------------------------------------------
+
+    unsigned apiLastClkCount() const
+    {
+        return lastclkcount;
     }
 
     //-------------------------------------------------------------
@@ -243,6 +335,22 @@ protected:
     void apiReset()
     {
         suspended = false;
+
+        // Return the usbModel handshake responder to its reset state,
+        // if it has been used
+        if (hwdevaddr)
+        {
+            apiSetDevAddr(0);
+        }
+
+        for (int dir = 0; dir < usbModel::NUMEPDIRS; dir++)
+        {
+            if (hwepstat[dir])
+            {
+                hwepstat[dir] = 0;
+                apiWrite(dir ? EPSTATIN : EPSTATOUT, 0, DELTA_CYCLE);
+            }
+        }
     }
 
     //-------------------------------------------------------------
@@ -257,7 +365,7 @@ protected:
     {
         unsigned rawline;
 
-        VRead(LINE, &rawline, delta, node);
+        apiRead(LINE, &rawline, delta);
 
         return rawline;
     }
@@ -265,52 +373,88 @@ protected:
     //-------------------------------------------------------------
     // apiSendPacket
     //
-    // Sends an NRZI encoded packet (nrzi[]) over the USB interface
+    // Sends an NRZI encoded packet (nrzi) over the USB interface
     // for the specified number of bits (bitlen). An idle period
-    // is generated first as specified by delay. The output enable
-    // is activated when sending the packet and deactivated when
-    // complete.
+    // is generated first as specified by delay. The packet is
+    // loaded into the usbModel transmit buffer and then sent with
+    // a single TXSEND access, with the HDL activating the output
+    // enable when sending the packet and deactivating it on the
+    // last bit. The TXSEND access does not complete until the
+    // whole packet has been sent. If sofok is set, the packet
+    // starts a transaction and a due hardware SOF may be sent
+    // before it.
     //
     //-------------------------------------------------------------
 
-    void apiSendPacket(const usbModel::usb_signal_t nrzi[], const int bitlen, const int delay = 50)
+    void apiSendPacket(const usbModel::usb_line_buf_t &nrzi, const int bitlen, const int delay = 50, const bool sofok = false)
     {
+        // Any received packet being captured to a pcap file goes first
+        pcapRxDrain();
+
         // Idle the bus for a time
         if (delay >= MINIMUMIDLE)
         {
-            apiSendIdle(delay);
+            apiSendIdle(delay, sofok);
         }
         else
         {
-            apiSendIdle(MINIMUMIDLE);
+            apiSendIdle(MINIMUMIDLE, sofok);
         }
 
-        // Enable outputs
-        VWrite(OUTEN, 1, DELTA_CYCLE, node);
-
         // Number of bytes in data, rounded up.
         int bytelen  = ((bitlen+7)/8);
 
-        // Number of bits in last byte
-        int lastbits = (bitlen & 0x7) ? (bitlen & 0x7) : 8;
-
-        for (int bytes = 0; bytes < bytelen; bytes++)
+        // A byte parallel usbModel takes the raw bytes, four per word
+        if (rawpkt)
         {
-            bool lastbyte = (bytes == (bytelen-1));
-            int bitcnt    = lastbyte ? lastbits : 8;
+            apiWrite(TXBUFIDX, 0, DELTA_CYCLE);
 
-            for (int bits = 0; bits < bitcnt; bits++)
+            for (int bidx = 0; bidx < bytelen; bidx += TXWORDBYTES)
             {
-                if (lastbyte && bits == (bitcnt-1))
+                uint64_t word = nrzi.dp[bidx/8] >> ((bidx%8)*8);
+
+                // Clear any bytes beyond the end of the packet
+                if ((bytelen - bidx) < TXWORDBYTES)
                 {
-                    // Disable outputs on last bit
-                    VWrite(OUTEN, 0, DELTA_CYCLE, node);
+                    word &= (1ULL << ((bytelen - bidx)*8)) - 1;
                 }
 
-                // Output data values
-                unsigned lineval = ((nrzi[bytes].dp >> bits) & 1) | (((nrzi[bytes].dm >> bits) & 1) << 1);
-                VWrite(LINE, lineval, ADVANCE_TIME, node);
+                apiWrite(TXBUFDATA, (uint32_t)word, DELTA_CYCLE);
             }
+
+            apiWrite(TXSEND, bytelen | (sofok ? SOFOK : 0), DELTA_CYCLE);
+
+            if (usbModel::usbPcap::enabled(usbModel::usbPcap::PCAP_TX))
+            {
+                pcapTx(nrzi, bitlen);
+            }
+
+            return;
+        }
+
+        // Number of transmit buffer words, rounded up.
+        int wordlen  = ((bitlen+TXWORDSAMPLES-1)/TXWORDSAMPLES);
+
+        // Load the packet into the transmit buffer from the start, with
+        // TXWORDSAMPLES samples from each of the D+ and D- planes per word
+        apiWrite(TXBUFIDX, 0, DELTA_CYCLE);
+
+        for (int widx = 0; widx < wordlen; widx++)
+        {
+            int      sidx   = widx*TXWORDSAMPLES;
+            int      shift  = sidx % usbModel::LINEBUFWORDSAMPLES;
+            uint32_t dpword = (nrzi.dp[sidx / usbModel::LINEBUFWORDSAMPLES] >> shift) & 0xffff;
+            uint32_t dmword = (nrzi.dm[sidx / usbModel::LINEBUFWORDSAMPLES] >> shift) & 0xffff;
+
+            apiWrite(TXBUFDATA, dpword | (dmword << 16), DELTA_CYCLE);
+        }
+
+        // Send the packet, which returns when all bitlen bits have been driven
+        apiWrite(TXSEND, bitlen | (sofok ? SOFOK : 0), DELTA_CYCLE);
+
+        if (usbModel::usbPcap::enabled(usbModel::usbPcap::PCAP_TX))
+        {
+            pcapTx(nrzi, bitlen);
         }
     }
 
@@ -325,6 +469,10 @@ protected:
     // period) and will timeout if a period specified (time > 0).
     // The method also monitors for disconnction (SE0 when idle).
     //
+    // The line monitoring is done by the usbModel receive capture
+    // engine (see apiRxCapture()), and any captured packet is then
+    // read back from the receive buffer with apiRxRead().
+    //
     // The possible return values are:
     //
     //   A bit count (return integer >= 0)
@@ -336,135 +484,511 @@ protected:
     //
     //-------------------------------------------------------------
 
-    int apiWaitForPkt(usbModel::usb_signal_t nrzi[], const bool isDevice = true, const unsigned timeout = 0)
+    int apiWaitForPkt(usbModel::usb_line_buf_t &nrzi, const bool isDevice = true, const unsigned timeout = 0)
     {
-        unsigned     line;
-        bool         idle         = true;
-        bool         lookforreset = false;
-        int          rstcount     = 0;
-        int          idlecount    = 0;
-        int          eop_count    = 0;
-        int          bitcount     = 0;
+        int          bitcount;
+        int          nsamples;
+        int          sidx;
+        uint64_t     dp;
+        uint64_t     dm;
 
-        // Disable outputs
-        VWrite(OUTEN, 0, DELTA_CYCLE, node);
+        if ((bitcount = apiRxCapture(isDevice, timeout)) < 0)
+        {
+            return bitcount;
+        }
 
-        do {
-            // Get status on USB line
-            line = apiReadLineState(0);
+        for (sidx = 0; (nsamples = apiRxRead(dp, dm)) != 0; sidx += nsamples)
+        {
+            int pidx  = sidx / usbModel::LINEBUFWORDSAMPLES;
+            int shift = sidx % usbModel::LINEBUFWORDSAMPLES;
 
-            // If a host and SE0 seen when idle, there is no device connected
-            if (!isDevice)
+            if (shift == 0)
             {
-                if (idle && line == usbModel::USB_SE0)
-                {
-                    return usbModel::USBDISCONNECTED;
-                }
+                nrzi.dp[pidx] = 0;
+                nrzi.dm[pidx] = 0;
+            }
+
+            nrzi.dp[pidx] |= dp << shift;
+            nrzi.dm[pidx] |= dm << shift;
+        }
+
+        // A raw packet is terminated with an SE0 entry
+        if (rawpkt)
+        {
+            nrzi.setByte(sidx / usbModel::NRZI_BITSPERBYTE, 0, 0);
+        }
+
+        // Return the bitcount of the packet
+        return bitcount;
+    }
+
+    //-------------------------------------------------------------
+    // apiRxCapture()
+    //
+    // Waits for a packet, or other line condition, as for
+    // apiWaitForPkt(), with the same return values, but without
+    // reading back the packet. The packet is then read back with
+    // apiRxRead(), so that it can be decoded as it is read, and
+    // the reading abandoned once the packet is known not to be of
+    // interest.
+    //
+    // The line monitoring is done by the usbModel receive capture
+    // engine, with a single RXCAPTURE access returning when one of
+    // the line conditions occurs. The status is then read.
+    //
+    //-------------------------------------------------------------
+
+    int apiRxCapture(const bool isDevice = true, const unsigned timeout = 0)
+    {
+        unsigned     status;
+        int          bitcount;
+        uint32_t     rxctrl;
+
+        // Finish reading back any previous packet being captured to a pcap file
+        pcapRxDrain();
+
+        rxremaining = 0;
+
+        apiConfigDetection();
+
+        // A device already suspended does not need suspension reported again, so
+        // the capture only returns on activity.
+        rxctrl = (isDevice ? RXCAPDEVICE : 0) | ((isDevice && suspended) ? RXCAPNOSUSPEND : 0) | (timeout & RXTIMEOUTMASK);
+
+        // Start a capture (which disables outputs). This returns only when a
+        // packet has been received, or some other line condition detected.
+        apiWrite(RXCAPTURE, rxctrl, DELTA_CYCLE);
+
+        apiRead(RXSTATUS, &status, DELTA_CYCLE);
+
+        // If anything other than a J (when already idle) seen, come out of suspend
+        if (suspended && (status & RXACTIVITY))
+        {
+            USBDISPPKT("Device activated from suspension\n");
+            suspended = false;
+        }
+
+        switch ((status >> RXSTATUSSHIFT) & RXSTATUSMASK)
+        {
+        case RXSTAT_PKT:
+            break;
+        case RXSTAT_DISCONNECTED:
+            return usbModel::USBDISCONNECTED;
+        case RXSTAT_RESET:
+            return usbModel::USBRESET;
+        case RXSTAT_SUSPEND:
+            suspended = true;
+            return usbModel::USBSUSPEND;
+        case RXSTAT_NORESPONSE:
+            return usbModel::USBNORESPONSE;
+        default:
+            return usbModel::USBERROR;
+        }
+
+        bitcount = status & RXBITCOUNTMASK;
+
+        // A packet too large for the buffer is an error. A packet from a byte
+        // parallel usbModel is read back as whole bytes, and otherwise as whole
+        // receive buffer words of samples.
+        if (rawpkt)
+        {
+            if (bitcount/8 >= usbModel::MAXBUFSIZE)
+            {
+                return usbModel::USBERROR;
             }
 
-            // If anything other than a J (when already idle) come out of suspend
-            if (suspended && (line == usbModel::USB_K || (isDevice && line == usbModel::USB_SE0)))
+            rxremaining = (bitcount/8) * 8;
+        }
+        else
+        {
+            if (bitcount > usbModel::MAXBUFSIZE*8)
             {
-                USBDISPPKT("Device activated from suspension\n");
-                suspended = false;
+                return usbModel::USBERROR;
             }
 
-            // If not in the middle of a reset detection and K seen, then line is not idle
-            if (!lookforreset && line == usbModel::USB_K)
+            rxremaining = ((bitcount+RXWORDSAMPLES-1)/RXWORDSAMPLES) * RXWORDSAMPLES;
+        }
+
+        // Decode the packet for the pcap file as it is read back
+        if (usbModel::usbPcap::enabled(usbModel::usbPcap::PCAP_RX))
+        {
+            pcapRxStart();
+        }
+
+        return bitcount;
+    }
+
+    //-------------------------------------------------------------
+    // apiRxRead()
+    //
+    // Reads back the next word of a packet captured with
+    // apiRxCapture(), as line samples in dp (D+) and dm (D-),
+    // first sample in bit 0, returning the number of samples, or
+    // 0 once the whole packet has been read. A packet from a byte
+    // parallel usbModel is returned as raw bytes, 8 samples each,
+    // with the bytes in dp and their complement in dm, as for the
+    // raw packets of a usb_line_buf_t. Any words of a packet not
+    // read are discarded by the next capture.
+    //
+    //-------------------------------------------------------------
+
+    int apiRxRead(uint64_t &dp, uint64_t &dm)
+    {
+        unsigned     rxword;
+        int          nsamples;
+
+        if (rxremaining <= 0)
+        {
+            return 0;
+        }
+
+        apiRead(RXBUFDATA, &rxword, DELTA_CYCLE);
+
+        if (rawpkt)
+        {
+            nsamples = (rxremaining < RXWORDBYTES*8) ? rxremaining : RXWORDBYTES*8;
+
+            uint64_t mask = (1ULL << nsamples) - 1;
+
+            dp =  (uint64_t)rxword & mask;
+            dm = ~(uint64_t)rxword & mask;
+        }
+        else
+        {
+            nsamples = RXWORDSAMPLES;
+
+            dp = rxword         & 0xffff;
+            dm = (rxword >> 16) & 0xffff;
+        }
+
+        rxremaining -= nsamples;
+
+        if (pcaprxactive)
+        {
+            pcapRxPut(dp, dm, nsamples);
+        }
+
+        return nsamples;
+    }
+
+    //-------------------------------------------------------------
+    // apiWaitForEvent()
+    //
+    // Sleeps until one of the line events selected in evmask
+    // (EVENT_LINECHG, EVENT_SUSPEND and/or EVENT_RESET) is
+    // detected by the usbModel, or until timeout clock ticks have
+    // elapsed if non-zero. Only events occurring after the call
+    // are waited for. This is a single access however long the
+    // wait.
+    //
+    // Returns a bitmap of the selected events that occurred, or 0
+    // if timed out.
+    //
+    //-------------------------------------------------------------
+
+    unsigned apiWaitForEvent(const unsigned evmask, const unsigned timeout = usbModel::NOTIMEOUT)
+    {
+        unsigned events;
+
+        apiConfigDetection();
+
+        apiWrite(EVWAIT, (evmask & EVMASKBITS) | (timeout << EVTIMEOUTSHIFT), DELTA_CYCLE);
+
+        apiRead(EVSTATUS, &events, DELTA_CYCLE);
+
+        return events & evmask;
+    }
+
+    //-------------------------------------------------------------
+    // apiSetEventIrqMask()
+    //
+    // Enables the line events in evmask to generate VProc
+    // interrupts, for handlers registered with VRegInterrupt() at
+    // level EV_xxx + 1. Pending events are cleared with
+    // apiClearEvents().
+    //
+    //-------------------------------------------------------------
+
+    void apiSetEventIrqMask(const unsigned evmask)
+    {
+        apiConfigDetection();
+
+        apiWrite(EVIRQMASK, evmask & EVMASKBITS, DELTA_CYCLE);
+    }
+
+    //-------------------------------------------------------------
+    // apiClearEvents()
+    //
+    // Clears the pending line events in evmask.
+    //
+    //-------------------------------------------------------------
+
+    void apiClearEvents(const unsigned evmask)
+    {
+        apiWrite(EVSTATUS, evmask & EVMASKBITS, DELTA_CYCLE);
+    }
+
+    //-------------------------------------------------------------
+    // apiEnableHwSof()
+    //
+    // Enables or disables the usbModel start of frame generator
+    // (host only). When enabled, an SOF is due at once and then
+    // every 1ms, and is sent by the HDL at the next transaction
+    // boundary (an idle or packet marked sofok). The frame number
+    // is loaded with frame if non-negative, else carries on from
+    // its current value.
+    //
+    //-------------------------------------------------------------
+
+    void apiEnableHwSof(const bool enable, const int frame = -1)
+    {
+        uint32_t ctrl = enable ? SOFCTLENABLE : 0;
+
+        if (frame >= 0)
+        {
+            ctrl |= SOFCTLLOAD | ((frame & SOFFRAMEMASK) << SOFCTLFRAMESHIFT);
+        }
+
+        apiWrite(SOFCTRL, ctrl, DELTA_CYCLE);
+    }
+
+    //-------------------------------------------------------------
+    // apiGetHwSofFrame()
+    //
+    // Returns the current frame number of the usbModel start of
+    // frame generator.
+    //
+    //-------------------------------------------------------------
+
+    unsigned apiGetHwSofFrame()
+    {
+        unsigned frame;
+
+        apiRead(SOFFRAME, &frame, DELTA_CYCLE);
+
+        return frame & SOFFRAMEMASK;
+    }
+
+    //-------------------------------------------------------------
+    // apiSetDevAddr()
+    //
+    // Sets the device address that the usbModel handshake
+    // responder matches tokens against.
+    //
+    //-------------------------------------------------------------
+
+    void apiSetDevAddr(const unsigned addr)
+    {
+        hwdevaddr = addr & DEVADDRMASK;
+
+        apiWrite(DEVADDR, hwdevaddr, DELTA_CYCLE);
+    }
+
+    //-------------------------------------------------------------
+    // apiSetEpStatus()
+    //
+    // Sets the status of an endpoint (endp, with the direction in
+    // bit 7) for the usbModel handshake responder. With a status
+    // of EPSTATUS_NAK or EPSTATUS_STALL, the HDL answers IN and
+    // OUT transactions on the endpoint with that handshake itself,
+    // and they are never seen by apiWaitForPkt. EPSTATUS_READY
+    // (the default) passes transactions to the C++ as normal.
+    //
+    //-------------------------------------------------------------
+
+    void apiSetEpStatus(const uint8_t endp, const int status)
+    {
+        int      dir   = (endp >> 7) & 1;
+        int      shift = (endp & 0xf) * EPSTATBITS;
+        uint32_t epstat;
+
+        epstat = (hwepstat[dir] & ~(EPSTATMASK << shift)) | ((status & EPSTATMASK) << shift);
+
+        if (epstat != hwepstat[dir])
+        {
+            hwepstat[dir] = epstat;
+            apiWrite(dir ? EPSTATIN : EPSTATOUT, epstat, DELTA_CYCLE);
+        }
+    }
+
+private:
+
+    //-------------------------------------------------------------
+    // Packet bytes (PID to CRC) for a pcap file, decoded from a
+    // packet's line samples, with any SYNC byte dropped
+    //-------------------------------------------------------------
+
+    struct pcapPkt_t
+    {
+        uint8_t  bytes[usbModel::MAXBUFSIZE];
+        int      len;
+        bool     sync;
+
+        void put (const uint8_t byte)
+        {
+            if (sync)
             {
-                idle = false;
+                sync = false;
             }
-            // If idle and an SE0 seen then this may be a reset
-            else if (isDevice && idle && line == usbModel::USB_SE0)
+            else if (len < usbModel::MAXBUFSIZE)
             {
-                idle         = false;
-                lookforreset = true;
-                rstcount++;
+                bytes[len++] = byte;
             }
+        }
+    };
+
+    //-------------------------------------------------------------
+    // pcapTx()
+    //
+    // Adds a transmitted packet to the pcap file, timestamped at
+    // the end of the packet.
+    //
+    //-------------------------------------------------------------
+
+    void pcapTx(const usbModel::usb_line_buf_t &nrzi, const int bitlen)
+    {
+        pcaptx.len  = 0;
+        pcaptx.sync = !rawpkt;
 
-            // If in the middle of a potential reset, keep track of the number of consecutive SE0 line states
-            if (lookforreset)
+        if (rawpkt)
+        {
+            for (int bidx = 0; bidx < (bitlen+7)/8; bidx++)
             {
-                // Another SE0 increments the count
-                if (line == usbModel::USB_SE0)
-                {
-                    rstcount++;
-                }
-                // When a non-SE0 state occurs, return the status to the calling method
-                else
-                {
-                    // The return status is reset if seen sufficient consecutive SE0s,
-                    // else return an error for unexplained SE0s
-                    if (rstcount >= MINRSTCOUNT)
-                    {
-                        return usbModel::USBRESET;
-                    }
-                    else
-                    {
-                        return usbModel::USBERROR;
-                    }
-
-                    rstcount = 0;
-                    lookforreset = false;
-                    idle         = (line == usbModel::USB_K) ? false : true;
-                }
+                pcaptx.put((nrzi.dp[bidx/8] >> ((bidx%8)*8)) & 0xff);
             }
+        }
+        else
+        {
+            usbNrziDec<pcapPkt_t> dec(&pcaptx);
 
-            // If not idle, then process the packet data
-            if (!idle && !lookforreset)
+            for (int sidx = 0; sidx < bitlen; sidx += usbModel::LINEBUFWORDSAMPLES)
             {
-                idlecount = 0;
+                int nsamples = (bitlen - sidx < usbModel::LINEBUFWORDSAMPLES) ? bitlen - sidx : usbModel::LINEBUFWORDSAMPLES;
 
-                // At each byte boundary, clear the new byte buffer entry
-                if (!(bitcount%8))
+                if (dec.put(nrzi.dp[sidx / usbModel::LINEBUFWORDSAMPLES], nrzi.dm[sidx / usbModel::LINEBUFWORDSAMPLES], nsamples) != usbNrzi::DECACTIVE)
                 {
-                    nrzi[bitcount/8].dp = nrzi[bitcount/8].dm = 0;
+                    break;
                 }
+            }
+        }
+
+        usbModel::usbPcap::record(apiGetClkCount(), pcaptx.bytes, pcaptx.len);
+    }
 
-                // Add the line values to the buffer entries and increment the packet bit count
-                nrzi[bitcount/8].dp |= (line        & 0x1) << bitcount%8;
-                nrzi[bitcount/8].dm |= ((line >> 1) & 0x1) << bitcount%8;
-                bitcount++;
+    //-------------------------------------------------------------
+    // pcapRxStart(), pcapRxPut() and pcapRxEnd()
+    //
+    // Decode a received packet for the pcap file as apiRxRead()
+    // reads it back, adding it, timestamped at the end of the
+    // packet, once all read.
+    //
+    //-------------------------------------------------------------
 
-                // If not yet seen an SE0, the keep a bit count for 3 bits for EOP
-                // (the decoding of the packet will detect any correupt EOP)
-                if (!eop_count && line == usbModel::USB_SE0)
-                {
-                    eop_count++;
-                }
-                else if (eop_count)
-                {
-                    eop_count++;
+    void pcapRxStart()
+    {
+        pcaprx.len   = 0;
+        pcaprx.sync  = !rawpkt;
+        pcaprxdec    = usbNrziDec<pcapPkt_t>(&pcaprx);
+        pcaprxtick   = apiGetClkCount();
+        pcaprxactive = true;
 
-                    // After 3 bits of EOP break out of the loop.
-                    if (eop_count == 3)
-                    {
-                        break;
-                    }
-                }
-            }
-            else
+        if (rxremaining <= 0)
+        {
+            pcapRxEnd();
+        }
+    }
+
+    void pcapRxPut(const uint64_t dp, const uint64_t dm, const int nsamples)
+    {
+        if (rawpkt)
+        {
+            for (int sidx = 0; sidx < nsamples; sidx += usbModel::NRZI_BITSPERBYTE)
             {
-                idlecount++;
-                if (isDevice && idlecount >= MINSUSPENDCOUNT)
-                {
-                    suspended = true;
-                    return usbModel::USBSUSPEND;
-                }
+                pcaprx.put((dp >> sidx) & 0xff);
+            }
+        }
+        else
+        {
+            pcaprxdec.put(dp, dm, nsamples);
+        }
 
-                if (timeout != usbModel::NOTIMEOUT && idlecount >= timeout)
-                {
-                    return usbModel::USBNORESPONSE;
-                }
+        if (rxremaining <= 0)
+        {
+            pcapRxEnd();
+        }
+    }
 
-            }
-        } while (true);
+    void pcapRxEnd()
+    {
+        usbModel::usbPcap::record(pcaprxtick, pcaprx.bytes, pcaprx.len);
 
-        // Return the bitcount of the packet
-        return bitcount;
+        pcaprxactive = false;
     }
 
-private:
+    // Read back the rest of a received packet not wholly read by the
+    // caller of apiRxRead(), for the pcap file
+    void pcapRxDrain()
+    {
+        uint64_t dp;
+        uint64_t dm;
+
+        while (pcaprxactive && apiRxRead(dp, dm) != 0);
+    }
+
+    //-------------------------------------------------------------
+    // apiWrite() and apiRead()
+    //
+    // Access a usbModel register, via the line backend registered
+    // for this node if there is one (see usbLineBackend.h), else
+    // via the VProc virtual processor.
+    //
+    //-------------------------------------------------------------
+
+    void apiWrite(const unsigned addr, const unsigned data, const int delta)
+    {
+        usbLineBackend* backend = usbLineBackend::getBackend(node);
+
+        if (backend != NULL)
+        {
+            backend->write(addr, data, delta);
+        }
+        else
+        {
+            VWrite(addr, data, delta, node);
+        }
+    }
+
+    void apiRead(const unsigned addr, unsigned *data, const int delta)
+    {
+        usbLineBackend* backend = usbLineBackend::getBackend(node);
+
+        if (backend != NULL)
+        {
+            backend->read(addr, data, delta);
+        }
+        else
+        {
+            VRead(addr, data, delta, node);
+        }
+    }
+
+    //-------------------------------------------------------------
+    // apiConfigDetection()
+    //
+    // Configures the usbModel reset and suspend detection periods
+    // on first use, as given at construction.
+    //
+    //-------------------------------------------------------------
+
+    void apiConfigDetection()
+    {
+        if (!rxconfigured)
+        {
+            apiWrite(RSTCOUNT,  rstcount,  DELTA_CYCLE);
+            apiWrite(SUSPCOUNT, suspcount, DELTA_CYCLE);
+            rxconfigured = true;
+        }
+    }
 
     //-------------------------------------------------------------
     // Internal private state.
@@ -473,9 +997,37 @@ private:
     // Node number of VProc module for this API object
     int  node;
 
+    // Reset and suspend detection periods, in clock ticks
+    unsigned rstcount;
+    unsigned suspcount;
+
+    // Last clkcount value read
+    unsigned lastclkcount;
+
     // Suspended state
     bool suspended;
 
+    // Flag to indicate reset and suspend detection periods configured
+    bool rxconfigured;
+
+    // Copies of the usbModel handshake responder address and endpoint
+    // status registers (OUT and IN)
+    uint32_t hwdevaddr;
+    uint32_t hwepstat[usbModel::NUMEPDIRS];
+
+    // Flag to indicate a byte parallel usbModel, using raw packets
+    bool rawpkt;
+
+    // Number of samples of a captured packet still to be read back
+    int rxremaining;
+
+    // Packet decode state for the pcap file
+    pcapPkt_t             pcaptx;
+    pcapPkt_t             pcaprx;
+    usbNrziDec<pcapPkt_t> pcaprxdec;
+    unsigned              pcaprxtick;
+    bool                  pcaprxactive;
+
 };
 
 #endif
\ No newline at end of file
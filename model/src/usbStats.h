@@ -0,0 +1,333 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 12th March 2024
+//
+// Contains the per-endpoint traffic statistics for the usbModel
+// host and device, with counters for each address, endpoint and
+// direction, and a dump in CSV or JSON for comparing runs.
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_STATS_H_
+#define _USB_STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "usbCommon.h"
+
+namespace usbModel
+{
+
+// -------------------------------------------------------------------------
+// Counters for one endpoint and direction, as seen by a node. Handshakes
+// are counted whether sent or received. Bad packets are counted against
+// the endpoint of the last token.
+// -------------------------------------------------------------------------
+
+struct usb_ep_stats_t
+{
+    uint64_t       packets;      // DATAx packets
+    uint64_t       bytes;        // DATAx payload bytes
+    uint64_t       acks;
+    uint64_t       naks;
+    uint64_t       stalls;
+    uint64_t       crcerrs;      // Received packets with a bad CRC5 or CRC16
+    uint64_t       errors;       // Other bad received packets
+    uint64_t       timeouts;     // No response waiting for a packet
+    uint64_t       retries;      // DATAx packets (or IN tokens) sent again after a NAK
+
+    void data (const int len)
+    {
+        packets++;
+        bytes += len;
+    }
+
+    // Ignores PIDs other than handshakes
+    void handshake (const int pid)
+    {
+        acks   += pid == PID_HSHK_ACK;
+        naks   += pid == PID_HSHK_NAK;
+        stalls += pid == PID_HSHK_STALL;
+    }
+
+    // A bad packet, classified by its error record (if any)
+    void badPkt (const usb_err_record_t* err)
+    {
+        if (err != NULL && (err->code == USBERR_CRC5 || err->code == USBERR_CRC16))
+        {
+            crcerrs++;
+        }
+        else
+        {
+            errors++;
+        }
+    }
+};
+
+// An endpoint's counters, as returned by usbStats::snapshot()
+struct usb_ep_stats_entry_t
+{
+    uint8_t        addr;
+    uint8_t        endp;
+    bool           in;
+    usb_ep_stats_t stats;
+};
+
+// -------------------------------------------------------------------------
+// usbStats
+//
+// A node's endpoint counters. The counters for an address are allocated
+// on first use, for all its endpoints. select() makes an endpoint current
+// when a token is sent or received, and txn() returns its counters, so
+// counting is an increment through a pointer.
+//
+// -------------------------------------------------------------------------
+
+class usbStats
+{
+public:
+
+    static const int NUMADDRS   = 128;
+    static const int NUMADDREPS = MAXENDPOINTS * NUMEPDIRS;
+
+    // Dump formats
+    static const int STATS_CSV  = 0;
+    static const int STATS_JSON = 1;
+
+    usbStats () : curr(NULL)
+    {
+        select(0, 0, false);
+    }
+
+    //-------------------------------------------------------------
+    // Counters for an endpoint (index and direction), and the
+    // current transaction's endpoint
+    //-------------------------------------------------------------
+
+    usb_ep_stats_t &ep (const uint8_t addr, const uint8_t endp, const bool in)
+    {
+        std::unique_ptr<usb_ep_stats_t[]> &addrstats = addrs[addr % NUMADDRS];
+
+        if (!addrstats)
+        {
+            addrstats.reset(new usb_ep_stats_t[NUMADDREPS]());
+        }
+
+        return addrstats[(endp % MAXENDPOINTS) * NUMEPDIRS + in];
+    }
+
+    void select (const uint8_t addr, const uint8_t endp, const bool in)
+    {
+        curr = &ep(addr, endp, in);
+    }
+
+    usb_ep_stats_t &txn (void)
+    {
+        return *curr;
+    }
+
+    //-------------------------------------------------------------
+    // Copy the counters of all endpoints with traffic
+    //-------------------------------------------------------------
+
+    void snapshot (std::vector<usb_ep_stats_entry_t> &entries) const
+    {
+        static const usb_ep_stats_t zero = usb_ep_stats_t();
+
+        entries.clear();
+
+        for (int addr = 0; addr < NUMADDRS; addr++)
+        {
+            for (int idx = 0; addrs[addr] && idx < NUMADDREPS; idx++)
+            {
+                if (memcmp(&addrs[addr][idx], &zero, sizeof(usb_ep_stats_t)) != 0)
+                {
+                    usb_ep_stats_entry_t entry = {(uint8_t)addr, (uint8_t)(idx / NUMEPDIRS), (idx % NUMEPDIRS) != 0, addrs[addr][idx]};
+
+                    entries.push_back(entry);
+                }
+            }
+        }
+    }
+
+    //-------------------------------------------------------------
+    // Zero all the counters
+    //-------------------------------------------------------------
+
+    void reset (void)
+    {
+        for (int addr = 0; addr < NUMADDRS; addr++)
+        {
+            for (int idx = 0; addrs[addr] && idx < NUMADDREPS; idx++)
+            {
+                addrs[addr][idx] = usb_ep_stats_t();
+            }
+        }
+    }
+
+    //-------------------------------------------------------------
+    // dump()
+    //
+    // Writes the counters of all endpoints with traffic to fp, as
+    // CSV (with a header line) or as a JSON object, labelled with
+    // the node name (without any display colour codes, and quoted
+    // as a CSV field or escaped as a JSON string).
+    //
+    //-------------------------------------------------------------
+
+    void dump (FILE* fp, const char* nodename, const int format = STATS_CSV) const
+    {
+        std::vector<usb_ep_stats_entry_t> entries;
+        std::string                       plain;
+
+        snapshot(entries);
+
+        // Drop escape sequences and padding from the name
+        for (const char* ptr = nodename; *ptr; ptr++)
+        {
+            if (*ptr == '\033')
+            {
+                while (ptr[1] && *ptr != 'm')
+                {
+                    ptr++;
+                }
+            }
+            else if (*ptr != ' ')
+            {
+                plain += *ptr;
+            }
+        }
+
+        std::string csvnode = csvQuote(plain);
+        const char* node    = csvnode.c_str();
+
+        if (format == STATS_CSV)
+        {
+            fprintf(fp, "node,addr,endp,dir,packets,bytes,acks,naks,stalls,crcerrs,errors,timeouts,retries\n");
+        }
+        else
+        {
+            fprintf(fp, "{\"node\": \"%s\", \"endpoints\": [", jsonEscape(plain).c_str());
+        }
+
+        for (unsigned edx = 0; edx < entries.size(); edx++)
+        {
+            const usb_ep_stats_entry_t &e = entries[edx];
+            const usb_ep_stats_t       &s = e.stats;
+
+            if (format == STATS_CSV)
+            {
+                fprintf(fp, "%s,%d,%d,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                            node, e.addr, e.endp, e.in ? "in" : "out",
+                            (unsigned long long)s.packets, (unsigned long long)s.bytes,
+                            (unsigned long long)s.acks,    (unsigned long long)s.naks,
+                            (unsigned long long)s.stalls,  (unsigned long long)s.crcerrs,
+                            (unsigned long long)s.errors,  (unsigned long long)s.timeouts,
+                            (unsigned long long)s.retries);
+            }
+            else
+            {
+                fprintf(fp, "%s\n  {\"addr\": %d, \"endp\": %d, \"dir\": \"%s\", \"packets\": %llu, \"bytes\": %llu, "
+                            "\"acks\": %llu, \"naks\": %llu, \"stalls\": %llu, \"crcerrs\": %llu, \"errors\": %llu, "
+                            "\"timeouts\": %llu, \"retries\": %llu}",
+                            edx ? "," : "", e.addr, e.endp, e.in ? "in" : "out",
+                            (unsigned long long)s.packets, (unsigned long long)s.bytes,
+                            (unsigned long long)s.acks,    (unsigned long long)s.naks,
+                            (unsigned long long)s.stalls,  (unsigned long long)s.crcerrs,
+                            (unsigned long long)s.errors,  (unsigned long long)s.timeouts,
+                            (unsigned long long)s.retries);
+            }
+        }
+
+        if (format == STATS_JSON)
+        {
+            fprintf(fp, "\n]}\n");
+        }
+    }
+
+private:
+
+    //-------------------------------------------------------------
+    // Quote a string as a CSV field, doubling any embedded quotes
+    // (RFC 4180)
+    //-------------------------------------------------------------
+
+    static std::string csvQuote (const std::string &str)
+    {
+        std::string quoted = "\"";
+
+        for (unsigned idx = 0; idx < str.size(); idx++)
+        {
+            if (str[idx] == '"')
+            {
+                quoted += '"';
+            }
+
+            quoted += str[idx];
+        }
+
+        return quoted + "\"";
+    }
+
+    //-------------------------------------------------------------
+    // Escape a string's quotes, backslashes and control
+    // characters for a JSON string
+    //-------------------------------------------------------------
+
+    static std::string jsonEscape (const std::string &str)
+    {
+        std::string escaped;
+        char        hex[8];
+
+        for (unsigned idx = 0; idx < str.size(); idx++)
+        {
+            unsigned char c = str[idx];
+
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (c < 0x20)
+            {
+                snprintf(hex, sizeof(hex), "\\u%04x", c);
+                escaped += hex;
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+
+        return escaped;
+    }
+
+    std::unique_ptr<usb_ep_stats_t[]> addrs[NUMADDRS];
+    usb_ep_stats_t*                   curr;
+};
+
+}
+
+#endif
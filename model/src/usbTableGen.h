@@ -0,0 +1,71 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 7th March 2024
+//
+// Contains templates for generating lookup tables at compile
+// time from constexpr entry functions
+//
+// This file is part of the C++ usbModel
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#ifndef _USB_TABLE_GEN_H_
+#define _USB_TABLE_GEN_H_
+
+// -------------------------------------------------------------------------
+// Compile time table generation
+//
+// C++11 constexpr functions are single expressions, so each table entry
+// is calculated with a recursive function, and the tables are expanded
+// from an index sequence. The sequence is built by halves to keep the
+// template nesting depth at log2 of the table size.
+//
+// A table is usbTableGen::table<F, usbTableGen::make<N>::type>::data,
+// where F has a type typedef and a static constexpr get(index) method
+// returning the entry for each index from 0 to N-1.
+//
+// -------------------------------------------------------------------------
+
+namespace usbTableGen
+{
+    template<unsigned... I>                 struct seq {};
+
+    template<class A, class B>              struct cat;
+    template<unsigned... A, unsigned... B>  struct cat<seq<A...>, seq<B...> >
+    {
+        typedef seq<A..., (sizeof...(A) + B)...> type;
+    };
+
+    template<unsigned N>                    struct make
+    {
+        typedef typename cat<typename make<N/2>::type, typename make<N - N/2>::type>::type type;
+    };
+    template<>                              struct make<0> {typedef seq<>  type;};
+    template<>                              struct make<1> {typedef seq<0> type;};
+
+    template<class F, class S>              struct table;
+    template<class F, unsigned... I>        struct table<F, seq<I...> >
+    {
+        static constexpr typename F::type data[sizeof...(I)] = {F::get(I)...};
+    };
+
+    template<class F, unsigned... I>
+    constexpr typename F::type table<F, seq<I...> >::data[sizeof...(I)];
+}
+
+#endif
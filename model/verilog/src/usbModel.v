@@ -43,6 +43,38 @@ module usbModel
              inout  linem
             );
 
+// Transmit and receive buffer sizes in 32 bit words, each holding 16 line
+// samples (dp in bits 15:0 and dm in bits 31:16). Matches MAXBUFSIZE bytes
+// of samples in the C++ model.
+localparam   TXBUFWORDS        = 1024;
+localparam   RXBUFWORDS        = 1024;
+
+// Line states
+localparam   USB_SE0           = 2'b00;
+localparam   USB_J             = 2'b01;
+localparam   USB_K             = 2'b10;
+
+// Start of frame period (1ms at 12MHz) and clocks of idle held after
+// an EOP before the serialiser releases the line
+localparam   SOFPERIOD         = 12000;
+localparam   SERGAPCLKS        = 4;
+
+// Serialiser phases
+localparam   SER_DATA          = 2'd0;
+localparam   SER_EOP           = 2'd1;
+localparam   SER_GAP           = 2'd2;
+
+// Handshake responder turnaround clocks after an EOP, and clocks to wait
+// for an OUT token's data packet before abandoning the transaction
+localparam   HSTURNCLKS        = 4;
+localparam   HSABSORBCLKS      = 64;
+
+// Handshake responder states
+localparam   HS_IDLE           = 2'd0;
+localparam   HS_ABSORB         = 2'd1;
+localparam   HS_TURN           = 2'd2;
+localparam   HS_SEND           = 2'd3;
+
 // --------------------------------
 // Register definitions
 // --------------------------------
@@ -53,10 +85,129 @@ reg          dm;
 
 // VP Interface signals
 reg   [31:0] rdata;
-reg          updateresp;
+reg          updateresp_imm;
+reg          updateresp_tx;
+reg          updateresp_rx;
+reg          updateresp_cnt;
+reg          updateresp_ev;
+reg          holdack;
 
 integer      clkcount;
 
+// Transmit engine state
+reg   [31:0] txbuf [0:TXBUFWORDS-1];
+reg   [31:0] txwidx;
+reg   [31:0] txlen;
+reg   [31:0] txidx;
+reg          txreq;
+reg          txack;
+reg          txbusy;
+reg          txsofok;
+
+// Receive capture engine state
+reg   [31:0] rxbuf [0:RXBUFWORDS-1];
+reg   [31:0] rxridx;
+reg   [31:0] rstthresh;
+reg   [31:0] suspthresh;
+reg   [29:0] rxtimeout;
+reg          rxdevice;
+reg          rxnosuspend;
+reg          rxreq;
+reg          rxack;
+reg          rxbusy;
+reg    [3:0] rxstatus;
+reg   [15:0] rxbitcount;
+reg          rxactivity;
+
+// Countdown state
+reg   [31:0] cntlen;
+reg   [31:0] cntval;
+reg          cntreq;
+reg          cntack;
+reg          cntbusy;
+reg          cntsofok;
+
+// Raw packet serialiser state
+reg   [31:0] serraw;
+reg    [5:0] serlen;
+reg    [5:0] seridx;
+reg    [1:0] serphase;
+reg    [2:0] serones;
+reg    [2:0] sercount;
+reg          serlevel;
+reg          serstuff;
+reg          serbusy;
+reg          sersel;
+reg          serdp;
+reg          serdm;
+reg          seroen;
+
+// Start of frame generator state
+reg          sofen;
+reg          sofdue;
+reg   [10:0] sofframe;
+reg          sofctlen;
+reg          sofctlload;
+reg   [10:0] sofctlframe;
+reg          sofctlreq;
+reg          sofctlack;
+integer      softimer;
+
+// Handshake responder state
+reg    [6:0] devaddr;
+reg   [31:0] epstatout;
+reg   [31:0] epstatin;
+reg          hsbusy;
+reg    [7:0] hspid;
+reg          hsreq;
+reg          hsack;
+
+// Handshake responder working state
+reg    [1:0] hsstate;
+reg    [1:0] hsline;
+reg    [1:0] hsprev;
+reg   [31:0] hsshift;
+reg    [2:0] hsones;
+reg    [1:0] hsepstat;
+reg    [3:0] hspidval;
+reg    [3:0] hsep;
+reg          hsinpkt;
+reg          hseop;
+reg          hsseen;
+integer      hsbits;
+integer      hscount;
+
+// Line event detector state
+reg    [2:0] evirqmask;
+reg    [2:0] evpend;
+reg    [2:0] evclr;
+reg          evclrreq;
+reg          evclrack;
+reg    [2:0] evwaitmask;
+reg   [28:0] evtimeout;
+reg          evwaitreq;
+reg          evwaitack;
+reg          evwaitbusy;
+reg    [1:0] evprev;
+integer      evse0count;
+integer      evjcount;
+integer      evwaitcount;
+
+// Line event detector working state
+reg    [1:0] evline;
+reg    [2:0] evnew;
+reg    [2:0] evstate;
+
+// Receive capture working state
+reg    [1:0] rxline;
+reg          rxidle;
+reg          rxlookforreset;
+reg          rxdone;
+integer      rxrstcount;
+integer      rxidlecount;
+integer      rxeopcount;
+integer      rxbits;
+
 // --------------------------------
 // Signal definitions
 // --------------------------------
@@ -68,8 +219,44 @@ wire         wack              = 1'b1;
 wire         rack              = 1'b1;
 wire  [31:0] node              = NODENUM;
 wire         update;
+wire         updateresp;
 wire         doen;
 
+wire         txstart;
+wire         rxstart;
+wire         cntstart;
+wire         evclrstart;
+wire         evwaitstart;
+wire   [2:0] evirq;
+wire   [2:0] irqlevel;
+wire  [31:0] txcurr;
+wire         txsel;
+wire         txhold;
+wire         txgo;
+wire         sofctlstart;
+wire         soflaunch;
+wire         hsstart;
+wire         lineoen;
+wire         linedp;
+wire         linedm;
+
+// --------------------------------
+// Functions
+// --------------------------------
+
+// CRC5 of an 11 bit token field, in the bit order it is sent on the line
+function [4:0] crc5;
+  input [10:0] data;
+  integer      i;
+  reg    [4:0] crc;
+  begin
+    crc                        = 5'h1f;
+    for (i = 0; i < 11; i = i + 1)
+      crc                      = {crc[3:0], 1'b0} ^ ((crc[4] ^ data[i]) ? 5'h05 : 5'h00);
+    crc5                       = ~{crc[0], crc[1], crc[2], crc[3], crc[4]};
+  end
+endfunction
+
 // --------------------------------
 // Combinatorial logic
 // --------------------------------
@@ -94,11 +281,66 @@ assign enpull                  = !nopullup;
 
 `endif
 
+// Acknowledge to VProc is either immediate (from the update process) or
+// delayed until a blocking command completes (from the engine processes)
+assign updateresp              = updateresp_imm ^ updateresp_tx ^ updateresp_rx ^ updateresp_cnt ^ updateresp_ev;
+
+// A receive capture request is pending from the RXCAPTURE write until the
+// next clock edge, when the capture engine starts sampling the line.
+assign rxstart                 = rxreq ^ rxack;
+
+// A countdown request is pending from the COUNTDOWN write until the next
+// clock edge, and the countdown is busy thereafter until it expires.
+assign cntstart                = cntreq ^ cntack;
+
+// Event clear and event wait requests are pending from the EVSTATUS and
+// EVWAIT writes until the next clock edge.
+assign evclrstart              = evclrreq ^ evclrack;
+assign evwaitstart             = evwaitreq ^ evwaitack;
+
+// The VProc interrupt level is that of the highest priority pending event
+// enabled in the interrupt mask, with reset the highest.
+assign evirq                   = evpend & evirqmask;
+assign irqlevel                = evirq[`EV_RESET]   ? (`EV_RESET   + 1) :
+                                 evirq[`EV_SUSPEND] ? (`EV_SUSPEND + 1) :
+                                 evirq[`EV_LINECHG] ? (`EV_LINECHG + 1) :
+                                                      3'd0;
+
+// A SOFCTRL update is pending from the write until the next clock edge
+assign sofctlstart             = sofctlreq ^ sofctlack;
+
+// A handshake request from the responder is pending until the serialiser
+// picks it up at the next clock edge
+assign hsstart                 = hsreq ^ hsack;
+
+// A host's due SOF is sent ahead of a transmission, or during an idle
+// countdown with the outputs disabled, when the C++ marks either as at a
+// transaction boundary. It is never sent whilst the serialiser is busy.
+assign soflaunch               = (DEVICE == 0) && sofdue && !sersel &&
+                                 ((txstart && txsofok) || (cntbusy && cntsofok && !oen));
+
+// A transmit request is pending from the TXSEND write until the next clock
+// edge, and the engine is busy thereafter until the last bit is sent. The
+// first bit is driven as soon as the request is made, unless held off
+// for the serialiser or a due SOF that is to go first.
+assign txstart                 = txreq ^ txack;
+assign txhold                  = sersel | (sofdue & txsofok);
+assign txgo                    = txstart & ~txhold;
+assign txsel                   = txgo | txbusy;
+assign txcurr                  = txbusy ? txidx : 32'h00000000;
+
+// Select line state from the serialiser when sending, then the transmit
+// engine when sending, else from the LINE and OUTEN registers. Output is
+// disabled on the last bit of a transmit buffer packet.
+assign lineoen                 = sersel ? seroen : txsel ? (txcurr != (txlen - 1)) : oen;
+assign linedp                  = sersel ? serdp  : txsel ? txbuf[txcurr[13:4]][{1'b0, txcurr[3:0]}]  : dp;
+assign linedm                  = sersel ? serdm  : txsel ? txbuf[txcurr[13:4]][{1'b1, txcurr[3:0]}]  : dm;
+
 // USB line driver logic
-assign linep                   = (doen & oen) ? dp : 1'bZ;
-assign linem                   = (doen & oen) ? dm : 1'bZ;
+assign linep                   = (doen & lineoen) ? linedp : 1'bZ;
+assign linem                   = (doen & lineoen) ? linedm : 1'bZ;
 
-assign #1 doen                 = oen;
+assign #1 doen                 = lineoen;
 
 
 // --------------------------------
@@ -110,8 +352,82 @@ begin
   dp                           = 1'b1;
   dm                           = 1'b0;
   nopullup                     = DEVICE ? 1'b1 : 1'b0; // Default disabled for device, enabled for host
-  updateresp                   = 1'b1;
+  updateresp_imm               = 1'b1;
+  updateresp_tx                = 1'b0;
+  updateresp_rx                = 1'b0;
+  updateresp_cnt               = 1'b0;
+  updateresp_ev                = 1'b0;
   clkcount                     = 0;
+
+  txwidx                       = 0;
+  txlen                        = 0;
+  txidx                        = 0;
+  txreq                        = 1'b0;
+  txack                        = 1'b0;
+  txbusy                       = 1'b0;
+  txsofok                      = 1'b0;
+
+  rxridx                       = 0;
+  rstthresh                    = 120000; // 10ms at 12MHz
+  suspthresh                   = 36000;  // 3ms at 12MHz
+  rxtimeout                    = 0;
+  rxdevice                     = DEVICE;
+  rxnosuspend                  = 1'b0;
+  rxreq                        = 1'b0;
+  rxack                        = 1'b0;
+  rxbusy                       = 1'b0;
+  rxstatus                     = `RXSTAT_PKT;
+  rxbitcount                   = 0;
+  rxactivity                   = 1'b0;
+
+  cntlen                       = 0;
+  cntval                       = 0;
+  cntreq                       = 1'b0;
+  cntack                       = 1'b0;
+  cntbusy                      = 1'b0;
+  cntsofok                     = 1'b0;
+
+  serbusy                      = 1'b0;
+  sersel                       = 1'b0;
+  serdp                        = 1'b1;
+  serdm                        = 1'b0;
+  seroen                       = 1'b0;
+
+  sofen                        = 1'b0;
+  sofdue                       = 1'b0;
+  sofframe                     = 0;
+  sofctlen                     = 1'b0;
+  sofctlload                   = 1'b0;
+  sofctlframe                  = 0;
+  sofctlreq                    = 1'b0;
+  sofctlack                    = 1'b0;
+  softimer                     = 0;
+
+  devaddr                      = 7'h00;
+  epstatout                    = 32'h00000000;
+  epstatin                     = 32'h00000000;
+  hsbusy                       = 1'b0;
+  hspid                        = 8'h00;
+  hsreq                        = 1'b0;
+  hsack                        = 1'b0;
+  hsstate                      = HS_IDLE;
+  hsprev                       = USB_J;
+  hsinpkt                      = 1'b0;
+
+  evirqmask                    = 3'b000;
+  evpend                       = 3'b000;
+  evclr                        = 3'b000;
+  evclrreq                     = 1'b0;
+  evclrack                     = 1'b0;
+  evwaitmask                   = 3'b000;
+  evtimeout                    = 0;
+  evwaitreq                    = 1'b0;
+  evwaitack                    = 1'b0;
+  evwaitbusy                   = 1'b0;
+  evprev                       = USB_J;
+  evse0count                   = 0;
+  evjcount                     = 0;
+  evwaitcount                  = 0;
 end
 
  // --------------------------------
@@ -125,7 +441,7 @@ end
            .DataIn             (rdata),
            .WRAck              (wack),
            .RDAck              (rack),
-           .Interrupt          (3'b000),
+           .Interrupt          (irqlevel),
            .Update             (update),
            .UpdateResponse     (updateresp),
            .Node               (node[3:0])
@@ -139,6 +455,531 @@ begin
   clkcount                     <= clkcount + 1;
 end
 
+// --------------------------------
+// Transmit engine. Shifts out txlen
+// line samples from the transmit
+// buffer, one per clock, and then
+// acknowledges the TXSEND access.
+// --------------------------------
+always @(posedge clk)
+begin
+  if (txgo)
+  begin
+    txack                      <= txreq;
+
+    if (txlen <= 1)
+      updateresp_tx            <= ~updateresp_tx;
+    else
+    begin
+      txbusy                   <= 1'b1;
+      txidx                    <= 1;
+    end
+  end
+  else if (txbusy)
+  begin
+    if (txidx == (txlen - 1))
+    begin
+      txbusy                   <= 1'b0;
+      updateresp_tx            <= ~updateresp_tx;
+    end
+    else
+      txidx                    <= txidx + 1;
+  end
+end
+
+// --------------------------------
+// Countdown. Acknowledges the
+// COUNTDOWN access after cntlen
+// clocks, or never if cntlen is 0.
+// Expiry is extended whilst the
+// serialiser is sending.
+// --------------------------------
+always @(posedge clk)
+begin
+  if (cntstart)
+  begin
+    cntack                     <= cntreq;
+
+    if (cntlen == 1 && !sersel)
+      updateresp_cnt           <= ~updateresp_cnt;
+    else
+    begin
+      cntbusy                  <= 1'b1;
+      cntval                   <= 1;
+    end
+  end
+  else if (cntbusy)
+  begin
+    if (cntlen != 0 && (cntval + 1) >= cntlen && !sersel)
+    begin
+      cntbusy                  <= 1'b0;
+      updateresp_cnt           <= ~updateresp_cnt;
+    end
+    else
+      cntval                   <= cntval + 1;
+  end
+end
+
+// --------------------------------
+// Start of frame generator and raw
+// packet serialiser. When enabled
+// in a host, an SOF becomes due
+// every 1ms, and is sent with the
+// next frame number at the first
+// transaction boundary thereafter.
+// The serialiser NRZI encodes and
+// bit stuffs serlen raw bits, then
+// sends EOP and holds the line idle
+// for SERGAPCLKS clocks. It also
+// sends the handshake responder's
+// handshake packets.
+// --------------------------------
+always @(posedge clk)
+begin
+  if (soflaunch)
+  begin
+    sofdue                     <= 1'b0;
+
+    serraw                     = {crc5(sofframe), sofframe, 8'ha5, 8'h80};
+    serlen                     = 32;
+  end
+  else if (hsstart)
+  begin
+    hsack                      <= hsreq;
+
+    serraw                     = {16'h0000, hspid, 8'h80};
+    serlen                     = 16;
+  end
+
+  if (soflaunch || hsstart)
+  begin
+    serbusy                    = 1'b1;
+    serphase                   = SER_DATA;
+    seridx                     = 0;
+    serones                    = 0;
+    serlevel                   = 1'b1;
+    serstuff                   = 1'b0;
+  end
+
+  // Apply any SOFCTRL update, with an SOF due straight away when enabled,
+  // else count out the frame period
+  if (sofctlstart)
+  begin
+    sofctlack                  <= sofctlreq;
+    sofen                      <= sofctlen;
+
+    if (sofctlload)
+      sofframe                 <= sofctlframe;
+
+    if (sofctlen && !sofen)
+    begin
+      softimer                 <= 0;
+      sofdue                   <= 1'b1;
+    end
+    else if (!sofctlen)
+      sofdue                   <= 1'b0;
+  end
+  else if (sofen)
+  begin
+    if (softimer == (SOFPERIOD - 1))
+    begin
+      softimer                 <= 0;
+      sofframe                 <= sofframe + 1;
+      sofdue                   <= 1'b1;
+    end
+    else
+      softimer                 <= softimer + 1;
+  end
+
+  if (serbusy)
+  begin
+    case (serphase)
+    SER_DATA:
+    begin
+      // A zero, or a stuffed bit after six ones, toggles the line state
+      if (serstuff)
+      begin
+        serlevel               = ~serlevel;
+        serones                = 0;
+        serstuff               = 1'b0;
+      end
+      else
+      begin
+        if (!serraw[seridx])
+        begin
+          serlevel             = ~serlevel;
+          serones              = 0;
+        end
+        else
+          serones              = serones + 1;
+
+        seridx                 = seridx + 1;
+        serstuff               = (serones == 6);
+      end
+
+      serdp                    <= serlevel;
+      serdm                    <= ~serlevel;
+      seroen                   <= 1'b1;
+
+      if (seridx == serlen && !serstuff)
+      begin
+        serphase               = SER_EOP;
+        sercount               = 0;
+      end
+    end
+
+    // Two SE0s then a J, with the outputs disabled on the J
+    SER_EOP:
+    begin
+      sercount                 = sercount + 1;
+
+      if (sercount <= 2)
+      begin
+        serdp                  <= 1'b0;
+        serdm                  <= 1'b0;
+      end
+      else
+      begin
+        serdp                  <= 1'b1;
+        serdm                  <= 1'b0;
+        seroen                 <= 1'b0;
+        serphase               = SER_GAP;
+        sercount               = 0;
+      end
+    end
+
+    default:
+    begin
+      sercount                 = sercount + 1;
+
+      if (sercount == SERGAPCLKS)
+        serbusy                = 1'b0;
+    end
+    endcase
+  end
+
+  sersel                       <= serbusy;
+end
+
+// --------------------------------
+// Handshake responder (device only).
+// Decodes tokens on the line, and
+// for an IN or OUT token to this
+// device's address on an endpoint
+// with a NAK or STALL status, the
+// transaction is claimed from the
+// receive capture engine and the
+// handshake sent after turnaround,
+// without involving the C++. An
+// OUT token's data packet is first
+// absorbed.
+// --------------------------------
+always @(posedge clk)
+begin
+  hsline                       = {(linem === 1'b1), (linep === 1'b1)};
+  hseop                        = 1'b0;
+
+  // Decode the NRZI, unstuffed bits of packets when looking at the line
+  if (DEVICE == 1 && (hsstate == HS_IDLE || hsstate == HS_ABSORB))
+  begin
+    // A packet starts with a K after idle
+    if (!hsinpkt && hsline == USB_K && hsprev == USB_J)
+    begin
+      hsinpkt                  = 1'b1;
+      hsbits                   = 0;
+      hsones                   = 0;
+      hsshift                  = 32'h00000000;
+    end
+
+    if (hsinpkt)
+    begin
+      if (hsline == USB_SE0)
+      begin
+        hsinpkt                = 1'b0;
+        hseop                  = 1'b1;
+      end
+      // Drop stuffed bits after six ones, else no change in line state is a one
+      else if (hsones == 6)
+        hsones                 = 0;
+      else
+      begin
+        hsones                 = (hsline == hsprev) ? hsones + 1 : 0;
+
+        if (hsbits < 32)
+          hsshift[hsbits]      = (hsline == hsprev);
+
+        hsbits                 = hsbits + 1;
+      end
+    end
+  end
+
+  hsprev                       = hsline;
+
+  case (hsstate)
+  HS_IDLE:
+    // On a valid token for this device, check the endpoint's status
+    if (hseop && hsbits == 32 && hsshift[7:0] == 8'h80 && hsshift[15:12] == ~hsshift[11:8] &&
+        hsshift[22:16] == devaddr && hsshift[31:27] == crc5(hsshift[26:16]))
+    begin
+      hspidval                 = hsshift[11:8];
+      hsep                     = hsshift[26:23];
+      hscount                  = 0;
+
+      if (hspidval == 4'h9)
+        hsepstat               = epstatin[{hsep, 1'b0} +: 2];
+      else if (hspidval == 4'h1)
+        hsepstat               = epstatout[{hsep, 1'b0} +: 2];
+      else
+        hsepstat               = `EPSTAT_READY;
+
+      if (hsepstat == `EPSTAT_NAK || hsepstat == `EPSTAT_STALL)
+      begin
+        hsbusy                 <= 1'b1;
+        hspid                  <= (hsepstat == `EPSTAT_NAK) ? 8'h5a : 8'h1e;
+        hsstate                = (hspidval == 4'h1) ? HS_ABSORB : HS_TURN;
+      end
+    end
+
+  // Wait for the OUT token's data packet, giving up if none arrives
+  HS_ABSORB:
+    if (hseop)
+    begin
+      hsstate                  = HS_TURN;
+      hscount                  = 0;
+    end
+    else if (!hsinpkt)
+    begin
+      hscount                  = hscount + 1;
+
+      if (hscount >= HSABSORBCLKS)
+      begin
+        hsbusy                 <= 1'b0;
+        hsstate                = HS_IDLE;
+      end
+    end
+
+  // Count the turnaround once the line is back at idle, then send the handshake
+  HS_TURN:
+  begin
+    if (hsline == USB_J)
+      hscount                  = hscount + 1;
+
+    if (hscount == HSTURNCLKS)
+    begin
+      hsreq                    <= ~hsreq;
+      hsseen                   = 1'b0;
+      hsstate                  = HS_SEND;
+    end
+  end
+
+  // Release the transaction once the serialiser has sent the handshake
+  default:
+    if (sersel)
+      hsseen                   = 1'b1;
+    else if (hsseen)
+    begin
+      hsbusy                   <= 1'b0;
+      hsstate                  = HS_IDLE;
+    end
+  endcase
+end
+
+// --------------------------------
+// Line event detectors. Flags line
+// state changes, SE0 held for the
+// reset period and J held for the
+// suspend period as pending events,
+// and acknowledges an EVWAIT access
+// when a waited for event occurs or
+// the wait times out.
+// --------------------------------
+always @(posedge clk)
+begin
+  evline                       = {(linem === 1'b1), (linep === 1'b1)};
+  evnew                        = 3'b000;
+
+  // Detect a change in line state
+  if (evline != evprev)
+    evnew[`EV_LINECHG]         = 1'b1;
+
+  evprev                       <= evline;
+
+  // Count consecutive SE0 and J states, flagging when they reach the
+  // reset and suspend periods respectively
+  evse0count                   = (evline == USB_SE0) ? evse0count + 1 : 0;
+  evjcount                     = (evline == USB_J)   ? evjcount   + 1 : 0;
+
+  if (evse0count == rstthresh)
+    evnew[`EV_RESET]           = 1'b1;
+
+  if (evjcount == suspthresh)
+    evnew[`EV_SUSPEND]         = 1'b1;
+
+  evstate                      = evpend;
+
+  // Clear any events requested from an EVSTATUS write
+  if (evclrstart)
+  begin
+    evclrack                   <= evclrreq;
+    evstate                    = evstate & ~evclr;
+  end
+
+  // Starting a wait clears the events being waited on, so only new events complete it
+  if (evwaitstart)
+  begin
+    evwaitack                  <= evwaitreq;
+    evstate                    = evstate & ~evwaitmask;
+    evwaitbusy                 = 1'b1;
+    evwaitcount                = 0;
+  end
+
+  evstate                      = evstate | evnew;
+  evpend                       <= evstate;
+
+  // Acknowledge the EVWAIT access when a waited for event is pending or on timeout
+  if (evwaitbusy)
+  begin
+    evwaitcount                = evwaitcount + 1;
+
+    if ((evstate & evwaitmask) != 3'b000 || (evtimeout != 0 && evwaitcount >= evtimeout))
+    begin
+      evwaitbusy               = 1'b0;
+      updateresp_ev            <= ~updateresp_ev;
+    end
+  end
+end
+
+// --------------------------------
+// Receive capture engine. Samples
+// the line once per clock, waiting
+// for a packet and capturing its
+// samples up to the EOP. Reset,
+// suspend, disconnection and
+// timeout are also detected. The
+// RXCAPTURE access is acknowledged
+// when any of these occur.
+// --------------------------------
+always @(posedge clk)
+begin
+  rxdone                       = 1'b0;
+
+  if (rxstart)
+  begin
+    rxack                      <= rxreq;
+    rxbusy                     = 1'b1;
+    rxidle                     = 1'b1;
+    rxlookforreset             = 1'b0;
+    rxrstcount                 = 0;
+    rxidlecount                = 0;
+    rxeopcount                 = 0;
+    rxbits                     = 0;
+    rxactivity                 <= 1'b0;
+  end
+
+  // Anything seen whilst the handshake responder is handling a transaction
+  // is discarded, with the capture starting afresh afterwards
+  if (rxbusy && hsbusy)
+  begin
+    rxidle                     = 1'b1;
+    rxlookforreset             = 1'b0;
+    rxrstcount                 = 0;
+    rxidlecount                = 0;
+    rxeopcount                 = 0;
+    rxbits                     = 0;
+  end
+  else if (rxbusy)
+  begin
+    rxline                     = {(linem === 1'b1), (linep === 1'b1)};
+
+    // If a host and SE0 seen when idle, there is no device connected
+    if (!rxdevice && rxidle && rxline == USB_SE0)
+    begin
+      rxstatus                 <= `RXSTAT_DISCONNECTED;
+      rxdone                   = 1'b1;
+    end
+    else
+    begin
+      // Flag any activity that would bring a device out of suspension
+      if (rxline == USB_K || (rxdevice && rxline == USB_SE0))
+        rxactivity             <= 1'b1;
+
+      // If not in the middle of a reset detection and K seen, then line is not idle
+      if (!rxlookforreset && rxline == USB_K)
+        rxidle                 = 1'b0;
+      // If idle and an SE0 seen then this may be a reset
+      else if (rxdevice && rxidle && rxline == USB_SE0)
+      begin
+        rxidle                 = 1'b0;
+        rxlookforreset         = 1'b1;
+        rxrstcount             = rxrstcount + 1;
+      end
+
+      // If in the middle of a potential reset, keep track of the number of consecutive
+      // SE0 line states. When a non-SE0 state occurs, the status is reset if seen
+      // sufficient consecutive SE0s, else an error for unexplained SE0s.
+      if (rxlookforreset)
+      begin
+        if (rxline == USB_SE0)
+          rxrstcount           = rxrstcount + 1;
+        else
+        begin
+          rxstatus             <= (rxrstcount >= rstthresh) ? `RXSTAT_RESET : `RXSTAT_ERROR;
+          rxdone               = 1'b1;
+        end
+      end
+
+      if (!rxdone)
+      begin
+        // If not idle, then capture the packet samples until the 3 bits of EOP
+        if (!rxidle && !rxlookforreset)
+        begin
+          rxidlecount          = 0;
+
+          rxbuf[rxbits[13:4]][{1'b0, rxbits[3:0]}] <= rxline[0];
+          rxbuf[rxbits[13:4]][{1'b1, rxbits[3:0]}] <= rxline[1];
+          rxbits               = rxbits + 1;
+
+          if (!rxeopcount && rxline == USB_SE0)
+            rxeopcount         = 1;
+          else if (rxeopcount)
+          begin
+            rxeopcount         = rxeopcount + 1;
+
+            if (rxeopcount == 3)
+            begin
+              rxstatus         <= `RXSTAT_PKT;
+              rxdone           = 1'b1;
+            end
+          end
+        end
+        else
+        begin
+          rxidlecount          = rxidlecount + 1;
+
+          if (rxdevice && !rxnosuspend && rxidlecount >= suspthresh)
+          begin
+            rxstatus           <= `RXSTAT_SUSPEND;
+            rxdone             = 1'b1;
+          end
+          else if (rxtimeout != 0 && rxidlecount >= rxtimeout)
+          begin
+            rxstatus           <= `RXSTAT_NORESPONSE;
+            rxdone             = 1'b1;
+          end
+        end
+      end
+    end
+
+    // On completion, save the bit count and acknowledge the RXCAPTURE access
+    if (rxdone)
+    begin
+      rxbusy                   = 1'b0;
+      rxbitcount               <= rxbits;
+      updateresp_rx            <= ~updateresp_rx;
+    end
+  end
+end
+
 // --------------------------------
 // Process to map VProc accesses
 // to registers and simulation
@@ -151,6 +992,9 @@ begin
   // Default read data value
   rdata                        = 32'h00000000;
 
+  // Default to acknowledging the access immediately
+  holdack                      = 1'b0;
+
   // Process when an access is valid
   if (wr === 1'b1 || rd === 1'b1)
   begin
@@ -183,6 +1027,155 @@ begin
       rdata                    = {30'h0000, linem, linep};
     end
 
+    `TXBUFIDX:
+    begin
+      if (wr === 1'b1)
+        txwidx                 = wdata;
+      rdata                    = txwidx;
+    end
+
+    `TXBUFDATA:
+      if (wr === 1'b1)
+      begin
+        txbuf[txwidx[9:0]]     = wdata;
+        txwidx                 = txwidx + 1;
+      end
+
+    `RSTCOUNT:
+    begin
+      if (wr === 1'b1)
+        rstthresh              = wdata;
+      rdata                    = rstthresh;
+    end
+
+    `SUSPCOUNT:
+    begin
+      if (wr === 1'b1)
+        suspthresh             = wdata;
+      rdata                    = suspthresh;
+    end
+
+    // Start a receive capture, with wdata[31] set for a device, wdata[30]
+    // set to not report suspension (when already suspended) and wdata[29:0]
+    // an idle timeout in clocks (0 for none). Outputs are disabled and the
+    // acknowledge is held off until the capture completes.
+    `RXCAPTURE:
+      if (wr === 1'b1)
+      begin
+        oen                    = 1'b0;
+        rxdevice               = wdata[31];
+        rxnosuspend            = wdata[30];
+        rxtimeout              = wdata[29:0];
+        rxridx                 = 0;
+        rxreq                  = ~rxreq;
+        holdack                = 1'b1;
+      end
+
+    `RXSTATUS:    rdata        = {11'h000, rxactivity, rxstatus, rxbitcount};
+
+    `RXBUFDATA:
+    begin
+      rdata                    = rxbuf[rxridx[9:0]];
+      rxridx                   = rxridx + 1;
+    end
+
+    `EVIRQMASK:
+    begin
+      if (wr === 1'b1)
+        evirqmask              = wdata[2:0];
+      rdata                    = {29'h0000, evirqmask};
+    end
+
+    // Pending events, cleared by writing 1s to the event bits
+    `EVSTATUS:
+    begin
+      if (wr === 1'b1)
+      begin
+        evclr                  = wdata[2:0];
+        evclrreq               = ~evclrreq;
+      end
+      rdata                    = {29'h0000, evpend};
+    end
+
+    // Wait for one of the events in wdata[2:0], with wdata[31:3] a timeout
+    // in clocks (0 for none). The acknowledge is held off until an event
+    // occurs or the wait times out.
+    `EVWAIT:
+      if (wr === 1'b1)
+      begin
+        evwaitmask             = wdata[2:0];
+        evtimeout              = wdata[31:3];
+        evwaitreq              = ~evwaitreq;
+        holdack                = 1'b1;
+      end
+
+    // Hold off the acknowledge for wdata[30:0] clock cycles, with the line
+    // left in its current state. A count of 0 never acknowledges. With
+    // wdata[31] set, a due SOF may be sent during the countdown.
+    `COUNTDOWN:
+      if (wr === 1'b1)
+      begin
+        cntlen                 = {1'b0, wdata[`TXLENMSB:0]};
+        cntsofok               = wdata[`TXSOFOKBIT];
+        cntreq                 = ~cntreq;
+        holdack                = 1'b1;
+      end
+
+    // Send the loaded transmit buffer for wdata[30:0] bits. The acknowledge
+    // is held off until the whole packet has been sent. With wdata[31] set,
+    // a due SOF is sent first.
+    `TXSEND:
+      if (wr === 1'b1 && wdata[`TXLENMSB:0] != 0)
+      begin
+        txlen                  = {1'b0, wdata[`TXLENMSB:0]};
+        txsofok                = wdata[`TXSOFOKBIT];
+        txreq                  = ~txreq;
+        holdack                = 1'b1;
+      end
+
+    // Device address for the handshake responder
+    `DEVADDR:
+    begin
+      if (wr === 1'b1)
+        devaddr                = wdata[6:0];
+      rdata                    = {25'h0000000, devaddr};
+    end
+
+    // Handshake responder endpoint statuses, two bits per endpoint
+    `EPSTATOUT:
+    begin
+      if (wr === 1'b1)
+        epstatout              = wdata;
+      rdata                    = epstatout;
+    end
+
+    `EPSTATIN:
+    begin
+      if (wr === 1'b1)
+        epstatin               = wdata;
+      rdata                    = epstatin;
+    end
+
+    // Physical interface type of this model
+    `PHYIF:       rdata        = `PHYIF_SERIAL;
+
+    // SOF generator control, with wdata[0] enabling generation (host only)
+    // and wdata[1] set to load the frame number from wdata[26:16]
+    `SOFCTRL:
+    begin
+      if (wr === 1'b1)
+      begin
+        sofctlen               = wdata[0];
+        sofctlload             = wdata[1];
+        sofctlframe            = wdata[26:16];
+        sofctlreq              = ~sofctlreq;
+      end
+      rdata                    = {31'h0000, sofen};
+    end
+
+    // Frame number of the current frame
+    `SOFFRAME:    rdata        = {21'h000000, sofframe};
+
     `UVH_STOP:
       if (wr === 1'b1) $stop;
 
@@ -198,8 +1191,10 @@ begin
     endcase
   end
 
-    // Finished processing for this update, so acknowledge to VProc (by invertint updateresp)
-    updateresp = ~updateresp;
+    // Finished processing for this update, so acknowledge to VProc (by invertint updateresp),
+    // unless a blocking command was started which will acknowledge on completion
+    if (!holdack)
+      updateresp_imm = ~updateresp_imm;
 end
 
 endmodule
\ No newline at end of file
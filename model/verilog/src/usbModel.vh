@@ -29,6 +29,58 @@
 `define PULLUP                 3
 `define OUTEN                  4
 `define LINE                   5
+`define TXBUFIDX               6
+`define TXBUFDATA              7
+`define TXSEND                 8
+`define RSTCOUNT               9
+`define SUSPCOUNT              10
+`define RXCAPTURE              11
+`define RXSTATUS               12
+`define RXBUFDATA              13
+`define COUNTDOWN              14
+`define EVIRQMASK              15
+`define EVSTATUS               16
+`define EVWAIT                 17
+`define SOFCTRL                18
+`define SOFFRAME               19
+`define DEVADDR                20
+`define EPSTATOUT              21
+`define EPSTATIN               22
+`define PHYIF                  23
+
+// TXSEND and COUNTDOWN write fields. Bits 30:0 are the length (TXSEND:
+// bits of the loaded packet for a serial usbModel, with UTMI using bits
+// 15:0 as a byte count; COUNTDOWN: clock ticks), and bit 31 is the SOF
+// OK flag, marking a transaction boundary at which a due hardware SOF
+// may be sent first (serial host only).
+`define TXLENMSB               30
+`define TXSOFOKBIT             31
+
+// Receive capture status codes (RXSTATUS bits 19:16)
+`define RXSTAT_PKT             0
+`define RXSTAT_DISCONNECTED    1
+`define RXSTAT_RESET           2
+`define RXSTAT_ERROR           3
+`define RXSTAT_SUSPEND         4
+`define RXSTAT_NORESPONSE      5
+
+// Line event bit positions (EVIRQMASK, EVSTATUS and EVWAIT). The VProc
+// interrupt level for an event is its bit position plus 1.
+`define EV_LINECHG             0
+`define EV_SUSPEND             1
+`define EV_RESET               2
+
+// Endpoint handshake responder status codes (EPSTATOUT and EPSTATIN, two
+// bits per endpoint)
+`define EPSTAT_READY           0
+`define EPSTAT_NAK             1
+`define EPSTAT_STALL           2
+
+// Physical interface types (PHYIF). PHYIF_TLM is a transaction level
+// C++ backend (see usbDirectNode), passing raw packets as for UTMI.
+`define PHYIF_SERIAL           0
+`define PHYIF_UTMI             1
+`define PHYIF_TLM              2
 
 `define UVH_STOP               1001
 `define UVH_FINISH             1002
@@ -0,0 +1,788 @@
+// =============================================================
+// Virtual USB component with a UTMI+ interface
+//
+// Copyright (c) 2024 Simon Southwell.
+//
+// This file is part of usbModel pattern generator.
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+// =============================================================
+//
+// Variant of usbModel that connects to a DUT's UTMI+ (level 0)
+// 8 bit parallel interface, rather than the serial D+/D- lines.
+// The model takes the place of the PHY and the far end of the
+// link. Packets are moved a byte at a time, without SYNC, NRZI,
+// bit stuffing or EOP, with the C++ usbPkt in raw mode (the
+// PHYIF register reads as PHYIF_UTMI).
+//
+// Packets sent by the C++ are presented on DataIn with RxActive
+// and RxValid. Packets sent by the DUT on DataOut with TxValid
+// are accepted with TxReady and captured for the C++. A byte is
+// transferred every TICKDIV clocks, so the default of 8 gives
+// full speed byte timing with a 12MHz clock.
+//
+// LineState reflects the model driving the line (via OUTEN and
+// LINE), packets in either direction, and otherwise the idle
+// state of a connected link (J) or disconnection (SE0). A host
+// DUT signals reset with OpMode 2'b10 and TxValid with a DataOut
+// of 0, and a device DUT connects with TermSelect.
+//
+// =============================================================
+
+`timescale 1 ns / 1 ps
+
+`include "usbModel.vh"
+
+module usbModelUtmi
+           #(parameter DEVICE    = 1,  // Select whether a device (1) or host (0)
+             parameter TICKDIV   = 8,  // Clocks per byte transferred
+             parameter NODENUM   = 0,  // Node number. Must be unique for each usbModel instantiation and any other VProc based component.
+             parameter GUI_RUN   = 0   // Flag whether running in a GUI (1) or not (0)
+            )
+            (
+             input        clk,
+             input        nreset,
+
+             // UTMI+ interface, named from the DUT link's side
+             input  [7:0] DataOut,
+             input        TxValid,
+             output       TxReady,
+             output [7:0] DataIn,
+             output       RxValid,
+             output       RxActive,
+             output       RxError,
+             output [1:0] LineState,
+             input        TermSelect,
+             input  [1:0] OpMode
+            );
+
+// Transmit and receive buffer sizes in 32 bit words, each holding 4
+// bytes, with the first in bits 7:0. Matches MAXBUFSIZE bytes in the
+// C++ model.
+localparam   TXBUFWORDS        = 1024;
+localparam   RXBUFWORDS        = 1024;
+
+// Line states
+localparam   USB_SE0           = 2'b00;
+localparam   USB_J             = 2'b01;
+localparam   USB_K             = 2'b10;
+
+// --------------------------------
+// Register definitions
+// --------------------------------
+reg          oen;
+reg          nopullup;
+reg          dp;
+reg          dm;
+
+// VP Interface signals
+reg   [31:0] rdata;
+reg          updateresp_imm;
+reg          updateresp_tx;
+reg          updateresp_rx;
+reg          updateresp_cnt;
+reg          updateresp_ev;
+reg          holdack;
+
+integer      clkcount;
+
+// Transmit engine state
+reg   [31:0] txbuf [0:TXBUFWORDS-1];
+reg   [31:0] txwidx;
+reg   [15:0] txlen;
+reg   [15:0] txidx;
+reg          txreq;
+reg          txack;
+reg          txbusy;
+integer      txtick;
+
+// UTMI receive side outputs
+reg    [7:0] utmidatain;
+reg          utmirxvalid;
+reg          utmirxactive;
+
+// UTMI transmit side pacing
+reg          utmitxready;
+integer      rdytick;
+
+// Receive capture engine state
+reg   [31:0] rxbuf [0:RXBUFWORDS-1];
+reg   [31:0] rxridx;
+reg   [31:0] rstthresh;
+reg   [31:0] suspthresh;
+reg   [29:0] rxtimeout;
+reg          rxdevice;
+reg          rxnosuspend;
+reg          rxreq;
+reg          rxack;
+reg          rxbusy;
+reg    [3:0] rxstatus;
+reg   [15:0] rxbitcount;
+reg          rxactivity;
+
+// Countdown state
+reg   [31:0] cntlen;
+reg   [31:0] cntval;
+reg          cntreq;
+reg          cntack;
+reg          cntbusy;
+
+// Line event detector state
+reg    [2:0] evirqmask;
+reg    [2:0] evpend;
+reg    [2:0] evclr;
+reg          evclrreq;
+reg          evclrack;
+reg    [2:0] evwaitmask;
+reg   [28:0] evtimeout;
+reg          evwaitreq;
+reg          evwaitack;
+reg          evwaitbusy;
+reg    [1:0] evprev;
+integer      evse0count;
+integer      evjcount;
+integer      evwaitcount;
+
+// Line event detector working state
+reg    [2:0] evnew;
+reg    [2:0] evstate;
+
+// Handshake responder registers, held for compatibility with usbModel
+reg    [6:0] devaddr;
+reg   [31:0] epstatout;
+reg   [31:0] epstatin;
+
+// Receive capture working state
+reg          rxinpkt;
+reg          rxlookforreset;
+reg          rxdone;
+integer      rxrstcount;
+integer      rxidlecount;
+integer      rxbytes;
+
+// --------------------------------
+// Signal definitions
+// --------------------------------
+
+wire  [31:0] addr;
+wire  [31:0] wdata;
+wire         wr, rd;
+wire         wack              = 1'b1;
+wire         rack              = 1'b1;
+wire  [31:0] node              = NODENUM;
+wire         update;
+wire         updateresp;
+
+wire         txstart;
+wire         txsel;
+wire         rxstart;
+wire         cntstart;
+wire         evclrstart;
+wire         evwaitstart;
+wire   [2:0] evirq;
+wire   [2:0] irqlevel;
+wire         dutreset;
+wire         dutactive;
+wire   [1:0] busline;
+
+// --------------------------------
+// Combinatorial logic
+// --------------------------------
+
+// Acknowledge to VProc is either immediate (from the update process) or
+// delayed until a blocking command completes (from the engine processes)
+assign updateresp              = updateresp_imm ^ updateresp_tx ^ updateresp_rx ^ updateresp_cnt ^ updateresp_ev;
+
+// Blocking command requests are pending from the register write until the
+// next clock edge, as for usbModel
+assign txstart                 = txreq ^ txack;
+assign txsel                   = txstart | txbusy;
+assign rxstart                 = rxreq ^ rxack;
+assign cntstart                = cntreq ^ cntack;
+assign evclrstart              = evclrreq ^ evclrack;
+assign evwaitstart             = evwaitreq ^ evwaitack;
+
+// The VProc interrupt level is that of the highest priority pending event
+// enabled in the interrupt mask, with reset the highest.
+assign evirq                   = evpend & evirqmask;
+assign irqlevel                = evirq[`EV_RESET]   ? (`EV_RESET   + 1) :
+                                 evirq[`EV_SUSPEND] ? (`EV_SUSPEND + 1) :
+                                 evirq[`EV_LINECHG] ? (`EV_LINECHG + 1) :
+                                                      3'd0;
+
+// A host DUT drives reset by transmitting zeros with bit stuffing and NRZI
+// disabled. Any other transmission is a packet.
+assign dutreset                = TxValid && (OpMode == 2'b10) && (DataOut == 8'h00);
+assign dutactive               = TxValid && !dutreset;
+
+// State of the virtual bus: driven by this model, else active with a
+// packet in either direction (K), else SE0 for a DUT reset, else idle
+// when connected.
+assign busline                 = oen       ? {dm, dp} :
+                                 txsel     ? USB_K    :
+                                 dutreset  ? USB_SE0  :
+                                 dutactive ? USB_K    :
+                                 DEVICE    ? (nopullup   ? USB_SE0 : USB_J) :
+                                             (TermSelect ? USB_J   : USB_SE0);
+
+// UTMI outputs
+assign TxReady                 = utmitxready;
+assign DataIn                  = utmidatain;
+assign RxValid                 = utmirxvalid;
+assign RxActive                = utmirxactive;
+assign RxError                 = 1'b0;
+assign LineState               = busline;
+
+// --------------------------------
+// Initial process
+// --------------------------------
+initial
+begin
+  oen                          = 1'b0;
+  dp                           = 1'b1;
+  dm                           = 1'b0;
+  nopullup                     = DEVICE ? 1'b1 : 1'b0; // Default disabled for device, enabled for host
+  updateresp_imm               = 1'b1;
+  updateresp_tx                = 1'b0;
+  updateresp_rx                = 1'b0;
+  updateresp_cnt               = 1'b0;
+  updateresp_ev                = 1'b0;
+  clkcount                     = 0;
+
+  txwidx                       = 0;
+  txlen                        = 0;
+  txidx                        = 0;
+  txreq                        = 1'b0;
+  txack                        = 1'b0;
+  txbusy                       = 1'b0;
+  txtick                       = 0;
+
+  utmidatain                   = 8'h00;
+  utmirxvalid                  = 1'b0;
+  utmirxactive                 = 1'b0;
+  utmitxready                  = 1'b0;
+  rdytick                      = 0;
+
+  rxridx                       = 0;
+  rstthresh                    = 120000; // 10ms at 12MHz
+  suspthresh                   = 36000;  // 3ms at 12MHz
+  rxtimeout                    = 0;
+  rxdevice                     = DEVICE;
+  rxnosuspend                  = 1'b0;
+  rxreq                        = 1'b0;
+  rxack                        = 1'b0;
+  rxbusy                       = 1'b0;
+  rxstatus                     = `RXSTAT_PKT;
+  rxbitcount                   = 0;
+  rxactivity                   = 1'b0;
+
+  cntlen                       = 0;
+  cntval                       = 0;
+  cntreq                       = 1'b0;
+  cntack                       = 1'b0;
+  cntbusy                      = 1'b0;
+
+  evirqmask                    = 3'b000;
+  evpend                       = 3'b000;
+  evclr                        = 3'b000;
+  evclrreq                     = 1'b0;
+  evclrack                     = 1'b0;
+  evwaitmask                   = 3'b000;
+  evtimeout                    = 0;
+  evwaitreq                    = 1'b0;
+  evwaitack                    = 1'b0;
+  evwaitbusy                   = 1'b0;
+  evprev                       = USB_J;
+  evse0count                   = 0;
+  evjcount                     = 0;
+  evwaitcount                  = 0;
+
+  devaddr                      = 7'h00;
+  epstatout                    = 32'h00000000;
+  epstatin                     = 32'h00000000;
+end
+
+ // --------------------------------
+ // Virtual Processor
+ // --------------------------------
+ VProc vp (.Clk                (clk),
+           .Addr               (addr),
+           .WE                 (wr),
+           .RD                 (rd),
+           .DataOut            (wdata),
+           .DataIn             (rdata),
+           .WRAck              (wack),
+           .RDAck              (rack),
+           .Interrupt          (irqlevel),
+           .Update             (update),
+           .UpdateResponse     (updateresp),
+           .Node               (node[3:0])
+           );
+
+// --------------------------------
+// Keep a clock tick count
+// --------------------------------
+always @(posedge clk)
+begin
+  clkcount                     <= clkcount + 1;
+end
+
+// --------------------------------
+// Transmit engine. Presents the
+// txlen bytes of the transmit
+// buffer to the DUT, one every
+// TICKDIV clocks, framed by
+// RxActive, and then acknowledges
+// the TXSEND access.
+// --------------------------------
+always @(posedge clk)
+begin
+  utmirxvalid                  <= 1'b0;
+
+  if (txstart)
+  begin
+    txack                      <= txreq;
+    txbusy                     <= 1'b1;
+    txidx                      <= 0;
+    txtick                     <= 0;
+    utmirxactive               <= 1'b1;
+  end
+  else if (txbusy)
+  begin
+    if (txtick == (TICKDIV - 1))
+    begin
+      txtick                   <= 0;
+
+      // Send the next byte, or end the packet when all sent
+      if (txidx < txlen)
+      begin
+        utmidatain             <= txbuf[txidx[11:2]][{txidx[1:0], 3'b000} +: 8];
+        utmirxvalid            <= 1'b1;
+        txidx                  <= txidx + 1;
+      end
+      else
+      begin
+        utmirxactive           <= 1'b0;
+        txbusy                 <= 1'b0;
+        updateresp_tx          <= ~updateresp_tx;
+      end
+    end
+    else
+      txtick                   <= txtick + 1;
+  end
+end
+
+// --------------------------------
+// Transmit pacing. Accepts a byte
+// from the DUT every TICKDIV clocks
+// whilst TxValid is asserted,
+// whether captured or not.
+// --------------------------------
+always @(posedge clk)
+begin
+  if (TxValid && !utmitxready)
+  begin
+    if (rdytick >= (TICKDIV - 1))
+    begin
+      rdytick                  <= 0;
+      utmitxready              <= 1'b1;
+    end
+    else
+      rdytick                  <= rdytick + 1;
+  end
+  else
+  begin
+    // Stay ready when a byte per clock, with the ready clock
+    // counting towards the next byte
+    utmitxready                <= TxValid && (TICKDIV <= 1);
+    rdytick                    <= TxValid ? 1 : 0;
+  end
+end
+
+// --------------------------------
+// Countdown. Acknowledges the
+// COUNTDOWN access after cntlen
+// clocks, or never if cntlen is 0.
+// --------------------------------
+always @(posedge clk)
+begin
+  if (cntstart)
+  begin
+    cntack                     <= cntreq;
+
+    if (cntlen == 1)
+      updateresp_cnt           <= ~updateresp_cnt;
+    else
+    begin
+      cntbusy                  <= 1'b1;
+      cntval                   <= 1;
+    end
+  end
+  else if (cntbusy)
+  begin
+    if ((cntval + 1) == cntlen)
+    begin
+      cntbusy                  <= 1'b0;
+      updateresp_cnt           <= ~updateresp_cnt;
+    end
+    else
+      cntval                   <= cntval + 1;
+  end
+end
+
+// --------------------------------
+// Line event detectors, as for
+// usbModel but on the virtual bus
+// state.
+// --------------------------------
+always @(posedge clk)
+begin
+  evnew                        = 3'b000;
+
+  // Detect a change in line state
+  if (busline != evprev)
+    evnew[`EV_LINECHG]         = 1'b1;
+
+  evprev                       <= busline;
+
+  // Count consecutive SE0 and J states, flagging when they reach the
+  // reset and suspend periods respectively
+  evse0count                   = (busline == USB_SE0) ? evse0count + 1 : 0;
+  evjcount                     = (busline == USB_J)   ? evjcount   + 1 : 0;
+
+  if (evse0count == rstthresh)
+    evnew[`EV_RESET]           = 1'b1;
+
+  if (evjcount == suspthresh)
+    evnew[`EV_SUSPEND]         = 1'b1;
+
+  evstate                      = evpend;
+
+  // Clear any events requested from an EVSTATUS write
+  if (evclrstart)
+  begin
+    evclrack                   <= evclrreq;
+    evstate                    = evstate & ~evclr;
+  end
+
+  // Starting a wait clears the events being waited on, so only new events complete it
+  if (evwaitstart)
+  begin
+    evwaitack                  <= evwaitreq;
+    evstate                    = evstate & ~evwaitmask;
+    evwaitbusy                 = 1'b1;
+    evwaitcount                = 0;
+  end
+
+  evstate                      = evstate | evnew;
+  evpend                       <= evstate;
+
+  // Acknowledge the EVWAIT access when a waited for event is pending or on timeout
+  if (evwaitbusy)
+  begin
+    evwaitcount                = evwaitcount + 1;
+
+    if ((evstate & evwaitmask) != 3'b000 || (evtimeout != 0 && evwaitcount >= evtimeout))
+    begin
+      evwaitbusy               = 1'b0;
+      updateresp_ev            <= ~updateresp_ev;
+    end
+  end
+end
+
+// --------------------------------
+// Receive capture engine. Captures
+// the bytes of a DUT packet as they
+// are accepted, up to the end of
+// TxValid. Reset, suspend,
+// disconnection and timeout are
+// detected as for usbModel. The
+// RXCAPTURE access is acknowledged
+// when any of these occur.
+// --------------------------------
+always @(posedge clk)
+begin
+  rxdone                       = 1'b0;
+
+  if (rxstart)
+  begin
+    rxack                      <= rxreq;
+    rxbusy                     = 1'b1;
+    rxinpkt                    = 1'b0;
+    rxlookforreset             = 1'b0;
+    rxrstcount                 = 0;
+    rxidlecount                = 0;
+    rxbytes                    = 0;
+    rxactivity                 <= 1'b0;
+  end
+
+  if (rxbusy)
+  begin
+    // If a host and SE0 seen when idle, there is no device connected
+    if (!rxdevice && !rxinpkt && busline == USB_SE0)
+    begin
+      rxstatus                 <= `RXSTAT_DISCONNECTED;
+      rxdone                   = 1'b1;
+    end
+    // If a device and SE0 seen when idle, this may be a reset
+    else if (rxdevice && !rxinpkt && busline == USB_SE0)
+    begin
+      rxactivity               <= 1'b1;
+      rxlookforreset           = 1'b1;
+      rxrstcount               = rxrstcount + 1;
+    end
+    // At the end of a potential reset, the status is reset if seen sufficient
+    // consecutive SE0s, else an error for unexplained SE0s.
+    else if (rxlookforreset)
+    begin
+      rxstatus                 <= (rxrstcount >= rstthresh) ? `RXSTAT_RESET : `RXSTAT_ERROR;
+      rxdone                   = 1'b1;
+    end
+    // Capture each byte of a DUT packet as it is accepted
+    else if (dutactive)
+    begin
+      rxinpkt                  = 1'b1;
+      rxidlecount              = 0;
+      rxactivity               <= 1'b1;
+
+      if (utmitxready)
+      begin
+        rxbuf[rxbytes[11:2]][{rxbytes[1:0], 3'b000} +: 8] <= DataOut;
+        rxbytes                = rxbytes + 1;
+      end
+    end
+    // The packet ends when TxValid is deasserted
+    else if (rxinpkt)
+    begin
+      rxstatus                 <= `RXSTAT_PKT;
+      rxdone                   = 1'b1;
+    end
+    else
+    begin
+      rxidlecount              = rxidlecount + 1;
+
+      if (rxdevice && !rxnosuspend && rxidlecount >= suspthresh)
+      begin
+        rxstatus               <= `RXSTAT_SUSPEND;
+        rxdone                 = 1'b1;
+      end
+      else if (rxtimeout != 0 && rxidlecount >= rxtimeout)
+      begin
+        rxstatus               <= `RXSTAT_NORESPONSE;
+        rxdone                 = 1'b1;
+      end
+    end
+
+    // On completion, save the count (in bits) and acknowledge the RXCAPTURE access
+    if (rxdone)
+    begin
+      rxbusy                   = 1'b0;
+      rxbitcount               <= rxbytes * 8;
+      updateresp_rx            <= ~updateresp_rx;
+    end
+  end
+end
+
+// --------------------------------
+// Process to map VProc accesses
+// to registers and simulation
+// control.
+// --------------------------------
+
+// Addressable read/write state from VProc
+always @(update)
+begin
+  // Default read data value
+  rdata                        = 32'h00000000;
+
+  // Default to acknowledging the access immediately
+  holdack                      = 1'b0;
+
+  // Process when an access is valid
+  if (wr === 1'b1 || rd === 1'b1)
+  begin
+    case(addr)
+    `NODE_NUM:    rdata        = node;
+    `CLKCOUNT:    rdata        = clkcount;
+    `RESET_STATE: rdata        = {31'h0000, ~nreset};
+    `PHYIF:       rdata        = `PHYIF_UTMI;
+
+    `PULLUP:
+    begin
+      if (wr === 1'b1)
+        nopullup               = ~wdata[0];
+      rdata                    = {31'h0000, nopullup};
+    end
+
+    `OUTEN:
+    begin
+      if (wr === 1'b1)
+        oen                    = wdata[0];
+      rdata                    = {31'h0000, oen};
+    end
+
+    `LINE:
+    begin
+      if (wr === 1'b1)
+      begin
+        dp                     = wdata[0];
+        dm                     = wdata[1];
+      end
+      rdata                    = {30'h0000, busline};
+    end
+
+    `TXBUFIDX:
+    begin
+      if (wr === 1'b1)
+        txwidx                 = wdata;
+      rdata                    = txwidx;
+    end
+
+    `TXBUFDATA:
+      if (wr === 1'b1)
+      begin
+        txbuf[txwidx[9:0]]     = wdata;
+        txwidx                 = txwidx + 1;
+      end
+
+    `RSTCOUNT:
+    begin
+      if (wr === 1'b1)
+        rstthresh              = wdata;
+      rdata                    = rstthresh;
+    end
+
+    `SUSPCOUNT:
+    begin
+      if (wr === 1'b1)
+        suspthresh             = wdata;
+      rdata                    = suspthresh;
+    end
+
+    // Start a receive capture, with fields as for usbModel
+    `RXCAPTURE:
+      if (wr === 1'b1)
+      begin
+        oen                    = 1'b0;
+        rxdevice               = wdata[31];
+        rxnosuspend            = wdata[30];
+        rxtimeout              = wdata[29:0];
+        rxridx                 = 0;
+        rxreq                  = ~rxreq;
+        holdack                = 1'b1;
+      end
+
+    `RXSTATUS:    rdata        = {11'h000, rxactivity, rxstatus, rxbitcount};
+
+    `RXBUFDATA:
+    begin
+      rdata                    = rxbuf[rxridx[9:0]];
+      rxridx                   = rxridx + 1;
+    end
+
+    `EVIRQMASK:
+    begin
+      if (wr === 1'b1)
+        evirqmask              = wdata[2:0];
+      rdata                    = {29'h0000, evirqmask};
+    end
+
+    `EVSTATUS:
+    begin
+      if (wr === 1'b1)
+      begin
+        evclr                  = wdata[2:0];
+        evclrreq               = ~evclrreq;
+      end
+      rdata                    = {29'h0000, evpend};
+    end
+
+    `EVWAIT:
+      if (wr === 1'b1)
+      begin
+        evwaitmask             = wdata[2:0];
+        evtimeout              = wdata[31:3];
+        evwaitreq              = ~evwaitreq;
+        holdack                = 1'b1;
+      end
+
+    // Hold off the acknowledge for wdata[30:0] clock cycles. There is no
+    // SOF generator, so the SOF flag in wdata[31] is ignored.
+    `COUNTDOWN:
+      if (wr === 1'b1)
+      begin
+        cntlen                 = {1'b0, wdata[30:0]};
+        cntreq                 = ~cntreq;
+        holdack                = 1'b1;
+      end
+
+    // Send the loaded transmit buffer for wdata[15:0] bytes. The acknowledge
+    // is held off until the whole packet has been sent.
+    `TXSEND:
+      if (wr === 1'b1 && wdata[15:0] != 0)
+      begin
+        txlen                  = wdata[15:0];
+        txreq                  = ~txreq;
+        holdack                = 1'b1;
+      end
+
+    // No handshake responder, but the registers are kept
+    `DEVADDR:
+    begin
+      if (wr === 1'b1)
+        devaddr                = wdata[6:0];
+      rdata                    = {25'h0000000, devaddr};
+    end
+
+    `EPSTATOUT:
+    begin
+      if (wr === 1'b1)
+        epstatout              = wdata;
+      rdata                    = epstatout;
+    end
+
+    `EPSTATIN:
+    begin
+      if (wr === 1'b1)
+        epstatin               = wdata;
+      rdata                    = epstatin;
+    end
+
+    // No SOF generator, so never enabled
+    `SOFCTRL:     rdata        = 32'h00000000;
+    `SOFFRAME:    rdata        = 32'h00000000;
+
+    `UVH_STOP:
+      if (wr === 1'b1) $stop;
+
+    `UVH_FINISH:
+      // Always stop when in GUI
+      if (wr === 1'b1) if (GUI_RUN==1) $stop; else $finish;
+
+    default:
+    begin
+        $display("%m: ***Error. usbModelUtmi---access to invalid address (%h) from VProc", addr);
+        if (GUI_RUN==1) $stop; else $finish;
+    end
+    endcase
+  end
+
+    // Finished processing for this update, so acknowledge to VProc (by invertint updateresp),
+    // unless a blocking command was started which will acknowledge on completion
+    if (!holdack)
+      updateresp_imm = ~updateresp_imm;
+end
+
+endmodule
@@ -0,0 +1,135 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 2nd March 2024
+//
+// Verilator top level for usbModel with the direct C++ line
+// backend. The host and device user code (VUserMain0 and
+// VUserMain1) run as usbDirectNode coroutines, stepped from
+// this eval() loop, with no VProc threads.
+//
+// This file is part of the usbModel package.
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "verilated.h"
+#if VM_TRACE
+#include "verilated_vcd_c.h"
+#endif
+
+#include "Vtest.h"
+#include "usbDirectNode.h"
+
+// User code entry points for the host (node 0) and device (node 1)
+extern "C" void VUserMain0(void);
+extern "C" void VUserMain1(void);
+
+// Clock frequency, simulation timeout and reset period, as for the
+// VProc based test bench
+static const int      CLK_PERIOD_MHZ = 12;
+static const int      TIMEOUT_US     = 5000;
+static const int      RESET_CLKS     = 10;
+
+static const uint64_t CLK_PERIOD_PS  = 1000000 / CLK_PERIOD_MHZ;
+static const uint64_t TIMEOUT_COUNT  = CLK_PERIOD_MHZ * TIMEOUT_US;
+
+int main(int argc, char** argv)
+{
+    VerilatedContext* ctx = new VerilatedContext;
+    ctx->commandArgs(argc, argv);
+
+    Vtest* top = new Vtest(ctx);
+
+#if VM_TRACE
+    ctx->traceEverOn(true);
+    VerilatedVcdC* tfp = new VerilatedVcdC;
+    top->trace(tfp, 99);
+    tfp->open("waves.vcd");
+#endif
+
+    // The nodes register themselves as the line backends for their node
+    // numbers, so the usbHost and usbDevice objects created by the user
+    // code access them in place of VProc
+    usbDirectNode host(0, false, VUserMain0);
+    usbDirectNode dev (1, true,  VUserMain1);
+
+    host.setReset(true);
+    dev.setReset(true);
+
+    // Run the user code up to its first wait on the clock
+    host.start();
+    dev.start();
+
+    uint64_t count;
+
+    for (count = 0; count < TIMEOUT_COUNT && !host.halted() && !dev.halted(); count++)
+    {
+        if (count == RESET_CLKS)
+        {
+            host.setReset(false);
+            dev.setReset(false);
+        }
+
+        // Drive the nodes' outputs for this cycle with the clock low
+        top->clk      = 0;
+        top->host_oe  = host.lineOe();
+        top->host_dp  = host.lineDp();
+        top->host_dm  = host.lineDm();
+        top->dev_oe   = dev.lineOe();
+        top->dev_dp   = dev.lineDp();
+        top->dev_dm   = dev.lineDm();
+        top->dev_pull = dev.linePullup();
+        top->eval();
+
+#if VM_TRACE
+        tfp->dump(ctx->time());
+#endif
+        ctx->timeInc(CLK_PERIOD_PS/2);
+
+        // Rising edge, with the nodes sampling the resolved line
+        top->clk      = 1;
+        top->eval();
+
+        host.clock(top->linep, top->linem);
+        dev.clock(top->linep, top->linem);
+
+#if VM_TRACE
+        tfp->dump(ctx->time());
+#endif
+        ctx->timeInc(CLK_PERIOD_PS/2);
+    }
+
+    if (count >= TIMEOUT_COUNT)
+    {
+        printf("***ERROR: simulation timed out\n");
+    }
+
+    top->final();
+
+#if VM_TRACE
+    tfp->close();
+    delete tfp;
+#endif
+
+    delete top;
+    delete ctx;
+
+    return (count >= TIMEOUT_COUNT) ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+//=============================================================
+//
+// Copyright (c) 2024 Simon Southwell. All rights reserved.
+//
+// Date: 2nd March 2024
+//
+// This file is part of the usbModel package.
+//
+// This code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// The code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+`timescale 1ps / 1ps
+
+//-------------------------------------------------------------
+// Top level for usbModel with the direct C++ line backend in
+// Verilator. There is no usbModel HDL or VProc here, as the
+// host and device nodes (usbDirectNode) are stepped from the
+// eval() loop in sim_main.cpp, which drives each node's line
+// outputs into this module and feeds back the resolved line.
+// A design under test would be instantiated here, connected
+// to the line in place of one of the nodes.
+//-------------------------------------------------------------
+
+module test
+(
+  input  clk,
+
+  // Host node line outputs
+  input  host_oe,
+  input  host_dp,
+  input  host_dm,
+
+  // Device node line outputs
+  input  dev_oe,
+  input  dev_dp,
+  input  dev_dm,
+  input  dev_pull,
+
+  // Resolved USB line
+  output linep,
+  output linem
+);
+
+// Resolve the line, with the device's D+ pullup (full speed)
+// and the host's pulldowns when neither end is driving
+assign linep                   = host_oe ? host_dp :
+                                 dev_oe  ? dev_dp  :
+                                           dev_pull;
+
+assign linem                   = host_oe ? host_dm :
+                                 dev_oe  ? dev_dm  :
+                                           1'b0;
+
+endmodule
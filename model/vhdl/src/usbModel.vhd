@@ -45,6 +45,49 @@ end entity;
 
 architecture behavioural of usbModel is
 
+-- Transmit and receive buffer sizes in 32 bit words, each holding 16 line
+-- samples (dp in bits 15:0 and dm in bits 31:16). Matches MAXBUFSIZE bytes
+-- of samples in the C++ model.
+constant     TXBUFWORDS   : integer := 1024;
+constant     RXBUFWORDS   : integer := 1024;
+
+-- Line states
+constant     USB_SE0      : std_logic_vector(1 downto 0) := "00";
+constant     USB_J        : std_logic_vector(1 downto 0) := "01";
+constant     USB_K        : std_logic_vector(1 downto 0) := "10";
+
+-- Start of frame period (1ms at 12MHz) and clocks of idle held after
+-- an EOP before the serialiser releases the line
+constant     SOFPERIOD    : integer := 12000;
+constant     SERGAPCLKS   : integer := 4;
+
+type serphase_t is (SER_DATA, SER_EOP, SER_GAP);
+
+-- Handshake responder turnaround clocks after an EOP, and clocks to wait
+-- for an OUT token's data packet before abandoning the transaction
+constant     HSTURNCLKS   : integer := 4;
+constant     HSABSORBCLKS : integer := 64;
+
+type hsstate_t is (HS_IDLE, HS_ABSORB, HS_TURN, HS_SEND);
+
+type txbuf_t is array (0 to TXBUFWORDS-1) of std_logic_vector(31 downto 0);
+type rxbuf_t is array (0 to RXBUFWORDS-1) of std_logic_vector(31 downto 0);
+
+-- CRC5 of an 11 bit token field, in the bit order it is sent on the line
+function crc5 (data : std_logic_vector(10 downto 0)) return std_logic_vector is
+  variable crc : std_logic_vector(4 downto 0) := "11111";
+  variable fb  : std_logic;
+begin
+  for i in 0 to 10 loop
+    fb                          := crc(4) xor data(i);
+    crc                         := crc(3 downto 0) & '0';
+    if fb = '1' then
+      crc                       := crc xor "00101";
+    end if;
+  end loop;
+  return not (crc(0) & crc(1) & crc(2) & crc(3) & crc(4));
+end function;
+
 -- --------------------------------
 -- Register definitions
 -- --------------------------------
@@ -56,10 +99,83 @@ signal       dm           : std_logic := '0';
 
 -- VP Interface signals
 signal       rdata        : std_logic_vector(31 downto 0);
-signal       updateresp   : std_logic := '1';
+signal       updateresp   : std_logic;
+signal       updateresp_imm : std_logic := '1';
+signal       updateresp_tx  : std_logic := '0';
+signal       updateresp_rx  : std_logic := '0';
+signal       updateresp_cnt : std_logic := '0';
+signal       updateresp_ev  : std_logic := '0';
 
 signal       clkcount     : integer := 0;
 
+-- Transmit engine state
+signal       txbuf        : txbuf_t;
+signal       txwidx       : integer := 0;
+signal       txlen        : integer := 0;
+signal       txidx        : integer := 0;
+signal       txreq        : std_logic := '0';
+signal       txack        : std_logic := '0';
+signal       txbusy       : std_logic := '0';
+signal       txsofok      : std_logic := '0';
+
+-- Receive capture engine state
+signal       rxbuf        : rxbuf_t;
+signal       rxridx       : integer := 0;
+signal       rstthresh    : integer := 120000; -- 10ms at 12MHz
+signal       suspthresh   : integer := 36000;  -- 3ms at 12MHz
+signal       rxtimeout    : integer := 0;
+signal       rxdevice     : boolean := (DEVICE = 1);
+signal       rxnosuspend  : boolean := false;
+signal       rxreq        : std_logic := '0';
+signal       rxack        : std_logic := '0';
+signal       rxstatus     : integer range 0 to 15 := RXSTAT_PKT;
+signal       rxbitcount   : integer := 0;
+signal       rxactivity   : std_logic := '0';
+
+-- Countdown state
+signal       cntlen       : integer := 0;
+signal       cntval       : integer := 0;
+signal       cntreq       : std_logic := '0';
+signal       cntack       : std_logic := '0';
+signal       cntbusy      : std_logic := '0';
+signal       cntsofok     : std_logic := '0';
+
+-- Raw packet serialiser state
+signal       sersel       : std_logic := '0';
+signal       serdp        : std_logic := '1';
+signal       serdm        : std_logic := '0';
+signal       seroen       : std_logic := '0';
+
+-- Start of frame generator state
+signal       sofen        : std_logic := '0';
+signal       sofdue       : std_logic := '0';
+signal       sofframe     : unsigned(10 downto 0) := (others => '0');
+signal       sofctlen     : std_logic := '0';
+signal       sofctlload   : std_logic := '0';
+signal       sofctlframe  : unsigned(10 downto 0) := (others => '0');
+signal       sofctlreq    : std_logic := '0';
+signal       sofctlack    : std_logic := '0';
+
+-- Handshake responder state
+signal       devaddr      : std_logic_vector(6 downto 0)  := (others => '0');
+signal       epstatout    : std_logic_vector(31 downto 0) := (others => '0');
+signal       epstatin     : std_logic_vector(31 downto 0) := (others => '0');
+signal       hsbusy       : std_logic := '0';
+signal       hspid        : std_logic_vector(7 downto 0)  := (others => '0');
+signal       hsreq        : std_logic := '0';
+signal       hsack        : std_logic := '0';
+
+-- Line event detector state
+signal       evirqmask    : std_logic_vector(2 downto 0) := "000";
+signal       evpend       : std_logic_vector(2 downto 0) := "000";
+signal       evclr        : std_logic_vector(2 downto 0) := "000";
+signal       evclrreq     : std_logic := '0';
+signal       evclrack     : std_logic := '0';
+signal       evwaitmask   : std_logic_vector(2 downto 0) := "000";
+signal       evtimeout    : integer := 0;
+signal       evwaitreq    : std_logic := '0';
+signal       evwaitack    : std_logic := '0';
+
 -- --------------------------------
 -- Signal definitions
 -- --------------------------------
@@ -74,6 +190,24 @@ signal        node        : std_logic_vector(31 downto 0) := std_logic_vector(to
 signal        update      : std_logic;
 signal        doen        : std_logic;
 
+signal        txstart     : std_logic;
+signal        rxstart     : std_logic;
+signal        cntstart    : std_logic;
+signal        evclrstart  : std_logic;
+signal        evwaitstart : std_logic;
+signal        evirq       : std_logic_vector(2 downto 0);
+signal        irqlevel    : std_logic_vector(2 downto 0);
+signal        txsel       : std_logic;
+signal        txhold      : std_logic;
+signal        txgo        : std_logic;
+signal        sofctlstart : std_logic;
+signal        soflaunch   : std_logic;
+signal        hsstart     : std_logic;
+signal        txcurr      : integer;
+signal        lineoen     : std_logic;
+signal        linedp      : std_logic;
+signal        linedm      : std_logic;
+
 begin
 -- --------------------------------
 -- Combinatorial logic
@@ -90,11 +224,73 @@ linep                           <= 'H' when (FULLSPEED = 1 and nopullup = '0') e
 linem                           <= 'H' when (FULLSPEED = 0 and nopullup = '0') else 'L';
 end generate;
 
-doen                            <= oen after 1 ns;
+-- Acknowledge to VProc is either immediate (from the update process) or
+-- delayed until a blocking command completes (from the engine processes)
+updateresp                      <= updateresp_imm xor updateresp_tx xor updateresp_rx xor updateresp_cnt xor updateresp_ev;
+
+-- A receive capture request is pending from the RXCAPTURE write until the
+-- next clock edge, when the capture engine starts sampling the line.
+rxstart                         <= rxreq xor rxack;
+
+-- A countdown request is pending from the COUNTDOWN write until the next
+-- clock edge, and the countdown is busy thereafter until it expires.
+cntstart                        <= cntreq xor cntack;
+
+-- Event clear and event wait requests are pending from the EVSTATUS and
+-- EVWAIT writes until the next clock edge.
+evclrstart                      <= evclrreq xor evclrack;
+evwaitstart                     <= evwaitreq xor evwaitack;
+
+-- The VProc interrupt level is that of the highest priority pending event
+-- enabled in the interrupt mask, with reset the highest.
+evirq                           <= evpend and evirqmask;
+irqlevel                        <= std_logic_vector(to_unsigned(EV_RESET   + 1, 3)) when evirq(EV_RESET)   = '1' else
+                                   std_logic_vector(to_unsigned(EV_SUSPEND + 1, 3)) when evirq(EV_SUSPEND) = '1' else
+                                   std_logic_vector(to_unsigned(EV_LINECHG + 1, 3)) when evirq(EV_LINECHG) = '1' else
+                                   "000";
+
+-- A SOFCTRL update is pending from the write until the next clock edge
+sofctlstart                     <= sofctlreq xor sofctlack;
+
+-- A handshake request from the responder is pending until the serialiser
+-- picks it up at the next clock edge
+hsstart                         <= hsreq xor hsack;
+
+-- A host's due SOF is sent ahead of a transmission, or during an idle
+-- countdown with the outputs disabled, when the C++ marks either as at a
+-- transaction boundary. It is never sent whilst the serialiser is busy.
+soflaunch                       <= '1' when DEVICE = 0 and sofdue = '1' and sersel = '0' and
+                                            ((txstart = '1' and txsofok = '1') or
+                                             (cntbusy = '1' and cntsofok = '1' and oen = '0')) else
+                                   '0';
+
+-- A transmit request is pending from the TXSEND write until the next clock
+-- edge, and the engine is busy thereafter until the last bit is sent. The
+-- first bit is driven as soon as the request is made, unless held off
+-- for the serialiser or a due SOF that is to go first.
+txstart                         <= txreq xor txack;
+txhold                          <= sersel or (sofdue and txsofok);
+txgo                            <= txstart and not txhold;
+txsel                           <= txgo or txbusy;
+txcurr                          <= txidx when txbusy = '1' else 0;
+
+-- Select line state from the serialiser when sending, then the transmit
+-- engine when sending, else from the LINE and OUTEN registers. Output is
+-- disabled on the last bit of a transmit buffer packet.
+lineoen                         <= seroen                                        when sersel = '1' else
+                                   oen                                           when txsel = '0' else
+                                   '1'                                           when txcurr /= txlen - 1 else
+                                   '0';
+linedp                          <= serdp                                         when sersel = '1' else
+                                   txbuf(txcurr / 16)(txcurr mod 16)             when txsel = '1' else dp;
+linedm                          <= serdm                                         when sersel = '1' else
+                                   txbuf(txcurr / 16)(16 + (txcurr mod 16))      when txsel = '1' else dm;
+
+doen                            <= lineoen after 1 ns;
 
 -- USB line driver logic
-linep                           <= dp when (doen and oen) = '1' else 'Z';
-linem                           <= dm when (doen and oen) = '1' else 'Z';
+linep                           <= linedp when (doen and lineoen) = '1' else 'Z';
+linem                           <= linedm when (doen and lineoen) = '1' else 'Z';
 
  -- --------------------------------
  -- Virtual Processor
@@ -108,7 +304,7 @@ linem                           <= dm when (doen and oen) = '1' else 'Z';
             DataIn              => rdata,
             WRAck               => wack,
             RDAck               => rack,
-            Interrupt           => 3x"0",
+            Interrupt           => irqlevel,
             Update              => update,
             UpdateResponse      => updateresp,
             Node                => node(3 downto 0)
@@ -124,6 +320,551 @@ begin
   end if;
 end process;
 
+-- --------------------------------
+-- Transmit engine. Shifts out txlen
+-- line samples from the transmit
+-- buffer, one per clock, and then
+-- acknowledges the TXSEND access.
+-- --------------------------------
+TX_P : process (clk)
+begin
+  if clk'event and clk = '1' then
+    if txgo = '1' then
+      txack                     <= txreq;
+
+      if txlen <= 1 then
+        updateresp_tx           <= not updateresp_tx;
+      else
+        txbusy                  <= '1';
+        txidx                   <= 1;
+      end if;
+    elsif txbusy = '1' then
+      if txidx = txlen - 1 then
+        txbusy                  <= '0';
+        updateresp_tx           <= not updateresp_tx;
+      else
+        txidx                   <= txidx + 1;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Countdown. Acknowledges the
+-- COUNTDOWN access after cntlen
+-- clocks, or never if cntlen is 0.
+-- Expiry is extended whilst the
+-- serialiser is sending.
+-- --------------------------------
+CNT_P : process (clk)
+begin
+  if clk'event and clk = '1' then
+    if cntstart = '1' then
+      cntack                    <= cntreq;
+
+      if cntlen = 1 and sersel = '0' then
+        updateresp_cnt          <= not updateresp_cnt;
+      else
+        cntbusy                 <= '1';
+        cntval                  <= 1;
+      end if;
+    elsif cntbusy = '1' then
+      if cntlen /= 0 and cntval + 1 >= cntlen and sersel = '0' then
+        cntbusy                 <= '0';
+        updateresp_cnt          <= not updateresp_cnt;
+      else
+        cntval                  <= cntval + 1;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Start of frame generator and raw
+-- packet serialiser. When enabled
+-- in a host, an SOF becomes due
+-- every 1ms, and is sent with the
+-- next frame number at the first
+-- transaction boundary thereafter.
+-- The serialiser NRZI encodes and
+-- bit stuffs serlen raw bits, then
+-- sends EOP and holds the line idle
+-- for SERGAPCLKS clocks. It also
+-- sends the handshake responder's
+-- handshake packets.
+-- --------------------------------
+SER_P : process (clk)
+variable serraw               : std_logic_vector(31 downto 0);
+variable serlen               : integer range 0 to 32;
+variable seridx               : integer range 0 to 32;
+variable serphase             : serphase_t;
+variable serones              : integer range 0 to 7;
+variable sercount             : integer range 0 to 7;
+variable serlevel             : std_logic;
+variable serstuff             : boolean;
+variable serbusy              : boolean := false;
+variable softimer             : integer := 0;
+begin
+  if clk'event and clk = '1' then
+
+    if soflaunch = '1' then
+      sofdue                    <= '0';
+
+      serraw                    := crc5(std_logic_vector(sofframe)) & std_logic_vector(sofframe) & x"a5" & x"80";
+      serlen                    := 32;
+    elsif hsstart = '1' then
+      hsack                     <= hsreq;
+
+      serraw                    := x"0000" & hspid & x"80";
+      serlen                    := 16;
+    end if;
+
+    if soflaunch = '1' or hsstart = '1' then
+      serbusy                   := true;
+      serphase                  := SER_DATA;
+      seridx                    := 0;
+      serones                   := 0;
+      serlevel                  := '1';
+      serstuff                  := false;
+    end if;
+
+    -- Apply any SOFCTRL update, with an SOF due straight away when enabled,
+    -- else count out the frame period
+    if sofctlstart = '1' then
+      sofctlack                 <= sofctlreq;
+      sofen                     <= sofctlen;
+
+      if sofctlload = '1' then
+        sofframe                <= sofctlframe;
+      end if;
+
+      if sofctlen = '1' and sofen = '0' then
+        softimer                := 0;
+        sofdue                  <= '1';
+      elsif sofctlen = '0' then
+        sofdue                  <= '0';
+      end if;
+    elsif sofen = '1' then
+      if softimer = SOFPERIOD - 1 then
+        softimer                := 0;
+        sofframe                <= sofframe + 1;
+        sofdue                  <= '1';
+      else
+        softimer                := softimer + 1;
+      end if;
+    end if;
+
+    if serbusy then
+      case serphase is
+      when SER_DATA =>
+        -- A zero, or a stuffed bit after six ones, toggles the line state
+        if serstuff then
+          serlevel              := not serlevel;
+          serones               := 0;
+          serstuff              := false;
+        else
+          if serraw(seridx) = '0' then
+            serlevel            := not serlevel;
+            serones             := 0;
+          else
+            serones             := serones + 1;
+          end if;
+
+          seridx                := seridx + 1;
+          serstuff              := (serones = 6);
+        end if;
+
+        serdp                   <= serlevel;
+        serdm                   <= not serlevel;
+        seroen                  <= '1';
+
+        if seridx = serlen and not serstuff then
+          serphase              := SER_EOP;
+          sercount              := 0;
+        end if;
+
+      -- Two SE0s then a J, with the outputs disabled on the J
+      when SER_EOP =>
+        sercount                := sercount + 1;
+
+        if sercount <= 2 then
+          serdp                 <= '0';
+          serdm                 <= '0';
+        else
+          serdp                 <= '1';
+          serdm                 <= '0';
+          seroen                <= '0';
+          serphase              := SER_GAP;
+          sercount              := 0;
+        end if;
+
+      when SER_GAP =>
+        sercount                := sercount + 1;
+
+        if sercount = SERGAPCLKS then
+          serbusy               := false;
+        end if;
+      end case;
+    end if;
+
+    if serbusy then
+      sersel                    <= '1';
+    else
+      sersel                    <= '0';
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Handshake responder (device only).
+-- Decodes tokens on the line, and
+-- for an IN or OUT token to this
+-- device's address on an endpoint
+-- with a NAK or STALL status, the
+-- transaction is claimed from the
+-- receive capture engine and the
+-- handshake sent after turnaround,
+-- without involving the C++. An
+-- OUT token's data packet is first
+-- absorbed.
+-- --------------------------------
+HS_P : process (clk)
+variable hsstate              : hsstate_t := HS_IDLE;
+variable hsline               : std_logic_vector(1 downto 0);
+variable hsprev               : std_logic_vector(1 downto 0) := USB_J;
+variable hsshift              : std_logic_vector(31 downto 0);
+variable hsones               : integer range 0 to 7;
+variable hsepstat             : integer range 0 to 3;
+variable hspidval             : std_logic_vector(3 downto 0);
+variable hsep                 : integer range 0 to 15;
+variable hsinpkt              : boolean := false;
+variable hseop                : boolean;
+variable hsseen               : boolean;
+variable hsbits               : integer;
+variable hscount              : integer;
+begin
+  if clk'event and clk = '1' then
+    hsline                      := to_X01(linem) & to_X01(linep);
+    hseop                       := false;
+
+    -- Decode the NRZI, unstuffed bits of packets when looking at the line
+    if DEVICE = 1 and (hsstate = HS_IDLE or hsstate = HS_ABSORB) then
+      -- A packet starts with a K after idle
+      if not hsinpkt and hsline = USB_K and hsprev = USB_J then
+        hsinpkt                 := true;
+        hsbits                  := 0;
+        hsones                  := 0;
+        hsshift                 := (others => '0');
+      end if;
+
+      if hsinpkt then
+        if hsline = USB_SE0 then
+          hsinpkt               := false;
+          hseop                 := true;
+        -- Drop stuffed bits after six ones, else no change in line state is a one
+        elsif hsones = 6 then
+          hsones                := 0;
+        else
+          if hsline = hsprev then
+            hsones              := hsones + 1;
+            if hsbits < 32 then
+              hsshift(hsbits)   := '1';
+            end if;
+          else
+            hsones              := 0;
+          end if;
+
+          hsbits                := hsbits + 1;
+        end if;
+      end if;
+    end if;
+
+    hsprev                      := hsline;
+
+    case hsstate is
+    when HS_IDLE =>
+      -- On a valid token for this device, check the endpoint's status
+      if hseop and hsbits = 32 and hsshift(7 downto 0) = x"80" and hsshift(15 downto 12) = not hsshift(11 downto 8) and
+         hsshift(22 downto 16) = devaddr and hsshift(31 downto 27) = crc5(hsshift(26 downto 16)) then
+
+        hspidval                := hsshift(11 downto 8);
+        hsep                    := to_integer(unsigned(hsshift(26 downto 23)));
+        hscount                 := 0;
+
+        if hspidval = x"9" then
+          hsepstat              := to_integer(unsigned(epstatin(2*hsep+1 downto 2*hsep)));
+        elsif hspidval = x"1" then
+          hsepstat              := to_integer(unsigned(epstatout(2*hsep+1 downto 2*hsep)));
+        else
+          hsepstat              := EPSTAT_READY;
+        end if;
+
+        if hsepstat = EPSTAT_NAK or hsepstat = EPSTAT_STALL then
+          hsbusy                <= '1';
+
+          if hsepstat = EPSTAT_NAK then
+            hspid               <= x"5a";
+          else
+            hspid               <= x"1e";
+          end if;
+
+          if hspidval = x"1" then
+            hsstate             := HS_ABSORB;
+          else
+            hsstate             := HS_TURN;
+          end if;
+        end if;
+      end if;
+
+    -- Wait for the OUT token's data packet, giving up if none arrives
+    when HS_ABSORB =>
+      if hseop then
+        hsstate                 := HS_TURN;
+        hscount                 := 0;
+      elsif not hsinpkt then
+        hscount                 := hscount + 1;
+
+        if hscount >= HSABSORBCLKS then
+          hsbusy                <= '0';
+          hsstate               := HS_IDLE;
+        end if;
+      end if;
+
+    -- Count the turnaround once the line is back at idle, then send the handshake
+    when HS_TURN =>
+      if hsline = USB_J then
+        hscount                 := hscount + 1;
+      end if;
+
+      if hscount = HSTURNCLKS then
+        hsreq                   <= not hsreq;
+        hsseen                  := false;
+        hsstate                 := HS_SEND;
+      end if;
+
+    -- Release the transaction once the serialiser has sent the handshake
+    when HS_SEND =>
+      if sersel = '1' then
+        hsseen                  := true;
+      elsif hsseen then
+        hsbusy                  <= '0';
+        hsstate                 := HS_IDLE;
+      end if;
+    end case;
+  end if;
+end process;
+
+-- --------------------------------
+-- Line event detectors. Flags line
+-- state changes, SE0 held for the
+-- reset period and J held for the
+-- suspend period as pending events,
+-- and acknowledges an EVWAIT access
+-- when a waited for event occurs or
+-- the wait times out.
+-- --------------------------------
+EV_P : process (clk)
+variable evline               : std_logic_vector(1 downto 0);
+variable evprev               : std_logic_vector(1 downto 0) := USB_J;
+variable evnew                : std_logic_vector(2 downto 0);
+variable evstate              : std_logic_vector(2 downto 0);
+variable evse0count           : integer := 0;
+variable evjcount             : integer := 0;
+variable evwaitbusy           : boolean := false;
+variable evwaitcount          : integer := 0;
+begin
+  if clk'event and clk = '1' then
+    evline                      := to_X01(linem) & to_X01(linep);
+    evnew                       := "000";
+
+    -- Detect a change in line state
+    if evline /= evprev then
+      evnew(EV_LINECHG)         := '1';
+    end if;
+
+    evprev                      := evline;
+
+    -- Count consecutive SE0 and J states, flagging when they reach the
+    -- reset and suspend periods respectively
+    if evline = USB_SE0 then
+      evse0count                := evse0count + 1;
+    else
+      evse0count                := 0;
+    end if;
+
+    if evline = USB_J then
+      evjcount                  := evjcount + 1;
+    else
+      evjcount                  := 0;
+    end if;
+
+    if evse0count = rstthresh then
+      evnew(EV_RESET)           := '1';
+    end if;
+
+    if evjcount = suspthresh then
+      evnew(EV_SUSPEND)         := '1';
+    end if;
+
+    evstate                     := evpend;
+
+    -- Clear any events requested from an EVSTATUS write
+    if evclrstart = '1' then
+      evclrack                  <= evclrreq;
+      evstate                   := evstate and not evclr;
+    end if;
+
+    -- Starting a wait clears the events being waited on, so only new events complete it
+    if evwaitstart = '1' then
+      evwaitack                 <= evwaitreq;
+      evstate                   := evstate and not evwaitmask;
+      evwaitbusy                := true;
+      evwaitcount               := 0;
+    end if;
+
+    evstate                     := evstate or evnew;
+    evpend                      <= evstate;
+
+    -- Acknowledge the EVWAIT access when a waited for event is pending or on timeout
+    if evwaitbusy then
+      evwaitcount               := evwaitcount + 1;
+
+      if (evstate and evwaitmask) /= "000" or (evtimeout /= 0 and evwaitcount >= evtimeout) then
+        evwaitbusy              := false;
+        updateresp_ev           <= not updateresp_ev;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Receive capture engine. Samples
+-- the line once per clock, waiting
+-- for a packet and capturing its
+-- samples up to the EOP. Reset,
+-- suspend, disconnection and
+-- timeout are also detected. The
+-- RXCAPTURE access is acknowledged
+-- when any of these occur.
+-- --------------------------------
+RX_P : process (clk)
+variable rxline               : std_logic_vector(1 downto 0);
+variable rxbusy               : boolean := false;
+variable rxidle               : boolean;
+variable rxlookforreset       : boolean;
+variable rxdone               : boolean;
+variable rxrstcount           : integer;
+variable rxidlecount          : integer;
+variable rxeopcount           : integer;
+variable rxbits               : integer;
+begin
+  if clk'event and clk = '1' then
+
+    rxdone                      := false;
+
+    if rxstart = '1' then
+      rxack                     <= rxreq;
+      rxbusy                    := true;
+      rxidle                    := true;
+      rxlookforreset            := false;
+      rxrstcount                := 0;
+      rxidlecount               := 0;
+      rxeopcount                := 0;
+      rxbits                    := 0;
+      rxactivity                <= '0';
+    end if;
+
+    -- Anything seen whilst the handshake responder is handling a transaction
+    -- is discarded, with the capture starting afresh afterwards
+    if rxbusy and hsbusy = '1' then
+      rxidle                    := true;
+      rxlookforreset            := false;
+      rxrstcount                := 0;
+      rxidlecount               := 0;
+      rxeopcount                := 0;
+      rxbits                    := 0;
+    elsif rxbusy then
+      rxline                    := to_X01(linem) & to_X01(linep);
+
+      -- If a host and SE0 seen when idle, there is no device connected
+      if not rxdevice and rxidle and rxline = USB_SE0 then
+        rxstatus                <= RXSTAT_DISCONNECTED;
+        rxdone                  := true;
+      else
+        -- Flag any activity that would bring a device out of suspension
+        if rxline = USB_K or (rxdevice and rxline = USB_SE0) then
+          rxactivity            <= '1';
+        end if;
+
+        -- If not in the middle of a reset detection and K seen, then line is not idle
+        if not rxlookforreset and rxline = USB_K then
+          rxidle                := false;
+        -- If idle and an SE0 seen then this may be a reset
+        elsif rxdevice and rxidle and rxline = USB_SE0 then
+          rxidle                := false;
+          rxlookforreset        := true;
+          rxrstcount            := rxrstcount + 1;
+        end if;
+
+        -- If in the middle of a potential reset, keep track of the number of consecutive
+        -- SE0 line states. When a non-SE0 state occurs, the status is reset if seen
+        -- sufficient consecutive SE0s, else an error for unexplained SE0s.
+        if rxlookforreset then
+          if rxline = USB_SE0 then
+            rxrstcount          := rxrstcount + 1;
+          else
+            if rxrstcount >= rstthresh then
+              rxstatus          <= RXSTAT_RESET;
+            else
+              rxstatus          <= RXSTAT_ERROR;
+            end if;
+            rxdone              := true;
+          end if;
+        end if;
+
+        if not rxdone then
+          -- If not idle, then capture the packet samples until the 3 bits of EOP
+          if not rxidle and not rxlookforreset then
+            rxidlecount         := 0;
+
+            rxbuf((rxbits / 16) mod RXBUFWORDS)(rxbits mod 16)      <= rxline(0);
+            rxbuf((rxbits / 16) mod RXBUFWORDS)(16 + rxbits mod 16) <= rxline(1);
+            rxbits              := rxbits + 1;
+
+            if rxeopcount = 0 and rxline = USB_SE0 then
+              rxeopcount        := 1;
+            elsif rxeopcount /= 0 then
+              rxeopcount        := rxeopcount + 1;
+
+              if rxeopcount = 3 then
+                rxstatus        <= RXSTAT_PKT;
+                rxdone          := true;
+              end if;
+            end if;
+          else
+            rxidlecount         := rxidlecount + 1;
+
+            if rxdevice and not rxnosuspend and rxidlecount >= suspthresh then
+              rxstatus          <= RXSTAT_SUSPEND;
+              rxdone            := true;
+            elsif rxtimeout /= 0 and rxidlecount >= rxtimeout then
+              rxstatus          <= RXSTAT_NORESPONSE;
+              rxdone            := true;
+            end if;
+          end if;
+        end if;
+      end if;
+
+      -- On completion, save the bit count and acknowledge the RXCAPTURE access
+      if rxdone then
+        rxbusy                  := false;
+        rxbitcount              <= rxbits;
+        updateresp_rx           <= not updateresp_rx;
+      end if;
+    end if;
+  end if;
+end process;
+
 -- --------------------------------
 -- Process to map VProc accesses
 -- to registers and simulation
@@ -132,12 +873,16 @@ end process;
 
 -- Addressable read/write state from VProc
 UPDATE_P : process (update)
+variable holdack              : boolean;
 begin
 
   if update'event then
   -- Default read data value
     rdata                       <= 32x"0";
 
+    -- Default to acknowledging the access immediately
+    holdack                     := false;
+
     -- Process when an access is valid
     if wr = '1'or rd = '1' then
 
@@ -165,6 +910,137 @@ begin
         end if;
         rdata                   <= 30x"0" & linem & linep;
 
+      when TXBUFIDX =>
+        if wr = '1' then
+          txwidx                <= to_integer(unsigned(wdata(9 downto 0)));
+        end if;
+        rdata                   <= std_logic_vector(to_unsigned(txwidx, 32));
+
+      when TXBUFDATA =>
+        if wr = '1' then
+          txbuf(txwidx)         <= wdata;
+          txwidx                <= (txwidx + 1) mod TXBUFWORDS;
+        end if;
+
+      when RSTCOUNT =>
+        if wr = '1' then
+          rstthresh             <= to_integer(unsigned(wdata));
+        end if;
+        rdata                   <= std_logic_vector(to_unsigned(rstthresh, 32));
+
+      when SUSPCOUNT =>
+        if wr = '1' then
+          suspthresh            <= to_integer(unsigned(wdata));
+        end if;
+        rdata                   <= std_logic_vector(to_unsigned(suspthresh, 32));
+
+      -- Start a receive capture, with wdata(31) set for a device, wdata(30)
+      -- set to not report suspension (when already suspended) and wdata(29:0)
+      -- an idle timeout in clocks (0 for none). Outputs are disabled and the
+      -- acknowledge is held off until the capture completes.
+      when RXCAPTURE =>
+        if wr = '1' then
+          oen                   <= '0';
+          rxdevice              <= wdata(31) = '1';
+          rxnosuspend           <= wdata(30) = '1';
+          rxtimeout             <= to_integer(unsigned(wdata(29 downto 0)));
+          rxridx                <= 0;
+          rxreq                 <= not rxreq;
+          holdack               := true;
+        end if;
+
+      when RXSTATUS =>
+        rdata                   <= 11x"0" & rxactivity & std_logic_vector(to_unsigned(rxstatus, 4)) &
+                                   std_logic_vector(to_unsigned(rxbitcount mod 65536, 16));
+
+      when RXBUFDATA =>
+        rdata                   <= rxbuf(rxridx);
+        rxridx                  <= (rxridx + 1) mod RXBUFWORDS;
+
+      when EVIRQMASK =>
+        if wr = '1' then
+          evirqmask             <= wdata(2 downto 0);
+        end if;
+        rdata                   <= 29x"0" & evirqmask;
+
+      -- Pending events, cleared by writing 1s to the event bits
+      when EVSTATUS =>
+        if wr = '1' then
+          evclr                 <= wdata(2 downto 0);
+          evclrreq              <= not evclrreq;
+        end if;
+        rdata                   <= 29x"0" & evpend;
+
+      -- Wait for one of the events in wdata(2:0), with wdata(31:3) a timeout
+      -- in clocks (0 for none). The acknowledge is held off until an event
+      -- occurs or the wait times out.
+      when EVWAIT =>
+        if wr = '1' then
+          evwaitmask            <= wdata(2 downto 0);
+          evtimeout             <= to_integer(unsigned(wdata(31 downto 3)));
+          evwaitreq             <= not evwaitreq;
+          holdack               := true;
+        end if;
+
+      -- Hold off the acknowledge for wdata(30:0) clock cycles, with the line
+      -- left in its current state. A count of 0 never acknowledges. With
+      -- wdata(31) set, a due SOF may be sent during the countdown.
+      when COUNTDOWN =>
+        if wr = '1' then
+          cntlen                <= to_integer(unsigned(wdata(TXLENMSB downto 0)));
+          cntsofok              <= wdata(TXSOFOKBIT);
+          cntreq                <= not cntreq;
+          holdack               := true;
+        end if;
+
+      -- Send the loaded transmit buffer for wdata(30:0) bits. The acknowledge
+      -- is held off until the whole packet has been sent. With wdata(31) set,
+      -- a due SOF is sent first.
+      when TXSEND =>
+        if wr = '1' and unsigned(wdata(TXLENMSB downto 0)) /= 0 then
+          txlen                 <= to_integer(unsigned(wdata(TXLENMSB downto 0)));
+          txsofok               <= wdata(TXSOFOKBIT);
+          txreq                 <= not txreq;
+          holdack               := true;
+        end if;
+
+      -- Device address for the handshake responder
+      when DEVADDR =>
+        if wr = '1' then
+          devaddr               <= wdata(6 downto 0);
+        end if;
+        rdata                   <= 25x"0" & devaddr;
+
+      -- Handshake responder endpoint statuses, two bits per endpoint
+      when EPSTATOUT =>
+        if wr = '1' then
+          epstatout             <= wdata;
+        end if;
+        rdata                   <= epstatout;
+
+      when EPSTATIN =>
+        if wr = '1' then
+          epstatin              <= wdata;
+        end if;
+        rdata                   <= epstatin;
+
+      -- Physical interface type of this model
+      when PHYIF       => rdata <= std_logic_vector(to_unsigned(PHYIF_SERIAL, 32));
+
+      -- SOF generator control, with wdata(0) enabling generation (host only)
+      -- and wdata(1) set to load the frame number from wdata(26:16)
+      when SOFCTRL =>
+        if wr = '1' then
+          sofctlen              <= wdata(0);
+          sofctlload            <= wdata(1);
+          sofctlframe           <= unsigned(wdata(26 downto 16));
+          sofctlreq             <= not sofctlreq;
+        end if;
+        rdata                   <= 31x"0" & sofen;
+
+      -- Frame number of the current frame
+      when SOFFRAME    => rdata <= 21x"0" & std_logic_vector(sofframe);
+
       when UVH_STOP =>
         if wr = '1' then stop ; end if;
 
@@ -179,8 +1055,11 @@ begin
       end case;
     end if;
 
-    -- Finished processing for this update, so acknowledge to VProc (by inverting updateresp)
-    updateresp <= not updateresp;
+    -- Finished processing for this update, so acknowledge to VProc (by inverting updateresp),
+    -- unless a blocking command was started which will acknowledge on completion
+    if not holdack then
+      updateresp_imm <= not updateresp_imm;
+    end if;
   end if;
 end process;
 
@@ -28,6 +28,58 @@ constant RESET_STATE            : integer := 2;
 constant PULLUP                 : integer := 3;
 constant OUTEN                  : integer := 4;
 constant LINE                   : integer := 5;
+constant TXBUFIDX               : integer := 6;
+constant TXBUFDATA              : integer := 7;
+constant TXSEND                 : integer := 8;
+constant RSTCOUNT               : integer := 9;
+constant SUSPCOUNT              : integer := 10;
+constant RXCAPTURE              : integer := 11;
+constant RXSTATUS               : integer := 12;
+constant RXBUFDATA              : integer := 13;
+constant COUNTDOWN              : integer := 14;
+constant EVIRQMASK              : integer := 15;
+constant EVSTATUS               : integer := 16;
+constant EVWAIT                 : integer := 17;
+constant SOFCTRL                : integer := 18;
+constant SOFFRAME               : integer := 19;
+constant DEVADDR                : integer := 20;
+constant EPSTATOUT              : integer := 21;
+constant EPSTATIN               : integer := 22;
+constant PHYIF                  : integer := 23;
+
+-- TXSEND and COUNTDOWN write fields. Bits 30:0 are the length (TXSEND:
+-- bits of the loaded packet for a serial usbModel, with UTMI using bits
+-- 15:0 as a byte count; COUNTDOWN: clock ticks), and bit 31 is the SOF
+-- OK flag, marking a transaction boundary at which a due hardware SOF
+-- may be sent first (serial host only).
+constant TXLENMSB               : integer := 30;
+constant TXSOFOKBIT             : integer := 31;
+
+-- Receive capture status codes (RXSTATUS bits 19:16)
+constant RXSTAT_PKT             : integer := 0;
+constant RXSTAT_DISCONNECTED    : integer := 1;
+constant RXSTAT_RESET           : integer := 2;
+constant RXSTAT_ERROR           : integer := 3;
+constant RXSTAT_SUSPEND         : integer := 4;
+constant RXSTAT_NORESPONSE      : integer := 5;
+
+-- Line event bit positions (EVIRQMASK, EVSTATUS and EVWAIT). The VProc
+-- interrupt level for an event is its bit position plus 1.
+constant EV_LINECHG             : integer := 0;
+constant EV_SUSPEND             : integer := 1;
+constant EV_RESET               : integer := 2;
+
+-- Endpoint handshake responder status codes (EPSTATOUT and EPSTATIN, two
+-- bits per endpoint)
+constant EPSTAT_READY           : integer := 0;
+constant EPSTAT_NAK             : integer := 1;
+constant EPSTAT_STALL           : integer := 2;
+
+-- Physical interface types (PHYIF). PHYIF_TLM is a transaction level
+-- C++ backend (see usbDirectNode), passing raw packets as for UTMI.
+constant PHYIF_SERIAL           : integer := 0;
+constant PHYIF_UTMI             : integer := 1;
+constant PHYIF_TLM              : integer := 2;
 
 constant UVH_STOP               : integer := 1001;
 constant UVH_FINISH             : integer := 1002;
@@ -0,0 +1,699 @@
+-- =============================================================
+-- Virtual USB component with a UTMI+ interface
+--
+-- Copyright (c) 2024 Simon Southwell.
+--
+-- This file is part of usbModel pattern generator.
+--
+-- This code is free software: you can redistribute it and/or modify
+-- it under the terms of the GNU General Public License as published by
+-- the Free Software Foundation, either version 3 of the License, or
+-- (at your option) any later version.
+--
+-- The code is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with this code. If not, see <http://www.gnu.org/licenses/>.
+--
+-- =============================================================
+--
+-- Variant of usbModel that connects to a DUT's UTMI+ (level 0)
+-- 8 bit parallel interface, rather than the serial D+/D- lines.
+-- See the verilog usbModelUtmi for details.
+--
+-- =============================================================
+
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+use std.env.all;
+
+use work.usbModelPkg.all;
+
+entity usbModelUtmi is
+  generic (DEVICE         : integer := 1;  -- Select whether a device (1) or host (0)
+           TICKDIV        : integer := 8;  -- Clocks per byte transferred
+           NODENUM        : integer := 0;  -- Node number. Must be unique for each usbModel instantiation and any other VProc based component.
+           GUI_RUN        : integer := 0   -- Flag whether running in a GUI (1) or not (0)
+  );
+  port    (clk            : in    std_logic;
+           nreset         : in    std_logic;
+
+           -- UTMI+ interface, named from the DUT link's side
+           DataOut        : in    std_logic_vector(7 downto 0);
+           TxValid        : in    std_logic;
+           TxReady        : out   std_logic;
+           DataIn         : out   std_logic_vector(7 downto 0);
+           RxValid        : out   std_logic;
+           RxActive       : out   std_logic;
+           RxError        : out   std_logic;
+           LineState      : out   std_logic_vector(1 downto 0);
+           TermSelect     : in    std_logic;
+           OpMode         : in    std_logic_vector(1 downto 0)
+  );
+
+end entity;
+
+
+architecture behavioural of usbModelUtmi is
+
+-- Transmit and receive buffer sizes in 32 bit words, each holding 4
+-- bytes, with the first in bits 7:0. Matches MAXBUFSIZE bytes in the
+-- C++ model.
+constant     TXBUFWORDS   : integer := 1024;
+constant     RXBUFWORDS   : integer := 1024;
+
+-- Line states
+constant     USB_SE0      : std_logic_vector(1 downto 0) := "00";
+constant     USB_J        : std_logic_vector(1 downto 0) := "01";
+constant     USB_K        : std_logic_vector(1 downto 0) := "10";
+
+type txbuf_t is array (0 to TXBUFWORDS-1) of std_logic_vector(31 downto 0);
+type rxbuf_t is array (0 to RXBUFWORDS-1) of std_logic_vector(31 downto 0);
+
+-- --------------------------------
+-- Register definitions
+-- --------------------------------
+
+signal       oen          : std_logic := '0';
+signal       nopullup     : std_logic := '1' ;
+signal       dp           : std_logic := '1';
+signal       dm           : std_logic := '0';
+
+-- VP Interface signals
+signal       rdata        : std_logic_vector(31 downto 0);
+signal       updateresp   : std_logic;
+signal       updateresp_imm : std_logic := '1';
+signal       updateresp_tx  : std_logic := '0';
+signal       updateresp_rx  : std_logic := '0';
+signal       updateresp_cnt : std_logic := '0';
+signal       updateresp_ev  : std_logic := '0';
+
+signal       clkcount     : integer := 0;
+
+-- Transmit engine state
+signal       txbuf        : txbuf_t;
+signal       txwidx       : integer := 0;
+signal       txlen        : integer := 0;
+signal       txidx        : integer := 0;
+signal       txreq        : std_logic := '0';
+signal       txack        : std_logic := '0';
+signal       txbusy       : std_logic := '0';
+signal       txtick       : integer := 0;
+
+-- UTMI receive side outputs
+signal       utmidatain   : std_logic_vector(7 downto 0) := (others => '0');
+signal       utmirxvalid  : std_logic := '0';
+signal       utmirxactive : std_logic := '0';
+
+-- UTMI transmit side pacing
+signal       utmitxready  : std_logic := '0';
+signal       rdytick      : integer := 0;
+
+-- Receive capture engine state
+signal       rxbuf        : rxbuf_t;
+signal       rxridx       : integer := 0;
+signal       rstthresh    : integer := 120000; -- 10ms at 12MHz
+signal       suspthresh   : integer := 36000;  -- 3ms at 12MHz
+signal       rxtimeout    : integer := 0;
+signal       rxdevice     : boolean := (DEVICE = 1);
+signal       rxnosuspend  : boolean := false;
+signal       rxreq        : std_logic := '0';
+signal       rxack        : std_logic := '0';
+signal       rxstatus     : integer range 0 to 15 := RXSTAT_PKT;
+signal       rxbitcount   : integer := 0;
+signal       rxactivity   : std_logic := '0';
+
+-- Countdown state
+signal       cntlen       : integer := 0;
+signal       cntval       : integer := 0;
+signal       cntreq       : std_logic := '0';
+signal       cntack       : std_logic := '0';
+signal       cntbusy      : std_logic := '0';
+
+-- Line event detector state
+signal       evirqmask    : std_logic_vector(2 downto 0) := "000";
+signal       evpend       : std_logic_vector(2 downto 0) := "000";
+signal       evclr        : std_logic_vector(2 downto 0) := "000";
+signal       evclrreq     : std_logic := '0';
+signal       evclrack     : std_logic := '0';
+signal       evwaitmask   : std_logic_vector(2 downto 0) := "000";
+signal       evtimeout    : integer := 0;
+signal       evwaitreq    : std_logic := '0';
+signal       evwaitack    : std_logic := '0';
+
+-- Handshake responder registers, held for compatibility with usbModel
+signal       devaddr      : std_logic_vector(6 downto 0)  := (others => '0');
+signal       epstatout    : std_logic_vector(31 downto 0) := (others => '0');
+signal       epstatin     : std_logic_vector(31 downto 0) := (others => '0');
+
+-- --------------------------------
+-- Signal definitions
+-- --------------------------------
+
+signal        addr        : std_logic_vector (31 downto 0);
+signal        wdata       : std_logic_vector (31 downto 0);
+signal        wr          : std_logic;
+signal        rd          : std_logic;
+signal        wack        : std_logic := '1';
+signal        rack        : std_logic := '1';
+signal        node        : std_logic_vector(31 downto 0) := std_logic_vector(to_unsigned(NODENUM, 32));
+signal        update      : std_logic;
+
+signal        txstart     : std_logic;
+signal        txsel       : std_logic;
+signal        rxstart     : std_logic;
+signal        cntstart    : std_logic;
+signal        evclrstart  : std_logic;
+signal        evwaitstart : std_logic;
+signal        evirq       : std_logic_vector(2 downto 0);
+signal        irqlevel    : std_logic_vector(2 downto 0);
+signal        dutreset    : std_logic;
+signal        dutactive   : std_logic;
+signal        busline     : std_logic_vector(1 downto 0);
+
+begin
+-- --------------------------------
+-- Combinatorial logic
+-- --------------------------------
+
+-- Acknowledge to VProc is either immediate (from the update process) or
+-- delayed until a blocking command completes (from the engine processes)
+updateresp                      <= updateresp_imm xor updateresp_tx xor updateresp_rx xor updateresp_cnt xor updateresp_ev;
+
+-- Blocking command requests are pending from the register write until the
+-- next clock edge, as for usbModel
+txstart                         <= txreq xor txack;
+txsel                           <= txstart or txbusy;
+rxstart                         <= rxreq xor rxack;
+cntstart                        <= cntreq xor cntack;
+evclrstart                      <= evclrreq xor evclrack;
+evwaitstart                     <= evwaitreq xor evwaitack;
+
+-- The VProc interrupt level is that of the highest priority pending event
+-- enabled in the interrupt mask, with reset the highest.
+evirq                           <= evpend and evirqmask;
+irqlevel                        <= std_logic_vector(to_unsigned(EV_RESET   + 1, 3)) when evirq(EV_RESET)   = '1' else
+                                   std_logic_vector(to_unsigned(EV_SUSPEND + 1, 3)) when evirq(EV_SUSPEND) = '1' else
+                                   std_logic_vector(to_unsigned(EV_LINECHG + 1, 3)) when evirq(EV_LINECHG) = '1' else
+                                   "000";
+
+-- A host DUT drives reset by transmitting zeros with bit stuffing and NRZI
+-- disabled. Any other transmission is a packet.
+dutreset                        <= '1' when TxValid = '1' and OpMode = "10" and DataOut = x"00" else '0';
+dutactive                       <= TxValid and not dutreset;
+
+-- State of the virtual bus: driven by this model, else active with a
+-- packet in either direction (K), else SE0 for a DUT reset, else idle
+-- when connected.
+busline                         <= dm & dp  when oen        = '1' else
+                                   USB_K    when txsel      = '1' else
+                                   USB_SE0  when dutreset   = '1' else
+                                   USB_K    when dutactive  = '1' else
+                                   USB_SE0  when DEVICE     = 1 and nopullup = '1' else
+                                   USB_J    when DEVICE     = 1 else
+                                   USB_J    when TermSelect = '1' else
+                                   USB_SE0;
+
+-- UTMI outputs
+TxReady                         <= utmitxready;
+DataIn                          <= utmidatain;
+RxValid                         <= utmirxvalid;
+RxActive                        <= utmirxactive;
+RxError                         <= '0';
+LineState                       <= busline;
+
+ -- --------------------------------
+ -- Virtual Processor
+ -- --------------------------------
+  vproc_inst : entity work.VProc
+  port map (Clk                 => clk,
+            Addr                => addr,
+            WE                  => wr,
+            RD                  => rd,
+            DataOut             => wdata,
+            DataIn              => rdata,
+            WRAck               => wack,
+            RDAck               => rack,
+            Interrupt           => irqlevel,
+            Update              => update,
+            UpdateResponse      => updateresp,
+            Node                => node(3 downto 0)
+           );
+
+-- --------------------------------
+-- Keep a clock tick count
+-- --------------------------------
+process (clk)
+begin
+  if clk'event and clk = '1' then
+    clkcount                    <= clkcount + 1;
+  end if;
+end process;
+
+-- --------------------------------
+-- Transmit engine. Presents the
+-- txlen bytes of the transmit
+-- buffer to the DUT, one every
+-- TICKDIV clocks, framed by
+-- RxActive, and then acknowledges
+-- the TXSEND access.
+-- --------------------------------
+TX_P : process (clk)
+begin
+  if clk'event and clk = '1' then
+    utmirxvalid                 <= '0';
+
+    if txstart = '1' then
+      txack                     <= txreq;
+      txbusy                    <= '1';
+      txidx                     <= 0;
+      txtick                    <= 0;
+      utmirxactive              <= '1';
+    elsif txbusy = '1' then
+      if txtick = TICKDIV - 1 then
+        txtick                  <= 0;
+
+        -- Send the next byte, or end the packet when all sent
+        if txidx < txlen then
+          utmidatain            <= txbuf((txidx / 4) mod TXBUFWORDS)(8*(txidx mod 4)+7 downto 8*(txidx mod 4));
+          utmirxvalid           <= '1';
+          txidx                 <= txidx + 1;
+        else
+          utmirxactive          <= '0';
+          txbusy                <= '0';
+          updateresp_tx         <= not updateresp_tx;
+        end if;
+      else
+        txtick                  <= txtick + 1;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Transmit pacing. Accepts a byte
+-- from the DUT every TICKDIV clocks
+-- whilst TxValid is asserted,
+-- whether captured or not.
+-- --------------------------------
+RDY_P : process (clk)
+begin
+  if clk'event and clk = '1' then
+    if TxValid = '1' and utmitxready = '0' then
+      if rdytick >= TICKDIV - 1 then
+        rdytick                 <= 0;
+        utmitxready             <= '1';
+      else
+        rdytick                 <= rdytick + 1;
+      end if;
+    else
+      -- Stay ready when a byte per clock, with the ready clock
+      -- counting towards the next byte
+      if TxValid = '1' and TICKDIV <= 1 then
+        utmitxready             <= '1';
+      else
+        utmitxready             <= '0';
+      end if;
+
+      if TxValid = '1' then
+        rdytick                 <= 1;
+      else
+        rdytick                 <= 0;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Countdown. Acknowledges the
+-- COUNTDOWN access after cntlen
+-- clocks, or never if cntlen is 0.
+-- --------------------------------
+CNT_P : process (clk)
+begin
+  if clk'event and clk = '1' then
+    if cntstart = '1' then
+      cntack                    <= cntreq;
+
+      if cntlen = 1 then
+        updateresp_cnt          <= not updateresp_cnt;
+      else
+        cntbusy                 <= '1';
+        cntval                  <= 1;
+      end if;
+    elsif cntbusy = '1' then
+      if cntval + 1 = cntlen then
+        cntbusy                 <= '0';
+        updateresp_cnt          <= not updateresp_cnt;
+      else
+        cntval                  <= cntval + 1;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Line event detectors, as for
+-- usbModel but on the virtual bus
+-- state.
+-- --------------------------------
+EV_P : process (clk)
+variable evprev               : std_logic_vector(1 downto 0) := USB_J;
+variable evnew                : std_logic_vector(2 downto 0);
+variable evstate              : std_logic_vector(2 downto 0);
+variable evse0count           : integer := 0;
+variable evjcount             : integer := 0;
+variable evwaitbusy           : boolean := false;
+variable evwaitcount          : integer := 0;
+begin
+  if clk'event and clk = '1' then
+    evnew                       := "000";
+
+    -- Detect a change in line state
+    if busline /= evprev then
+      evnew(EV_LINECHG)         := '1';
+    end if;
+
+    evprev                      := busline;
+
+    -- Count consecutive SE0 and J states, flagging when they reach the
+    -- reset and suspend periods respectively
+    if busline = USB_SE0 then
+      evse0count                := evse0count + 1;
+    else
+      evse0count                := 0;
+    end if;
+
+    if busline = USB_J then
+      evjcount                  := evjcount + 1;
+    else
+      evjcount                  := 0;
+    end if;
+
+    if evse0count = rstthresh then
+      evnew(EV_RESET)           := '1';
+    end if;
+
+    if evjcount = suspthresh then
+      evnew(EV_SUSPEND)         := '1';
+    end if;
+
+    evstate                     := evpend;
+
+    -- Clear any events requested from an EVSTATUS write
+    if evclrstart = '1' then
+      evclrack                  <= evclrreq;
+      evstate                   := evstate and not evclr;
+    end if;
+
+    -- Starting a wait clears the events being waited on, so only new events complete it
+    if evwaitstart = '1' then
+      evwaitack                 <= evwaitreq;
+      evstate                   := evstate and not evwaitmask;
+      evwaitbusy                := true;
+      evwaitcount               := 0;
+    end if;
+
+    evstate                     := evstate or evnew;
+    evpend                      <= evstate;
+
+    -- Acknowledge the EVWAIT access when a waited for event is pending or on timeout
+    if evwaitbusy then
+      evwaitcount               := evwaitcount + 1;
+
+      if (evstate and evwaitmask) /= "000" or (evtimeout /= 0 and evwaitcount >= evtimeout) then
+        evwaitbusy              := false;
+        updateresp_ev           <= not updateresp_ev;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Receive capture engine. Captures
+-- the bytes of a DUT packet as they
+-- are accepted, up to the end of
+-- TxValid. Reset, suspend,
+-- disconnection and timeout are
+-- detected as for usbModel. The
+-- RXCAPTURE access is acknowledged
+-- when any of these occur.
+-- --------------------------------
+RX_P : process (clk)
+variable rxbusy               : boolean := false;
+variable rxinpkt              : boolean;
+variable rxlookforreset       : boolean;
+variable rxdone               : boolean;
+variable rxrstcount           : integer;
+variable rxidlecount          : integer;
+variable rxbytes              : integer;
+begin
+  if clk'event and clk = '1' then
+
+    rxdone                      := false;
+
+    if rxstart = '1' then
+      rxack                     <= rxreq;
+      rxbusy                    := true;
+      rxinpkt                   := false;
+      rxlookforreset            := false;
+      rxrstcount                := 0;
+      rxidlecount               := 0;
+      rxbytes                   := 0;
+      rxactivity                <= '0';
+    end if;
+
+    if rxbusy then
+      -- If a host and SE0 seen when idle, there is no device connected
+      if not rxdevice and not rxinpkt and busline = USB_SE0 then
+        rxstatus                <= RXSTAT_DISCONNECTED;
+        rxdone                  := true;
+      -- If a device and SE0 seen when idle, this may be a reset
+      elsif rxdevice and not rxinpkt and busline = USB_SE0 then
+        rxactivity              <= '1';
+        rxlookforreset          := true;
+        rxrstcount              := rxrstcount + 1;
+      -- At the end of a potential reset, the status is reset if seen sufficient
+      -- consecutive SE0s, else an error for unexplained SE0s.
+      elsif rxlookforreset then
+        if rxrstcount >= rstthresh then
+          rxstatus              <= RXSTAT_RESET;
+        else
+          rxstatus              <= RXSTAT_ERROR;
+        end if;
+        rxdone                  := true;
+      -- Capture each byte of a DUT packet as it is accepted
+      elsif dutactive = '1' then
+        rxinpkt                 := true;
+        rxidlecount             := 0;
+        rxactivity              <= '1';
+
+        if utmitxready = '1' then
+          rxbuf((rxbytes / 4) mod RXBUFWORDS)(8*(rxbytes mod 4)+7 downto 8*(rxbytes mod 4)) <= DataOut;
+          rxbytes               := rxbytes + 1;
+        end if;
+      -- The packet ends when TxValid is deasserted
+      elsif rxinpkt then
+        rxstatus                <= RXSTAT_PKT;
+        rxdone                  := true;
+      else
+        rxidlecount             := rxidlecount + 1;
+
+        if rxdevice and not rxnosuspend and rxidlecount >= suspthresh then
+          rxstatus              <= RXSTAT_SUSPEND;
+          rxdone                := true;
+        elsif rxtimeout /= 0 and rxidlecount >= rxtimeout then
+          rxstatus              <= RXSTAT_NORESPONSE;
+          rxdone                := true;
+        end if;
+      end if;
+
+      -- On completion, save the count (in bits) and acknowledge the RXCAPTURE access
+      if rxdone then
+        rxbusy                  := false;
+        rxbitcount              <= rxbytes * 8;
+        updateresp_rx           <= not updateresp_rx;
+      end if;
+    end if;
+  end if;
+end process;
+
+-- --------------------------------
+-- Process to map VProc accesses
+-- to registers and simulation
+-- control.
+-- --------------------------------
+
+-- Addressable read/write state from VProc
+UPDATE_P : process (update)
+variable holdack              : boolean;
+begin
+
+  if update'event then
+  -- Default read data value
+    rdata                       <= 32x"0";
+
+    -- Default to acknowledging the access immediately
+    holdack                     := false;
+
+    -- Process when an access is valid
+    if wr = '1'or rd = '1' then
+
+      case to_integer(unsigned(addr)) is
+      when NODE_NUM    => rdata <= node;
+      when CLK_COUNT   => rdata <= std_logic_vector(to_unsigned(clkcount, 32));
+      when RESET_STATE => rdata <= 31x"0" & not nreset;
+      when PHYIF       => rdata <= std_logic_vector(to_unsigned(PHYIF_UTMI, 32));
+
+      when PULLUP      =>
+        if wr = '1' then
+          nopullup              <= not wdata(0);
+        end if;
+        rdata                   <= 31x"0" & nopullup;
+
+      when OUTEN =>
+        if wr = '1' then
+          oen                   <= wdata(0);
+        end if;
+        rdata                   <= 31x"0" & oen;
+
+      when LINE =>
+        if wr = '1' then
+          dp                    <= wdata(0);
+          dm                    <= wdata(1);
+        end if;
+        rdata                   <= 30x"0" & busline;
+
+      when TXBUFIDX =>
+        if wr = '1' then
+          txwidx                <= to_integer(unsigned(wdata(9 downto 0)));
+        end if;
+        rdata                   <= std_logic_vector(to_unsigned(txwidx, 32));
+
+      when TXBUFDATA =>
+        if wr = '1' then
+          txbuf(txwidx)         <= wdata;
+          txwidx                <= (txwidx + 1) mod TXBUFWORDS;
+        end if;
+
+      when RSTCOUNT =>
+        if wr = '1' then
+          rstthresh             <= to_integer(unsigned(wdata));
+        end if;
+        rdata                   <= std_logic_vector(to_unsigned(rstthresh, 32));
+
+      when SUSPCOUNT =>
+        if wr = '1' then
+          suspthresh            <= to_integer(unsigned(wdata));
+        end if;
+        rdata                   <= std_logic_vector(to_unsigned(suspthresh, 32));
+
+      -- Start a receive capture, with fields as for usbModel
+      when RXCAPTURE =>
+        if wr = '1' then
+          oen                   <= '0';
+          rxdevice              <= wdata(31) = '1';
+          rxnosuspend           <= wdata(30) = '1';
+          rxtimeout             <= to_integer(unsigned(wdata(29 downto 0)));
+          rxridx                <= 0;
+          rxreq                 <= not rxreq;
+          holdack               := true;
+        end if;
+
+      when RXSTATUS =>
+        rdata                   <= 11x"0" & rxactivity & std_logic_vector(to_unsigned(rxstatus, 4)) &
+                                   std_logic_vector(to_unsigned(rxbitcount mod 65536, 16));
+
+      when RXBUFDATA =>
+        rdata                   <= rxbuf(rxridx);
+        rxridx                  <= (rxridx + 1) mod RXBUFWORDS;
+
+      when EVIRQMASK =>
+        if wr = '1' then
+          evirqmask             <= wdata(2 downto 0);
+        end if;
+        rdata                   <= 29x"0" & evirqmask;
+
+      when EVSTATUS =>
+        if wr = '1' then
+          evclr                 <= wdata(2 downto 0);
+          evclrreq              <= not evclrreq;
+        end if;
+        rdata                   <= 29x"0" & evpend;
+
+      when EVWAIT =>
+        if wr = '1' then
+          evwaitmask            <= wdata(2 downto 0);
+          evtimeout             <= to_integer(unsigned(wdata(31 downto 3)));
+          evwaitreq             <= not evwaitreq;
+          holdack               := true;
+        end if;
+
+      -- Hold off the acknowledge for wdata(30:0) clock cycles. There is no
+      -- SOF generator, so the SOF flag in wdata(31) is ignored.
+      when COUNTDOWN =>
+        if wr = '1' then
+          cntlen                <= to_integer(unsigned(wdata(30 downto 0)));
+          cntreq                <= not cntreq;
+          holdack               := true;
+        end if;
+
+      -- Send the loaded transmit buffer for wdata(15:0) bytes. The acknowledge
+      -- is held off until the whole packet has been sent.
+      when TXSEND =>
+        if wr = '1' and unsigned(wdata(15 downto 0)) /= 0 then
+          txlen                 <= to_integer(unsigned(wdata(15 downto 0)));
+          txreq                 <= not txreq;
+          holdack               := true;
+        end if;
+
+      -- No handshake responder, but the registers are kept
+      when DEVADDR =>
+        if wr = '1' then
+          devaddr               <= wdata(6 downto 0);
+        end if;
+        rdata                   <= 25x"0" & devaddr;
+
+      when EPSTATOUT =>
+        if wr = '1' then
+          epstatout             <= wdata;
+        end if;
+        rdata                   <= epstatout;
+
+      when EPSTATIN =>
+        if wr = '1' then
+          epstatin              <= wdata;
+        end if;
+        rdata                   <= epstatin;
+
+      -- No SOF generator, so never enabled
+      when SOFCTRL     => rdata <= 32x"0";
+      when SOFFRAME    => rdata <= 32x"0";
+
+      when UVH_STOP =>
+        if wr = '1' then stop ; end if;
+
+      when UVH_FINISH =>
+        -- Always stop when in GUI
+        if wr = '1' then if GUI_RUN = 1 then stop; else finish; end if; end if;
+
+      when others =>
+          report UPDATE_P'path_name  & "***Error. usbModelUtmi---access to invalid address (" & to_hstring(addr) & ") from VProc" severity error;
+          if GUI_RUN = 1 then stop; else finish; end if;
+
+      end case;
+    end if;
+
+    -- Finished processing for this update, so acknowledge to VProc (by inverting updateresp),
+    -- unless a blocking command was started which will acknowledge on completion
+    if not holdack then
+      updateresp_imm <= not updateresp_imm;
+    end if;
+  end if;
+end process;
+
+end behavioural;